@@ -208,6 +208,13 @@ SP_LIBEXPORT(sp_error) sp_session_logout(sp_session *session);
 SP_LIBEXPORT(sp_connectionstate) sp_session_connectionstate(sp_session *session);
 SP_LIBEXPORT(void *) sp_session_userdata(sp_session *session);
 SP_LIBEXPORT(void) sp_session_process_events(sp_session *session, int *next_timeout);
+SP_LIBEXPORT(int) opensp_session_fd(sp_session *session);
+SP_LIBEXPORT(int) opensp_session_num_coalesced(sp_session *session);
+SP_LIBEXPORT(void) opensp_session_set_browse_batch_window(sp_session *session, int msecs);
+SP_LIBEXPORT(void) opensp_session_set_browse_chunks(sp_session *session, int num_chunks);
+SP_LIBEXPORT(void) opensp_session_set_parse_threads(sp_session *session, int num_threads);
+SP_LIBEXPORT(void) opensp_session_channel_stats(sp_session *session, int audio, int *limit, int *num_open, int *num_waiting);
+SP_LIBEXPORT(int) opensp_session_num_reconnects(sp_session *session);
 SP_LIBEXPORT(sp_error) sp_session_player_load(sp_session *session, sp_track *track);
 SP_LIBEXPORT(sp_error) sp_session_player_play(sp_session *session, bool play);
 SP_LIBEXPORT(sp_error) sp_session_player_seek(sp_session *session, int offset);
@@ -0,0 +1,349 @@
+/*
+ * AES-128 in CTR mode, used to decrypt audio data
+ *
+ * On x86 CPUs with the AES-NI instructions (checked at runtime with CPUID)
+ * eight counter blocks are encrypted at a time so the AES unit can work
+ * on several of them at once, and the keystream is XOR'ed onto
+ * the data 16 bytes at a time with SSE2.
+ * Elsewhere rijndaelEncrypt() from aes.c produces the keystream and it's
+ * XOR'ed a machine word at a time.
+ *
+ * The counter is the 128-bit big endian integer that the server's encoder
+ * started from the nonce, incremented once per 16 byte block.
+ *
+ * Audio files are also stored with every 1024 byte block split into four
+ * 256 byte stripes, the first holding bytes 0, 4, 8, ..., the second 1, 5,
+ * 9, ... and so on. aes_ctr_xor_interleaved() puts the bytes back in order
+ * and decrypts them in the same pass, with SSE2 unpacks on the AES-NI path.
+ *
+ */
+
+#include <string.h>
+
+#include "aes.h"
+#include "aesctr.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define AES_CTR_X86
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define AESNI_TARGET
+#else
+#include <cpuid.h>
+#define AESNI_TARGET __attribute__((target("sse2,aes")))
+#endif
+#endif
+
+
+#define GETU32(p) (((u32)(p)[0] << 24) ^ ((u32)(p)[1] << 16) ^ ((u32)(p)[2] << 8) ^ ((u32)(p)[3]))
+#define PUTU32(p, v) { (p)[0] = (u8)((v) >> 24); (p)[1] = (u8)((v) >> 16); (p)[2] = (u8)((v) >> 8); (p)[3] = (u8)(v); }
+#define BSWAP32(v) (((v) >> 24) | (((v) >> 8) & 0xff00) | (((v) << 8) & 0xff0000) | ((v) << 24))
+
+
+static void aes_ctr_increment(u8 *counter);
+static void aes_ctr_xor_generic(struct aes_ctr *ctx, unsigned char *buf, size_t num_blocks);
+#ifdef AES_CTR_X86
+static void aes_ctr_xor_aesni(struct aes_ctr *ctx, unsigned char *buf, size_t num_blocks);
+static void aes_ctr_xor_interleaved_aesni(struct aes_ctr *ctx, unsigned char *dest, const unsigned char *src, size_t len);
+#endif
+
+
+/*
+ * Expand a 128-bit key and pick the implementation to use
+ *
+ */
+void aes_ctr_key(struct aes_ctr *ctx, const unsigned char *key) {
+	int i;
+
+	rijndaelKeySetupEnc(ctx->rk, key, 128);
+	for(i = 0; i < 4 * (10 + 1); i++)
+		PUTU32(ctx->round_keys[i / 4] + 4 * (i % 4), ctx->rk[i]);
+
+	memset(ctx->counter, 0, sizeof(ctx->counter));
+	ctx->use_aesni = aes_ctr_have_aesni();
+}
+
+
+/*
+ * Set the counter to the IV plus the number of blocks before 'offset'
+ *
+ */
+void aes_ctr_seek(struct aes_ctr *ctx, const unsigned char *iv, size_t offset) {
+	int i;
+
+	memcpy(ctx->counter, iv, 16);
+
+	offset >>= 4;
+	for(i = 15; offset && i >= 0; offset >>= 8) {
+		offset += ctx->counter[i];
+		ctx->counter[i--] = offset & 0xff;
+	}
+}
+
+
+/*
+ * En- or decrypt 'len' bytes in place
+ * A partial block at the end uses up a whole counter value, so callers
+ * should keep to multiples of 16 bytes until the last call
+ *
+ */
+void aes_ctr_xor(struct aes_ctr *ctx, unsigned char *buf, size_t len) {
+	u8 keystream[16];
+	size_t num_blocks, i;
+
+	num_blocks = len / 16;
+#ifdef AES_CTR_X86
+	if(ctx->use_aesni)
+		aes_ctr_xor_aesni(ctx, buf, num_blocks);
+	else
+#endif
+		aes_ctr_xor_generic(ctx, buf, num_blocks);
+
+	buf += 16 * num_blocks;
+	len -= 16 * num_blocks;
+	if(len) {
+		rijndaelEncrypt(ctx->rk, 10, ctx->counter, keystream);
+		aes_ctr_increment(ctx->counter);
+
+		for(i = 0; i < len; i++)
+			buf[i] ^= keystream[i];
+	}
+}
+
+
+/*
+ * De-interleave and decrypt whole 1024 byte blocks from 'src' into 'dest'
+ * Any bytes after the last whole block are left alone
+ *
+ */
+void aes_ctr_xor_interleaved(struct aes_ctr *ctx, unsigned char *dest, const unsigned char *src, size_t len) {
+	const unsigned char *w, *x, *y, *z;
+	unsigned char *ptr;
+	size_t block, i;
+
+	len &= ~1023;
+
+#ifdef AES_CTR_X86
+	if(ctx->use_aesni) {
+		aes_ctr_xor_interleaved_aesni(ctx, dest, src, len);
+		return;
+	}
+#endif
+
+	for(block = 0; block < len; block += 1024) {
+		w = src + block + 0 * 256;
+		x = src + block + 1 * 256;
+		y = src + block + 2 * 256;
+		z = src + block + 3 * 256;
+
+		ptr = dest + block;
+		for(i = 0; i < 256; i++) {
+			*ptr++ = w[i];
+			*ptr++ = x[i];
+			*ptr++ = y[i];
+			*ptr++ = z[i];
+		}
+
+		aes_ctr_xor_generic(ctx, dest + block, 1024 / 16);
+	}
+}
+
+
+/*
+ * Returns 1 if the CPU has the AES-NI instructions
+ *
+ */
+int aes_ctr_have_aesni(void) {
+#if defined(AES_CTR_X86) && defined(_MSC_VER)
+	int info[4];
+
+	__cpuid(info, 1);
+
+	return (info[2] & (1 << 25)) && (info[3] & (1 << 26));
+#elif defined(AES_CTR_X86)
+	unsigned int eax, ebx, ecx, edx;
+
+	if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+
+	return (ecx & bit_AES) && (edx & bit_SSE2);
+#else
+	return 0;
+#endif
+}
+
+
+static void aes_ctr_increment(u8 *counter) {
+	int i;
+
+	for(i = 15; i >= 0; i--)
+		if(++counter[i] != 0)
+			break;
+}
+
+
+/*
+ * The counter stays a byte array here, rebuilding it from words before
+ * every rijndaelEncrypt() stalls on store forwarding
+ *
+ */
+static void aes_ctr_xor_generic(struct aes_ctr *ctx, unsigned char *buf, size_t num_blocks) {
+	u8 keystream[16];
+	unsigned long a, b;
+	size_t i;
+
+	for(; num_blocks; num_blocks--, buf += 16) {
+		rijndaelEncrypt(ctx->rk, 10, ctx->counter, keystream);
+		aes_ctr_increment(ctx->counter);
+
+		/* A word at a time, memcpy() keeps it safe for unaligned buffers */
+		for(i = 0; i < 16; i += sizeof(a)) {
+			memcpy(&a, buf + i, sizeof(a));
+			memcpy(&b, keystream + i, sizeof(b));
+			a ^= b;
+			memcpy(buf + i, &a, sizeof(a));
+		}
+	}
+}
+
+
+#ifdef AES_CTR_X86
+#define AESNI_ROUND8(op, k) { \
+	b0 = op(b0, k); b1 = op(b1, k); b2 = op(b2, k); b3 = op(b3, k); \
+	b4 = op(b4, k); b5 = op(b5, k); b6 = op(b6, k); b7 = op(b7, k); }
+
+#define AESNI_XOR_STORE(p, b) \
+	_mm_storeu_si128((__m128i *)(p), _mm_xor_si128(_mm_loadu_si128((const __m128i *)(p)), b))
+
+/* Interleave 16 bytes from each stripe into 64 bytes of output, XOR'ed with four keystream blocks */
+#define SSE2_DEINTERLEAVE_XOR(d, s, k0, k1, k2, k3) { \
+	__m128i w, x, y, z, wx, yz; \
+	w = _mm_loadu_si128((const __m128i *)((s) + 0 * 256)); \
+	x = _mm_loadu_si128((const __m128i *)((s) + 1 * 256)); \
+	y = _mm_loadu_si128((const __m128i *)((s) + 2 * 256)); \
+	z = _mm_loadu_si128((const __m128i *)((s) + 3 * 256)); \
+	wx = _mm_unpacklo_epi8(w, x); \
+	yz = _mm_unpacklo_epi8(y, z); \
+	_mm_storeu_si128((__m128i *)((d) + 0 * 16), _mm_xor_si128(_mm_unpacklo_epi16(wx, yz), k0)); \
+	_mm_storeu_si128((__m128i *)((d) + 1 * 16), _mm_xor_si128(_mm_unpackhi_epi16(wx, yz), k1)); \
+	wx = _mm_unpackhi_epi8(w, x); \
+	yz = _mm_unpackhi_epi8(y, z); \
+	_mm_storeu_si128((__m128i *)((d) + 2 * 16), _mm_xor_si128(_mm_unpacklo_epi16(wx, yz), k2)); \
+	_mm_storeu_si128((__m128i *)((d) + 3 * 16), _mm_xor_si128(_mm_unpackhi_epi16(wx, yz), k3)); }
+
+/* Increment the counter kept as four host order words, most significant first */
+#define COUNTER_INC(c) { if(++(c)[3] == 0 && ++(c)[2] == 0 && ++(c)[1] == 0) ++(c)[0]; }
+
+static AESNI_TARGET __m128i aesni_counter_block(u32 *c) {
+	__m128i block;
+
+	block = _mm_set_epi32((int)BSWAP32(c[3]), (int)BSWAP32(c[2]),
+		(int)BSWAP32(c[1]), (int)BSWAP32(c[0]));
+	COUNTER_INC(c);
+
+	return block;
+}
+
+
+static AESNI_TARGET void aes_ctr_xor_aesni(struct aes_ctr *ctx, unsigned char *buf, size_t num_blocks) {
+	__m128i k[10 + 1];
+	__m128i b0, b1, b2, b3, b4, b5, b6, b7;
+	u32 c[4];
+	int r;
+
+	c[0] = GETU32(ctx->counter);
+	c[1] = GETU32(ctx->counter + 4);
+	c[2] = GETU32(ctx->counter + 8);
+	c[3] = GETU32(ctx->counter + 12);
+
+	for(r = 0; r < 10 + 1; r++)
+		k[r] = _mm_loadu_si128((const __m128i *)ctx->round_keys[r]);
+
+	for(; num_blocks >= 8; num_blocks -= 8, buf += 8 * 16) {
+		b0 = _mm_xor_si128(aesni_counter_block(c), k[0]);
+		b1 = _mm_xor_si128(aesni_counter_block(c), k[0]);
+		b2 = _mm_xor_si128(aesni_counter_block(c), k[0]);
+		b3 = _mm_xor_si128(aesni_counter_block(c), k[0]);
+		b4 = _mm_xor_si128(aesni_counter_block(c), k[0]);
+		b5 = _mm_xor_si128(aesni_counter_block(c), k[0]);
+		b6 = _mm_xor_si128(aesni_counter_block(c), k[0]);
+		b7 = _mm_xor_si128(aesni_counter_block(c), k[0]);
+
+		for(r = 1; r < 10; r++)
+			AESNI_ROUND8(_mm_aesenc_si128, k[r]);
+		AESNI_ROUND8(_mm_aesenclast_si128, k[10]);
+
+		AESNI_XOR_STORE(buf + 0 * 16, b0);
+		AESNI_XOR_STORE(buf + 1 * 16, b1);
+		AESNI_XOR_STORE(buf + 2 * 16, b2);
+		AESNI_XOR_STORE(buf + 3 * 16, b3);
+		AESNI_XOR_STORE(buf + 4 * 16, b4);
+		AESNI_XOR_STORE(buf + 5 * 16, b5);
+		AESNI_XOR_STORE(buf + 6 * 16, b6);
+		AESNI_XOR_STORE(buf + 7 * 16, b7);
+	}
+
+	for(; num_blocks; num_blocks--, buf += 16) {
+		b0 = _mm_xor_si128(aesni_counter_block(c), k[0]);
+		for(r = 1; r < 10; r++)
+			b0 = _mm_aesenc_si128(b0, k[r]);
+		b0 = _mm_aesenclast_si128(b0, k[10]);
+
+		AESNI_XOR_STORE(buf, b0);
+	}
+
+	PUTU32(ctx->counter, c[0]);
+	PUTU32(ctx->counter + 4, c[1]);
+	PUTU32(ctx->counter + 8, c[2]);
+	PUTU32(ctx->counter + 12, c[3]);
+}
+
+
+/*
+ * Each pass takes 32 bytes from every stripe, which make 128 bytes of
+ * output, and XOR's them with eight keystream blocks on the way out
+ *
+ */
+static AESNI_TARGET void aes_ctr_xor_interleaved_aesni(struct aes_ctr *ctx, unsigned char *dest, const unsigned char *src, size_t len) {
+	__m128i k[10 + 1];
+	__m128i b0, b1, b2, b3, b4, b5, b6, b7;
+	u32 c[4];
+	size_t block, i;
+	int r;
+
+	c[0] = GETU32(ctx->counter);
+	c[1] = GETU32(ctx->counter + 4);
+	c[2] = GETU32(ctx->counter + 8);
+	c[3] = GETU32(ctx->counter + 12);
+
+	for(r = 0; r < 10 + 1; r++)
+		k[r] = _mm_loadu_si128((const __m128i *)ctx->round_keys[r]);
+
+	for(block = 0; block < len; block += 1024) {
+		for(i = 0; i < 256; i += 32) {
+			b0 = _mm_xor_si128(aesni_counter_block(c), k[0]);
+			b1 = _mm_xor_si128(aesni_counter_block(c), k[0]);
+			b2 = _mm_xor_si128(aesni_counter_block(c), k[0]);
+			b3 = _mm_xor_si128(aesni_counter_block(c), k[0]);
+			b4 = _mm_xor_si128(aesni_counter_block(c), k[0]);
+			b5 = _mm_xor_si128(aesni_counter_block(c), k[0]);
+			b6 = _mm_xor_si128(aesni_counter_block(c), k[0]);
+			b7 = _mm_xor_si128(aesni_counter_block(c), k[0]);
+
+			for(r = 1; r < 10; r++)
+				AESNI_ROUND8(_mm_aesenc_si128, k[r]);
+			AESNI_ROUND8(_mm_aesenclast_si128, k[10]);
+
+			SSE2_DEINTERLEAVE_XOR(dest + block + 4 * i, src + block + i, b0, b1, b2, b3);
+			SSE2_DEINTERLEAVE_XOR(dest + block + 4 * i + 64, src + block + i + 16, b4, b5, b6, b7);
+		}
+	}
+
+	PUTU32(ctx->counter, c[0]);
+	PUTU32(ctx->counter + 4, c[1]);
+	PUTU32(ctx->counter + 8, c[2]);
+	PUTU32(ctx->counter + 12, c[3]);
+}
+#endif
@@ -0,0 +1,33 @@
+/*
+ * AES-128 in CTR mode for decrypting audio, see aesctr.c
+ *
+ */
+
+#ifndef LIBOPENSPOTIFY_AESCTR_H
+#define LIBOPENSPOTIFY_AESCTR_H
+
+#include <stddef.h>
+
+#include "aes.h"
+
+struct aes_ctr {
+	/* Expanded key for rijndaelEncrypt() */
+	u32 rk[4 * (10 + 1)];
+
+	/* The same round keys in byte order, as the AES-NI instructions want them */
+	u8 round_keys[10 + 1][16];
+
+	/* Big endian counter for the next block */
+	u8 counter[16];
+
+	/* Set by aes_ctr_key() if the CPU supports AES-NI */
+	int use_aesni;
+};
+
+void aes_ctr_key(struct aes_ctr *ctx, const unsigned char *key);
+void aes_ctr_seek(struct aes_ctr *ctx, const unsigned char *iv, size_t offset);
+void aes_ctr_xor(struct aes_ctr *ctx, unsigned char *buf, size_t len);
+void aes_ctr_xor_interleaved(struct aes_ctr *ctx, unsigned char *dest, const unsigned char *src, size_t len);
+int aes_ctr_have_aesni(void);
+
+#endif
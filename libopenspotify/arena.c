@@ -0,0 +1,167 @@
+/*
+ * Bump allocator for the temporaries of a response
+ *
+ * Everything that's only needed while a browse, search or toplist reply
+ * is inflated and parsed, the inflater and zlib's state, the parser and
+ * the text and lists in the records metadata.c fills in, is carved out of
+ * a few large blocks. Nothing is freed on its own, the blocks all go at
+ * once when the response has been handled, however many allocations
+ * were made from them.
+ *
+ * What outlives the response, like the names and country lists of the
+ * loaded tracks, albums and artists, is copied out by the loaders.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "debug.h"
+
+
+/* Allocations are aligned for any type */
+union arena_align {
+	double d;
+	long l;
+	void *p;
+};
+
+#define ARENA_ALIGN		sizeof(union arena_align)
+#define ARENA_ROUND(size)	(((size) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+/* Allocations larger than this get a block of their own */
+#define ARENA_LARGE		(ARENA_BLOCK_SIZE / 4)
+
+struct arena_block {
+	struct arena_block *next;
+	size_t size;
+	size_t used;
+};
+
+/* Room for the block header, data follows */
+#define ARENA_HEADER		ARENA_ROUND(sizeof(struct arena_block))
+
+
+static struct arena_block *arena_block_new(size_t size);
+
+
+/* The arena itself lives at the start of its first block */
+struct arena *arena_new(void) {
+	struct arena_block *block;
+	struct arena *arena;
+
+	if((block = arena_block_new(ARENA_BLOCK_SIZE)) == NULL)
+		return NULL;
+
+	arena = (struct arena *)((unsigned char *)block + ARENA_HEADER);
+	block->used = ARENA_ROUND(sizeof(struct arena));
+
+	arena->blocks = block;
+	arena->last = NULL;
+
+	return arena;
+}
+
+
+/* Release the arena and everything allocated from it */
+void arena_free(struct arena *arena) {
+	struct arena_block *block, *next;
+
+	for(block = arena->blocks; block; block = next) {
+		next = block->next;
+		free(block);
+	}
+}
+
+
+void *arena_alloc(struct arena *arena, size_t size) {
+	struct arena_block *block;
+	void *ptr;
+
+	size = ARENA_ROUND(size);
+
+	/* Large allocations go in a block behind the one being filled */
+	if(size > ARENA_LARGE) {
+		if((block = arena_block_new(size)) == NULL)
+			return NULL;
+
+		block->used = size;
+		block->next = arena->blocks->next;
+		arena->blocks->next = block;
+
+		return (unsigned char *)block + ARENA_HEADER;
+	}
+
+	block = arena->blocks;
+	if(block->size - block->used < size) {
+		if((block = arena_block_new(ARENA_BLOCK_SIZE)) == NULL)
+			return NULL;
+
+		block->next = arena->blocks;
+		arena->blocks = block;
+	}
+
+	ptr = (unsigned char *)block + ARENA_HEADER + block->used;
+	block->used += size;
+	arena->last = ptr;
+
+	return ptr;
+}
+
+
+/*
+ * Resize an allocation of 'old_size' bytes, NULL allocates a new one
+ * The most recent allocation grows in place if there's room, others are
+ * copied and their old space is left until the arena is freed.
+ *
+ */
+void *arena_realloc(struct arena *arena, void *ptr, size_t old_size, size_t size) {
+	struct arena_block *block = arena->blocks;
+	unsigned char *data;
+	void *new_ptr;
+
+	if(ptr == NULL)
+		return arena_alloc(arena, size);
+
+	data = (unsigned char *)block + ARENA_HEADER;
+	if(ptr == arena->last && data + block->size - (unsigned char *)ptr >= (long)ARENA_ROUND(size)) {
+		block->used = (unsigned char *)ptr - data + ARENA_ROUND(size);
+		return ptr;
+	}
+
+	if((new_ptr = arena_alloc(arena, size)) == NULL)
+		return NULL;
+
+	memcpy(new_ptr, ptr, old_size < size? old_size: size);
+
+	return new_ptr;
+}
+
+
+char *arena_strdup(struct arena *arena, const char *str) {
+	size_t len = strlen(str) + 1;
+	char *copy;
+
+	if((copy = arena_alloc(arena, len)) != NULL)
+		memcpy(copy, str, len);
+
+	return copy;
+}
+
+
+/* A block with room for 'size' bytes of data */
+static struct arena_block *arena_block_new(size_t size) {
+	struct arena_block *block;
+
+	if((block = malloc(ARENA_HEADER + size)) == NULL) {
+		DSFYDEBUG("Failed to allocate %lu byte block\n", (unsigned long)size);
+		return NULL;
+	}
+
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+
+	return block;
+}
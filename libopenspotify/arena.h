@@ -0,0 +1,30 @@
+/*
+ * Bump allocator for the temporaries of a response, see arena.c
+ *
+ */
+
+#ifndef LIBOPENSPOTIFY_ARENA_H
+#define LIBOPENSPOTIFY_ARENA_H
+
+#include <stddef.h>
+
+/* Size of the blocks allocations are carved out of */
+#define ARENA_BLOCK_SIZE	32768
+
+struct arena_block;
+
+struct arena {
+	/* The block being filled, and the blocks before it */
+	struct arena_block *blocks;
+
+	/* The most recent allocation, which arena_realloc() can grow in place */
+	void *last;
+};
+
+struct arena *arena_new(void);
+void arena_free(struct arena *arena);
+void *arena_alloc(struct arena *arena, size_t size);
+void *arena_realloc(struct arena *arena, void *ptr, size_t old_size, size_t size);
+char *arena_strdup(struct arena *arena, const char *str);
+
+#endif
@@ -0,0 +1,208 @@
+/*
+ * Throughput benchmark for audio decryption in aesctr.c
+ *
+ * Decrypts a buffer the size of a typical player_ov_read() request over
+ * and over, with the loop player_ov_read() used to have (one
+ * rijndaelEncrypt() per block, the counter incremented and the keystream
+ * XOR'ed a byte at a time) and with aes_ctr_xor(), both with and without
+ * AES-NI. Checks that they all produce the same output and reports MB/s.
+ *
+ * Then does the same for the whole of player_ov_read()'s work on the data:
+ * copying it out of the rbuf, putting the 4x256 byte stripes of each block
+ * back in order and decrypting, against aes_ctr_xor_interleaved().
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../aes.h"
+#include "../aesctr.h"
+#include "../util.h"
+
+
+#define BUF_SIZE	(64 * 1024)
+#define TOTAL_SIZE	(256 * 1024 * 1024)
+
+static const unsigned char nonce[16] = {
+	0x72, 0xe0, 0x67, 0xfb, 0xdd, 0xcb, 0xcf, 0x77,
+	0xeb, 0xe8, 0xbc, 0x64, 0x3f, 0x63, 0x0d, 0x93
+};
+
+
+/* What player_ov_read() did before */
+static void decrypt_bytewise(u32 *rk, unsigned char *counter, unsigned char *buf, size_t len) {
+	unsigned char keystream[16];
+	size_t i;
+	int j;
+
+	for(i = 0; i < len; i += 16) {
+		rijndaelEncrypt(rk, 10, counter, keystream);
+
+		for(j = 15; j >= 0; j--) {
+			counter[j] += 1;
+			if(counter[j] != 0)
+				break;
+		}
+
+		for(j = 0; j < 16; j++)
+			buf[i + j] ^= keystream[j];
+	}
+}
+
+
+static double run(const char *name, int variant, unsigned char *key, unsigned char *buf, unsigned char *check) {
+	struct aes_ctr ctx;
+	unsigned char counter[16];
+	size_t done;
+	int start, elapsed;
+
+	aes_ctr_key(&ctx, key);
+	if(variant == 1)
+		ctx.use_aesni = 0;
+
+	start = get_millisecs();
+	for(done = 0; done < TOTAL_SIZE; done += BUF_SIZE) {
+		if(variant == 0) {
+			memcpy(counter, nonce, 16);
+			decrypt_bytewise(ctx.rk, counter, buf, BUF_SIZE);
+		}
+		else {
+			aes_ctr_seek(&ctx, nonce, 0);
+			aes_ctr_xor(&ctx, buf, BUF_SIZE);
+		}
+	}
+	elapsed = get_millisecs() - start;
+	if(elapsed == 0)
+		elapsed = 1;
+
+	/* An even number of passes leaves the buffer as it was, do one more to compare */
+	if(variant == 0) {
+		memcpy(counter, nonce, 16);
+		decrypt_bytewise(ctx.rk, counter, buf, BUF_SIZE);
+		memcpy(check, buf, BUF_SIZE);
+	}
+	else {
+		aes_ctr_seek(&ctx, nonce, 0);
+		aes_ctr_xor(&ctx, buf, BUF_SIZE);
+		if(memcmp(check, buf, BUF_SIZE)) {
+			fprintf(stderr, "%s: output differs from the old path\n", name);
+			exit(1);
+		}
+	}
+
+	/* Undo the last pass */
+	memcpy(counter, nonce, 16);
+	decrypt_bytewise(ctx.rk, counter, buf, BUF_SIZE);
+
+	printf("%-20s %8.1f MB/s\n", name, TOTAL_SIZE / 1048576.0 * 1000.0 / elapsed);
+
+	return TOTAL_SIZE / 1048576.0 * 1000.0 / elapsed;
+}
+
+
+/* What player_ov_read() did before, with the new aes_ctr_xor() */
+static void decrypt_copied(struct aes_ctr *ctx, unsigned char *dest, const unsigned char *src, size_t len) {
+	unsigned char *data, *ptr;
+	const unsigned char *w, *x, *y, *z;
+	size_t block;
+	int i;
+
+	data = malloc(len);
+	memcpy(data, src, len);
+
+	for(block = 0; block < len; block += 1024) {
+		ptr = dest + block;
+		w = data + block + 0 * 256;
+		x = data + block + 1 * 256;
+		y = data + block + 2 * 256;
+		z = data + block + 3 * 256;
+
+		for(i = 0; i < 1024; i += 4) {
+			*ptr++ = *w++;
+			*ptr++ = *x++;
+			*ptr++ = *y++;
+			*ptr++ = *z++;
+		}
+	}
+
+	free(data);
+
+	aes_ctr_xor(ctx, dest, len);
+}
+
+
+static void run_interleaved(const char *name, int fused, int use_aesni, unsigned char *key,
+		const unsigned char *src, unsigned char *dest, unsigned char *check) {
+	struct aes_ctr ctx;
+	size_t done;
+	int start, elapsed;
+
+	aes_ctr_key(&ctx, key);
+	ctx.use_aesni = use_aesni;
+
+	start = get_millisecs();
+	for(done = 0; done < TOTAL_SIZE; done += BUF_SIZE) {
+		aes_ctr_seek(&ctx, nonce, 0);
+		if(fused)
+			aes_ctr_xor_interleaved(&ctx, dest, src, BUF_SIZE);
+		else
+			decrypt_copied(&ctx, dest, src, BUF_SIZE);
+	}
+	elapsed = get_millisecs() - start;
+	if(elapsed == 0)
+		elapsed = 1;
+
+	if(!fused && !use_aesni)
+		memcpy(check, dest, BUF_SIZE);
+	else if(memcmp(check, dest, BUF_SIZE)) {
+		fprintf(stderr, "%s: output differs from the old path\n", name);
+		exit(1);
+	}
+
+	printf("%-20s %8.1f MB/s\n", name, TOTAL_SIZE / 1048576.0 * 1000.0 / elapsed);
+}
+
+
+int main(void) {
+	unsigned char key[16];
+	unsigned char *buf, *check, *dest;
+	double old, generic, aesni;
+	int i;
+
+	for(i = 0; i < 16; i++)
+		key[i] = i * 7;
+
+	buf = malloc(BUF_SIZE);
+	check = malloc(BUF_SIZE);
+	for(i = 0; i < BUF_SIZE; i++)
+		buf[i] = i & 0xff;
+
+	printf("aes: AES-128 CTR over %d kB buffers, AES-NI %savailable\n",
+		BUF_SIZE / 1024, aes_ctr_have_aesni()? "": "not ");
+
+	old = run("bytewise (old)", 0, key, buf, check);
+	generic = run("aes_ctr_xor generic", 1, key, buf, check);
+	printf("%-20s %8.1fx\n", "speedup", generic / old);
+
+	if(aes_ctr_have_aesni()) {
+		aesni = run("aes_ctr_xor AES-NI", 2, key, buf, check);
+		printf("%-20s %8.1fx\n", "speedup", aesni / old);
+	}
+
+	printf("aes: de-interleave and decrypt\n");
+	dest = malloc(BUF_SIZE);
+	run_interleaved("copied (old)", 0, 0, key, buf, dest, check);
+	run_interleaved("fused generic", 1, 0, key, buf, dest, check);
+	if(aes_ctr_have_aesni()) {
+		run_interleaved("copied AES-NI", 0, 1, key, buf, dest, check);
+		run_interleaved("fused AES-NI", 1, 1, key, buf, dest, check);
+	}
+
+	free(buf);
+	free(check);
+	free(dest);
+
+	return 0;
+}
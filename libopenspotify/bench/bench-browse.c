@@ -0,0 +1,562 @@
+/*
+ * Benchmark for playlist track browsing in browse.c
+ *
+ * A thread standing in for the Spotify server answers CMD_BROWSE requests
+ * over a socketpair after a simulated round trip (with some jitter, so
+ * chunks complete out of order). The main thread plays the iothread and
+ * loads playlists of various sizes with a varying number of chunks in
+ * flight, parsing replies itself or with the parse pool. Reports load
+ * time per playlist size, and the longest the loop went without reading
+ * from the socket, which is how late audio data and pings would be.
+ * Checks first that identical track browses complete when the one they
+ * wait for fails.
+ *
+ * Build with 'make nodebug=1 bench' or DSFYDEBUG will dominate the numbers.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/eventfd.h>
+#endif
+
+#include <zlib.h>
+
+#include <spotify/api.h>
+
+#include "../browse.h"
+#include "../buf.h"
+#include "../channel.h"
+#include "../parsepool.h"
+#include "../request.h"
+#include "../sp_opaque.h"
+#include "../util.h"
+
+
+/* Simulated round trip to the server, in milliseconds */
+#define SERVER_RTT	20
+#define SERVER_JITTER	8
+
+#define MAX_PENDING	64
+
+/* Track browse replies, with the IDs echoed and the rest made up */
+#define XML_HEAD	"<?xml version=\"1.0\" encoding=\"utf-8\" ?>\n<result>\n<tracks>\n"
+#define XML_TAIL	"</tracks>\n</result>\n"
+#define XML_TRACK	"<title>Insane in the Brain</title>" \
+			"<artist-id>9e74e7856a07496190ef2180d26003db</artist-id><artist>Cypress Hill</artist>" \
+			"<album>Black Sunday</album><album-id>c3711d81999b48529903bf708b8192da</album-id>" \
+			"<album-artist>Cypress Hill</album-artist>" \
+			"<album-artist-id>9e74e7856a07496190ef2180d26003db</album-artist-id>" \
+			"<year>1993</year><track-number>3</track-number><length>211000</length>" \
+			"<files><file id=\"0123456789abcdef0123456789abcdef01234567\" format=\"Ogg Vorbis,160000,1,32,4\"/></files>" \
+			"<cover>0123456789abcdef0123456789abcdef01234567</cover><popularity>0.62</popularity>" \
+			"<restrictions><restriction catalogues=\"premium,free\" allowed=\"SE FI NO DK GB\"/></restrictions>"
+
+
+static int client_sock;
+static int num_tracks_routed;
+
+/* Set to have cmd_browse() lose requests, and to have tracks load */
+static int drop_requests;
+static int track_loaded;
+
+
+/*
+ * The stand-in server
+ * Requests are <u16 channel id><u16 number of IDs><IDs>
+ * Replies are <u16 length><payload> where payload is what the client
+ * would hand to channel_process() after decrypting a CMD_CHANNEL_* packet
+ *
+ */
+struct pending {
+	int due;
+	unsigned short channel_id;
+	int num_ids;
+	unsigned char *ids;
+};
+
+
+static void server_send(int sock, unsigned short channel_id, const unsigned char *data, int len) {
+	unsigned char hdr[4];
+	unsigned short n;
+
+	n = htons(2 + len);
+	memcpy(hdr, &n, 2);
+	n = htons(channel_id);
+	memcpy(hdr + 2, &n, 2);
+
+	block_write(sock, hdr, 4);
+	if(len)
+		block_write(sock, data, len);
+}
+
+
+static void server_reply(int sock, struct pending *p) {
+	unsigned char no_headers[2] = { 0, 0 };
+	unsigned char gzip_header[10];
+	unsigned char *deflated;
+	char hex[33];
+	z_stream z;
+	struct buf *xml, *b;
+	int i;
+
+	/* No channel headers */
+	server_send(sock, p->channel_id, no_headers, 2);
+
+	/* Echo the IDs as track elements */
+	xml = buf_new();
+	buf_append_data(xml, XML_HEAD, strlen(XML_HEAD));
+	for(i = 0; i < p->num_ids; i++) {
+		hex_bytes_to_ascii(p->ids + 16*i, hex, 16);
+		buf_append_data(xml, "<track><id>", 11);
+		buf_append_data(xml, hex, 32);
+		buf_append_data(xml, "</id>", 5);
+		buf_append_data(xml, XML_TRACK, strlen(XML_TRACK));
+		buf_append_data(xml, "</track>\n", 9);
+	}
+	buf_append_data(xml, XML_TAIL, strlen(XML_TAIL));
+
+	/* Deflated after a gzip header like the real thing */
+	memset(gzip_header, 0, sizeof(gzip_header));
+	b = buf_new();
+	buf_append_data(b, gzip_header, sizeof(gzip_header));
+
+	memset(&z, 0, sizeof(z));
+	deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+	deflated = malloc(deflateBound(&z, xml->len));
+	z.next_in = xml->ptr;
+	z.avail_in = xml->len;
+	z.next_out = deflated;
+	z.avail_out = deflateBound(&z, xml->len);
+	deflate(&z, Z_FINISH);
+	buf_append_data(b, deflated, z.total_out);
+	deflateEnd(&z);
+
+	/* In packet sized pieces, so elements are split across them */
+	for(i = 0; i < b->len; i += 4096)
+		server_send(sock, p->channel_id, b->ptr + i, b->len - i < 4096? b->len - i: 4096);
+
+	free(deflated);
+	buf_free(b);
+	buf_free(xml);
+
+	/* Empty data packet ends the channel */
+	server_send(sock, p->channel_id, NULL, 0);
+}
+
+
+static void *server(void *data) {
+	int sock = *(int *)data;
+	struct pending pending[MAX_PENDING];
+	int num_pending = 0;
+	unsigned char hdr[4];
+	unsigned short n;
+	struct pollfd pfd;
+	int i, timeout, now;
+
+	for(;;) {
+		now = get_millisecs();
+		timeout = -1;
+		for(i = 0; i < num_pending; i++) {
+			if(pending[i].due <= now) {
+				server_reply(sock, &pending[i]);
+				free(pending[i].ids);
+				pending[i--] = pending[--num_pending];
+				continue;
+			}
+
+			if(timeout == -1 || pending[i].due - now < timeout)
+				timeout = pending[i].due - now;
+		}
+
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		if(poll(&pfd, 1, timeout) <= 0)
+			continue;
+
+		if(block_read(sock, hdr, 4) != 4)
+			break;
+
+		memcpy(&n, hdr, 2);
+		pending[num_pending].channel_id = ntohs(n);
+		memcpy(&n, hdr + 2, 2);
+		pending[num_pending].num_ids = ntohs(n);
+		pending[num_pending].ids = malloc(16 * pending[num_pending].num_ids);
+		block_read(sock, pending[num_pending].ids, 16 * pending[num_pending].num_ids);
+
+		pending[num_pending].due = get_millisecs() + SERVER_RTT
+			+ (pending[num_pending].channel_id * 5) % SERVER_JITTER;
+		num_pending++;
+	}
+
+	return NULL;
+}
+
+
+/* Replaces cmd_browse() in commands.c */
+int cmd_browse(sp_session *session, unsigned char kind, unsigned char *idlist,
+		int num, channel_callback callback, void *private) {
+	CHANNEL *ch;
+	unsigned char hdr[4];
+	unsigned short n;
+
+	ch = channel_register(session, "browse-bench", callback, private);
+	if(drop_requests)
+		return 0;
+
+	n = htons(ch->channel_id);
+	memcpy(hdr, &n, 2);
+	n = htons(num);
+	memcpy(hdr + 2, &n, 2);
+
+	block_write(client_sock, hdr, 4);
+	block_write(client_sock, idlist, 16 * num);
+
+	return 0;
+}
+
+
+/* Stands in for the playlist's XML handlers, checks the echoed IDs as they're parsed */
+static void playlist_xml_end(void *arg, int depth, const char *name, char *text) {
+	struct browse_callback_ctx *brctx = (struct browse_callback_ctx *)arg;
+	unsigned char id[16];
+	int i;
+
+	if(depth != 4 || strcmp(name, "id"))
+		return;
+
+	/* brctx->section counts the tracks seen so far */
+	i = brctx->num_browsed + brctx->section++;
+	hex_ascii_to_bytes(text, id, 16);
+	if(brctx->section > brctx->num_in_request || memcmp(id, brctx->data.playlist->tracks[i]->id, 16)) {
+		fprintf(stderr, "Track %d routed to the wrong chunk\n", i);
+		exit(1);
+	}
+}
+
+
+/* Stands in for osfy_playlist_browse_callback() */
+static int playlist_parser(struct browse_callback_ctx *brctx) {
+	if(brctx->section != brctx->num_in_request) {
+		fprintf(stderr, "Chunk at offset %d has %d tracks, expected %d\n",
+			brctx->num_browsed, brctx->section, brctx->num_in_request);
+		exit(1);
+	}
+
+	num_tracks_routed += brctx->num_in_request;
+
+	return 0;
+}
+
+
+/* The rest of the library isn't linked in */
+int handle_packet(sp_session *session, int cmd, unsigned char *payload, unsigned short len) { return 0; }
+bool sp_track_is_loaded(sp_track *track) { return track_loaded; }
+bool sp_album_is_loaded(sp_album *album) { return 0; }
+bool sp_artist_is_loaded(sp_artist *artist) { return 0; }
+void sp_track_release(sp_track *track) { }
+void sp_album_release(sp_album *album) { }
+void sp_artist_release(sp_artist *artist) { }
+int osfy_track_load_from_xml(sp_session *session, sp_track *track, struct track_xml *xml) { return 0; }
+
+static void SP_CALLCONV notify_main_thread(sp_session *session) {
+}
+
+
+static int get_microsecs(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+/*
+ * Run the request loop the way iothread() does until num_results results
+ * have been returned, or for at most timeout milliseconds if that's not -1.
+ * Returns the number of results. Sets *max_busy to the longest time spent
+ * between two polls, in microseconds.
+ *
+ */
+static int run_requests(sp_session *session, int num_results, int timeout, int *max_busy) {
+	struct request *req;
+	unsigned char hdr[2], payload[65536];
+	unsigned short len;
+	struct pollfd pfd[2];
+	int num_ready, next_timeout, start, busy, n, wait;
+#ifdef __linux__
+	uint64_t counter;
+#endif
+
+	n = 0;
+	*max_busy = 0;
+	start = get_millisecs();
+
+	busy = get_microsecs();
+	for(;;) {
+		request_cleanup(session);
+		parsepool_complete(session->parsepool);
+		num_ready = request_schedule_due(session);
+		while(num_ready-- > 0 && (req = request_fetch_next_due(session)) != NULL) {
+			browse_process(session, req);
+			request_reschedule(session, req);
+		}
+
+		while((req = request_fetch_next_result(session, &next_timeout)) != NULL) {
+			request_mark_processed(session, req);
+			n++;
+		}
+
+		if(n >= num_results || (timeout != -1 && get_millisecs() - start >= timeout))
+			break;
+
+		if(get_microsecs() - busy > *max_busy)
+			*max_busy = get_microsecs() - busy;
+
+		wait = request_next_timeout(session);
+		if(timeout != -1 && (wait == -1 || wait > timeout - (get_millisecs() - start)))
+			wait = timeout - (get_millisecs() - start);
+
+		pfd[0].fd = client_sock;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = -1;
+		pfd[1].events = POLLIN;
+#ifdef __linux__
+		pfd[1].fd = session->wakeup_fd;
+#endif
+		if(poll(pfd, 2, wait) <= 0)
+			continue;
+
+		busy = get_microsecs();
+#ifdef __linux__
+		/* A worker has parsed a reply */
+		if(pfd[1].revents & POLLIN)
+			if(read(session->wakeup_fd, &counter, sizeof(counter)) != sizeof(counter))
+				continue;
+#endif
+
+		if(!(pfd[0].revents & POLLIN))
+			continue;
+
+		if(block_read(client_sock, hdr, 2) != 2)
+			return -1;
+
+		memcpy(&len, hdr, 2);
+		len = ntohs(len);
+		if(block_read(client_sock, payload, len) != len)
+			return -1;
+
+		channel_process(session, payload, len, 0);
+	}
+
+	return n;
+}
+
+
+/* Load the playlist's tracks, returns the time it took */
+static int load_playlist(sp_session *session, sp_playlist *playlist, int *max_busy) {
+	struct browse_callback_ctx *brctx;
+	void **container;
+	int start;
+
+	brctx = (struct browse_callback_ctx *)malloc(sizeof(struct browse_callback_ctx));
+	memset(brctx, 0, sizeof(struct browse_callback_ctx));
+	brctx->session = session;
+	brctx->type = REQ_TYPE_BROWSE_PLAYLIST_TRACKS;
+	brctx->data.playlist = playlist;
+	brctx->num_total = playlist->num_tracks;
+	brctx->browse_parser = playlist_parser;
+	brctx->xml_end = playlist_xml_end;
+
+	container = (void **)malloc(sizeof(void *));
+	*container = brctx;
+
+	num_tracks_routed = 0;
+	start = get_millisecs();
+	request_post(session, REQ_TYPE_BROWSE_PLAYLIST_TRACKS, container);
+
+	if(run_requests(session, 1, -1, max_busy) != 1)
+		return -1;
+
+	if(num_tracks_routed != playlist->num_tracks) {
+		fprintf(stderr, "Routed %d of %d tracks\n", num_tracks_routed, playlist->num_tracks);
+		exit(1);
+	}
+
+	return get_millisecs() - start;
+}
+
+
+/* Stands in for osfy_track_browse_callback() */
+static int track_parser(struct browse_callback_ctx *brctx) {
+	return 0;
+}
+
+
+/* Post a browse of a single track, returns its context */
+static struct browse_callback_ctx *browse_track(sp_session *session, sp_track *track) {
+	struct browse_callback_ctx *brctx;
+	void **container;
+
+	brctx = (struct browse_callback_ctx *)malloc(sizeof(struct browse_callback_ctx));
+	memset(brctx, 0, sizeof(struct browse_callback_ctx));
+	brctx->session = session;
+	brctx->type = REQ_TYPE_BROWSE_TRACK;
+	brctx->data.tracks = (sp_track **)malloc(sizeof(sp_track *));
+	brctx->data.tracks[0] = track;
+	brctx->num_total = 1;
+	brctx->browse_parser = track_parser;
+
+	container = (void **)malloc(sizeof(void *));
+	*container = brctx;
+
+	request_post(session, REQ_TYPE_BROWSE_TRACK, container);
+
+	return brctx;
+}
+
+
+/*
+ * Two identical track browses, the second waiting for the first. The
+ * first one's channel fails and the track is loaded by something else
+ * before it's retried. Both must complete, and a later browse of the
+ * same track must go out rather than wait for the first one again.
+ *
+ */
+static void check_inflight_retry(sp_session *session) {
+	struct browse_callback_ctx *owner;
+	sp_track track;
+	int max_busy;
+
+	memset(&track, 0, sizeof(track));
+	memset(track.id, 0xab, sizeof(track.id));
+
+	/* Lost on the way to the server */
+	drop_requests = 1;
+	owner = browse_track(session, &track);
+	browse_track(session, &track);
+	run_requests(session, 0, 0, &max_busy);
+
+	channel_fail_and_unregister_all(session);
+
+	/* Loaded elsewhere, then the owner's retry timer fires */
+	track_loaded = 1;
+	request_set_next_timeout(session, owner->req, 0);
+	if(run_requests(session, 2, 1000, &max_busy) != 2) {
+		fprintf(stderr, "Browse waiting for a failed owner never completed\n");
+		exit(1);
+	}
+
+	drop_requests = 0;
+	track_loaded = 0;
+	browse_track(session, &track);
+	if(run_requests(session, 1, 1000, &max_busy) != 1) {
+		fprintf(stderr, "Browse joined a completed owner and never completed\n");
+		exit(1);
+	}
+}
+
+
+int main(void) {
+	static const int sizes[] = { 244, 1000, 5000, 10000 };
+	static const int chunks[] = { 1, 2, 4, 8 };
+#ifdef __linux__
+	static const int threads[] = { 0, PARSEPOOL_THREADS };
+#else
+	/* Workers wake the loop up through the eventfd */
+	static const int threads[] = { 0 };
+#endif
+	sp_session session;
+	sp_session_callbacks callbacks;
+	sp_playlist playlist;
+	pthread_t thread;
+	int socks[2];
+	int i, j, k, t, ms, max_busy;
+
+	memset(&session, 0, sizeof(session));
+	memset(&callbacks, 0, sizeof(callbacks));
+	callbacks.notify_main_thread = notify_main_thread;
+	session.callbacks = &callbacks;
+#ifdef __linux__
+	session.wakeup_fd = eventfd(0, EFD_NONBLOCK);
+#endif
+	pthread_mutex_init(&session.request_mutex, NULL);
+	pthread_cond_init(&session.idle_wakeup, NULL);
+
+	if(request_init(&session)) {
+		fprintf(stderr, "request_init() failed\n");
+		return 1;
+	}
+
+	request_set_iothread(&session);
+	channel_init(&session);
+	session.parsepool = parsepool_create(&session, 0);
+	session.hashtable_browses = hashtable_create(BROWSE_INFLIGHT_KEY_SIZE);
+
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, socks)) {
+		perror("socketpair");
+		return 1;
+	}
+
+	client_sock = socks[0];
+	pthread_create(&thread, NULL, server, &socks[1]);
+
+	check_inflight_retry(&session);
+
+	printf("browse: %d ms round trip, time to load playlist tracks / longest time socket wasn't read\n", SERVER_RTT);
+	printf("%8s %7s", "tracks", "workers");
+	for(j = 0; j < sizeof(chunks) / sizeof(chunks[0]); j++)
+		printf("  %16d chunks", chunks[j]);
+	printf("\n");
+
+	for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		memset(&playlist, 0, sizeof(playlist));
+		playlist.num_tracks = sizes[i];
+		playlist.tracks = (sp_track **)malloc(sizeof(sp_track *) * sizes[i]);
+		for(k = 0; k < sizes[i]; k++) {
+			playlist.tracks[k] = (sp_track *)calloc(1, sizeof(sp_track));
+			memcpy(playlist.tracks[k]->id, &k, sizeof(k));
+		}
+
+		for(t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+			parsepool_set_limit(session.parsepool, threads[t]);
+
+			printf("%8d %7d", sizes[i], threads[t]);
+			for(j = 0; j < sizeof(chunks) / sizeof(chunks[0]); j++) {
+				session.browse_max_chunks = chunks[j];
+				ms = load_playlist(&session, &playlist, &max_busy);
+				printf("  %6d ms / %5d us", ms, max_busy);
+				fflush(stdout);
+			}
+			printf("\n");
+		}
+
+		for(k = 0; k < sizes[i]; k++)
+			free(playlist.tracks[k]);
+		free(playlist.tracks);
+	}
+
+	close(client_sock);
+	pthread_join(thread, NULL);
+
+	parsepool_release(session.parsepool);
+	browse_release(&session);
+	request_cleanup(&session);
+	request_release(&session);
+	channel_release(&session);
+#ifdef __linux__
+	close(session.wakeup_fd);
+#endif
+
+	return 0;
+}
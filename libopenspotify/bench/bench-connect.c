@@ -0,0 +1,179 @@
+/*
+ * Benchmark for connecting to access points in connect.c
+ *
+ * Sets up local listeners standing in for access points that are healthy,
+ * refuse connections or are dead (SYNs silently dropped, like a host that
+ * went away) and times how long it takes to get a connection for various
+ * SRV lists. Compares connect_race_process() with trying one address at a
+ * time with a timeout, the way login_process() used to.
+ *
+ * Build with 'make nodebug=1 bench' or DSFYDEBUG will dominate the numbers.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+#include "../connect.h"
+#include "../dns.h"
+#include "../util.h"
+
+
+enum ap_kind { AP_HEALTHY, AP_REFUSED, AP_DEAD };
+
+static char ports[3][6];
+
+
+/* A listener with a full backlog drops SYNs, so connects to it hang */
+static int listener(enum ap_kind kind, char *port) {
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int sock, filler;
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0
+		|| listen(sock, kind == AP_DEAD? 0: 64) < 0) {
+		perror("bind/listen");
+		exit(1);
+	}
+
+	getsockname(sock, (struct sockaddr *)&addr, &len);
+	sprintf(port, "%u", ntohs(addr.sin_port));
+
+	if(kind == AP_REFUSED)
+		close(sock);
+	else if(kind == AP_DEAD) {
+		filler = socket(AF_INET, SOCK_STREAM, 0);
+		fcntl(filler, F_SETFL, O_NONBLOCK);
+		connect(filler, (struct sockaddr *)&addr, sizeof(addr));
+	}
+
+	return sock;
+}
+
+
+/* What login_process() did before, one address at a time */
+static int connect_sequential(struct dns_srv_records *hosts) {
+	struct dns_srv_records *svc;
+	struct addrinfo h, *ai;
+	struct timeval tv;
+	fd_set wfds;
+	socklen_t len;
+	int sock, err, waited;
+
+	for(svc = hosts; svc; svc = svc->next) {
+		memset(&h, 0, sizeof(h));
+		h.ai_family = PF_UNSPEC;
+		h.ai_socktype = SOCK_STREAM;
+		if(getaddrinfo(svc->host, svc->port, &h, &ai) != 0)
+			continue;
+
+		sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		fcntl(sock, F_SETFL, O_NONBLOCK);
+		if(connect(sock, ai->ai_addr, ai->ai_addrlen) < 0 && errno != EINPROGRESS) {
+			close(sock);
+			freeaddrinfo(ai);
+			continue;
+		}
+		freeaddrinfo(ai);
+
+		for(waited = 0; waited < CONNECT_TIMEOUT_MS; waited += CONNECT_WAIT_MS) {
+			FD_ZERO(&wfds);
+			FD_SET(sock, &wfds);
+			tv.tv_sec = 0;
+			tv.tv_usec = CONNECT_WAIT_MS * 1000;
+			if(select(sock + 1, NULL, &wfds, NULL, &tv) > 0)
+				break;
+		}
+
+		len = sizeof(err);
+		if(waited < CONNECT_TIMEOUT_MS
+			&& getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0)
+			return sock;
+
+		close(sock);
+	}
+
+	return -1;
+}
+
+
+static int connect_raced(struct dns_srv_records *hosts) {
+	struct connect_race race;
+	int ret;
+
+	race.num_attempts = 0;
+	while(connect_race_start(&race, hosts) == 0) {
+		while((ret = connect_race_process(&race)) == 0)
+			;
+
+		if(ret == 1)
+			return race.sock;
+	}
+
+	return -1;
+}
+
+
+static int run(const char *kinds, int raced) {
+	struct dns_srv_records svc[3];
+	int i, sock, start;
+
+	for(i = 0; i < 3; i++) {
+		svc[i].host = "127.0.0.1";
+		svc[i].port = ports[kinds[i] == 'H'? AP_HEALTHY: kinds[i] == 'R'? AP_REFUSED: AP_DEAD];
+		svc[i].prio = i;
+		svc[i].tried = 0;
+		svc[i].expires = 0;
+		svc[i].latency = 0;
+		svc[i].failures = 0;
+		svc[i].next = i < 2? &svc[i + 1]: NULL;
+	}
+
+	start = get_millisecs();
+	sock = raced? connect_raced(svc): connect_sequential(svc);
+	if(sock != -1)
+		close(sock);
+
+	return sock == -1? -1: get_millisecs() - start;
+}
+
+
+int main(void) {
+	static const char *scenarios[][2] = {
+		{ "HHH", "all healthy" },
+		{ "RHH", "first refuses" },
+		{ "DHH", "first dead" },
+		{ "DDH", "first two dead" },
+	};
+	int i;
+
+	listener(AP_HEALTHY, ports[AP_HEALTHY]);
+	listener(AP_REFUSED, ports[AP_REFUSED]);
+	listener(AP_DEAD, ports[AP_DEAD]);
+
+	printf("connect: %dms stagger, %dms timeout, time to connect\n",
+		CONNECT_STAGGER_MS, CONNECT_TIMEOUT_MS);
+	printf("%-16s %12s %12s\n", "access points", "sequential", "raced");
+
+	for(i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+		printf("%-16s", scenarios[i][1]);
+		fflush(stdout);
+		printf(" %9d ms", run(scenarios[i][0], 0));
+		fflush(stdout);
+		printf(" %9d ms\n", run(scenarios[i][0], 1));
+	}
+
+	return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * Benchmark for the crypto primitives
+ *
+ * Runs each of them over a 4 kB buffer (the size of an audio data packet)
+ * until TOTAL_SIZE bytes have been processed and reports MB/s, and on x86
+ * also cycles per byte from the time stamp counter. HMAC-SHA1 is measured
+ * on the 96 byte key and short messages login.c uses it with.
+ *
+ * See test/test-crypto.c for the known answer tests.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "../aesctr.h"
+#include "../hmac.h"
+#include "../sha1.h"
+#include "../shn.h"
+#include "../util.h"
+
+
+#define BUF_SIZE	4096
+#define TOTAL_SIZE	(64 * 1024 * 1024)
+
+enum primitive {
+	SHN_ENCRYPT, SHN_DECRYPT, AES_CTR, AES_CTR_AESNI, AES_CTR_INTERLEAVED, SHA1, HMAC_SHA1
+};
+
+static const char *names[] = {
+	"shn_encrypt", "shn_decrypt", "aes_ctr_xor", "aes_ctr_xor AES-NI",
+	"aes_ctr_xor_interleaved", "SHA1", "HMAC-SHA1"
+};
+
+
+static unsigned long long cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+
+static void run(enum primitive p, unsigned char *buf, unsigned char *dest) {
+	unsigned char key[96], digest[20];
+	struct aes_ctr aes;
+	SHA1_CTX sha;
+	shn_ctx shn;
+	unsigned long long start_cycles, elapsed_cycles;
+	size_t done, len;
+	int start, elapsed;
+
+	memset(key, 0x42, sizeof(key));
+	shn_key(&shn, key, 32);
+	aes_ctr_key(&aes, key);
+	if(p != AES_CTR_AESNI && p != AES_CTR_INTERLEAVED)
+		aes.use_aesni = 0;
+
+	len = p == HMAC_SHA1? 64: BUF_SIZE;
+
+	start = get_millisecs();
+	start_cycles = cycles();
+	for(done = 0; done < TOTAL_SIZE; done += len) {
+		switch(p) {
+		case SHN_ENCRYPT:
+			shn_encrypt(&shn, buf, len);
+			break;
+		case SHN_DECRYPT:
+			shn_decrypt(&shn, buf, len);
+			break;
+		case AES_CTR:
+		case AES_CTR_AESNI:
+			aes_ctr_xor(&aes, buf, len);
+			break;
+		case AES_CTR_INTERLEAVED:
+			aes_ctr_xor_interleaved(&aes, dest, buf, len);
+			break;
+		case SHA1:
+			SHA1Init(&sha);
+			SHA1Update(&sha, buf, len);
+			SHA1Final(digest, &sha);
+			break;
+		case HMAC_SHA1:
+			sha1_hmac(key, sizeof(key), buf, len, digest);
+			break;
+		}
+	}
+	elapsed_cycles = cycles() - start_cycles;
+	elapsed = get_millisecs() - start;
+	if(elapsed == 0)
+		elapsed = 1;
+
+	printf("%-24s %8.1f MB/s", names[p], TOTAL_SIZE / 1048576.0 * 1000.0 / elapsed);
+	if(elapsed_cycles)
+		printf(" %8.2f cycles/byte", (double)elapsed_cycles / TOTAL_SIZE);
+	printf("\n");
+}
+
+
+int main(void) {
+	unsigned char *buf, *dest;
+	int i;
+
+	buf = malloc(BUF_SIZE);
+	dest = malloc(BUF_SIZE);
+	for(i = 0; i < BUF_SIZE; i++)
+		buf[i] = i;
+
+	printf("crypto: %d byte buffers, %d MB each\n", BUF_SIZE, TOTAL_SIZE / 1048576);
+	run(SHN_ENCRYPT, buf, dest);
+	run(SHN_DECRYPT, buf, dest);
+	run(AES_CTR, buf, dest);
+	if(aes_ctr_have_aesni()) {
+		run(AES_CTR_AESNI, buf, dest);
+		run(AES_CTR_INTERLEAVED, buf, dest);
+	}
+	run(SHA1, buf, dest);
+	run(HMAC_SHA1, buf, dest);
+
+	free(buf);
+	free(dest);
+
+	return 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * Benchmark for the time it takes to log in, with and without keypool.c
+ *
+ * A thread stands in for an access point on a local port. It answers the
+ * client's parameters with a fixed server key, an easy puzzle and no
+ * challenges, doesn't check the client's HMAC and accepts every login.
+ * A settings directory with an SRV cache pointing at it keeps DNS out of
+ * the picture, so what's left is connecting, key generation, the puzzle
+ * and the two round trips.
+ *
+ * Logins are timed from login_create() until login_process() returns 1:
+ * without a pool, with a pool filled while the application starts up,
+ * with a pool that had a reconnect backoff's worth of time to refill,
+ * and back to back, when the pool can't keep up.
+ *
+ * Build with 'make nodebug=1 bench' or DSFYDEBUG will dominate the numbers.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "../dns.h"
+#include "../iothread.h"
+#include "../keypool.h"
+#include "../login.h"
+#include "../util.h"
+
+
+#define NUM_LOGINS	10
+
+/* Bits in the stand-in server's puzzle, small enough to not matter */
+#define PUZZLE_BITS	8
+
+static char settings_location[] = "/tmp/bench-login-XXXXXX";
+
+
+static int read_full(int sock, unsigned char *buf, int len) {
+	int n, done;
+
+	for(done = 0; done < len; done += n)
+		if((n = recv(sock, buf + done, len - done, 0)) <= 0)
+			return -1;
+
+	return 0;
+}
+
+
+/* One login handshake, see send_client_parameters() and friends in login.c */
+static void serve(int sock) {
+	unsigned char buf[1024], *ptr;
+	int len;
+
+	/* Client parameters, the length follows the protocol version */
+	if(read_full(sock, buf, 4) < 0)
+		return;
+
+	len = (buf[2] << 8) | buf[3];
+	if(len < 4 || len > sizeof(buf) || read_full(sock, buf + 4, len - 4) < 0)
+		return;
+
+	/* Status and server random */
+	ptr = buf;
+	memset(ptr, 0, 2);
+	ptr += 2;
+	memset(ptr, 0x5a, 14);
+	ptr += 14;
+
+	/* Server public key, the generator will do */
+	memset(ptr, 0, 96);
+	ptr[95] = 2;
+	ptr += 96;
+
+	/* Server blob and salt */
+	memset(ptr, 0xa5, 256 + 10);
+	ptr += 256 + 10;
+
+	/* Padding length, username length, challenge lengths */
+	*ptr++ = 1;
+	*ptr++ = 4;
+	memcpy(ptr, "\x00\x06\x00\x00\x00\x00\x00\x00", 8);
+	ptr += 8;
+
+	/* Padding and username */
+	*ptr++ = 0;
+	memcpy(ptr, "user", 4);
+	ptr += 4;
+
+	/* Puzzle, type 1 */
+	*ptr++ = 1;
+	*ptr++ = PUZZLE_BITS;
+	memcpy(ptr, "\x12\x34\x56\x78", 4);
+	ptr += 4;
+
+	if(send(sock, buf, ptr - buf, 0) != ptr - buf)
+		return;
+
+	/* Client HMAC and puzzle solution, then let it in */
+	if(read_full(sock, buf, 20 + 1 + 1 + 2 + 4 + 8) < 0)
+		return;
+
+	send(sock, "\x00\x01\x00", 3, 0);
+}
+
+
+static void *server(void *arg) {
+	int listen_sock = *(int *)arg;
+	int sock;
+
+	while((sock = accept(listen_sock, NULL, NULL)) != -1) {
+		serve(sock);
+		close(sock);
+	}
+
+	return NULL;
+}
+
+
+static int listener(void) {
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int sock;
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 16) < 0) {
+		perror("bind/listen");
+		exit(1);
+	}
+
+	getsockname(sock, (struct sockaddr *)&addr, &len);
+
+	return sock;
+}
+
+
+/* An SRV cache that won't expire during the benchmark */
+static void write_srv_cache(int listen_sock) {
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	char path[sizeof(settings_location) + sizeof(DNS_CACHE_FILE) + 1];
+	FILE *fd;
+
+	getsockname(listen_sock, (struct sockaddr *)&addr, &len);
+
+	sprintf(path, "%s/%s", settings_location, DNS_CACHE_FILE);
+	if((fd = fopen(path, "w")) == NULL) {
+		perror(path);
+		exit(1);
+	}
+
+	fprintf(fd, "_spotify-client._tcp.spotify.com\n");
+	fprintf(fd, "%ld 0 0 0 %u 127.0.0.1\n", (long)time(NULL) + 3600, ntohs(addr.sin_port));
+	fclose(fd);
+}
+
+
+static int login(struct keypool *pool) {
+	struct login_ctx *l;
+	unsigned char key_recv[32], key_send[32];
+	int ret, sock, start;
+
+	start = get_millisecs();
+	l = login_create("user", "password", settings_location, pool);
+	while((ret = login_process(l)) == 0)
+		;
+
+	if(ret == 1) {
+		login_export_session(l, &sock, key_recv, key_send);
+		close(sock);
+	}
+	login_release(l);
+
+	return ret == 1? get_millisecs() - start: -1;
+}
+
+
+/* Average time to log in, waiting 'gap' ms before each login */
+static void run(const char *name, struct keypool *pool, int gap) {
+	int i, ms, total = 0, worst = 0, hits = 0;
+
+	if(pool != NULL)
+		hits = pool->num_hits;
+
+	for(i = 0; i < NUM_LOGINS; i++) {
+		if(gap)
+			usleep(gap * 1000);
+
+		if((ms = login(pool)) < 0) {
+			printf("%-28s login failed\n", name);
+			return;
+		}
+
+		total += ms;
+		if(ms > worst)
+			worst = ms;
+	}
+
+	printf("%-28s %8.1f ms %8d ms", name, (double)total / NUM_LOGINS, worst);
+	if(pool != NULL)
+		printf(" %6d/%d", pool->num_hits - hits, NUM_LOGINS);
+	printf("\n");
+}
+
+
+int main(void) {
+	struct keypool *pool;
+	pthread_t thread;
+	char path[sizeof(settings_location) + sizeof(DNS_CACHE_FILE) + 1];
+	int listen_sock;
+
+	if(mkdtemp(settings_location) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	listen_sock = listener();
+	write_srv_cache(listen_sock);
+	pthread_create(&thread, NULL, server, &listen_sock);
+
+	printf("login: stand-in access point, %d logins each, time to logged in\n", NUM_LOGINS);
+	printf("%-28s %11s %11s %9s\n", "keys", "average", "worst", "pooled");
+
+	run("generated during login", NULL, 0);
+
+	/* The pool fills up while the application starts */
+	pool = keypool_create(KEYPOOL_SIZE);
+	while(keypool_num_ready(pool) < KEYPOOL_SIZE)
+		usleep(1000);
+
+	run("pool, reconnect backoff", pool, RECONNECT_BACKOFF_MIN);
+	run("pool, back to back", pool, 0);
+
+	keypool_release(pool);
+
+	sprintf(path, "%s/%s", settings_location, DNS_CACHE_FILE);
+	unlink(path);
+	rmdir(settings_location);
+
+	return 0;
+}
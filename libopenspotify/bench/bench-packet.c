@@ -0,0 +1,148 @@
+/*
+ * Throughput benchmark for the receive path in packet.c
+ *
+ * Encrypts a stream of synthetic packets (mostly channel data of varying
+ * sizes, like during audio streaming and browsing) with Shannon the way
+ * the server does, and has a thread write it to a socketpair while the
+ * main thread runs packet_read_and_process() on the other end.
+ * Reports decrypted payload throughput.
+ *
+ * Build with 'make nodebug=1 bench' or DSFYDEBUG will dominate the numbers.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <spotify/api.h>
+
+#include "../packet.h"
+#include "../shn.h"
+#include "../sp_opaque.h"
+#include "../util.h"
+
+
+#define STREAM_SIZE	(64 * 1024 * 1024)
+
+/* Payload sizes cycled through, the server sends up to 4kB of audio per packet */
+static const int payload_sizes[] = { 4096, 4096, 4096, 512, 4096, 64, 16384, 4096 };
+
+
+static unsigned char *stream;
+static int stream_len;
+static int num_packets;
+static int num_handled;
+static long long payload_handled;
+
+
+/* Replaces handle_packet() in handlers.c */
+int handle_packet(sp_session *session, int cmd, unsigned char *payload, unsigned short len) {
+	num_handled++;
+	payload_handled += len;
+
+	/* Make sure we got the plaintext */
+	if(len && payload[0] != (unsigned char)len) {
+		fprintf(stderr, "Packet %d decrypted wrong\n", num_handled);
+		exit(1);
+	}
+
+	return 0;
+}
+
+
+static void build_stream(unsigned char *key) {
+	shn_ctx shn;
+	unsigned char nonce[4];
+	unsigned char *ptr;
+	unsigned int iv;
+	int len;
+
+	stream = malloc(STREAM_SIZE + PACKET_MAX_SIZE);
+	shn_key(&shn, key, 32);
+
+	ptr = stream;
+	for(iv = 0; ptr - stream < STREAM_SIZE; iv++) {
+		len = payload_sizes[iv % (sizeof(payload_sizes) / sizeof(payload_sizes[0]))];
+
+		nonce[0] = (iv >> 24) & 0xff;
+		nonce[1] = (iv >> 16) & 0xff;
+		nonce[2] = (iv >> 8) & 0xff;
+		nonce[3] = iv & 0xff;
+		shn_nonce(&shn, nonce, 4);
+
+		ptr[0] = 0x09;
+		ptr[1] = len >> 8;
+		ptr[2] = len & 0xff;
+		memset(ptr + 3, len & 0xff, len);
+
+		shn_encrypt(&shn, ptr, 3 + len);
+		shn_finish(&shn, ptr + 3 + len, 4);
+
+		ptr += 3 + len + 4;
+		num_packets++;
+	}
+
+	stream_len = ptr - stream;
+}
+
+
+static void *writer(void *data) {
+	int sock = *(int *)data;
+
+	block_write(sock, stream, stream_len);
+
+	return NULL;
+}
+
+
+int main(void) {
+	sp_session session;
+	unsigned char key[32];
+	pthread_t thread;
+	int socks[2];
+	int start, elapsed;
+
+	memset(key, 0x42, sizeof(key));
+	build_stream(key);
+
+	memset(&session, 0, sizeof(session));
+	shn_key(&session.shn_recv, key, sizeof(key));
+	session.key_recv_IV = 0;
+
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, socks)) {
+		perror("socketpair");
+		return 1;
+	}
+
+	session.sock = socks[0];
+
+	start = get_millisecs();
+	pthread_create(&thread, NULL, writer, &socks[1]);
+
+	while(num_handled < num_packets) {
+		if(packet_read_and_process(&session)) {
+			fprintf(stderr, "packet_read_and_process() failed after %d packets\n", num_handled);
+			return 1;
+		}
+	}
+
+	elapsed = get_millisecs() - start;
+	pthread_join(thread, NULL);
+
+	if(elapsed == 0)
+		elapsed = 1;
+
+	printf("packet: %d packets, %lld bytes payload in %d ms, %.1f MB/s, %.0f packets/sec\n",
+		num_packets, payload_handled, elapsed,
+		payload_handled / 1048576.0 * 1000.0 / elapsed,
+		num_packets * 1000.0 / elapsed);
+
+	free(session.recv_buf);
+	free(stream);
+
+	return 0;
+}
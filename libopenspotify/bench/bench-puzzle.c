@@ -0,0 +1,129 @@
+/*
+ * Benchmark for the login puzzle solver in puzzle.c
+ *
+ * Solves puzzles of increasing difficulty for a fixed server random and
+ * magic, so every run does the same work: with the loop login.c used to
+ * have (SHA1Init/Update/Final over random() output) and with
+ * puzzle_solve() on 1 to puzzle_num_threads() threads, from a fixed seed.
+ * Each difficulty is solved SOLVES_PER_SIZE times with different seeds,
+ * reporting the total time. Checks that every solution is valid and that
+ * the thread count doesn't change which one is found.
+ *
+ * Build with 'make nodebug=1 bench'.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "../puzzle.h"
+#include "../sha1.h"
+#include "../util.h"
+
+
+#define SOLVES_PER_SIZE	16
+#define MAGIC		0x1f2e3d4c
+
+static const unsigned char server_random_16[16] = {
+	0x5c, 0x11, 0x8e, 0x40, 0x3b, 0x9a, 0x02, 0xf7,
+	0x61, 0xd4, 0x2c, 0x85, 0xe9, 0x70, 0x1b, 0xa6
+};
+
+static const int sizes[] = { 8, 12, 16, 20 };
+
+
+static int is_solution(const unsigned char *solution, int bits) {
+	SHA1_CTX ctx;
+	unsigned char digest[20];
+	unsigned int nominator;
+
+	SHA1Init(&ctx);
+	SHA1Update(&ctx, (unsigned char *)server_random_16, 16);
+	SHA1Update(&ctx, (unsigned char *)solution, 8);
+	SHA1Final(digest, &ctx);
+
+	memcpy(&nominator, digest + 16, 4);
+
+	return ((ntohl(nominator) ^ MAGIC) & ((1U << bits) - 1)) == 0;
+}
+
+
+/* What login.c did before */
+static void solve_old(int bits, unsigned int seed, unsigned char *solution) {
+	SHA1_CTX ctx;
+	unsigned char digest[20];
+	unsigned int *nominator_from_hash;
+	unsigned int denominator;
+	int i;
+
+	denominator = (1 << bits) - 1;
+
+	srandom(seed);
+	nominator_from_hash = (unsigned int *)(digest + 16);
+	do {
+		SHA1Init(&ctx);
+		SHA1Update(&ctx, (unsigned char *)server_random_16, 16);
+
+		for(i = 0; i < 8; i++)
+			solution[i] = random();
+		SHA1Update(&ctx, solution, 8);
+
+		SHA1Final(digest, &ctx);
+
+		*nominator_from_hash = htonl(*nominator_from_hash);
+		*nominator_from_hash ^= MAGIC;
+	} while(*nominator_from_hash & denominator);
+}
+
+
+int main(void) {
+	unsigned char solution[8], first[SOLVES_PER_SIZE][8];
+	int i, j, threads, max_threads, start;
+
+	max_threads = puzzle_num_threads();
+	printf("puzzle: %d solves per size, ms total\n", SOLVES_PER_SIZE);
+	printf("%-6s %8s", "bits", "old");
+	for(threads = 1; threads <= max_threads; threads *= 2)
+		printf(" %5d thr", threads);
+	printf("\n");
+
+	for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		printf("%-6d", sizes[i]);
+
+		start = get_millisecs();
+		for(j = 0; j < SOLVES_PER_SIZE; j++) {
+			solve_old(sizes[i], j, solution);
+			if(!is_solution(solution, sizes[i])) {
+				fprintf(stderr, "Old solver gave a wrong solution\n");
+				return 1;
+			}
+		}
+		printf(" %8d", get_millisecs() - start);
+		fflush(stdout);
+
+		for(threads = 1; threads <= max_threads; threads *= 2) {
+			start = get_millisecs();
+			for(j = 0; j < SOLVES_PER_SIZE; j++) {
+				puzzle_solve(server_random_16, sizes[i], MAGIC, j, threads, solution);
+				if(!is_solution(solution, sizes[i])) {
+					fprintf(stderr, "Wrong solution for %d bits with %d threads\n", sizes[i], threads);
+					return 1;
+				}
+
+				if(threads == 1)
+					memcpy(first[j], solution, 8);
+				else if(memcmp(first[j], solution, 8)) {
+					fprintf(stderr, "%d threads found a different solution than 1\n", threads);
+					return 1;
+				}
+			}
+			printf(" %9d", get_millisecs() - start);
+			fflush(stdout);
+		}
+		printf("\n");
+	}
+
+	return 0;
+}
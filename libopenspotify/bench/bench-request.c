@@ -0,0 +1,96 @@
+/*
+ * Microbenchmark for the request rings in request.c
+ *
+ * A thread standing in for the iothread posts results as fast as it can
+ * while the main thread drains them the same way sp_session_process_events()
+ * does. Reports results per second.
+ *
+ * Build with 'make nodebug=1 bench' or DSFYDEBUG will dominate the numbers.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <spotify/api.h>
+
+#include "../request.h"
+#include "../sp_opaque.h"
+#include "../util.h"
+
+
+#define NUM_RESULTS 2000000
+
+
+static void SP_CALLCONV notify_main_thread(sp_session *session) {
+}
+
+
+static void *producer(void *data) {
+	sp_session *session = (sp_session *)data;
+	int i;
+
+	request_set_iothread(session);
+
+	for(i = 0; i < NUM_RESULTS; i++) {
+		request_post_result(session, REQ_TYPE_PLAYLIST_LOAD, SP_ERROR_OK, NULL);
+
+		/* Free results the main thread has handed back */
+		if((i & 255) == 0)
+			request_cleanup(session);
+	}
+
+	return NULL;
+}
+
+
+int main(void) {
+	sp_session session;
+	sp_session_callbacks callbacks;
+	struct request *req;
+	pthread_t thread;
+	int drained, start, elapsed, next_timeout;
+
+	memset(&session, 0, sizeof(session));
+	memset(&callbacks, 0, sizeof(callbacks));
+	callbacks.notify_main_thread = notify_main_thread;
+	session.callbacks = &callbacks;
+#ifdef __linux__
+	session.wakeup_fd = -1;
+#endif
+	pthread_mutex_init(&session.request_mutex, NULL);
+	pthread_cond_init(&session.idle_wakeup, NULL);
+
+	if(request_init(&session)) {
+		fprintf(stderr, "request_init() failed\n");
+		return 1;
+	}
+
+	start = get_millisecs();
+	pthread_create(&thread, NULL, producer, &session);
+
+	drained = 0;
+	while(drained < NUM_RESULTS) {
+		if((req = request_fetch_next_result(&session, &next_timeout)) == NULL)
+			continue;
+
+		request_mark_processed(&session, req);
+		drained++;
+	}
+
+	pthread_join(thread, NULL);
+	elapsed = get_millisecs() - start;
+
+	request_cleanup(&session);
+	request_release(&session);
+
+	if(elapsed == 0)
+		elapsed = 1;
+
+	printf("request: %d results posted and drained in %d ms, %.0f results/sec\n",
+		drained, elapsed, drained * 1000.0 / elapsed);
+
+	return 0;
+}
@@ -0,0 +1,521 @@
+/*
+ * Benchmark for parsing browse replies
+ *
+ * Compares the way replies used to be handled, inflating all of the XML
+ * into a buffer, parsing it into a tree with ezxml and looking up each
+ * field the track loader wants with ezxml_get(), with the way they are
+ * now: the inflater feeding xmlparser.c a packet at a time and the
+ * handlers in metadata.c filling in a track record as elements close.
+ * Every 'track' element in the document is loaded either way.
+ *
+ * Give it XML files recorded from the server (browse-*.xml, search.xml
+ * and toplistbrowse-*.xml as saved by older DEBUG builds) or it makes up
+ * a reply to a browse of 244 tracks. Reports time per document, MB/s of
+ * XML and how many times each method calls the allocator per document.
+ *
+ * Build with 'make nodebug=1 bench'.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "../arena.h"
+#include "../buf.h"
+#include "../ezxml.h"
+#include "../inflater.h"
+#include "../metadata.h"
+#include "../util.h"
+#include "../xmlparser.h"
+
+
+/* Run each method for at least this long */
+#define RUN_MILLISECS	1000
+
+/* Largest piece of a channel the inflater is handed at once */
+#define PACKET_SIZE	4096
+
+#define NUM_TRACKS	244
+
+
+/* Loaded tracks, so neither method can skip work */
+static int num_tracks;
+static int checksum;
+
+/* Calls to malloc(), calloc() and realloc(), from anywhere */
+static int num_allocs;
+
+
+/*
+ * Allocation counting hook
+ * These take the place of the C library's functions for the whole
+ * program, zlib included, and pass the calls on to glibc's allocator.
+ *
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+	num_allocs++;
+
+	return __libc_malloc(size);
+}
+
+
+void *calloc(size_t nmemb, size_t size) {
+	num_allocs++;
+
+	return __libc_calloc(nmemb, size);
+}
+
+
+void *realloc(void *ptr, size_t size) {
+	num_allocs++;
+
+	return __libc_realloc(ptr, size);
+}
+
+
+/* A hex ID of 'len' bytes that's the same every run */
+static char *make_id(char *hex, int len) {
+	static unsigned int seed = 1;
+	unsigned char id[20];
+	int i;
+
+	for(i = 0; i < len; i++) {
+		seed = seed * 1103515245 + 12345;
+		id[i] = (seed >> 16) & 0xff;
+	}
+
+	hex_bytes_to_ascii(id, hex, len);
+
+	return hex;
+}
+
+
+/* A reply to a browse of NUM_TRACKS tracks, like the server sends */
+static struct buf *make_reply(void) {
+	struct buf *xml;
+	char line[512], a[41], b[41];
+	int i;
+
+	xml = buf_new();
+
+#define XML_APPEND(...) do { \
+		snprintf(line, sizeof(line), __VA_ARGS__); \
+		buf_append_data(xml, line, strlen(line)); \
+	} while(0)
+
+	XML_APPEND("<?xml version=\"1.0\" encoding=\"utf-8\" ?>\n<result>\n<version>1</version>\n<tracks>\n");
+	for(i = 0; i < NUM_TRACKS; i++) {
+		XML_APPEND("<track>\n<id>%s</id>\n", make_id(a, 16));
+		if(i % 8 == 0)
+			XML_APPEND("<redirect>%s</redirect>\n", make_id(a, 16));
+
+		XML_APPEND("<title>Track %d of the &quot;Greatest&quot; Hits &amp; More</title>\n", i);
+		XML_APPEND("<explicit>%s</explicit>\n", i % 5? "false": "true");
+		XML_APPEND("<artist-id>%s</artist-id>\n<artist>Artist %d</artist>\n", make_id(a, 16), i / 12);
+		if(i % 6 == 0)
+			XML_APPEND("<artist-id>%s</artist-id>\n<artist>Guest %d</artist>\n", make_id(a, 16), i);
+
+		XML_APPEND("<album>Album %d</album>\n<album-id>%s</album-id>\n", i / 12, make_id(a, 16));
+		XML_APPEND("<album-artist>Artist %d</album-artist>\n<album-artist-id>%s</album-artist-id>\n", i / 12, make_id(a, 16));
+		XML_APPEND("<year>%d</year>\n<track-number>%d</track-number>\n<length>%d</length>\n", 1970 + i % 40, 1 + i % 12, 120000 + 997 * i);
+		XML_APPEND("<files>\n<file id=\"%s\" format=\"Ogg Vorbis,160000,1,32,4\"/>\n<file id=\"%s\" format=\"Ogg Vorbis,96000,1,32,4\"/>\n</files>\n",
+			make_id(a, 20), make_id(b, 20));
+		XML_APPEND("<cover>%s</cover>\n<popularity>0.%05d</popularity>\n", make_id(a, 20), (i * 7919) % 100000);
+		XML_APPEND("<restrictions>\n<restriction catalogues=\"premium,free\" forbidden=\"DE JP\"/>\n</restrictions>\n</track>\n");
+	}
+	XML_APPEND("</tracks>\n</result>\n");
+
+#undef XML_APPEND
+
+	return xml;
+}
+
+
+/* Deflate after a 10 byte gzip header, the way channels carry XML */
+static struct buf *compress_reply(struct buf *xml) {
+	struct buf *b;
+	z_stream z;
+	int bound;
+
+	memset(&z, 0, sizeof(z));
+	deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+
+	bound = deflateBound(&z, xml->len);
+	b = buf_new();
+	buf_extend(b, 10 + bound);
+	memset(b->ptr, 0, 10);
+
+	z.next_in = xml->ptr;
+	z.avail_in = xml->len;
+	z.next_out = b->ptr + 10;
+	z.avail_out = bound;
+	deflate(&z, Z_FINISH);
+	b->len = 10 + z.total_out;
+	deflateEnd(&z);
+
+	return b;
+}
+
+
+/* What osfy_track_load_from_xml() used to look up in a track element */
+static void ezxml_load_track(ezxml_t track_node) {
+	unsigned char id[20];
+	double popularity;
+	const char *str;
+	ezxml_t node;
+
+	if((node = ezxml_get(track_node, "id", -1)) == NULL)
+		return;
+
+	hex_ascii_to_bytes(node->txt, id, 16);
+	checksum += id[0];
+
+	if((node = ezxml_get(track_node, "title", -1)) != NULL)
+		checksum += strlen(node->txt);
+
+	if((node = ezxml_get(track_node, "explicit", -1)) != NULL)
+		checksum += !strcmp(node->txt, "true");
+
+	if((node = ezxml_get(track_node, "popularity", -1)) != NULL) {
+		sscanf(node->txt, "%lf", &popularity);
+		checksum += (int)(100 * popularity);
+	}
+
+	for(node = ezxml_get(track_node, "files", 0, "file", -1); node; node = node->next) {
+		str = ezxml_attr(node, "format");
+		if(str == NULL || !strstr(str, "160000"))
+			continue;
+
+		if((str = ezxml_attr(node, "id")) != NULL) {
+			hex_ascii_to_bytes(str, id, 20);
+			checksum += id[0];
+		}
+	}
+
+	if((node = ezxml_get(track_node, "length", -1)) != NULL)
+		checksum += atoi(node->txt);
+
+	for(node = ezxml_get(track_node, "restrictions", 0, "restriction", -1); node; node = node->next) {
+		str = ezxml_attr(node, "catalogues");
+		if(!str || !strstr(str, "premium"))
+			continue;
+
+		if((str = ezxml_attr(node, "forbidden")) != NULL)
+			checksum += strstr(str, "SE") == NULL;
+	}
+
+	for(node = ezxml_get(track_node, "artist-id", -1); node; node = node->next) {
+		hex_ascii_to_bytes(node->txt, id, 16);
+		checksum += id[0];
+	}
+
+	for(node = ezxml_get(track_node, "artist", -1); node; node = node->next)
+		checksum += strlen(node->txt);
+
+	if((node = ezxml_get(track_node, "album-id", -1)) != NULL) {
+		hex_ascii_to_bytes(node->txt, id, 16);
+		checksum += id[0];
+	}
+
+	if((node = ezxml_get(track_node, "album", -1)) != NULL)
+		checksum += strlen(node->txt);
+
+	if((node = ezxml_get(track_node, "year", -1)) != NULL)
+		checksum += atoi(node->txt);
+
+	if((node = ezxml_get(track_node, "album-artist-id", -1)) != NULL) {
+		hex_ascii_to_bytes(node->txt, id, 16);
+		checksum += id[0];
+	}
+
+	if((node = ezxml_get(track_node, "album-artist", -1)) != NULL)
+		checksum += strlen(node->txt);
+
+	if((node = ezxml_get(track_node, "cover", -1)) != NULL) {
+		hex_ascii_to_bytes(node->txt, id, 20);
+		checksum += id[0];
+	}
+
+	num_tracks++;
+}
+
+
+static void ezxml_load_tracks(ezxml_t parent) {
+	ezxml_t node;
+
+	for(node = parent->child; node; node = node->ordered) {
+		if(!strcmp(node->name, "track"))
+			ezxml_load_track(node);
+		else
+			ezxml_load_tracks(node);
+	}
+}
+
+
+/* The old way: inflate everything, parse it into a tree, walk the tree */
+static int run_ezxml(struct buf *compressed) {
+	struct inflater *inflater;
+	struct buf *xml;
+	ezxml_t root;
+	int i, n;
+
+	xml = buf_new();
+	inflater = inflater_new(NULL, inflater_sink_buf, xml);
+	for(i = 0; i < compressed->len; i += n) {
+		n = compressed->len - i < PACKET_SIZE? compressed->len - i: PACKET_SIZE;
+		inflater_write(inflater, compressed->ptr + i, n);
+	}
+
+	if(inflater_finish(inflater))
+		return -1;
+
+	inflater_free(inflater);
+
+	buf_append_u8(xml, 0);
+	if((root = ezxml_parse_str((char *)xml->ptr, xml->len)) == NULL)
+		return -1;
+
+	ezxml_load_tracks(root);
+
+	ezxml_free(root);
+	buf_free(xml);
+
+	return 0;
+}
+
+
+/* Load tracks wherever they are, like the handlers in browse.c and friends */
+struct sax_ctx {
+	int track_depth;
+	struct track_xml track;
+};
+
+
+static void sax_start(void *arg, int depth, const char *name, const char **attrs) {
+	struct sax_ctx *ctx = (struct sax_ctx *)arg;
+
+	if(ctx->track_depth)
+		track_xml_start(&ctx->track, depth - ctx->track_depth, name, attrs);
+	else if(!strcmp(name, "track")) {
+		ctx->track_depth = depth;
+		track_xml_free(&ctx->track);
+	}
+}
+
+
+static void sax_end(void *arg, int depth, const char *name, char *text) {
+	struct sax_ctx *ctx = (struct sax_ctx *)arg;
+	struct track_xml *t = &ctx->track;
+	int i;
+
+	if(ctx->track_depth == 0)
+		return;
+
+	if(depth > ctx->track_depth) {
+		track_xml_end(t, depth - ctx->track_depth, name, text);
+		return;
+	}
+
+	ctx->track_depth = 0;
+	if(!(t->found & TRACK_XML_ID))
+		return;
+
+	checksum += t->id[0];
+
+	if(t->found & TRACK_XML_TITLE)
+		checksum += strlen(t->title);
+
+	checksum += t->has_explicit_lyrics;
+
+	if(t->found & TRACK_XML_POPULARITY)
+		checksum += (int)(100 * t->popularity);
+
+	checksum += t->file_id[0] + t->length;
+
+	if(t->restriction.restricted_countries)
+		checksum += strstr(t->restriction.restricted_countries, "SE") == NULL;
+
+	for(i = 0; i < t->artist_list.num_artists; i++) {
+		if(t->artist_list.artists[i].found & ARTIST_XML_ID)
+			checksum += t->artist_list.artists[i].id[0];
+
+		if(t->artist_list.artists[i].found & ARTIST_XML_NAME)
+			checksum += strlen(t->artist_list.artists[i].name);
+	}
+
+	if(t->found & TRACK_XML_ALBUM_ID)
+		checksum += t->album_id[0];
+
+	if(t->found & TRACK_XML_ALBUM)
+		checksum += strlen(t->album);
+
+	checksum += t->year;
+
+	if(t->found & TRACK_XML_ALBUM_ARTIST_ID)
+		checksum += t->album_artist_id[0];
+
+	if(t->found & TRACK_XML_ALBUM_ARTIST)
+		checksum += strlen(t->album_artist);
+
+	if(t->found & TRACK_XML_COVER)
+		checksum += t->cover[0];
+
+	num_tracks++;
+}
+
+
+/*
+ * The new way: parse as the XML is inflated, a packet at a time, with
+ * everything allocated from an arena that goes when the document is done
+ *
+ */
+static int run_sax(struct buf *compressed) {
+	struct arena *arena;
+	struct inflater *inflater;
+	struct xml_parser *parser;
+	struct sax_ctx ctx;
+	int i, n, ret;
+
+	arena = arena_new();
+
+	ctx.track_depth = 0;
+	track_xml_init(&ctx.track, arena, "SE");
+
+	parser = xml_parser_new(arena, sax_start, sax_end, &ctx);
+	inflater = inflater_new(arena, xml_parser_sink, parser);
+	for(i = 0; i < compressed->len; i += n) {
+		n = compressed->len - i < PACKET_SIZE? compressed->len - i: PACKET_SIZE;
+		inflater_write(inflater, compressed->ptr + i, n);
+	}
+
+	ret = inflater_finish(inflater) || xml_parser_finish(parser)? -1: 0;
+
+	inflater_free(inflater);
+	arena_free(arena);
+
+	return ret;
+}
+
+
+/* Returns milliseconds per document */
+static double run(int (*method)(struct buf *), struct buf *compressed, int *tracks, int *sum, int *allocs) {
+	int start, elapsed, runs;
+
+	*tracks = 0;
+	*sum = 0;
+	*allocs = 0;
+
+	num_allocs = 0;
+	if(method(compressed))
+		return -1.0;
+
+	*allocs = num_allocs;
+
+	start = get_millisecs();
+	for(runs = 0; (elapsed = get_millisecs() - start) < RUN_MILLISECS; runs++) {
+		num_tracks = 0;
+		checksum = 0;
+		if(method(compressed))
+			return -1.0;
+	}
+
+	*tracks = num_tracks;
+	*sum = checksum;
+
+	return (double)elapsed / runs;
+}
+
+
+static int bench(const char *name, struct buf *xml) {
+	struct buf *compressed;
+	double ms_ezxml, ms_sax;
+	int tracks_ezxml, tracks_sax, sum_ezxml, sum_sax, allocs_ezxml, allocs_sax;
+
+	compressed = compress_reply(xml);
+
+	ms_ezxml = run(run_ezxml, compressed, &tracks_ezxml, &sum_ezxml, &allocs_ezxml);
+	ms_sax = run(run_sax, compressed, &tracks_sax, &sum_sax, &allocs_sax);
+	buf_free(compressed);
+
+	if(ms_ezxml < 0 || ms_sax < 0) {
+		fprintf(stderr, "%s: failed to parse\n", name);
+		return -1;
+	}
+
+	if(tracks_ezxml != tracks_sax || sum_ezxml != sum_sax) {
+		fprintf(stderr, "%s: ezxml loaded %d tracks (checksum %d), xmlparser %d (checksum %d)\n",
+			name, tracks_ezxml, sum_ezxml, tracks_sax, sum_sax);
+		return -1;
+	}
+
+	printf("%-24s %8d %6d %8.3f %6.1f %6d %8.3f %6.1f %6d\n", name, xml->len, tracks_sax,
+		ms_ezxml, xml->len / 1048.576 / ms_ezxml, allocs_ezxml,
+		ms_sax, xml->len / 1048.576 / ms_sax, allocs_sax);
+
+	return 0;
+}
+
+
+static struct buf *read_file(const char *filename) {
+	struct buf *b;
+	FILE *fd;
+	int n;
+
+	if((fd = fopen(filename, "rb")) == NULL)
+		return NULL;
+
+	b = buf_new();
+	do {
+		buf_extend(b, 65536);
+		n = fread(b->ptr + b->len, 1, 65536, fd);
+		b->len += n;
+	} while(n > 0);
+
+	fclose(fd);
+
+	return b;
+}
+
+
+int main(int argc, char **argv) {
+	struct buf *xml;
+	const char *name;
+	int i, ret = 0;
+
+	printf("xml: ms per document, MB/s of XML and allocations per document, inflated in %d byte packets\n", PACKET_SIZE);
+	printf("%-24s %8s %6s %22s %22s\n", "document", "bytes", "tracks", "ezxml tree", "xmlparser");
+
+	if(argc < 2) {
+		xml = make_reply();
+		ret = bench("browse 244 tracks", xml);
+		buf_free(xml);
+
+		return ret? 1: 0;
+	}
+
+	for(i = 1; i < argc; i++) {
+		if((xml = read_file(argv[i])) == NULL) {
+			perror(argv[i]);
+			return 1;
+		}
+
+		if((name = strrchr(argv[i], '/')) != NULL)
+			name++;
+		else
+			name = argv[i];
+
+		if(bench(name, xml))
+			ret = 1;
+
+		buf_free(xml);
+	}
+
+	return ret;
+}
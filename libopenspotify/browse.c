@@ -15,11 +15,15 @@
  * |   +--+ handle_channel()
  * |      +--+ channel_process()
  * |         +--+ browse_callback()
- * |            +--- CHANNEL_DATA: Buffer XML-data
- * |            +--+ CHANNEL_END:
- * |               +--- browse_parse_compressed_xml()
- * |               +--+ browse_send_browsetrack_request()
- * |                  +-- Will do request_post_set_result(REQ_TYPE_BROWSE_TRACKS) when done
+ * |            +--- CHANNEL_DATA: Inflate and parse XML-data, or keep it for the parse pool
+ * |            +--+ CHANNEL_END: xml_reply_finish()
+ * .
+ * .
+ * +--+ parsepool_complete(), or right away without a parse pool
+ * |   +--+ browse_generic_parsed()
+ * |      +--- brctx->browse_parser()
+ * |      +--+ browse_send_browsetrack_request()
+ * |         +-- Will do request_post_set_result(REQ_TYPE_BROWSE_TRACKS) when done
  * .
  * .
  * +--- DONE
@@ -36,17 +40,40 @@
 #include "channel.h"
 #include "commands.h"
 #include "debug.h"
-#include "ezxml.h"
 #include "playlist.h"
 #include "request.h"
 #include "sp_opaque.h"
 #include "track.h"
 #include "util.h"
+#include "xmlparser.h"
+#include "xmlreply.h"
 
 
 
 static int browse_send_generic_request(sp_session *session, struct request *req);
 static int browse_generic_callback(CHANNEL *ch, unsigned char *payload, unsigned short len);
+static void browse_generic_parsed(void *arg, int ret);
+static int browse_inflight_key(struct browse_callback_ctx *brctx, unsigned char *key);
+static int browse_inflight_join(sp_session *session, struct browse_callback_ctx *brctx);
+static void browse_inflight_add(sp_session *session, struct browse_callback_ctx *brctx);
+static void browse_inflight_complete(sp_session *session, struct browse_callback_ctx *brctx);
+static void browse_release_objects(struct browse_callback_ctx *brctx);
+static int browse_batch_join(sp_session *session, struct browse_callback_ctx *brctx);
+static int browse_batch_flush(sp_session *session);
+static int browse_batch_callback(CHANNEL *ch, unsigned char *payload, unsigned short len);
+static void browse_batch_parsed(void *arg, int ret);
+static void browse_batch_failed(struct browse_batch *batch);
+static void browse_batch_xml_start(void *arg, int depth, const char *name, const char **attrs);
+static void browse_batch_xml_end(void *arg, int depth, const char *name, char *text);
+static void browse_batch_route(struct browse_batch *batch, unsigned char *id);
+static void browse_batch_free(struct browse_batch *batch);
+static int browse_xml_start(struct browse_callback_ctx *brctx);
+static void browse_xml_free(struct browse_callback_ctx *brctx);
+static void browse_generic_failed(struct browse_callback_ctx *brctx);
+static int browse_send_chunks(sp_session *session, struct browse_callback_ctx *brctx);
+static int browse_chunk_callback(CHANNEL *ch, unsigned char *payload, unsigned short len);
+static void browse_chunk_parsed(void *arg, int ret);
+static void browse_chunk_failed(struct browse_chunk *chunk);
 
 
 /* For giving the channel handler access to things it need to know */
@@ -60,6 +87,63 @@ struct callback_ctx {
 };
 
 
+/*
+ * A browse of a single track, album or artist that is on the wire.
+ * Identical browses posted while it's outstanding are parked as waiters
+ * and completed along with the owner instead of sending another CMD_BROWSE.
+ * Kept in session->hashtable_browses and only touched by the iothread.
+ *
+ */
+struct browse_inflight {
+	struct request *owner;
+
+	int num_waiters;
+	struct request **waiters;
+};
+
+
+/*
+ * Track browses from any number of requests sharing one CMD_BROWSE.
+ * The first request to join becomes the leader and sleeps until the
+ * batching window closes, then sends the batch on behalf of all members.
+ * The batch being filled is session->browse_batch, once sent it's owned
+ * by the channel.
+ *
+ */
+struct browse_batch {
+	sp_session *session;
+	struct request *leader;
+
+	int num_ids;
+	unsigned char idlist[16 * MAX_TRACKS_PER_REQUEST];
+
+	int num_members;
+	struct browse_callback_ctx **members;
+
+	/* The XML, parsed as it arrives or by the parse pool */
+	struct xml_reply *reply;
+
+	/* The track element being read */
+	struct track_xml track;
+};
+
+
+/*
+ * One chunk of a playlist track browse on the wire
+ * ctx is a copy of the request's browse context narrowed down to the
+ * chunk (num_browsed is the chunk's offset, num_in_request its size)
+ * so the playlist parser only sees the tracks of this chunk.
+ *
+ */
+struct browse_chunk {
+	struct browse_callback_ctx ctx;
+	struct browse_callback_ctx *parent;
+
+	/* For the parent's list of failed chunks */
+	struct browse_chunk *next;
+};
+
+
 int browse_process(sp_session *session, struct request *req) {
 	int ret;
 
@@ -142,6 +226,23 @@ static int browse_send_generic_request(sp_session *session, struct request *req)
 	}
 
 
+	/* The leader's timer fires when the batching window closes */
+	if(session->browse_batch != NULL && session->browse_batch->leader == req)
+		return browse_batch_flush(session);
+
+	/* Piggyback on an identical browse that's already in flight */
+	if(browse_inflight_join(session, brctx))
+		return 0;
+
+	/* Share a CMD_BROWSE with track browses from other requests */
+	if(brctx->type == REQ_TYPE_BROWSE_TRACK && session->browse_batch_window > 0)
+		return browse_batch_join(session, brctx);
+
+	/* Large playlists are fetched several chunks at a time */
+	if(brctx->type == REQ_TYPE_BROWSE_PLAYLIST_TRACKS)
+		return browse_send_chunks(session, brctx);
+
+
 	/* Don't send too many browse requests at once */
 	brctx->num_in_request = brctx->num_total - brctx->num_browsed;
 	switch(brctx->type) {
@@ -154,7 +255,6 @@ static int browse_send_generic_request(sp_session *session, struct request *req)
 			break;
 
 		case REQ_TYPE_BROWSE_TRACK:
-		case REQ_TYPE_BROWSE_PLAYLIST_TRACKS:
 			if(brctx->num_in_request > MAX_TRACKS_PER_REQUEST)
 				brctx->num_in_request = MAX_TRACKS_PER_REQUEST;
 			break;
@@ -191,12 +291,6 @@ static int browse_send_generic_request(sp_session *session, struct request *req)
 				memcpy(idlist + i*16, brctx->data.artists[brctx->num_browsed + i]->id, 16);
 			break;
 
-		case REQ_TYPE_BROWSE_PLAYLIST_TRACKS:
-			browse_type = BROWSE_TRACK;
-			for(i = 0; i < brctx->num_in_request; i++)
-				memcpy(idlist + i*16, brctx->data.playlist->tracks[brctx->num_browsed + i]->id, 16);
-			break;
-
 		case REQ_TYPE_BROWSE_TRACK:
 			browse_type = BROWSE_TRACK;
 			for(i = 0; i < brctx->num_in_request; i++)
@@ -212,9 +306,12 @@ static int browse_send_generic_request(sp_session *session, struct request *req)
 	/* Need to have a valid browse type */
 	assert(browse_type != 0);
 	
-	/* Buffer to hold data (gzip'd XML) retrieved */
-	assert(brctx->buf == NULL);
-	brctx->buf = buf_new();
+	/* Parser for the XML retrieved */
+	assert(brctx->reply == NULL);
+	if(browse_xml_start(brctx)) {
+		free(idlist);
+		return -1;
+	}
 
 	
 	DSFYDEBUG("Sending BROWSE for %d items (from offset %d) on behalf of <type %s, state %s, input %p>\n",
@@ -224,6 +321,11 @@ static int browse_send_generic_request(sp_session *session, struct request *req)
 	ret = cmd_browse(session, browse_type, idlist, brctx->num_in_request, browse_generic_callback, brctx);
 	
 	free(idlist);
+
+	if(ret == 0)
+		browse_inflight_add(session, brctx);
+	else
+		browse_generic_failed(brctx);
 	
 	return ret;
 }
@@ -231,69 +333,679 @@ static int browse_send_generic_request(sp_session *session, struct request *req)
 
 /* Callback for browse requests */
 static int browse_generic_callback(CHANNEL *ch, unsigned char *payload, unsigned short len) {
-	int skip_len;
 	struct browse_callback_ctx *brctx;
 	brctx = (struct browse_callback_ctx *)ch->private;
 
 	switch(ch->state) {
 		case CHANNEL_DATA:
-			/* Skip a minimal gzip header */
-			if (ch->total_data_len < 10) {
-				skip_len = 10 - ch->total_data_len;
-				while(skip_len && len) {
-					skip_len--;
-					len--;
-					payload++;
-				}
-				
-				if (len == 0)
-					break;
-			}
+			xml_reply_write(brctx->reply, payload, len);
+			break;
 			
-			buf_append_data(brctx->buf, payload, len);
+		case CHANNEL_ERROR:
+			DSFYDEBUG("Got a channel ERROR\n");
+			browse_generic_failed(brctx);
+			break;
+			
+		case CHANNEL_END:
+			xml_reply_finish(brctx->reply, browse_generic_parsed, brctx);
 			break;
 			
+		default:
+			break;
+	}
+	
+	return 0;
+}
+
+
+/* Called once the XML has been parsed, which may be after the channel has gone */
+static void browse_generic_parsed(void *arg, int ret) {
+	struct browse_callback_ctx *brctx = (struct browse_callback_ctx *)arg;
+
+	if(ret) {
+		DSFYDEBUG("Failed to decompress or parse XML\n");
+		browse_generic_failed(brctx);
+		return;
+	}
+
+	DSFYDEBUG("Got all data, calling parser\n");
+	brctx->browse_parser(brctx);
+	browse_xml_free(brctx);
+	
+	/* Increase number of items processed */
+	brctx->num_browsed += brctx->num_in_request;
+	
+	/* Force the next browse request to happen immediately */
+	request_set_next_timeout(brctx->session, brctx->req, 0);
+
+	/* Finish identical browses that waited for this one */
+	browse_inflight_complete(brctx->session, brctx);
+}
+
+
+/* Give up on the data received, retrying the browse later */
+static void browse_generic_failed(struct browse_callback_ctx *brctx) {
+	browse_xml_free(brctx);
+
+	if(brctx->type == REQ_TYPE_ARTISTBROWSE) {
+		DSFYDEBUG("Failing artist browse\n");
+
+		/* Force SP_ERROR_OTHER_TRANSIENT and !loaded */
+		brctx->browse_parser(brctx);
+
+		/* Increase number of items processed */
+		brctx->num_browsed += brctx->num_in_request;
+
+		/* Force the next browse request to happen immediately */
+		request_set_next_timeout(brctx->session, brctx->req, 0);
+	}
+	else {
+		DSFYDEBUG("Retrying within %d seconds\n", BROWSE_RETRY_TIMEOUT);
+
+		/* The request will be retried as soon as req->next_timeout expires */
+		request_set_next_timeout(brctx->session, brctx->req, get_millisecs() + BROWSE_RETRY_TIMEOUT);
+	}
+}
+
+
+/*
+ * Build the in-flight key for a browse of a single track, album or artist
+ * Returns -1 for browses that can't be shared (playlists, album and artist
+ * browses) since those fill in objects private to the request
+ *
+ */
+static int browse_inflight_key(struct browse_callback_ctx *brctx, unsigned char *key) {
+	unsigned char *id;
+
+	if(brctx->num_total != 1)
+		return -1;
+
+	switch(brctx->type) {
+		case REQ_TYPE_BROWSE_TRACK:
+			id = brctx->data.tracks[0]->id;
+			break;
+
+		case REQ_TYPE_BROWSE_ALBUM:
+			id = brctx->data.albums[0]->id;
+			break;
+
+		case REQ_TYPE_BROWSE_ARTIST:
+			id = brctx->data.artists[0]->id;
+			break;
+
+		default:
+			return -1;
+	}
+
+	/* The hashtable hashes on the first bytes of the key, so ID goes first */
+	memset(key, 0, BROWSE_INFLIGHT_KEY_SIZE);
+	memcpy(key, id, 16);
+	key[16] = (unsigned char)brctx->type;
+
+	return 0;
+}
+
+
+/*
+ * Called before sending a browse
+ * Returns 1 if the request was taken care of without going to the network,
+ * either because the object was loaded in the meantime or because an
+ * identical browse is in flight and we're now waiting for it
+ *
+ */
+static int browse_inflight_join(sp_session *session, struct browse_callback_ctx *brctx) {
+	unsigned char key[BROWSE_INFLIGHT_KEY_SIZE];
+	struct browse_inflight *inflight;
+	int is_loaded;
+
+	if(browse_inflight_key(brctx, key))
+		return 0;
+
+	switch(brctx->type) {
+		case REQ_TYPE_BROWSE_TRACK:
+			is_loaded = sp_track_is_loaded(brctx->data.tracks[0]);
+			break;
+
+		case REQ_TYPE_BROWSE_ALBUM:
+			is_loaded = sp_album_is_loaded(brctx->data.albums[0]);
+			break;
+
+		default:
+			is_loaded = sp_artist_is_loaded(brctx->data.artists[0]);
+			break;
+	}
+
+	brctx->num_in_request = 1;
+	inflight = (struct browse_inflight *)hashtable_find(session->hashtable_browses, key);
+
+	if(is_loaded) {
+		DSFYDEBUG("Object already loaded, completing <type %s> without a browse\n", REQUEST_TYPE_STR(brctx->req->type));
+
+		/* An owner retrying after a failure takes its waiters along */
+		if(inflight != NULL && inflight->owner == brctx->req)
+			browse_inflight_complete(session, brctx);
+
+		browse_release_objects(brctx);
+		brctx->num_browsed += brctx->num_in_request;
+		brctx->req->next_timeout = 0;
+
+		atomic_add(&session->num_coalesced, 1);
+		return 1;
+	}
+
+	if(inflight == NULL || inflight->owner == brctx->req)
+		return 0;
+
+	DSFYDEBUG("Identical browse in flight, <type %s, input %p> waits for it\n",
+		  REQUEST_TYPE_STR(brctx->req->type), brctx->req->input);
+
+	inflight->waiters = (struct request **)realloc(inflight->waiters, sizeof(struct request *) * (inflight->num_waiters + 1));
+	inflight->waiters[inflight->num_waiters++] = brctx->req;
+
+	atomic_add(&session->num_coalesced, 1);
+
+	/* req->next_timeout stays at INT_MAX until the owner completes */
+	return 1;
+}
+
+
+/* Called after a browse went out, makes the request the owner of its key */
+static void browse_inflight_add(sp_session *session, struct browse_callback_ctx *brctx) {
+	unsigned char key[BROWSE_INFLIGHT_KEY_SIZE];
+	struct browse_inflight *inflight;
+
+	if(browse_inflight_key(brctx, key))
+		return;
+
+	/* Retries keep their existing entry and waiters */
+	if(hashtable_find(session->hashtable_browses, key) != NULL)
+		return;
+
+	inflight = (struct browse_inflight *)malloc(sizeof(struct browse_inflight));
+	inflight->owner = brctx->req;
+	inflight->num_waiters = 0;
+	inflight->waiters = NULL;
+
+	hashtable_insert(session->hashtable_browses, key, inflight);
+}
+
+
+/* Called when the owner's browse has been parsed, wakes up the waiters */
+static void browse_inflight_complete(sp_session *session, struct browse_callback_ctx *brctx) {
+	unsigned char key[BROWSE_INFLIGHT_KEY_SIZE];
+	struct browse_inflight *inflight;
+	struct browse_callback_ctx *waiter;
+	int i;
+
+	if(browse_inflight_key(brctx, key))
+		return;
+
+	inflight = (struct browse_inflight *)hashtable_find(session->hashtable_browses, key);
+	if(inflight == NULL || inflight->owner != brctx->req)
+		return;
+
+	hashtable_remove(session->hashtable_browses, key);
+
+	for(i = 0; i < inflight->num_waiters; i++) {
+		waiter = *(struct browse_callback_ctx **)inflight->waiters[i]->input;
+
+		/* The owner's parser loaded the shared object, drop our reference */
+		browse_release_objects(waiter);
+		waiter->num_browsed += waiter->num_in_request;
+
+		request_set_next_timeout(session, inflight->waiters[i], 0);
+	}
+
+	free(inflight->waiters);
+	free(inflight);
+}
+
+
+/* Release the references the browse holds on the objects in the current request */
+static void browse_release_objects(struct browse_callback_ctx *brctx) {
+	int i;
+
+	for(i = brctx->num_browsed; i < brctx->num_browsed + brctx->num_in_request; i++) {
+		switch(brctx->type) {
+			case REQ_TYPE_BROWSE_TRACK:
+				sp_track_release(brctx->data.tracks[i]);
+				break;
+
+			case REQ_TYPE_BROWSE_ALBUM:
+				sp_album_release(brctx->data.albums[i]);
+				break;
+
+			case REQ_TYPE_BROWSE_ARTIST:
+				sp_artist_release(brctx->data.artists[i]);
+				break;
+
+			default:
+				break;
+		}
+	}
+}
+
+
+/*
+ * Add the request's next tracks to the batch being filled, starting a new
+ * batch if needed. Sends the batch right away once it's full.
+ *
+ */
+static int browse_batch_join(sp_session *session, struct browse_callback_ctx *brctx) {
+	struct browse_batch *batch;
+	unsigned char *id;
+	int i, j;
+
+	batch = session->browse_batch;
+	if(batch == NULL) {
+		batch = (struct browse_batch *)malloc(sizeof(struct browse_batch));
+		batch->session = session;
+		batch->leader = brctx->req;
+		batch->num_ids = 0;
+		batch->num_members = 0;
+		batch->members = NULL;
+		batch->reply = NULL;
+
+		session->browse_batch = batch;
+
+		brctx->req->next_timeout = get_millisecs() + session->browse_batch_window;
+	}
+
+	brctx->num_in_request = brctx->num_total - brctx->num_browsed;
+	if(brctx->num_in_request > MAX_TRACKS_PER_REQUEST - batch->num_ids)
+		brctx->num_in_request = MAX_TRACKS_PER_REQUEST - batch->num_ids;
+
+	for(i = 0; i < brctx->num_in_request; i++) {
+		id = brctx->data.tracks[brctx->num_browsed + i]->id;
+
+		for(j = 0; j < batch->num_ids; j++)
+			if(!memcmp(batch->idlist + j*16, id, 16))
+				break;
+
+		if(j < batch->num_ids) {
+			atomic_add(&session->num_coalesced, 1);
+			continue;
+		}
+
+		memcpy(batch->idlist + batch->num_ids*16, id, 16);
+		batch->num_ids++;
+	}
+
+	batch->members = (struct browse_callback_ctx **)realloc(batch->members, sizeof(struct browse_callback_ctx *) * (batch->num_members + 1));
+	batch->members[batch->num_members++] = brctx;
+
+	/* Identical single track browses can wait for this one */
+	browse_inflight_add(session, brctx);
+
+	DSFYDEBUG("Added %d tracks from <type %s, input %p> to batch of %d tracks and %d requests\n",
+		  brctx->num_in_request, REQUEST_TYPE_STR(brctx->req->type), brctx->req->input,
+		  batch->num_ids, batch->num_members);
+
+	if(batch->num_ids == MAX_TRACKS_PER_REQUEST)
+		return browse_batch_flush(session);
+
+	return 0;
+}
+
+
+/* Send the batch being filled */
+static int browse_batch_flush(sp_session *session) {
+	struct browse_batch *batch;
+
+	batch = session->browse_batch;
+	session->browse_batch = NULL;
+
+	/* Members, the leader included, sleep until the channel callback wakes them */
+	request_set_next_timeout(session, batch->leader, INT_MAX);
+
+	batch->reply = xml_reply_new(session->parsepool, browse_batch_xml_start, browse_batch_xml_end, batch);
+	if(batch->reply == NULL) {
+		browse_batch_failed(batch);
+		return 0;
+	}
+
+	track_xml_init(&batch->track, batch->reply->arena, session->country);
+
+	DSFYDEBUG("Sending batched BROWSE for %d tracks on behalf of %d requests\n",
+		  batch->num_ids, batch->num_members);
+
+	if(cmd_browse(session, BROWSE_TRACK, batch->idlist, batch->num_ids, browse_batch_callback, batch))
+		browse_batch_failed(batch);
+
+	return 0;
+}
+
+
+/* Callback for batched track browses */
+static int browse_batch_callback(CHANNEL *ch, unsigned char *payload, unsigned short len) {
+	struct browse_batch *batch;
+
+	batch = (struct browse_batch *)ch->private;
+
+	switch(ch->state) {
+		case CHANNEL_DATA:
+			xml_reply_write(batch->reply, payload, len);
+			break;
+
 		case CHANNEL_ERROR:
-			buf_free(brctx->buf);
-			brctx->buf = NULL;
+			DSFYDEBUG("Got a channel ERROR\n");
+			browse_batch_failed(batch);
+			break;
 
-			if(brctx->type == REQ_TYPE_ARTISTBROWSE) {
-				DSFYDEBUG("Got a channel ERROR, failing artist browse\n");
+		case CHANNEL_END:
+			xml_reply_finish(batch->reply, browse_batch_parsed, batch);
+			break;
+
+		default:
+			break;
+	}
 
-				/* Force SP_ERROR_OTHER_TRANSIENT and !loaded */
-				brctx->browse_parser(brctx);
+	return 0;
+}
 
-				/* Increase number of items processed */
-				brctx->num_browsed += brctx->num_in_request;
-			
-				/* Force the next browse request to happen immediately */
-				brctx->req->next_timeout = 0;
-			}
-			else {
-				DSFYDEBUG("Got a channel ERROR, retrying within %d seconds\n", BROWSE_RETRY_TIMEOUT);
 
-				/* The request will be retried as soon as req->next_timeout expires */
-				brctx->req->next_timeout = get_millisecs() + BROWSE_RETRY_TIMEOUT;
-			}
+/* Called once the batch's XML has been parsed and its tracks loaded */
+static void browse_batch_parsed(void *arg, int ret) {
+	struct browse_batch *batch = (struct browse_batch *)arg;
+	struct browse_callback_ctx *brctx;
+	int i;
+
+	if(ret) {
+		DSFYDEBUG("Failed to decompress or parse XML for batch of %d tracks\n", batch->num_ids);
+		browse_batch_failed(batch);
+		return;
+	}
+
+	DSFYDEBUG("Got all data for batch of %d tracks\n", batch->num_ids);
+
+	for(i = 0; i < batch->num_members; i++) {
+		brctx = batch->members[i];
+
+		/* Release references made when the browse was posted */
+		browse_release_objects(brctx);
+
+		/* Increase number of items processed */
+		brctx->num_browsed += brctx->num_in_request;
+
+		/* Force the next browse request to happen immediately */
+		request_set_next_timeout(batch->session, brctx->req, 0);
+
+		/* Finish identical browses that waited for this one */
+		browse_inflight_complete(batch->session, brctx);
+	}
+
+	browse_batch_free(batch);
+}
+
+
+/* Give up on the batch, its members will join a new one when they're retried */
+static void browse_batch_failed(struct browse_batch *batch) {
+	int i;
+
+	DSFYDEBUG("Retrying %d batched requests within %d seconds\n",
+		  batch->num_members, BROWSE_RETRY_TIMEOUT);
+
+	for(i = 0; i < batch->num_members; i++)
+		request_set_next_timeout(batch->session, batch->members[i]->req, get_millisecs() + BROWSE_RETRY_TIMEOUT);
+
+	browse_batch_free(batch);
+}
+
+
+/* Tracks are at <result><tracks><track> */
+static void browse_batch_xml_start(void *arg, int depth, const char *name, const char **attrs) {
+	struct browse_batch *batch = (struct browse_batch *)arg;
+
+	if(depth == 3)
+		track_xml_free(&batch->track);
+	else if(depth > 3)
+		track_xml_start(&batch->track, depth - 3, name, attrs);
+}
+
+
+/*
+ * Load every member's tracks as the track elements close
+ * A track is matched on its 'id' element or any of its 'redirect' elements
+ * since the server may answer with a different track, see playlist.c
+ *
+ */
+static void browse_batch_xml_end(void *arg, int depth, const char *name, char *text) {
+	struct browse_batch *batch = (struct browse_batch *)arg;
+	int i;
+
+	if(depth > 3) {
+		track_xml_end(&batch->track, depth - 3, name, text);
+		return;
+	}
+
+	if(depth < 3)
+		return;
+
+	if(batch->track.found & TRACK_XML_ID)
+		browse_batch_route(batch, batch->track.id);
+
+	for(i = 0; i < batch->track.num_redirects; i++)
+		browse_batch_route(batch, batch->track.redirects[i]);
+}
+
+
+/* Load the member tracks with the given ID from the track just read */
+static void browse_batch_route(struct browse_batch *batch, unsigned char *id) {
+	struct browse_callback_ctx *brctx;
+	sp_track *track;
+	int i, j;
+
+	for(i = 0; i < batch->num_members; i++) {
+		brctx = batch->members[i];
+
+		for(j = brctx->num_browsed; j < brctx->num_browsed + brctx->num_in_request; j++) {
+			track = brctx->data.tracks[j];
+			if(sp_track_is_loaded(track) || memcmp(track->id, id, 16))
+				continue;
+
+			osfy_track_load_from_xml(batch->session, track, &batch->track);
+		}
+	}
+}
+
+
+static void browse_batch_free(struct browse_batch *batch) {
+	/* The track record's contents go with it */
+	if(batch->reply)
+		xml_reply_free(batch->reply);
+
+	free(batch->members);
+	free(batch);
+}
+
+
+/*
+ * Keep up to session->browse_max_chunks chunks of a playlist's tracks on
+ * the wire. Failed chunks are sent again before new ones. Beyond the first
+ * chunk we stay within the global channel budget so other requests get
+ * their share. Chunks may complete in any order, num_browsed counts the
+ * tracks of completed chunks.
+ *
+ */
+static int browse_send_chunks(sp_session *session, struct browse_callback_ctx *brctx) {
+	struct browse_chunk *chunk = NULL;
+	unsigned char *idlist;
+	int i, ret;
+
+	while(brctx->num_chunks < session->browse_max_chunks
+		&& (brctx->failed_chunks != NULL || brctx->num_sent < brctx->num_total)) {
+
+		if(brctx->num_chunks > 0 && !channel_budget_available(session, CHANNEL_CLASS_METADATA))
 			break;
-			
+
+		if((chunk = brctx->failed_chunks) != NULL) {
+			brctx->failed_chunks = chunk->next;
+		}
+		else {
+			chunk = (struct browse_chunk *)malloc(sizeof(struct browse_chunk));
+			chunk->ctx = *brctx;
+			chunk->parent = brctx;
+
+			chunk->ctx.num_browsed = brctx->num_sent;
+			chunk->ctx.num_in_request = brctx->num_total - brctx->num_sent;
+			if(chunk->ctx.num_in_request > MAX_TRACKS_PER_REQUEST)
+				chunk->ctx.num_in_request = MAX_TRACKS_PER_REQUEST;
+
+			brctx->num_sent += chunk->ctx.num_in_request;
+		}
+
+		chunk->next = NULL;
+		if(browse_xml_start(&chunk->ctx))
+			break;
+
+		idlist = (unsigned char *)malloc(16 * chunk->ctx.num_in_request);
+		for(i = 0; i < chunk->ctx.num_in_request; i++)
+			memcpy(idlist + i*16, brctx->data.playlist->tracks[chunk->ctx.num_browsed + i]->id, 16);
+
+		DSFYDEBUG("Sending BROWSE for %d items (from offset %d, %d chunks in flight) on behalf of <type %s, input %p>\n",
+			  chunk->ctx.num_in_request, chunk->ctx.num_browsed, brctx->num_chunks,
+			  REQUEST_TYPE_STR(brctx->req->type), brctx->req->input);
+
+		ret = cmd_browse(session, BROWSE_TRACK, idlist, chunk->ctx.num_in_request, browse_chunk_callback, chunk);
+		free(idlist);
+
+		/* cmd_browse() unregisters the channel if it fails, the chunk is ours again */
+		if(ret) {
+			browse_xml_free(&chunk->ctx);
+			break;
+		}
+
+		brctx->num_chunks++;
+		chunk = NULL;
+	}
+
+	if(chunk == NULL)
+		return 0;
+
+	/* Send it again later, with the chunks still in flight or on a timer */
+	chunk->next = brctx->failed_chunks;
+	brctx->failed_chunks = chunk;
+
+	if(brctx->num_chunks == 0)
+		request_set_next_timeout(session, brctx->req, get_millisecs() + BROWSE_RETRY_TIMEOUT);
+
+	return -1;
+}
+
+
+/* Callback for the chunks of a playlist track browse */
+static int browse_chunk_callback(CHANNEL *ch, unsigned char *payload, unsigned short len) {
+	struct browse_chunk *chunk;
+
+	chunk = (struct browse_chunk *)ch->private;
+
+	switch(ch->state) {
+		case CHANNEL_DATA:
+			xml_reply_write(chunk->ctx.reply, payload, len);
+			break;
+
+		case CHANNEL_ERROR:
+			DSFYDEBUG("Got a channel ERROR for chunk at offset %d\n", chunk->ctx.num_browsed);
+			browse_chunk_failed(chunk);
+			break;
+
 		case CHANNEL_END:
-			DSFYDEBUG("Got all data, calling parser\n");
-			brctx->browse_parser(brctx);
-			buf_free(brctx->buf);
-			brctx->buf = NULL;
-			
-			/* Increase number of items processed */
-			brctx->num_browsed += brctx->num_in_request;
-			
-			/* Force the next browse request to happen immediately */
-			brctx->req->next_timeout = 0;
-			
+			xml_reply_finish(chunk->ctx.reply, browse_chunk_parsed, chunk);
 			break;
-			
+
 		default:
 			break;
 	}
-	
+
+	return 0;
+}
+
+
+/* Called once a chunk's XML has been parsed, it still counts as in flight until then */
+static void browse_chunk_parsed(void *arg, int ret) {
+	struct browse_chunk *chunk = (struct browse_chunk *)arg;
+	struct browse_callback_ctx *brctx = chunk->parent;
+
+	if(ret) {
+		DSFYDEBUG("Failed to decompress XML for chunk at offset %d\n", chunk->ctx.num_browsed);
+		browse_chunk_failed(chunk);
+		return;
+	}
+
+	DSFYDEBUG("Got all data for chunk at offset %d, calling parser\n", chunk->ctx.num_browsed);
+	brctx->browse_parser(&chunk->ctx);
+	browse_xml_free(&chunk->ctx);
+
+	/* Increase number of items processed */
+	brctx->num_browsed += chunk->ctx.num_in_request;
+	brctx->num_chunks--;
+	free(chunk);
+
+	/* Send more chunks or return the result */
+	request_set_next_timeout(brctx->session, brctx->req, 0);
+}
+
+
+/* Send a chunk again with the next batch of chunks */
+static void browse_chunk_failed(struct browse_chunk *chunk) {
+	struct browse_callback_ctx *brctx = chunk->parent;
+
+	DSFYDEBUG("Retrying chunk at offset %d within %d seconds\n",
+		  chunk->ctx.num_browsed, BROWSE_RETRY_TIMEOUT);
+
+	browse_xml_free(&chunk->ctx);
+
+	chunk->next = brctx->failed_chunks;
+	brctx->failed_chunks = chunk;
+	brctx->num_chunks--;
+
+	if(brctx->num_chunks == 0)
+		request_set_next_timeout(brctx->session, brctx->req, get_millisecs() + BROWSE_RETRY_TIMEOUT);
+}
+
+
+/* Set up for parsing a browse's XML with the context's handlers */
+static int browse_xml_start(struct browse_callback_ctx *brctx) {
+	brctx->reply = xml_reply_new(brctx->session->parsepool, brctx->xml_start, brctx->xml_end, brctx);
+	if(brctx->reply == NULL)
+		return -1;
+
+	artist_xml_init(&brctx->artist, brctx->reply->arena);
+	album_xml_init(&brctx->album, brctx->reply->arena, brctx->session->country);
+	track_xml_init(&brctx->track, brctx->reply->arena, brctx->session->country);
+	brctx->section = 0;
+	brctx->disc_number = -1;
+	brctx->disc_index = 0;
+
 	return 0;
 }
+
+
+/* Release everything the parse needed, the records' contents included */
+static void browse_xml_free(struct browse_callback_ctx *brctx) {
+	if(brctx->reply) {
+		xml_reply_free(brctx->reply);
+		brctx->reply = NULL;
+	}
+}
+
+
+/* Free the in-flight table, called by sp_session_release() */
+void browse_release(sp_session *session) {
+	struct hashiterator *iter;
+	struct hashentry *entry;
+	struct browse_inflight *inflight;
+
+	iter = hashtable_iterator_init(session->hashtable_browses);
+	while((entry = hashtable_iterator_next(iter)) != NULL) {
+		inflight = (struct browse_inflight *)entry->value;
+		free(inflight->waiters);
+		free(inflight);
+	}
+
+	hashtable_iterator_free(iter);
+	hashtable_free(session->hashtable_browses);
+
+	if(session->browse_batch)
+		browse_batch_free(session->browse_batch);
+}
@@ -5,13 +5,26 @@
 
 #include "buf.h"
 #include "hashtable.h"
+#include "metadata.h"
 #include "request.h"
+#include "xmlparser.h"
+#include "xmlreply.h"
 
 
 #define BROWSE_RETRY_TIMEOUT	30
 
+/* Default milliseconds track browses wait for others to share a CMD_BROWSE */
+#define BROWSE_BATCH_WINDOW	20
+
+/* Default number of chunks of a playlist's tracks fetched at once */
+#define BROWSE_MAX_CHUNKS	4
+
+/* Object ID followed by the browse type, see browse_inflight_key() */
+#define BROWSE_INFLIGHT_KEY_SIZE	20
+
 
 struct browse_callback_ctx;
+struct browse_chunk;
 typedef int (*browse_parser) (struct browse_callback_ctx *brctx);
 
 struct browse_callback_ctx {
@@ -21,8 +34,8 @@ struct browse_callback_ctx {
 	/* The request, so we can store the result */
 	struct request *req;
 	
-	/* For keeping the gzip'd XML */
-	struct buf *buf;
+	/* The XML, parsed as it arrives or by the parse pool, see xmlreply.c */
+	struct xml_reply *reply;
 
 	/* Type of objects, same as request->type */
 	int type;
@@ -45,11 +58,39 @@ struct browse_callback_ctx {
 	/* Number of items in the current request */
 	int num_in_request;
 	
-	/* Gzip'd XML parser, provided by the caller */
+	/* Called once all of the XML has been parsed, provided by the caller */
 	browse_parser browse_parser;
+
+	/* XML element handlers, provided by the caller, 'arg' is the context */
+	xml_start_handler xml_start;
+	xml_end_handler xml_end;
+
+	/*
+	 * For the handlers: The object being read, where in the document
+	 * we are (meaning is up to the handlers) and the disc the tracks
+	 * of album and artist browses are on
+	 *
+	 */
+	struct artist_xml artist;
+	struct album_xml album;
+	struct track_xml track;
+	int section;
+	int disc_number;
+	int disc_index;
+
+	/*
+	 * Only used by REQ_TYPE_BROWSE_PLAYLIST_TRACKS, which is fetched
+	 * in concurrent chunks: Number of objects sent for so far, chunks
+	 * on the wire and chunks waiting to be sent again (see browse.c)
+	 *
+	 */
+	int num_sent;
+	int num_chunks;
+	struct browse_chunk *failed_chunks;
 };
 
 
 int browse_process(sp_session *session, struct request *req);
+void browse_release(sp_session *session);
 
 #endif
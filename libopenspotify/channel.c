@@ -10,32 +10,46 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <limits.h>
 
+#include "buf.h"
 #include "debug.h"
 #include "channel.h"
+#include "packet.h"
+#include "request.h"
 #include "sp_opaque.h"
 #include "util.h"
 
+static int channel_alloc_id (sp_session *session);
+static void channel_free_id (sp_session *session, int id);
+static void channel_budget_update (sp_session *session, CHANNEL *ch);
+static void channel_budget_wakeup (sp_session *session, struct channel_budget *budget);
+
 CHANNEL *channel_register (sp_session *session, char *name, channel_callback callback,
 			   void *private)
+{
+	return channel_register_class (session, CHANNEL_CLASS_METADATA, name, callback, private);
+}
+
+CHANNEL *channel_register_class (sp_session *session, enum channel_class traffic_class,
+				 char *name, channel_callback callback, void *private)
 {
 	CHANNEL *ch;
 	int id;
 
-	/*
-	 * Pick a channel id and lazily set next to last available + 1
-	 */
-	id = session->next_channel_id++;
-	if ((ch = session->channels) != NULL) {
-		for (; ch; ch = ch->next) {
-			if (ch->channel_id >= session->next_channel_id)
-				session->next_channel_id = ch->channel_id + 1;
-		}
-	}
+	/* Pick the lowest free channel id */
+	if ((id = channel_alloc_id (session)) == -1)
+		return NULL;
 
-	ch = malloc (sizeof (CHANNEL));
-	if (!ch)
+	/* Recycle a CHANNEL from the pool if we can */
+	if ((ch = session->channel_pool) != NULL)
+		session->channel_pool = ch->next;
+	else if ((ch = malloc (sizeof (CHANNEL))) == NULL) {
+		channel_free_id (session, id);
 		return NULL;
+	}
+	else
+		ch->request = NULL;
 
 	ch->channel_id = id;
 	ch->header_id = 0;
@@ -44,19 +58,36 @@ CHANNEL *channel_register (sp_session *session, char *name, channel_callback cal
 	ch->total_header_len = 0;
 	ch->total_data_len = 0;
 
+	ch->traffic_class = traffic_class;
+	ch->start_time = get_millisecs();
+
+	/* A recycled CHANNEL keeps its request buffer */
+	if (ch->request != NULL)
+		ch->request->len = 0;
+	ch->request_resume_offset = -1;
+	ch->resumed_len = 0;
+	ch->skip_headers = 0;
+	ch->skip_data = 0;
+
+	/* The name is only used for tracing */
+#ifdef DEBUG
 	if (name)
 		strncpy (ch->name, name, sizeof (ch->name) - 1);
 	else
 		ch->name[0] = 0;
 	ch->name[sizeof (ch->name) - 1] = 0;
+#else
+	ch->name[0] = 0;
+#endif
 
 	ch->callback = callback;
 	ch->private = private;
+	ch->next = NULL;
 
-	ch->next = session->channels;
-	session->channels = ch;
+	session->channel_table[id] = ch;
 
 	session->num_channels++;
+	session->channel_budgets[traffic_class].num_open++;
 
 	DSFYDEBUG("Registered channel '%s' with id %d\n", ch->name, ch->channel_id);
 
@@ -65,42 +96,33 @@ CHANNEL *channel_register (sp_session *session, char *name, channel_callback cal
 
 void channel_unregister (sp_session *session, CHANNEL * ch)
 {
-	CHANNEL *tmp;
-
 	DSFYDEBUG
 		("channel %d: unregistering, %d headers, %u bytes header, %u bytes payload\n",
 		 ch->channel_id, ch->header_id, ch->total_header_len,
 		 ch->total_data_len);
 
-	if (ch == session->channels)
-		session->channels = ch->next;
-	else {
-		for (tmp = session->channels; tmp; tmp = tmp->next)
-			if (tmp->next == ch)
-				break;
+	assert (session->channel_table[ch->channel_id] == ch);
 
-		assert (tmp != NULL);
+	session->channel_table[ch->channel_id] = NULL;
+	channel_free_id (session, ch->channel_id);
 
-		tmp->next = ch->next;
-	}
-
-	if (ch->channel_id < session->next_channel_id)
-		session->next_channel_id = ch->channel_id;
+	session->num_channels--;
+	session->channel_budgets[ch->traffic_class].num_open--;
 
-	free (ch);
+	/* Let the next request waiting for a channel of this class go */
+	channel_budget_wakeup (session, &session->channel_budgets[ch->traffic_class]);
 
-	session->num_channels--;
+	/* Back to the pool */
+	ch->next = session->channel_pool;
+	session->channel_pool = ch;
 }
 
 CHANNEL *channel_by_id (sp_session *session, unsigned short channel_id)
 {
-	CHANNEL *ch;
-
-	for (ch = session->channels; ch; ch = ch->next)
-		if (ch->channel_id == channel_id)
-			break;
+	if (channel_id >= session->channel_table_size)
+		return NULL;
 
-	return ch;
+	return session->channel_table[channel_id];
 }
 
 int channel_process (sp_session *session, unsigned char *buf, unsigned short len, int error)
@@ -109,7 +131,7 @@ int channel_process (sp_session *session, unsigned char *buf, unsigned short len
 	unsigned short channel_id;
 	int ret;
 	unsigned char *ptr;
-	unsigned short header_len, consumed_len;
+	unsigned short header_len, consumed_len, skip_len;
 	
 	/* Extract channel ID */
 	memcpy(&channel_id, buf, 2);
@@ -118,10 +140,7 @@ int channel_process (sp_session *session, unsigned char *buf, unsigned short len
 	len -= 2;
 
 	/* Find a matching channel */
-	for (ch = session->channels; ch; ch = ch->next) {
-		if (ch->channel_id == channel_id)
-			break;
-	}
+	ch = channel_by_id (session, channel_id);
 
 	if (ch == NULL) {
 		DSFYDEBUG
@@ -166,6 +185,15 @@ int channel_process (sp_session *session, unsigned char *buf, unsigned short len
 				fhexdump8x32 (stderr, "payload:", ptr, len);
 				return 0;
 			}
+
+			/* The callback already got this header before the request was replayed */
+			if (ch->skip_headers > 0) {
+				ch->skip_headers--;
+				ptr += header_len;
+				consumed_len += header_len;
+				continue;
+			}
+
 			ch->header_id++;
 			DSFYDEBUG
 				("channel %d: Entering callback (header %d) for channel '%s', %d bytes data\n",
@@ -187,6 +215,17 @@ int channel_process (sp_session *session, unsigned char *buf, unsigned short len
 		return 0;
 	}
 
+	/* Drop data the callback already got before the request was replayed */
+	if (ch->state == CHANNEL_DATA && ch->skip_data > 0 && len > 0) {
+		skip_len = len < ch->skip_data? len: ch->skip_data;
+		ch->skip_data -= skip_len;
+		buf += skip_len;
+		len -= skip_len;
+
+		if (len == 0)
+			return 0;
+	}
+
 	/*
 	 * Now we're either in the CHANNEL_DATA or CHANNEL_ERROR state
 	 * If in CHANNEL_DATA, and length is zero, switch to CHANNEL_END,
@@ -205,8 +244,10 @@ int channel_process (sp_session *session, unsigned char *buf, unsigned short len
 	ch->total_data_len += len;
 
 	/* Deallocate channel if in END or ERROR state */
-	if (ch->state & (CHANNEL_END | CHANNEL_ERROR))
+	if (ch->state & (CHANNEL_END | CHANNEL_ERROR)) {
+		channel_budget_update (session, ch);
 		channel_unregister (session, ch);
+	}
 
 	return ret;
 }
@@ -214,8 +255,12 @@ int channel_process (sp_session *session, unsigned char *buf, unsigned short len
 
 void channel_fail_and_unregister_all(sp_session *session) {
 	CHANNEL *ch;
+	int id;
+
+	for(id = 0; id < session->channel_table_size; id++) {
+		if((ch = session->channel_table[id]) == NULL)
+			continue;
 
-	while((ch = session->channels) != NULL) {
 		DSFYDEBUG
 			("channel %d: Forcing failure via callback (current state: %s) for channel '%s'\n",
 			 ch->channel_id,
@@ -229,3 +274,318 @@ void channel_fail_and_unregister_all(sp_session *session) {
 		channel_unregister(session, ch);
 	}
 }
+
+
+/*
+ * Send the request that opens a channel and keep a copy of it so it
+ * can be replayed if the connection is lost before the channel ends.
+ * resume_offset is the offset in the payload of the stream's start
+ * position (a 32-bit word count), or -1 if it can't be resumed part way.
+ *
+ * Requests that mustn't be repeated, like playlist changes, are sent
+ * with packet_write() directly.
+ *
+ */
+int channel_send (sp_session *session, CHANNEL *ch, unsigned char cmd,
+		  unsigned char *payload, unsigned short len, int resume_offset)
+{
+	if (ch->request == NULL && (ch->request = buf_new ()) == NULL)
+		return -1;
+
+	ch->request->len = 0;
+	buf_append_data (ch->request, payload, len);
+	ch->request_cmd = cmd;
+	ch->request_state = ch->state;
+	ch->request_resume_offset = resume_offset;
+
+	return packet_write (session, cmd, payload, len);
+}
+
+
+/*
+ * Called by the connection supervisor in iothread.c once it has logged
+ * in again after losing the connection
+ *
+ * Repeats the request of every open channel on the new connection.
+ * The headers and data that were already passed to the callback are
+ * dropped when they arrive again, so to the callback it looks like the
+ * connection was never lost. Streams that can be resumed are requested
+ * from (close to) where they left off. Channels that got data but can't
+ * be resumed, or that have no request to replay, are failed instead.
+ *
+ */
+void channel_replay_all(sp_session *session) {
+	CHANNEL *ch;
+	unsigned char *ptr;
+	unsigned int start, resume;
+	int id;
+
+	for(id = 0; id < session->channel_table_size; id++) {
+		if((ch = session->channel_table[id]) == NULL)
+			continue;
+
+		if(ch->request == NULL || ch->request->len == 0
+			|| (ch->total_data_len > 0 && ch->request_resume_offset == -1)) {
+			DSFYDEBUG("channel %d: Can't replay request for channel '%s', failing it\n",
+				ch->channel_id, ch->name);
+
+			ch->state = CHANNEL_ERROR;
+			ch->callback(ch, NULL, 0);
+
+			channel_unregister(session, ch);
+			continue;
+		}
+
+		/* Move the start position ahead by the data we got, in whole 4kB blocks */
+		resume = (ch->total_data_len - ch->resumed_len) & ~4095;
+		if(resume) {
+			ptr = ch->request->ptr + ch->request_resume_offset;
+			start = (ptr[0] << 24) | (ptr[1] << 16) | (ptr[2] << 8) | ptr[3];
+			start += resume >> 2;
+			ptr[0] = (start >> 24) & 0xff;
+			ptr[1] = (start >> 16) & 0xff;
+			ptr[2] = (start >> 8) & 0xff;
+			ptr[3] = start & 0xff;
+
+			ch->resumed_len += resume;
+		}
+
+		ch->skip_headers = ch->header_id;
+		ch->skip_data = ch->total_data_len - ch->resumed_len;
+		ch->state = ch->request_state;
+		ch->start_time = get_millisecs();
+
+		DSFYDEBUG("channel %d: Replaying request for channel '%s', skipping %u headers and %u bytes\n",
+			ch->channel_id, ch->name, ch->skip_headers, ch->skip_data);
+
+		packet_write(session, ch->request_cmd, ch->request->ptr, ch->request->len);
+	}
+}
+
+
+/*
+ * Allocate the channel table and id bitmap, called by sp_session_init()
+ * Both grow on demand in channel_alloc_id()
+ *
+ */
+int channel_init(sp_session *session) {
+	struct channel_budget *budget;
+	int i;
+
+	session->channel_table_size = CHANNEL_TABLE_INITIAL_SIZE;
+	session->channel_table = (CHANNEL **)calloc(session->channel_table_size, sizeof(CHANNEL *));
+	session->channel_ids = (unsigned int *)calloc(session->channel_table_size / 32, sizeof(unsigned int));
+	session->channel_pool = NULL;
+	session->num_channels = 0;
+
+	if(session->channel_table == NULL || session->channel_ids == NULL)
+		return -1;
+
+	for(i = 0; i < CHANNEL_NUM_CLASSES; i++) {
+		budget = &session->channel_budgets[i];
+		memset(budget, 0, sizeof(struct channel_budget));
+
+		if(i == CHANNEL_CLASS_AUDIO) {
+			budget->limit = CHANNEL_AUDIO_LIMIT;
+			budget->min_limit = CHANNEL_AUDIO_LIMIT;
+			budget->max_limit = CHANNEL_AUDIO_LIMIT;
+		}
+		else {
+			budget->limit = CHANNEL_METADATA_LIMIT;
+			budget->min_limit = CHANNEL_METADATA_LIMIT_MIN;
+			budget->max_limit = CHANNEL_METADATA_LIMIT_MAX;
+		}
+	}
+
+	return 0;
+}
+
+
+/* Called by sp_session_release() after all channels have been unregistered */
+void channel_release(sp_session *session) {
+	CHANNEL *ch;
+	int i;
+
+	while((ch = session->channel_pool) != NULL) {
+		session->channel_pool = ch->next;
+		if(ch->request != NULL)
+			buf_free(ch->request);
+		free(ch);
+	}
+
+	free(session->channel_table);
+	free(session->channel_ids);
+
+	for(i = 0; i < CHANNEL_NUM_CLASSES; i++)
+		free(session->channel_budgets[i].waiting);
+}
+
+
+/*
+ * Find the lowest free channel id in the bitmap and mark it used
+ * Grows the table when all ids are taken. Returns -1 when all
+ * 65536 ids are in use.
+ *
+ */
+static int channel_alloc_id(sp_session *session) {
+	unsigned int word;
+	int i, bit, old_size;
+
+	for(i = 0; i < session->channel_table_size / 32; i++) {
+		if((word = ~session->channel_ids[i]) == 0)
+			continue;
+
+#if defined(__GNUC__)
+		bit = __builtin_ctz(word);
+#else
+		for(bit = 0; !(word & (1u << bit)); bit++);
+#endif
+		session->channel_ids[i] |= 1u << bit;
+
+		return i * 32 + bit;
+	}
+
+	if(session->channel_table_size == CHANNEL_TABLE_MAX_SIZE)
+		return -1;
+
+	old_size = session->channel_table_size;
+	session->channel_table_size *= 2;
+
+	session->channel_table = (CHANNEL **)realloc(session->channel_table, session->channel_table_size * sizeof(CHANNEL *));
+	memset(session->channel_table + old_size, 0, old_size * sizeof(CHANNEL *));
+
+	session->channel_ids = (unsigned int *)realloc(session->channel_ids, session->channel_table_size / 32 * sizeof(unsigned int));
+	memset(session->channel_ids + old_size / 32, 0, old_size / 32 * sizeof(unsigned int));
+
+	session->channel_ids[old_size / 32] = 1;
+
+	return old_size;
+}
+
+
+static void channel_free_id(sp_session *session, int id) {
+	session->channel_ids[id / 32] &= ~(1u << (id % 32));
+}
+
+
+/* Whether another channel of the given class may be opened right now */
+int channel_budget_available(sp_session *session, enum channel_class traffic_class) {
+	struct channel_budget *budget = &session->channel_budgets[traffic_class];
+
+	return budget->num_open < budget->limit;
+}
+
+
+/*
+ * Called by process_request() before a new request is processed
+ * Returns 0 if the request may go ahead. Otherwise the request is parked
+ * until channel_unregister() frees a channel of its class and 1 is returned.
+ * Requests get a channel in the order they first asked for one: new ones
+ * queue up behind any that are waiting, and woken requests stay at the
+ * head of the queue until they come back here for their channel.
+ *
+ */
+int channel_budget_wait(sp_session *session, enum channel_class traffic_class, struct request *req) {
+	struct channel_budget *budget = &session->channel_budgets[traffic_class];
+	int i;
+
+	for(i = 0; i < budget->num_waiting; i++)
+		if(budget->waiting[i] == req)
+			break;
+
+	if(i == budget->num_waiting) {
+		if(budget->num_waiting == 0 && budget->num_open < budget->limit)
+			return 0;
+
+		if(budget->num_waiting == budget->waiting_size) {
+			budget->waiting_size = budget->waiting_size? 2 * budget->waiting_size: 16;
+			budget->waiting = (struct request **)realloc(budget->waiting, sizeof(struct request *) * budget->waiting_size);
+		}
+
+		budget->waiting[budget->num_waiting++] = req;
+	}
+	else if(i < budget->limit - budget->num_open) {
+		/* Our turn, leave the queue */
+		budget->num_waiting--;
+		memmove(budget->waiting + i, budget->waiting + i + 1, sizeof(struct request *) * (budget->num_waiting - i));
+
+		return 0;
+	}
+
+	/* No point in waking up before a channel is freed */
+	req->next_timeout = INT_MAX;
+
+	return 1;
+}
+
+
+/* Wake up as many requests at the head of the queue as there are free channels */
+static void channel_budget_wakeup(sp_session *session, struct channel_budget *budget) {
+	int i, num_free, num_woken;
+
+	num_free = budget->limit - budget->num_open;
+	if(num_free <= 0 || budget->num_waiting == 0)
+		return;
+
+	/* They're taken off the queue by channel_budget_wait() */
+	num_woken = num_free < budget->num_waiting? num_free: budget->num_waiting;
+	for(i = 0; i < num_woken; i++)
+		request_set_next_timeout(session, budget->waiting[i], 0);
+}
+
+
+/*
+ * Adapt the limit of a class to the latency and errors of its channels
+ *
+ * Much like TCP congestion control, the limit is raised by one for every
+ * 'limit' channels that complete without trouble and cut by a quarter when
+ * a channel fails or the smoothed latency rises well above the lowest
+ * latency seen (i.e, the server or the link is queueing up our requests).
+ * After a cut at least half the new limit of channels need to complete
+ * before the next one, so a single burst doesn't collapse the limit.
+ *
+ */
+static void channel_budget_update(sp_session *session, CHANNEL *ch) {
+	struct channel_budget *budget = &session->channel_budgets[ch->traffic_class];
+	int latency, congested;
+
+	if(budget->min_limit == budget->max_limit)
+		return;
+
+	latency = get_millisecs() - ch->start_time;
+	if(budget->base_latency == 0 || latency < budget->base_latency)
+		budget->base_latency = latency? latency: 1;
+	else
+		budget->base_latency += (latency - budget->base_latency) / 64;
+
+	if(budget->latency == 0)
+		budget->latency = latency;
+	else
+		budget->latency += (latency - budget->latency) / 8;
+
+	budget->num_completed++;
+
+	congested = ch->state == CHANNEL_ERROR
+		|| budget->latency > 2 * budget->base_latency + CHANNEL_LATENCY_SLACK;
+
+	if(congested) {
+		if(budget->num_completed < budget->limit / 2)
+			return;
+
+		budget->limit -= budget->limit / 4;
+		if(budget->limit < budget->min_limit)
+			budget->limit = budget->min_limit;
+
+		DSFYDEBUG("Channel %s, lowering limit to %d (latency %d ms, base %d ms)\n",
+			  ch->state == CHANNEL_ERROR? "error": "latency up",
+			  budget->limit, budget->latency, budget->base_latency);
+
+		budget->num_completed = 0;
+	}
+	else if(budget->num_completed >= budget->limit && budget->limit < budget->max_limit) {
+		budget->limit++;
+		budget->num_completed = 0;
+
+		channel_budget_wakeup(session, budget);
+	}
+}
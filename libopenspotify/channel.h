@@ -8,6 +8,57 @@
 
 #include <spotify/api.h>
 
+struct request;
+
+/*
+ * Channels are budgeted per traffic class so metadata requests can
+ * never take the channels audio playback needs
+ *
+ */
+enum channel_class
+{
+	CHANNEL_CLASS_METADATA = 0,
+	CHANNEL_CLASS_AUDIO,
+	CHANNEL_NUM_CLASSES
+};
+
+/* Channel ids index a table that grows by doubling, see channel_alloc_id() */
+#define CHANNEL_TABLE_INITIAL_SIZE	64
+#define CHANNEL_TABLE_MAX_SIZE		65536
+
+/* Limits on concurrently open metadata channels, see channel_budget_update() */
+#define CHANNEL_METADATA_LIMIT		16
+#define CHANNEL_METADATA_LIMIT_MIN	4
+#define CHANNEL_METADATA_LIMIT_MAX	48
+
+/* Audio needs an AES key and a substream channel per track being played */
+#define CHANNEL_AUDIO_LIMIT		4
+
+/* Latency above twice the base latency plus this (ms) is taken as congestion */
+#define CHANNEL_LATENCY_SLACK		50
+
+struct channel_budget
+{
+	/* Current limit on open channels and its bounds */
+	int limit;
+	int min_limit;
+	int max_limit;
+
+	int num_open;
+
+	/* Requests waiting for a channel, oldest first */
+	int num_waiting;
+	int waiting_size;
+	struct request **waiting;
+
+	/* Smoothed and base (lowest seen) channel latency in milliseconds */
+	int latency;
+	int base_latency;
+
+	/* Channels completed since the limit was last changed */
+	int num_completed;
+};
+
 enum channel_state
 {
 	/* Channel headers */
@@ -37,7 +88,30 @@ struct _channel
 	unsigned int total_header_len;
 	unsigned int total_data_len;
 
-	/* for internal use */
+	/* For the channel budget */
+	enum channel_class traffic_class;
+	int start_time;
+
+	/*
+	 * The request that opened the channel, kept by channel_send() so
+	 * channel_replay_all() can repeat it on a new connection.
+	 * request_state is the state the channel was in when it was sent.
+	 * request_resume_offset is where the stream's start position is
+	 * stored in the request, -1 if it can't be resumed part way, and
+	 * resumed_len how many bytes the start position was moved ahead.
+	 *
+	 */
+	unsigned char request_cmd;
+	struct buf *request;
+	enum channel_state request_state;
+	int request_resume_offset;
+	unsigned int resumed_len;
+
+	/* Headers and data already delivered, dropped when a request is replayed */
+	unsigned int skip_headers;
+	unsigned int skip_data;
+
+	/* for internal use, only filled in when built with DEBUG */
 	char name[256];
 
 	/* pointer to private storage */
@@ -46,12 +120,20 @@ struct _channel
 	/* function pointer */
 	channel_callback callback;
 
+	/* For the session's pool of free channels */
 	struct _channel *next;
 };
 
 CHANNEL *channel_register (sp_session *session, char *, channel_callback, void *);
+CHANNEL *channel_register_class (sp_session *session, enum channel_class, char *, channel_callback, void *);
 void channel_unregister (sp_session *session, CHANNEL *);
 CHANNEL *channel_by_id (sp_session *session, unsigned short);
 int channel_process (sp_session *session, unsigned char *, unsigned short, int);
 void channel_fail_and_unregister_all(sp_session *session);
+int channel_send (sp_session *session, CHANNEL *, unsigned char, unsigned char *, unsigned short, int);
+void channel_replay_all(sp_session *session);
+int channel_init(sp_session *session);
+void channel_release(sp_session *session);
+int channel_budget_available(sp_session *session, enum channel_class);
+int channel_budget_wait(sp_session *session, enum channel_class, struct request *req);
 #endif
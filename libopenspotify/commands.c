@@ -91,7 +91,7 @@ int cmd_requestad (sp_session * session, unsigned char ad_type)
         buf_append_u16(b, ch->channel_id);
 	buf_append_u8(b, ad_type);
 
-	ret = packet_write (session, CMD_REQUESTAD, b->ptr, b->len);
+	ret = channel_send (session, ch, CMD_REQUESTAD, b->ptr, b->len, -1);
 	DSFYDEBUG ("packet_write() returned %d\n", ret);
 
 	buf_free(b);
@@ -123,7 +123,7 @@ int cmd_request_image (sp_session * session, unsigned char *hash,
 	buf_append_u16(b, ch->channel_id);
 	buf_append_data(b, hash, 20);
 
-	ret = packet_write (session, CMD_IMAGE, b->ptr, b->len);
+	ret = channel_send (session, ch, CMD_IMAGE, b->ptr, b->len, -1);
 	DSFYDEBUG ("packet_write() returned %d\n", ret);
             
         buf_free(b);
@@ -164,7 +164,7 @@ int cmd_search (sp_session * session, char *searchtext, unsigned int offset,
 	buf_append_u8(b, searchtext_length);
 	buf_append_data(b, searchtext, searchtext_length);
 
-	ret = packet_write (session, CMD_SEARCH, b->ptr, b->len);
+	ret = channel_send (session, ch, CMD_SEARCH, b->ptr, b->len, -1);
 	DSFYDEBUG ("packet_write() returned %d\n", ret)
 
 	buf_free(b);
@@ -242,7 +242,7 @@ int cmd_toplistbrowse (sp_session *session,
 	}
 
 
-	ret = packet_write (session, CMD_TOPLISTBROWSE, b->ptr, b->len);
+	ret = channel_send (session, ch, CMD_TOPLISTBROWSE, b->ptr, b->len, -1);
 	DSFYDEBUG ("packet_write() returned %d\n", ret)
 
 	buf_free(b);
@@ -280,10 +280,12 @@ int cmd_aeskey (sp_session * session, unsigned char *file_id,
 	buf_append_data(b, track_id, 16);
 	buf_append_u16(b, 0);
 
-	/* Allocate a channel and set its name to key-<file id> */
+	/* Allocate a channel and set its name to key-<file id> (names are only used for tracing) */
+#ifdef DEBUG
 	strcpy (buf, "key-");
 	hex_bytes_to_ascii (file_id, buf + 4, 20);
-	ch = channel_register (session, buf, callback, private);
+#endif
+	ch = channel_register_class (session, CHANNEL_CLASS_AUDIO, buf, callback, private);
 	DSFYDEBUG
 		("allocated channel %d, retrieving AES key for file '%.40s'\n",
 		 ch->channel_id, buf);
@@ -292,7 +294,7 @@ int cmd_aeskey (sp_session * session, unsigned char *file_id,
 	ch->state = CHANNEL_DATA;
 	buf_append_u16(b, ch->channel_id);
 
-	ret = packet_write (session, CMD_REQKEY, b->ptr, b->len);
+	ret = channel_send (session, ch, CMD_REQKEY, b->ptr, b->len, -1);
 	buf_free(b);
 	if (ret != 0) {
 		DSFYDEBUG ("packet_write(cmd=0x0c) returned %d, aborting!\n", ret)
@@ -317,11 +319,13 @@ int cmd_getsubstreams (sp_session * session, unsigned char *file_id,
 {
 	char buf[512];
 	CHANNEL *ch;
-	int ret;
+	int ret, resume_offset;
 	struct buf *b;
 
+#ifdef DEBUG
 	hex_bytes_to_ascii (file_id, buf, 20);
-	ch = channel_register (session, buf, callback, private);
+#endif
+	ch = channel_register_class (session, CHANNEL_CLASS_AUDIO, buf, callback, private);
 	DSFYDEBUG
 		("cmd_getsubstreams: allocated channel %d, retrieving song '%s'\n",
 		 ch->channel_id, ch->name);
@@ -342,6 +346,9 @@ int cmd_getsubstreams (sp_session * session, unsigned char *file_id,
 	assert (length % 4096 == 0);
 	offset >>= 2;
 	length >>= 2;
+
+	/* Lets the request be resumed part way after a reconnect */
+	resume_offset = b->len;
 	buf_append_u32(b, offset);
 	buf_append_u32(b, offset + length);
 
@@ -350,7 +357,7 @@ int cmd_getsubstreams (sp_session * session, unsigned char *file_id,
 		("Sending GetSubstreams(file_id=%s, offset=%u [%u bytes], length=%u [%u bytes])\n",
 		 buf, offset, offset << 2, length, length << 2);
 
-	ret = packet_write (session, CMD_GETSUBSTREAM, b->ptr, b->len);
+	ret = channel_send (session, ch, CMD_GETSUBSTREAM, b->ptr, b->len, resume_offset);
 	buf_free(b);
 
 	if (ret != 0) {
@@ -380,6 +387,7 @@ int cmd_browse (sp_session * session, unsigned char kind, unsigned char *idlist,
 	assert (((kind == BROWSE_ARTIST || kind == BROWSE_ALBUM) && num == 1)
 		|| kind == BROWSE_TRACK);
 
+#ifdef DEBUG
 	switch(kind) {
 	case BROWSE_ALBUM:
 		strcpy (buf, "browse-album-");
@@ -396,6 +404,7 @@ int cmd_browse (sp_session * session, unsigned char kind, unsigned char *idlist,
 	}
 
 	hex_bytes_to_ascii(idlist, buf + strlen(buf), 16);
+#endif
 	ch = channel_register (session, buf, callback, private);
 
 	b = buf_new();
@@ -411,7 +420,8 @@ int cmd_browse (sp_session * session, unsigned char kind, unsigned char *idlist,
 	}
 
 	if ((ret =
-	     packet_write (session, CMD_BROWSE, b->ptr, b->len)) != 0) {
+	     channel_send (session, ch, CMD_BROWSE, b->ptr, b->len, -1)) != 0) {
+		channel_unregister (session, ch);
 		DSFYDEBUG
 			("packet_write(cmd=0x30) returned %d, aborting!\n",
 			 ret)
@@ -442,7 +452,7 @@ int cmd_userinfo (sp_session * session, char *username,
 	buf_append_data(b, username, len);
 
 	if ((ret =
-	     packet_write (session, CMD_USERINFO, b->ptr, b->len)) != 0) {
+	     channel_send (session, ch, CMD_USERINFO, b->ptr, b->len, -1)) != 0) {
 		DSFYDEBUG
 			("packet_write(cmd=0x57) returned %d, aborting!\n",
 			 ret);
@@ -480,7 +490,7 @@ int cmd_getplaylist (sp_session * session, unsigned char *playlist_id,
 	buf_append_u8(b, 0x1);
 
 	if ((ret =
-	     packet_write (session, CMD_GETPLAYLIST, b->ptr, b->len)) != 0) {
+	     channel_send (session, ch, CMD_GETPLAYLIST, b->ptr, b->len, -1)) != 0) {
 		DSFYDEBUG
 			("packet_write(cmd=0x35) returned %d, aborting!\n",
 			 ret);
@@ -521,6 +531,7 @@ int cmd_changeplaylist (sp_session * session, unsigned char *playlist_id,
 	buf_append_u8(b, 3);		/* Unknown */
         buf_append_data(b, xml, strlen(xml));
 
+	/* Not sent with channel_send(), a change mustn't be applied twice */
 	if ((ret =
 	     packet_write (session, CMD_CHANGEPLAYLIST, b->ptr, b->len)) != 0) {
 		DSFYDEBUG ("packet_write(cmd=0x36) "
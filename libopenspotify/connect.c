@@ -0,0 +1,301 @@
+/*
+ * Race non-blocking connects to Spotify's access points
+ *
+ * connect_race_start() resolves the first few SRV targets not yet tried
+ * (healthiest first, see dns.c) and orders their addresses so IPv6 and
+ * IPv4 alternate.
+ * connect_race_process() then starts a connect to the next address every
+ * CONNECT_STAGGER_MS, or right away when one fails, while keeping the
+ * earlier ones going. The first to complete the TCP handshake wins and
+ * the rest are closed, so a dead or slow access point costs a stagger
+ * delay instead of a full connect timeout. Connect times and failures
+ * go into the hosts' health scores.
+ *
+ * connect_race_process() follows the login_process() convention: it
+ * returns 0 to be called again, 1 once connected and -1 when every
+ * address failed.
+ *
+ */
+
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#include <winsock2.h>
+#else
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <fcntl.h>
+#endif
+#include <string.h>
+#include <errno.h>
+
+#include "connect.h"
+#include "debug.h"
+#include "dns.h"
+#include "util.h"
+
+
+static int connect_attempt_start(struct connect_attempt *attempt);
+static void connect_attempt_close(struct connect_race *race, struct connect_attempt *attempt);
+
+
+/*
+ * Set up a race between the addresses of the first CONNECT_MAX_HOSTS
+ * SRV targets that haven't been tried yet, and mark them as tried
+ * Returns -1 if there are no more targets
+ *
+ */
+int connect_race_start(struct connect_race *race, struct dns_srv_records *hosts) {
+	struct connect_attempt found[2][CONNECT_MAX_ADDRS];
+	int num_found[2], family, num_hosts, i;
+	struct dns_srv_records *svc;
+	struct addrinfo h, *result, *ai;
+
+
+	connect_race_cancel(race);
+
+	num_found[0] = num_found[1] = 0;
+	num_hosts = 0;
+	for(svc = hosts; svc && num_hosts < CONNECT_MAX_HOSTS; svc = svc->next) {
+		if(svc->tried)
+			continue;
+
+		svc->tried = 1;
+		num_hosts++;
+
+		/* Lookup available address records (IPv4/IPv6) for the host */
+		memset(&h, 0, sizeof(h));
+		h.ai_family = PF_UNSPEC;
+		h.ai_socktype = SOCK_STREAM;
+		h.ai_protocol = IPPROTO_TCP;
+		if(getaddrinfo(svc->host, svc->port, &h, &result) != 0) {
+			DSFYDEBUG("Failed to lookup addresses for %s:%s\n", svc->host, svc->port);
+			continue;
+		}
+
+		for(ai = result; ai; ai = ai->ai_next) {
+			if(ai->ai_family == AF_INET6)
+				family = 0;
+			else if(ai->ai_family == AF_INET)
+				family = 1;
+			else
+				continue;
+
+			if(num_found[family] == CONNECT_MAX_ADDRS)
+				continue;
+
+			memcpy(&found[family][num_found[family]].addr, ai->ai_addr, ai->ai_addrlen);
+			found[family][num_found[family]].addrlen = ai->ai_addrlen;
+			found[family][num_found[family]].host = svc;
+			num_found[family]++;
+		}
+
+		freeaddrinfo(result);
+	}
+
+	if(num_hosts == 0) {
+		DSFYDEBUG("Run out of hostnames in SRV record list\n");
+		return -1;
+	}
+
+
+	/* Alternate address families, starting with IPv6 */
+	race->num_attempts = 0;
+	for(i = 0; race->num_attempts < CONNECT_MAX_ADDRS && (i < num_found[0] || i < num_found[1]); i++) {
+		for(family = 0; family < 2 && race->num_attempts < CONNECT_MAX_ADDRS; family++) {
+			if(i >= num_found[family])
+				continue;
+
+			race->attempts[race->num_attempts] = found[family][i];
+			race->attempts[race->num_attempts].sock = -1;
+			race->num_attempts++;
+		}
+	}
+
+	race->next_attempt = 0;
+	race->next_start = 0;
+	race->num_open = 0;
+	race->sock = -1;
+	race->host = NULL;
+
+	DSFYDEBUG("Racing %d addresses of %d hosts\n", race->num_attempts, num_hosts);
+
+	return 0;
+}
+
+
+/*
+ * Start due connects and wait up to CONNECT_WAIT_MS for one to finish
+ *
+ */
+int connect_race_process(struct connect_race *race) {
+	struct connect_attempt *attempt;
+	fd_set wfds, efds;
+	struct timeval tv;
+	socklen_t len;
+	int i, ret, now, wait, max_fd, connect_error;
+
+
+	/* Start the next connect when it's due, or right away if none is in progress */
+	now = get_millisecs();
+	while(race->next_attempt < race->num_attempts && (race->num_open == 0 || now >= race->next_start)) {
+		attempt = &race->attempts[race->next_attempt++];
+		if(connect_attempt_start(attempt) == 0) {
+			race->num_open++;
+			race->next_start = now + CONNECT_STAGGER_MS;
+			break;
+		}
+	}
+
+	if(race->num_open == 0) {
+		DSFYDEBUG("Run out of addresses to connect to\n");
+		return -1;
+	}
+
+
+	/* Wait for a handshake to complete, or until the next connect is due */
+	FD_ZERO(&wfds);
+	FD_ZERO(&efds);
+	max_fd = -1;
+	for(i = 0; i < race->next_attempt; i++) {
+		attempt = &race->attempts[i];
+		if(attempt->sock == -1)
+			continue;
+
+		if(now - attempt->start_time >= CONNECT_TIMEOUT_MS) {
+			DSFYDEBUG("Connect timed out on socket %d\n", attempt->sock);
+			dns_host_failed(attempt->host);
+			connect_attempt_close(race, attempt);
+			race->next_start = now;
+			continue;
+		}
+
+		FD_SET(attempt->sock, &wfds);
+		FD_SET(attempt->sock, &efds);
+		if(attempt->sock > max_fd)
+			max_fd = attempt->sock;
+	}
+
+	if(max_fd == -1)
+		return 0;
+
+	wait = CONNECT_WAIT_MS;
+	if(race->next_attempt < race->num_attempts && race->next_start - now < wait)
+		wait = race->next_start - now > 0? race->next_start - now: 0;
+
+	tv.tv_sec = wait / 1000;
+	tv.tv_usec = (wait % 1000) * 1000;
+
+	ret = select(max_fd + 1, NULL, &wfds, &efds, &tv);
+	if(ret < 0) {
+#ifndef _WIN32
+		if(errno == EINTR)
+			return 0;
+#endif
+		DSFYDEBUG("select() failed with errno %d\n", errno);
+		return -1;
+	}
+	else if(ret == 0)
+		return 0;
+
+
+	now = get_millisecs();
+	for(i = 0; i < race->next_attempt; i++) {
+		attempt = &race->attempts[i];
+		if(attempt->sock == -1
+			|| (!FD_ISSET(attempt->sock, &wfds) && !FD_ISSET(attempt->sock, &efds)))
+			continue;
+
+		len = sizeof(connect_error);
+		if(getsockopt(attempt->sock, SOL_SOCKET, SO_ERROR, (char *)&connect_error, &len) < 0
+			|| connect_error != 0) {
+			DSFYDEBUG("Connect to %s:%s failed with error %d\n",
+				attempt->host->host, attempt->host->port, connect_error);
+			dns_host_failed(attempt->host);
+			connect_attempt_close(race, attempt);
+
+			/* Don't wait out the stagger delay for the next one */
+			race->next_start = now;
+			continue;
+		}
+
+		/* We have a winner, the others lose */
+		race->sock = attempt->sock;
+		race->host = attempt->host;
+		race->latency = now - attempt->start_time;
+		attempt->sock = -1;
+		race->num_open--;
+
+		dns_host_connected(race->host, race->latency);
+
+		connect_race_cancel(race);
+
+		DSFYDEBUG("Connected to %s:%s in %dms\n",
+			race->host->host, race->host->port, race->latency);
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Close the connects in progress, but not the winner
+ *
+ */
+void connect_race_cancel(struct connect_race *race) {
+	int i;
+
+	for(i = 0; i < race->num_attempts; i++)
+		if(race->attempts[i].sock != -1)
+			connect_attempt_close(race, &race->attempts[i]);
+
+	race->next_attempt = race->num_attempts;
+}
+
+
+static int connect_attempt_start(struct connect_attempt *attempt) {
+#ifdef _WIN32
+	u_long nonblocking = 1;
+#else
+	int flags;
+#endif
+
+	attempt->sock = socket(attempt->addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+	if(attempt->sock < 0) {
+		attempt->sock = -1;
+		return -1;
+	}
+
+	DSFYDEBUG("Initiating connect() to %s:%s on socket %d\n",
+		attempt->host->host, attempt->host->port, attempt->sock);
+#ifdef _WIN32
+	if(ioctlsocket(attempt->sock, FIONBIO, &nonblocking) < 0
+		|| (connect(attempt->sock, (struct sockaddr *)&attempt->addr, attempt->addrlen) < 0 && WSAGetLastError() != WSAEWOULDBLOCK)) {
+		closesocket(attempt->sock);
+#else
+	if((flags = fcntl(attempt->sock, F_GETFL, 0)) < 0
+		|| fcntl(attempt->sock, F_SETFL, flags | O_NONBLOCK) < 0
+		|| (connect(attempt->sock, (struct sockaddr *)&attempt->addr, attempt->addrlen) < 0 && errno != EINPROGRESS)) {
+		close(attempt->sock);
+#endif
+		DSFYDEBUG("fcntl() or connect() failed with errno %d, will try the next address\n", errno);
+		attempt->sock = -1;
+		return -1;
+	}
+
+	attempt->start_time = get_millisecs();
+
+	return 0;
+}
+
+
+static void connect_attempt_close(struct connect_race *race, struct connect_attempt *attempt) {
+#ifdef _WIN32
+	closesocket(attempt->sock);
+#else
+	close(attempt->sock);
+#endif
+	attempt->sock = -1;
+	race->num_open--;
+}
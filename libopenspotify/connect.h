@@ -0,0 +1,65 @@
+/*
+ * Race connects to several access points, see connect.c
+ *
+ */
+
+#ifndef LIBOPENSPOTIFY_CONNECT_H
+#define LIBOPENSPOTIFY_CONNECT_H
+
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netdb.h>
+#endif
+
+#include "dns.h"
+
+/* Number of SRV targets raced against each other */
+#define CONNECT_MAX_HOSTS	3
+
+/* Addresses kept per race, IPv4 and IPv6 together */
+#define CONNECT_MAX_ADDRS	12
+
+/* Delay before starting a connect to the next address (ms) */
+#define CONNECT_STAGGER_MS	250
+
+/* Give up on an address that hasn't completed the handshake after this (ms) */
+#define CONNECT_TIMEOUT_MS	3000
+
+/* Longest connect_race_process() blocks waiting for a handshake (ms) */
+#define CONNECT_WAIT_MS		200
+
+struct connect_attempt {
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+
+	/* SRV target the address belongs to */
+	struct dns_srv_records *host;
+
+	/* -1 unless the connect is in progress */
+	int sock;
+	int start_time;
+};
+
+struct connect_race {
+	int num_attempts;
+	struct connect_attempt attempts[CONNECT_MAX_ADDRS];
+
+	/* Next address to connect to, and when */
+	int next_attempt;
+	int next_start;
+
+	int num_open;
+
+	/* The winner, once connect_race_process() returned 1 */
+	int sock;
+	struct dns_srv_records *host;
+	int latency;
+};
+
+int connect_race_start(struct connect_race *race, struct dns_srv_records *hosts);
+int connect_race_process(struct connect_race *race);
+void connect_race_cancel(struct connect_race *race);
+
+#endif
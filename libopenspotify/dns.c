@@ -20,16 +20,202 @@
 #include "dns.h"
 
 static int initialized;
+static struct dns_srv_records *dns_query(char *);
+static struct dns_srv_records *dns_load_service_list(const char *, char *);
+static void dns_sort_by_health(struct dns_srv_records **);
+static int dns_health_score(struct dns_srv_records *);
 static struct dns_srv_records *list_insert_by_prio(struct dns_srv_records **, int);
 
-struct dns_srv_records *dns_get_service_list(char *hostname) {
+
+/*
+ * Get the SRV records for a service, healthiest access point first
+ *
+ * If cache_file isn't NULL, records are served from it until their TTL
+ * runs out and stale ones are used if the DNS lookup fails. The health
+ * of the access points (see dns_host_connected() and dns_host_failed())
+ * is carried over when the records are refreshed.
+ *
+ */
+struct dns_srv_records *dns_get_service_list(char *hostname, const char *cache_file) {
+	struct dns_srv_records *cached = NULL, *root, *entry, *old;
+	time_t now = time(NULL), expires;
+
+	if(cache_file != NULL && (cached = dns_load_service_list(cache_file, hostname)) != NULL) {
+		expires = cached->expires;
+		for(entry = cached; entry; entry = entry->next)
+			if(entry->expires < expires)
+				expires = entry->expires;
+
+		if(expires > now) {
+			DSFYDEBUG("Using SRV records for %s from cache, valid for another %ld seconds\n",
+				hostname, (long)(expires - now));
+			dns_sort_by_health(&cached);
+			return cached;
+		}
+	}
+
+	if((root = dns_query(hostname)) == NULL) {
+		if(cached != NULL) {
+			DSFYDEBUG("Failed to lookup %s, using expired SRV records from cache\n", hostname);
+			dns_sort_by_health(&cached);
+		}
+
+		return cached;
+	}
+
+	/* Carry over what we know about the hosts */
+	for(entry = root; entry; entry = entry->next) {
+		for(old = cached; old; old = old->next) {
+			if(strcmp(entry->host, old->host) || strcmp(entry->port, old->port))
+				continue;
+
+			entry->latency = old->latency;
+			entry->failures = old->failures;
+			break;
+		}
+	}
+
+	dns_free_list(cached);
+
+	if(cache_file != NULL)
+		dns_save_service_list(cache_file, hostname, root);
+
+	dns_sort_by_health(&root);
+
+	return root;
+}
+
+
+/*
+ * Record a successful connect to an access point
+ *
+ */
+void dns_host_connected(struct dns_srv_records *svc, int latency) {
+	if(svc->latency == 0)
+		svc->latency = latency > 0? latency: 1;
+	else
+		svc->latency = (3 * svc->latency + latency) / 4;
+
+	svc->failures /= 2;
+}
+
+
+/*
+ * Record a failed connect, or a failed login handshake, to an access point
+ *
+ */
+void dns_host_failed(struct dns_srv_records *svc) {
+	svc->failures++;
+}
+
+
+/*
+ * Save records to the cache
+ * Each line has a record's expiry, priority, health, port and host
+ * after a first line with the service name.
+ *
+ */
+int dns_save_service_list(const char *cache_file, char *hostname, struct dns_srv_records *root) {
+	FILE *fd;
+	struct dns_srv_records *entry;
+
+	if((fd = fopen(cache_file, "w")) == NULL) {
+		DSFYDEBUG("Failed to open '%s' for writing\n", cache_file);
+		return -1;
+	}
+
+	fprintf(fd, "%s\n", hostname);
+	for(entry = root; entry; entry = entry->next)
+		fprintf(fd, "%ld %d %d %d %s %s\n", (long)entry->expires, entry->prio,
+			entry->latency, entry->failures, entry->port, entry->host);
+
+	fclose(fd);
+
+	return 0;
+}
+
+
+static struct dns_srv_records *dns_load_service_list(const char *cache_file, char *hostname) {
+	FILE *fd;
+	struct dns_srv_records *root = NULL, **tail = &root, *entry;
+	char line[1024 + 64], host[1024], port[6];
+	long expires;
+	int prio, latency, failures;
+
+	if((fd = fopen(cache_file, "r")) == NULL)
+		return NULL;
+
+	/* Records for some other service */
+	if(fgets(line, sizeof(line), fd) == NULL
+		|| strncmp(line, hostname, strlen(hostname)) || line[strlen(hostname)] != '\n') {
+		fclose(fd);
+		return NULL;
+	}
+
+	while(fgets(line, sizeof(line), fd) != NULL) {
+		if(sscanf(line, "%ld %d %d %d %5s %1023s", &expires, &prio,
+				&latency, &failures, port, host) != 6)
+			continue;
+
+		entry = (struct dns_srv_records *)malloc(sizeof(struct dns_srv_records));
+		entry->host = strdup(host);
+		entry->port = strdup(port);
+		entry->prio = prio;
+		entry->tried = 0;
+		entry->expires = (time_t)expires;
+		entry->latency = latency;
+		entry->failures = failures;
+		entry->next = NULL;
+
+		*tail = entry;
+		tail = &entry->next;
+	}
+
+	fclose(fd);
+
+	return root;
+}
+
+
+/*
+ * Order records by health score, keeping the SRV priority order
+ * between hosts that score the same
+ *
+ */
+static void dns_sort_by_health(struct dns_srv_records **root) {
+	struct dns_srv_records *sorted = NULL, **walker, *entry;
+
+	while((entry = *root) != NULL) {
+		*root = entry->next;
+
+		for(walker = &sorted; *walker; walker = &(*walker)->next) {
+			if(dns_health_score(*walker) > dns_health_score(entry)
+				|| (dns_health_score(*walker) == dns_health_score(entry) && (*walker)->prio > entry->prio))
+				break;
+		}
+
+		entry->next = *walker;
+		*walker = entry;
+	}
+
+	*root = sorted;
+}
+
+
+static int dns_health_score(struct dns_srv_records *svc) {
+	return (svc->latency? svc->latency: DNS_UNKNOWN_LATENCY)
+		+ svc->failures * DNS_FAILURE_PENALTY;
+}
+
+
+static struct dns_srv_records *dns_query(char *hostname) {
 	struct dns_srv_records *root = NULL, *entry;
 	
 #ifdef _WIN32
 	DNS_STATUS ret;
 	PDNS_RECORD pRoot = NULL, p;
 
-	ret = DnsQuery_A(hostname, DNS_TYPE_SRV, DNS_QUERY_BYPASS_CACHE, NULL, &pRoot, NULL);
+	ret = DnsQuery_A(hostname, DNS_TYPE_SRV, DNS_QUERY_STANDARD, NULL, &pRoot, NULL);
 	if(ret != 0) {
 		DSFYDEBUG("DnsQuery() failed status %d\n", ret);
 		return NULL;
@@ -46,6 +232,9 @@ struct dns_srv_records *dns_get_service_list(char *hostname) {
 		sprintf(entry->port, "%u", p->Data.SRV.wPort);
 		entry->prio = p->Data.SRV.wPriority;
 		entry->tried = 0;
+		entry->expires = time(NULL) + p->dwTtl;
+		entry->latency = 0;
+		entry->failures = 0;
 	}
 
 	DnsRecordListFree(pRoot, DnsFreeRecordListDeep);
@@ -54,6 +243,7 @@ struct dns_srv_records *dns_get_service_list(char *hostname) {
 	char host[1024];
 	unsigned char answer[1024], *p;
 	unsigned short atype, prio, weight, port;
+	unsigned int ttl;
 	HEADER *h = (HEADER *) answer;
 
 
@@ -81,8 +271,8 @@ struct dns_srv_records *dns_get_service_list(char *hostname) {
 
 		p += hlen;
 		GETSHORT (atype, p);
-
-		p += 6;
+		p += 2;
+		GETLONG (ttl, p);
 		GETSHORT (hlen, p);
 		if (atype != ns_t_srv) {
 			p += hlen;
@@ -106,6 +296,9 @@ struct dns_srv_records *dns_get_service_list(char *hostname) {
 		sprintf(entry->port, "%u", port);
 		entry->prio = prio;
 		entry->tried = 0;
+		entry->expires = time(NULL) + ttl;
+		entry->latency = 0;
+		entry->failures = 0;
 	}
     #endif
 
@@ -132,11 +325,7 @@ static struct dns_srv_records *list_insert_by_prio(struct dns_srv_records **root
 			walker = walker->next;
 
 		entry = (struct dns_srv_records *)malloc(sizeof(struct dns_srv_records));
-		if(walker->next)
-			entry->next = walker->next->next;
-		else
-			entry->next = NULL;
-
+		entry->next = walker->next;
 		walker->next = entry;
 	}
 
@@ -6,16 +6,43 @@
 #ifndef DESPOTIFY_DNS_H
 #define DESPOTIFY_DNS_H
 
+#include <time.h>
+
+/* SRV records are cached in this file under the session's settings_location */
+#define DNS_CACHE_FILE		"srv.cache"
+
+/* A failure counts as much as this much connect latency (ms) when picking hosts */
+#define DNS_FAILURE_PENALTY	3000
+
+/* Connect latency assumed for hosts we haven't connected to yet (ms) */
+#define DNS_UNKNOWN_LATENCY	250
+
 struct dns_srv_records {
 	char *host;
 	char *port;
 	int prio;
 	int tried;
 
+	/* When the record's TTL runs out */
+	time_t expires;
+
+	/*
+	 * Health of the access point, kept in the cache across logins
+	 * latency is a rolling average of connect times in ms, 0 if unknown
+	 * failures goes up by one per failed connect and is halved per
+	 * successful one
+	 *
+	 */
+	int latency;
+	int failures;
+
 	struct dns_srv_records *next;
 };
 
-struct dns_srv_records *dns_get_service_list(char *);
+struct dns_srv_records *dns_get_service_list(char *, const char *);
+int dns_save_service_list(const char *, char *, struct dns_srv_records *);
+void dns_host_connected(struct dns_srv_records *, int);
+void dns_host_failed(struct dns_srv_records *);
 void dns_free_list(struct dns_srv_records *);
 
 #endif
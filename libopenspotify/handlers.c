@@ -235,8 +235,13 @@ int handle_packet (sp_session * session,
 		if(!sp_user_is_loaded(session->user))
 			user_lookup(session, session->user);
 		
-		/* Trigger loading of playlist container and contained playlists */
-		request_post(session, REQ_TYPE_PC_LOAD, NULL);
+		/*
+		 * Trigger loading of playlist container and contained playlists
+		 * After a reconnect they're already loaded, or being loaded
+		 *
+		 */
+		if(session->num_reconnects == 0)
+			request_post(session, REQ_TYPE_PC_LOAD, NULL);
 		break;
 
 	case CMD_TOKENLOST:
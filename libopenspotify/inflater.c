@@ -0,0 +1,165 @@
+/*
+ * Streaming decompression of gzip'd channel data
+ *
+ * Browse, search, toplist and user info replies are gzip'd XML, split
+ * over any number of CHANNEL_DATA payloads. User info, and the others
+ * when there's no parse pool, pass each payload to inflater_write() as it
+ * arrives, so decompression overlaps with the transfer and the compressed
+ * data is never kept around. With a parse pool, browse, search and
+ * toplist replies are kept until the channel ends and then inflated on a
+ * worker, see xmlreply.c.
+ *
+ * The gzip header is skipped as part of the stream, whichever payloads
+ * it's spread over, and the deflated data after it is inflated into a
+ * fixed window that is handed to the sink whenever it fills up or the
+ * input runs out. inflater_sink_buf() is a sink that collects the whole
+ * document in a struct buf.
+ *
+ * Given an arena, the inflater and everything zlib allocates for it come
+ * from there and are released along with the rest of the response.
+ *
+ * The gzip trailer is ignored, as it always has been.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "buf.h"
+#include "debug.h"
+#include "inflater.h"
+
+
+static voidpf inflater_zalloc(voidpf opaque, uInt items, uInt size);
+static void inflater_zfree(voidpf opaque, voidpf ptr);
+
+
+struct inflater *inflater_new(struct arena *arena, inflater_sink sink, void *arg) {
+	struct inflater *inf;
+	int rc;
+
+	if(arena)
+		inf = arena_alloc(arena, sizeof(struct inflater));
+	else
+		inf = malloc(sizeof(struct inflater));
+
+	if(inf == NULL)
+		return NULL;
+
+	memset(&inf->z, 0, sizeof(inf->z));
+	if(arena) {
+		inf->z.zalloc = inflater_zalloc;
+		inf->z.zfree = inflater_zfree;
+		inf->z.opaque = arena;
+	}
+
+	inf->arena = arena;
+	if((rc = inflateInit2(&inf->z, -MAX_WBITS)) != Z_OK) {
+		DSFYDEBUG("inflateInit2() returned %d\n", rc);
+		if(arena == NULL)
+			free(inf);
+
+		return NULL;
+	}
+
+	inf->header_left = INFLATER_GZIP_HEADER_SIZE;
+	inf->state = 0;
+	inf->sink = sink;
+	inf->arg = arg;
+
+	return inf;
+}
+
+
+void inflater_free(struct inflater *inf) {
+	inflateEnd(&inf->z);
+
+	if(inf->arena == NULL)
+		free(inf);
+}
+
+
+/*
+ * Inflate a piece of the stream and pass what comes out to the sink
+ * Returns 0, or -1 if the data is corrupt. Data after the end of the
+ * deflated stream is ignored.
+ *
+ */
+int inflater_write(struct inflater *inf, unsigned char *data, int len) {
+	int n, rc;
+
+	if(inf->state != 0)
+		return inf->state < 0? -1: 0;
+
+	/* Skip the gzip header */
+	if(inf->header_left) {
+		n = len < inf->header_left? len: inf->header_left;
+		inf->header_left -= n;
+		data += n;
+		len -= n;
+	}
+
+	if(len == 0)
+		return 0;
+
+	inf->z.next_in = data;
+	inf->z.avail_in = len;
+
+	/* Until zlib has used all input and has nothing more to give */
+	do {
+		inf->z.next_out = inf->window;
+		inf->z.avail_out = sizeof(inf->window);
+
+		rc = inflate(&inf->z, Z_NO_FLUSH);
+		if(rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+			DSFYDEBUG("inflate() returned %d\n", rc);
+			inf->state = -1;
+			return -1;
+		}
+
+		n = sizeof(inf->window) - inf->z.avail_out;
+		if(n)
+			inf->sink(inf->arg, inf->window, n);
+
+		if(rc == Z_STREAM_END) {
+			inf->state = 1;
+			break;
+		}
+	} while(rc != Z_BUF_ERROR && (inf->z.avail_in > 0 || inf->z.avail_out == 0));
+
+	return 0;
+}
+
+
+/*
+ * Called when there's no more data
+ * Returns 0 if the whole stream was inflated, -1 if it was corrupt or cut short
+ *
+ */
+int inflater_finish(struct inflater *inf) {
+	if(inf->state != 1) {
+		DSFYDEBUG("Stream %s after %lu bytes of output\n",
+			inf->state < 0? "is corrupt": "ended early", inf->z.total_out);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* Append decompressed data to the struct buf in 'arg' */
+void inflater_sink_buf(void *arg, unsigned char *data, int len) {
+	buf_append_data((struct buf *)arg, data, len);
+}
+
+
+/* zlib's allocator when there's an arena, its memory goes with the arena */
+static voidpf inflater_zalloc(voidpf opaque, uInt items, uInt size) {
+	return arena_alloc((struct arena *)opaque, (size_t)items * size);
+}
+
+
+static void inflater_zfree(voidpf opaque, voidpf ptr) {
+}
@@ -0,0 +1,46 @@
+/*
+ * Streaming decompression of gzip'd channel data, see inflater.c
+ *
+ */
+
+#ifndef LIBOPENSPOTIFY_INFLATER_H
+#define LIBOPENSPOTIFY_INFLATER_H
+
+#include <zlib.h>
+
+#include "arena.h"
+
+/* Size of the minimal gzip header in front of the deflated data */
+#define INFLATER_GZIP_HEADER_SIZE	10
+
+/* Decompressed data is handed to the sink this many bytes at a time, at most */
+#define INFLATER_WINDOW_SIZE		16384
+
+typedef void (*inflater_sink)(void *arg, unsigned char *data, int len);
+
+struct inflater {
+	z_stream z;
+
+	/* The inflater and zlib's state are allocated from this, if it's not NULL */
+	struct arena *arena;
+
+	/* Bytes of the gzip header still to be skipped */
+	int header_left;
+
+	/* 0 while inflating, 1 once the stream has ended and -1 after an error */
+	int state;
+
+	/* Where decompressed data goes */
+	inflater_sink sink;
+	void *arg;
+
+	unsigned char window[INFLATER_WINDOW_SIZE];
+};
+
+struct inflater *inflater_new(struct arena *arena, inflater_sink sink, void *arg);
+void inflater_free(struct inflater *inf);
+int inflater_write(struct inflater *inf, unsigned char *data, int len);
+int inflater_finish(struct inflater *inf);
+void inflater_sink_buf(void *arg, unsigned char *data, int len);
+
+#endif
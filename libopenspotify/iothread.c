@@ -7,6 +7,8 @@
  */
 
 
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 #ifdef _WIN32
 #include <ws2tcpip.h>
@@ -15,6 +17,12 @@
 #include <unistd.h>
 #include <pthread.h>
 #endif
+#ifdef __linux__
+#include <errno.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
 #include <spotify/api.h>
 
 #include "browse.h"
@@ -25,6 +33,7 @@
 #include "iothread.h"
 #include "login.h"
 #include "packet.h"
+#include "parsepool.h"
 #include "player.h"
 #include "playlist.h"
 #include "request.h"
@@ -37,8 +46,22 @@
 
 
 static int process_request(sp_session *s, struct request *req);
+static void process_packets(sp_session *s);
+static void flush_packets(sp_session *s);
+static void disconnect(sp_session *s);
+static int request_channel_class(struct request *req);
+#ifdef __linux__
+static void iothread_wait(sp_session *s);
+#elif !defined(_WIN32)
+static void iothread_unlock(void *arg);
+#endif
 static int process_login_request(sp_session *s, struct request *req);
+static int process_reconnect_request(sp_session *s, struct request *req);
 static int process_logout_request(sp_session *s, struct request *req);
+static void hold_request(sp_session *s, struct request *req);
+static void release_held_requests(sp_session *s);
+static void login_established(sp_session *s);
+static sp_error login_error(struct login_ctx *login);
 
 
 /*
@@ -55,7 +78,7 @@ void *iothread(void *data) {
 	sp_session *s = (sp_session *)data;
 	struct request *req;
 	int ret;
-	int now;
+	int num_ready;
 
 #ifdef _WIN32
 	/* Initialize Winsock */
@@ -63,43 +86,69 @@ void *iothread(void *data) {
 	WSAStartup(MAKEWORD(2,2), &wsadata);
 #endif
 
+	/* Enables the lock-free paths in request.c */
+	request_set_iothread(s);
+
 	for(;;) {
 		request_cleanup(s);
 
-		/* No locking needed since we're in control of request_cleanup() */
-		now = get_millisecs();
-		for(req = s->requests; req; req = req->next) {
-			if(req->state != REQ_STATE_NEW && req->state != REQ_STATE_RUNNING)
-				continue;
-
-			if(req->next_timeout > now)
-				continue;
+		/*
+		 * Hand the replies parsed by the workers to the handlers that
+		 * load them into the session, see xmlreply.c
+		 *
+		 */
+		parsepool_complete(s->parsepool);
 
+		/*
+		 * Only process the requests that are due right now. Requests
+		 * rescheduled as due while processing are run on the next pass.
+		 *
+		 */
+		num_ready = request_schedule_due(s);
+		while(num_ready-- > 0 && (req = request_fetch_next_due(s)) != NULL) {
 			DSFYDEBUG("Processing request <type %s, state %s, input %p, timeout %d>\n",
 					REQUEST_TYPE_STR(req->type), REQUEST_STATE_STR(req->state),
 					req->input, req->next_timeout);
 			ret = process_request(s, req);
 			DSFYDEBUG("Request processing returned %d\n", ret);
 
-			/* FIXME: Drop connection on errors! */
-			if(ret != 0) {
-				DSFYDEBUG("Request failed, good bye\n");
-#ifdef _WIN32
-#else
-				exit(1);
-#endif
+			/* Drop the connection and let the supervisor set up a new one */
+			if(ret != 0 && s->connectionstate == SP_CONNECTION_STATE_LOGGED_IN) {
+				DSFYDEBUG("Request failed, disconnecting!\n");
+				disconnect(s);
 			}
+
+			request_reschedule(s, req);
 		}
 
 
+		/*
+		 * Send the packets queued by the requests above and by
+		 * the packet handlers on the previous pass in one go
+		 *
+		 */
+		flush_packets(s);
+
+
+#ifdef __linux__
+		/*
+		 * Sleep until a request is posted, a request times out,
+		 * data arrives on the socket or a reply has been parsed
+		 *
+		 */
+		iothread_wait(s);
+#else
 		/* Packets can only be processed once we're logged in */
 		if(s->connectionstate != SP_CONNECTION_STATE_LOGGED_IN) {
 #ifdef _WIN32
 			WaitForSingleObject(s->request_mutex, INFINITE);
 #else
 			pthread_mutex_lock(&s->request_mutex);
+
+			/* sp_session_release() cancels us, possibly while waiting */
+			pthread_cleanup_push(iothread_unlock, s);
 #endif
-			if(s->requests == NULL) {
+			if(request_is_idle(s) && !parsepool_has_finished(s->parsepool)) {
 				DSFYDEBUG("Sleeping because there's nothing to do\n");
 #ifdef _WIN32
 				ReleaseMutex(s->request_mutex);
@@ -113,7 +162,7 @@ void *iothread(void *data) {
 #ifdef _WIN32
 			ReleaseMutex(s->request_mutex);
 #else
-			pthread_mutex_unlock(&s->request_mutex);
+			pthread_cleanup_pop(1);
 #endif
 
 			continue;
@@ -125,23 +174,188 @@ void *iothread(void *data) {
 		 * Will sleep somewhere around 64ms if no
 		 * data is available
 		 */
-		ret = packet_read_and_process(s);
-		if(ret < 0) {
-			DSFYDEBUG("process_packets() returned %d, disconnecting!\n", ret);
+		process_packets(s);
+#endif
+	}
+
+
+}
+
+
+#if !defined(__linux__) && !defined(_WIN32)
+/* Cleanup handler, leaves the request mutex unlocked if we're cancelled */
+static void iothread_unlock(void *arg) {
+	sp_session *s = (sp_session *)arg;
+
+	pthread_mutex_unlock(&s->request_mutex);
+}
+#endif
+
+
+/*
+ * Read and process packets, dropping the connection on errors
+ *
+ */
+static void process_packets(sp_session *s) {
+	int ret;
+
+	ret = packet_read_and_process(s);
+	if(ret < 0) {
+		DSFYDEBUG("process_packets() returned %d, disconnecting!\n", ret);
+		disconnect(s);
+	}
+}
+
+
+/*
+ * Write queued packets, dropping the connection on errors
+ *
+ */
+static void flush_packets(sp_session *s) {
+	if(s->connectionstate != SP_CONNECTION_STATE_LOGGED_IN || s->sock == -1)
+		return;
+
+	if(packet_flush(s) < 0) {
+		DSFYDEBUG("packet_flush() failed, disconnecting!\n");
+		disconnect(s);
+	}
+}
+
+
+/*
+ * Close a failed connection and have process_reconnect_request() set up
+ * a new one. Open channels are kept so their requests can be replayed.
+ *
+ */
+static void disconnect(sp_session *s) {
 #ifdef _WIN32
-			closesocket(s->sock);
+	closesocket(s->sock);
 #else
-			close(s->sock);
+	close(s->sock);
 #endif
-			s->sock = -1;
+	s->sock = -1;
+
+	s->connectionstate = SP_CONNECTION_STATE_DISCONNECTED;
+
+	request_post(s, REQ_TYPE_RECONNECT, NULL);
+}
+
 
-			s->connectionstate = SP_CONNECTION_STATE_DISCONNECTED;
+#ifdef __linux__
+/*
+ * Block in epoll_wait() until one of the following happens:
+ * - request_post() or a parse worker signals the eventfd
+ * - the timerfd, armed for the earliest request timeout, expires
+ * - the socket becomes readable (only while logged in)
+ * - the socket becomes writable while packets are queued for sending
+ *
+ */
+static void iothread_wait(sp_session *s) {
+	struct epoll_event ev, events[3];
+	struct itimerspec its;
+	int i, n, timeout, readable;
+	unsigned int sock_events;
+	uint64_t counter;
+
+
+	/* Keep the socket registered with epoll only while logged in */
+	if(s->epoll_sock != -1
+		&& (s->connectionstate != SP_CONNECTION_STATE_LOGGED_IN || s->epoll_sock != s->sock)) {
+		/* Fails harmlessly if the socket was already closed */
+		epoll_ctl(s->epoll_fd, EPOLL_CTL_DEL, s->epoll_sock, &ev);
+		s->epoll_sock = -1;
+	}
 
-			request_post_result(s, REQ_TYPE_LOGOUT, SP_ERROR_OTHER_TRANSIENT, NULL);
+	/* Only ask for EPOLLOUT while the socket didn't take all queued data */
+	sock_events = EPOLLIN;
+	if(s->send_head < s->send_tail)
+		sock_events |= EPOLLOUT;
+
+	if(s->epoll_sock == -1 && s->connectionstate == SP_CONNECTION_STATE_LOGGED_IN && s->sock != -1) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = sock_events;
+		ev.data.fd = s->sock;
+		if(epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->sock, &ev) == 0) {
+			s->epoll_sock = s->sock;
+			s->epoll_sock_events = sock_events;
 		}
+		else
+			DSFYDEBUG("epoll_ctl() failed to add socket %d, errno %d\n", s->sock, errno);
+	}
+	else if(s->epoll_sock != -1 && s->epoll_sock_events != sock_events) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = sock_events;
+		ev.data.fd = s->sock;
+		if(epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, s->sock, &ev) == 0)
+			s->epoll_sock_events = sock_events;
+	}
+
+
+	/* Arm (or disarm) the timer for the earliest request timeout */
+	timeout = request_next_timeout(s);
+	memset(&its, 0, sizeof(its));
+	if(timeout > 0) {
+		its.it_value.tv_sec = timeout / 1000;
+		its.it_value.tv_nsec = (timeout % 1000) * 1000000;
+
+		/* Let the timerfd wake us up */
+		timeout = -1;
+	}
+
+	timerfd_settime(s->timer_fd, 0, &its, NULL);
+
+
+	n = epoll_wait(s->epoll_fd, events, sizeof(events) / sizeof(events[0]), timeout);
+	if(n < 0) {
+		if(errno != EINTR)
+			DSFYDEBUG("epoll_wait() failed with errno %d\n", errno);
+
+		return;
+	}
+
+
+	readable = 0;
+	for(i = 0; i < n; i++) {
+		if(events[i].data.fd == s->wakeup_fd || events[i].data.fd == s->timer_fd) {
+			/* Reset the counter so we don't wake up again */
+			if(read(events[i].data.fd, &counter, sizeof(counter)) != sizeof(counter))
+				continue;
+		}
+		else if(events[i].data.fd == s->epoll_sock && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+			readable = 1;
+
+		/* On EPOLLOUT the next pass through the main loop flushes */
 	}
 
 
+	if(readable && s->connectionstate == SP_CONNECTION_STATE_LOGGED_IN)
+		process_packets(s);
+}
+#endif
+
+
+/*
+ * Which channel budget a request draws from, -1 for requests that
+ * don't open channels
+ *
+ */
+static int request_channel_class(struct request *req) {
+	switch(req->type) {
+	case REQ_TYPE_LOGIN:
+	case REQ_TYPE_LOGOUT:
+	case REQ_TYPE_RECONNECT:
+	case REQ_TYPE_PLAY_TOKEN_ACQUIRE:
+	case REQ_TYPE_PLAY_TOKEN_LOST:
+	case REQ_TYPE_CACHE_PERIODIC:
+		return -1;
+
+	case REQ_TYPE_PLAYER_KEY:
+	case REQ_TYPE_PLAYER_SUBSTREAM:
+		return CHANNEL_CLASS_AUDIO;
+
+	default:
+		return CHANNEL_CLASS_METADATA;
+	}
 }
 
 
@@ -151,10 +365,19 @@ void *iothread(void *data) {
  */
 static int process_request(sp_session *session, struct request *req) {
 	int now = get_millisecs();
+	int class;
 
 	if(session->connectionstate != SP_CONNECTION_STATE_LOGGED_IN
-		&& (req->type != REQ_TYPE_LOGIN && req->type != REQ_TYPE_LOGOUT)) {
-		if(req->state == REQ_STATE_NEW) {
+		&& (req->type != REQ_TYPE_LOGIN && req->type != REQ_TYPE_LOGOUT && req->type != REQ_TYPE_RECONNECT)) {
+		if(session->connectionstate == SP_CONNECTION_STATE_DISCONNECTED) {
+			/* Hold on to everything while the supervisor reconnects */
+			DSFYDEBUG("Holding request <type %s, state %s, input %p> while reconnecting\n",
+					REQUEST_TYPE_STR(req->type), REQUEST_STATE_STR(req->state), req->input);
+			hold_request(session, req);
+
+			return 0;
+		}
+		else if(req->state == REQ_STATE_NEW) {
 			DSFYDEBUG("Postponing request <type %s, state %s, input %p> 10 seconds due to not logged in\n",
 					REQUEST_TYPE_STR(req->type), REQUEST_STATE_STR(req->state), req->input);
 			req->next_timeout = now + 10*1000;
@@ -167,14 +390,12 @@ static int process_request(sp_session *session, struct request *req) {
 			return request_set_result(session, req, SP_ERROR_OTHER_TRANSIENT, NULL);
 		}
 	}
-	else if(req->state == REQ_STATE_NEW && session->num_channels >= 16) {
-		DSFYDEBUG("%d channels active, postponing request <type %s, state %s, input %p>\n",
-			  session->num_channels, REQUEST_TYPE_STR(req->type),
-			  REQUEST_STATE_STR(req->state), req->input);
-
-		if(req->next_timeout < now + 100)
-			req->next_timeout = now + 100;
-		
+	else if(req->state == REQ_STATE_NEW && (class = request_channel_class(req)) != -1
+		&& channel_budget_wait(session, class, req)) {
+		DSFYDEBUG("%d channels active (limit %d), request <type %s, state %s, input %p> waits for one\n",
+			  session->channel_budgets[class].num_open, session->channel_budgets[class].limit,
+			  REQUEST_TYPE_STR(req->type), REQUEST_STATE_STR(req->state), req->input);
+
 		return 0;
 	}
 
@@ -187,6 +408,10 @@ static int process_request(sp_session *session, struct request *req) {
 	case REQ_TYPE_LOGOUT:
 		return process_logout_request(session, req);
 		break;
+
+	case REQ_TYPE_RECONNECT:
+		return process_reconnect_request(session, req);
+		break;
 	
 	case REQ_TYPE_PC_LOAD:
 	case REQ_TYPE_PLAYLIST_LOAD:
@@ -247,12 +472,31 @@ static int process_request(sp_session *session, struct request *req) {
 static int process_login_request(sp_session *s, struct request *req) {
 	int ret;
 	sp_error error;
-	unsigned char key_recv[32], key_send[32];
 
 	if(req->state == REQ_STATE_NEW) {
 		req->state = REQ_STATE_RUNNING;
 
-		s->login = login_create(s->username, s->password);
+		/* Take over from the connection supervisor, see process_reconnect_request() */
+		if(s->connectionstate == SP_CONNECTION_STATE_DISCONNECTED) {
+			DSFYDEBUG("Logging in again, giving up on reconnecting\n");
+
+			if(s->login) {
+				login_release(s->login);
+				s->login = NULL;
+			}
+
+			/* A new login doesn't replay the channels of the lost connection */
+			s->connectionstate = SP_CONNECTION_STATE_LOGGED_OUT;
+			channel_fail_and_unregister_all(s);
+			release_held_requests(s);
+
+			if(s->reconnect) {
+				request_set_next_timeout(s, s->reconnect, 0);
+				s->reconnect = NULL;
+			}
+		}
+
+		s->login = login_create(s->username, s->password, s->settings_location, s->keypool);
 		if(s->login == NULL)
 			return request_set_result(s, req, SP_ERROR_OTHER_TRANSIENT, NULL);
 	}
@@ -274,58 +518,163 @@ static int process_login_request(sp_session *s, struct request *req) {
 	if(ret == 0)
 		return 0;
 	else if(ret == 1) {
-		login_export_session(s->login, &s->sock, key_recv, key_send);
-		login_release(s->login);
-		s->login = NULL;
+		login_established(s);
+		s->num_reconnects = 0;
+		s->reconnect_backoff = RECONNECT_BACKOFF_MIN;
 
-		shn_key(&s->shn_recv, key_recv, sizeof(key_recv));
-		s->key_recv_IV = 0;
+		DSFYDEBUG("Logged in\n");
+		return request_set_result(s, req, SP_ERROR_OK, NULL);
+	}
 
-		shn_key(&s->shn_send, key_send, sizeof(key_send));
-		s->key_send_IV = 0;
+	error = login_error(s->login);
 
-		s->connectionstate = SP_CONNECTION_STATE_LOGGED_IN;
+	login_release(s->login);
+	s->login = NULL;
+
+	DSFYDEBUG("Login failed with error: %s\n", sp_error_message(error));
+	return request_set_result(s, req, error, NULL);
+}
+
+
+/*
+ * Connection supervisor
+ *
+ * When the connection is lost while logged in, disconnect() posts a
+ * REQ_TYPE_RECONNECT. We wait reconnect_backoff milliseconds, log in
+ * again with the stored credentials and double the backoff for every
+ * failed attempt. Requests are held back while we're at it. Once logged
+ * in, the requests of channels still open are replayed so browsing,
+ * image and audio downloads carry on instead of failing.
+ *
+ * Gives up, logging out the session, if the credentials are refused.
+ * A call to sp_session_login() while we're at it takes over, see
+ * process_login_request().
+ *
+ */
+static int process_reconnect_request(sp_session *s, struct request *req) {
+	int ret;
+	sp_error error;
+
+	/* Logged out or in again, or the connection was lost again, while waiting */
+	if(s->connectionstate != SP_CONNECTION_STATE_DISCONNECTED
+		|| (req->state != REQ_STATE_NEW && s->reconnect != req)) {
+		if(s->reconnect == req)
+			s->reconnect = NULL;
 
-		DSFYDEBUG("Logged in\n");
 		return request_set_result(s, req, SP_ERROR_OK, NULL);
 	}
 
-	switch(s->login->error) {
+	if(req->state == REQ_STATE_NEW) {
+		req->state = REQ_STATE_RUNNING;
+		s->reconnect = req;
+
+		DSFYDEBUG("Connection lost, reconnecting in %dms\n", s->reconnect_backoff);
+		req->next_timeout = get_millisecs() + s->reconnect_backoff;
+		return 0;
+	}
+
+	if(s->login == NULL && (s->login = login_create(s->username, s->password, s->settings_location, s->keypool)) == NULL)
+		ret = -1;
+	else if((ret = login_process(s->login)) == 0)
+		return 0;
+
+	if(ret == 1) {
+		login_established(s);
+		s->num_reconnects++;
+		s->reconnect_backoff = RECONNECT_BACKOFF_MIN;
+
+		DSFYDEBUG("Reconnected, replaying requests of %d open channels\n", s->num_channels);
+		channel_replay_all(s);
+		release_held_requests(s);
+
+		s->reconnect = NULL;
+		return request_set_result(s, req, SP_ERROR_OK, NULL);
+	}
+
+	error = SP_ERROR_OTHER_TRANSIENT;
+	if(s->login != NULL) {
+		error = login_error(s->login);
+
+		login_release(s->login);
+		s->login = NULL;
+	}
+
+	if(error != SP_ERROR_OTHER_TRANSIENT && error != SP_ERROR_UNABLE_TO_CONTACT_SERVER) {
+		DSFYDEBUG("Reconnect failed with error: %s, giving up\n", sp_error_message(error));
+
+		s->connectionstate = SP_CONNECTION_STATE_LOGGED_OUT;
+		channel_fail_and_unregister_all(s);
+		release_held_requests(s);
+		request_post_result(s, REQ_TYPE_LOGOUT, error, NULL);
+
+		s->reconnect = NULL;
+		return request_set_result(s, req, error, NULL);
+	}
+
+	/* Try again later */
+	s->reconnect_backoff *= 2;
+	if(s->reconnect_backoff > RECONNECT_BACKOFF_MAX)
+		s->reconnect_backoff = RECONNECT_BACKOFF_MAX;
+
+	DSFYDEBUG("Reconnect failed with error: %s, retrying in %dms\n",
+			sp_error_message(error), s->reconnect_backoff);
+	req->next_timeout = get_millisecs() + s->reconnect_backoff;
+
+	return 0;
+}
+
+
+/*
+ * Take over the socket and keys from a successful login
+ *
+ */
+static void login_established(sp_session *s) {
+	unsigned char key_recv[32], key_send[32];
+
+	login_export_session(s->login, &s->sock, key_recv, key_send);
+	login_release(s->login);
+	s->login = NULL;
+
+	shn_key(&s->shn_recv, key_recv, sizeof(key_recv));
+	s->key_recv_IV = 0;
+	packet_reset(s);
+
+	shn_key(&s->shn_send, key_send, sizeof(key_send));
+	s->key_send_IV = 0;
+
+	s->connectionstate = SP_CONNECTION_STATE_LOGGED_IN;
+}
+
+
+/*
+ * Map a failed login to the error reported to the application
+ *
+ */
+static sp_error login_error(struct login_ctx *login) {
+	switch(login->error) {
 	case SP_LOGIN_ERROR_DNS_FAILURE:
 	case SP_LOGIN_ERROR_NO_MORE_SERVERS:
-		error = SP_ERROR_UNABLE_TO_CONTACT_SERVER;
-		break;
+		return SP_ERROR_UNABLE_TO_CONTACT_SERVER;
 
 	case SP_LOGIN_ERROR_UPGRADE_REQUIRED:
-		error = SP_ERROR_CLIENT_TOO_OLD;
-		break;
+		return SP_ERROR_CLIENT_TOO_OLD;
 
 	case SP_LOGIN_ERROR_USER_BANNED:
-		error = SP_ERROR_USER_BANNED;
-		break;
+		return SP_ERROR_USER_BANNED;
 
 	case SP_LOGIN_ERROR_USER_NOT_FOUND:
 	case SP_LOGIN_ERROR_BAD_PASSWORD:
-		error = SP_ERROR_BAD_USERNAME_OR_PASSWORD;
-		break;
+		return SP_ERROR_BAD_USERNAME_OR_PASSWORD;
 
 	case SP_LOGIN_ERROR_USER_NEED_TO_COMPLETE_DETAILS:
 	case SP_LOGIN_ERROR_USER_COUNTRY_MISMATCH:
 	case SP_LOGIN_ERROR_OTHER_PERMANENT:
-		error = SP_ERROR_OTHER_PERMANENT;
-		break;
+		return SP_ERROR_OTHER_PERMANENT;
 
 	case SP_LOGIN_ERROR_SOCKET_ERROR:
 	default:
-		error = SP_ERROR_OTHER_TRANSIENT;
-		break;
+		return SP_ERROR_OTHER_TRANSIENT;
 	}
-
-	login_release(s->login);
-	s->login = NULL;
-
-	DSFYDEBUG("Login failed with error: %s\n", sp_error_message(error));
-	return request_set_result(s, req, error, NULL);
 }
 
 
@@ -375,8 +724,57 @@ static int process_logout_request(sp_session *session, struct request *req) {
 
 	session->connectionstate = SP_CONNECTION_STATE_LOGGED_OUT;
 
+	/* Have the connection supervisor finish, if it was reconnecting */
+	if(session->reconnect) {
+		request_set_next_timeout(session, session->reconnect, 0);
+		session->reconnect = NULL;
+	}
+
 	/* Unregister all channels */
 	channel_fail_and_unregister_all(session);
 
+	release_held_requests(session);
+
 	return request_set_result(session, req, SP_ERROR_OK, NULL);
 }
+
+
+/*
+ * Park a request until the session is no longer disconnected
+ * Like channel_budget_wait(), it's woken up rather than polled.
+ *
+ */
+static void hold_request(sp_session *s, struct request *req) {
+	int i;
+
+	req->next_timeout = INT_MAX;
+
+	for(i = 0; i < s->num_held; i++)
+		if(s->held[i] == req)
+			return;
+
+	if(s->num_held == s->held_size) {
+		s->held_size = s->held_size? 2 * s->held_size: 16;
+		s->held = (struct request **)realloc(s->held, sizeof(struct request *) * s->held_size);
+	}
+
+	s->held[s->num_held++] = req;
+}
+
+
+/*
+ * Called whenever the session leaves SP_CONNECTION_STATE_DISCONNECTED
+ * The requests go ahead if we're logged in again and are failed or
+ * postponed by process_request() otherwise.
+ *
+ */
+static void release_held_requests(sp_session *s) {
+	int i;
+
+	DSFYDEBUG("Releasing %d requests held while reconnecting\n", s->num_held);
+
+	for(i = 0; i < s->num_held; i++)
+		request_set_next_timeout(s, s->held[i], 0);
+
+	s->num_held = 0;
+}
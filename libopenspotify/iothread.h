@@ -1,5 +1,14 @@
+#ifndef LIBOPENSPOTIFY_IOTHREAD_H
+#define LIBOPENSPOTIFY_IOTHREAD_H
+
+/* Delay before reconnecting after losing the connection, doubled per failed attempt (ms) */
+#define RECONNECT_BACKOFF_MIN	1000
+#define RECONNECT_BACKOFF_MAX	(64 * 1000)
+
 #ifdef _WIN32
 DWORD WINAPI iothread(LPVOID data);
 #else
 void *iothread(void *data);
 #endif
+
+#endif
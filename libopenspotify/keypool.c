@@ -0,0 +1,335 @@
+/*
+ * Login key material generated ahead of time
+ *
+ * Every login needs a fresh 1024-bit RSA key pair and a Diffie-Hellman
+ * key, and generating the RSA key takes long enough to show up in the
+ * time it takes to log in. sp_session_init() creates a pool that fills
+ * itself with KEYPOOL_SIZE key sets on a background thread, so a login,
+ * or a reconnect after the connection was lost, can start the handshake
+ * with keys that are already there. keypool_get() hands out a set and
+ * wakes the thread up to make a new one in its place.
+ *
+ * If the pool has run dry, keypool_get() generates a set on the calling
+ * thread, the way login_create() always used to. The thread runs at the
+ * lowest priority so that refilling the pool doesn't slow down a login
+ * that is in progress.
+ *
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE	/* Required for SCHED_IDLE on Linux */
+#endif
+#include <stdlib.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include <openssl/crypto.h>
+#include <openssl/dh.h>
+#include <openssl/rsa.h>
+
+#include "debug.h"
+#include "keypool.h"
+
+
+static unsigned char DH_generator[1] = { 2 };
+static unsigned char DH_prime[] = {
+        /* Well-known Group 1, 768-bit prime */
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xc9,
+        0x0f, 0xda, 0xa2, 0x21, 0x68, 0xc2, 0x34, 0xc4, 0xc6,
+        0x62, 0x8b, 0x80, 0xdc, 0x1c, 0xd1, 0x29, 0x02, 0x4e,
+        0x08, 0x8a, 0x67, 0xcc, 0x74, 0x02, 0x0b, 0xbe, 0xa6,
+        0x3b, 0x13, 0x9b, 0x22, 0x51, 0x4a, 0x08, 0x79, 0x8e,
+        0x34, 0x04, 0xdd, 0xef, 0x95, 0x19, 0xb3, 0xcd, 0x3a,
+        0x43, 0x1b, 0x30, 0x2b, 0x0a, 0x6d, 0xf2, 0x5f, 0x14,
+        0x37, 0x4f, 0xe1, 0x35, 0x6d, 0x6d, 0x51, 0xc2, 0x45,
+        0xe4, 0x85, 0xb5, 0x76, 0x62, 0x5e, 0x7e, 0xc6, 0xf4,
+        0x4c, 0x42, 0xe9, 0xa6, 0x3a, 0x36, 0x20, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/*
+ * OpenSSL before 1.1 is only safe to use from several threads at once
+ * if the application provides locks. With the pool, keys are generated
+ * while the networking thread is logging in, so install locks unless
+ * the application already did. They stay installed for good.
+ *
+ */
+#ifdef _WIN32
+static HANDLE *openssl_locks;
+#else
+static pthread_mutex_t *openssl_locks;
+#endif
+
+static void keypool_openssl_lock(int mode, int n, const char *file, int line) {
+#ifdef _WIN32
+	if(mode & CRYPTO_LOCK)
+		WaitForSingleObject(openssl_locks[n], INFINITE);
+	else
+		ReleaseMutex(openssl_locks[n]);
+#else
+	if(mode & CRYPTO_LOCK)
+		pthread_mutex_lock(&openssl_locks[n]);
+	else
+		pthread_mutex_unlock(&openssl_locks[n]);
+#endif
+}
+
+
+static void keypool_openssl_init(void) {
+	int i;
+
+	if(CRYPTO_get_locking_callback() != NULL)
+		return;
+
+	openssl_locks = malloc(CRYPTO_num_locks() * sizeof(*openssl_locks));
+	if(openssl_locks == NULL)
+		return;
+
+	for(i = 0; i < CRYPTO_num_locks(); i++) {
+#ifdef _WIN32
+		openssl_locks[i] = CreateMutex(NULL, FALSE, NULL);
+#else
+		pthread_mutex_init(&openssl_locks[i], NULL);
+#endif
+	}
+
+	CRYPTO_set_locking_callback(keypool_openssl_lock);
+}
+#endif
+
+
+struct login_keys *login_keys_generate(void) {
+	struct login_keys *keys;
+
+	if((keys = malloc(sizeof(struct login_keys))) == NULL)
+		return NULL;
+
+	/* Client key pair */
+	keys->rsa = RSA_generate_key(1024, 65537, NULL, NULL);
+
+	/* Diffie-Hellman parameters */
+	keys->dh = DH_new();
+	keys->dh->p = BN_bin2bn(DH_prime, 96, NULL);
+	keys->dh->g = BN_bin2bn(DH_generator, 1, NULL);
+	DH_generate_key(keys->dh);
+
+	keys->next = NULL;
+
+	return keys;
+}
+
+
+void login_keys_free(struct login_keys *keys) {
+	RSA_free(keys->rsa);
+	DH_free(keys->dh);
+	free(keys);
+}
+
+
+static void keypool_lock(struct keypool *pool) {
+#ifdef _WIN32
+	WaitForSingleObject(pool->mutex, INFINITE);
+#else
+	pthread_mutex_lock(&pool->mutex);
+#endif
+}
+
+
+static void keypool_unlock(struct keypool *pool) {
+#ifdef _WIN32
+	ReleaseMutex(pool->mutex);
+#else
+	pthread_mutex_unlock(&pool->mutex);
+#endif
+}
+
+
+/* Wake up the thread, called with the mutex held */
+static void keypool_signal(struct keypool *pool) {
+#ifdef _WIN32
+	SetEvent(pool->wakeup);
+#else
+	pthread_cond_signal(&pool->wakeup);
+#endif
+}
+
+
+/* Generate key sets until the pool is full, then sleep until one is taken */
+#ifdef _WIN32
+static DWORD WINAPI keypool_thread(LPVOID arg) {
+#else
+static void *keypool_thread(void *arg) {
+#endif
+	struct keypool *pool = (struct keypool *)arg;
+	struct login_keys *keys;
+#ifdef __linux__
+	struct sched_param param;
+
+	param.sched_priority = 0;
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+
+	keypool_lock(pool);
+	while(!pool->done) {
+		if(pool->num_ready >= pool->size) {
+#ifdef _WIN32
+			keypool_unlock(pool);
+			WaitForSingleObject(pool->wakeup, INFINITE);
+			keypool_lock(pool);
+#else
+			pthread_cond_wait(&pool->wakeup, &pool->mutex);
+#endif
+			continue;
+		}
+
+		keypool_unlock(pool);
+		keys = login_keys_generate();
+		keypool_lock(pool);
+
+		if(keys == NULL)
+			break;
+
+		keys->next = pool->ready;
+		pool->ready = keys;
+		pool->num_ready++;
+	}
+	keypool_unlock(pool);
+
+#ifdef _WIN32
+	return 0;
+#else
+	return NULL;
+#endif
+}
+
+
+struct keypool *keypool_create(int size) {
+	struct keypool *pool;
+
+	if((pool = malloc(sizeof(struct keypool))) == NULL)
+		return NULL;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	keypool_openssl_init();
+#endif
+
+	pool->size = size;
+	pool->ready = NULL;
+	pool->num_ready = 0;
+	pool->done = 0;
+	pool->num_hits = 0;
+	pool->num_misses = 0;
+
+#ifdef _WIN32
+	pool->mutex = CreateMutex(NULL, FALSE, NULL);
+	pool->wakeup = CreateEvent(NULL, FALSE, FALSE, NULL);
+	pool->thread = CreateThread(NULL, 0, keypool_thread, pool, 0, NULL);
+	if(pool->thread == NULL) {
+		CloseHandle(pool->wakeup);
+		CloseHandle(pool->mutex);
+		free(pool);
+		return NULL;
+	}
+
+	SetThreadPriority(pool->thread, THREAD_PRIORITY_IDLE);
+#else
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->wakeup, NULL);
+	if(pthread_create(&pool->thread, NULL, keypool_thread, pool)) {
+		pthread_cond_destroy(&pool->wakeup);
+		pthread_mutex_destroy(&pool->mutex);
+		free(pool);
+		return NULL;
+	}
+#endif
+
+	DSFYDEBUG("Key pool created at %p, keeping %d key sets\n", pool, size);
+
+	return pool;
+}
+
+
+/*
+ * Stop the thread and free the key sets left in the pool
+ * Waits for a key set being generated to finish.
+ *
+ */
+void keypool_release(struct keypool *pool) {
+	struct login_keys *keys;
+
+	keypool_lock(pool);
+	pool->done = 1;
+	keypool_signal(pool);
+	keypool_unlock(pool);
+
+#ifdef _WIN32
+	WaitForSingleObject(pool->thread, INFINITE);
+	CloseHandle(pool->thread);
+	CloseHandle(pool->wakeup);
+	CloseHandle(pool->mutex);
+#else
+	pthread_join(pool->thread, NULL);
+	pthread_cond_destroy(&pool->wakeup);
+	pthread_mutex_destroy(&pool->mutex);
+#endif
+
+	while((keys = pool->ready) != NULL) {
+		pool->ready = keys->next;
+		login_keys_free(keys);
+	}
+
+	DSFYDEBUG("Key pool released, %d key sets came from the pool and %d were generated on demand\n",
+		pool->num_hits, pool->num_misses);
+
+	free(pool);
+}
+
+
+/*
+ * Take a key set from the pool, or generate one if the pool is empty
+ * The caller owns the key set. A NULL pool always generates one.
+ *
+ */
+struct login_keys *keypool_get(struct keypool *pool) {
+	struct login_keys *keys = NULL;
+
+	if(pool == NULL)
+		return login_keys_generate();
+
+	keypool_lock(pool);
+	if((keys = pool->ready) != NULL) {
+		pool->ready = keys->next;
+		pool->num_ready--;
+		pool->num_hits++;
+	}
+	else
+		pool->num_misses++;
+
+	keypool_signal(pool);
+	keypool_unlock(pool);
+
+	if(keys == NULL) {
+		DSFYDEBUG("Key pool is empty, generating keys for this login\n");
+		return login_keys_generate();
+	}
+
+	keys->next = NULL;
+
+	return keys;
+}
+
+
+int keypool_num_ready(struct keypool *pool) {
+	int n;
+
+	keypool_lock(pool);
+	n = pool->num_ready;
+	keypool_unlock(pool);
+
+	return n;
+}
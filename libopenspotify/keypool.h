@@ -0,0 +1,60 @@
+/*
+ * Login key material generated ahead of time, see keypool.c
+ *
+ */
+
+#ifndef LIBOPENSPOTIFY_KEYPOOL_H
+#define LIBOPENSPOTIFY_KEYPOOL_H
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include <openssl/dh.h>
+#include <openssl/rsa.h>
+
+/* Key sets kept ready, enough for a login and a reconnect right after it */
+#define KEYPOOL_SIZE	2
+
+/* Client key pair and Diffie-Hellman key for one login */
+struct login_keys {
+	RSA *rsa;
+	DH *dh;
+
+	struct login_keys *next;
+};
+
+struct keypool {
+	int size;
+
+	/* Protected by the mutex */
+	struct login_keys *ready;
+	int num_ready;
+	int done;
+
+	/* Key sets handed out from the pool and generated on demand */
+	int num_hits;
+	int num_misses;
+
+#ifdef _WIN32
+	HANDLE mutex;
+	HANDLE wakeup;
+	HANDLE thread;
+#else
+	pthread_mutex_t mutex;
+	pthread_cond_t wakeup;
+	pthread_t thread;
+#endif
+};
+
+struct keypool *keypool_create(int size);
+void keypool_release(struct keypool *pool);
+struct login_keys *keypool_get(struct keypool *pool);
+int keypool_num_ready(struct keypool *pool);
+
+struct login_keys *login_keys_generate(void);
+void login_keys_free(struct login_keys *keys);
+
+#endif
@@ -19,6 +19,7 @@
 #include <sys/select.h>
 #include <fcntl.h>
 #endif
+#include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
@@ -31,66 +32,68 @@
 #include "debug.h"
 #include "dns.h"
 #include "hmac.h"
+#include "keypool.h"
 #include "login.h"
+#include "puzzle.h"
 #include "sha1.h"
 #include "util.h"
 
 #define SPOTIFY_SRV_HOSTNAME	"_spotify-client._tcp.spotify.com"
 
+/* The Visual C++ compiler doesn't know 'snprintf'... */
+#ifdef _MSC_VER
+#define snprintf _snprintf
+#endif
+
 
 static int send_client_parameters(struct login_ctx *l);
 static int receive_server_parameters(struct login_ctx *l);
 static void key_init(struct login_ctx *l);
 static void auth_generate_auth_hash(struct login_ctx *l);
 static void auth_generate_auth_hmac(struct login_ctx *l);
-static void puzzle_solve (struct login_ctx *l);
 static int send_client_auth_packet(struct login_ctx *l);
 static int receive_server_auth_response(struct login_ctx *l);
 
 
-static unsigned char DH_generator[1] = { 2 };
-static unsigned char DH_prime[] = {
-        /* Well-known Group 1, 768-bit prime */
-        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xc9,
-        0x0f, 0xda, 0xa2, 0x21, 0x68, 0xc2, 0x34, 0xc4, 0xc6,
-        0x62, 0x8b, 0x80, 0xdc, 0x1c, 0xd1, 0x29, 0x02, 0x4e,
-        0x08, 0x8a, 0x67, 0xcc, 0x74, 0x02, 0x0b, 0xbe, 0xa6,
-        0x3b, 0x13, 0x9b, 0x22, 0x51, 0x4a, 0x08, 0x79, 0x8e,
-        0x34, 0x04, 0xdd, 0xef, 0x95, 0x19, 0xb3, 0xcd, 0x3a,
-        0x43, 0x1b, 0x30, 0x2b, 0x0a, 0x6d, 0xf2, 0x5f, 0x14,
-        0x37, 0x4f, 0xe1, 0x35, 0x6d, 0x6d, 0x51, 0xc2, 0x45,
-        0xe4, 0x85, 0xb5, 0x76, 0x62, 0x5e, 0x7e, 0xc6, 0xf4,
-        0x4c, 0x42, 0xe9, 0xa6, 0x3a, 0x36, 0x20, 0xff, 0xff,
-        0xff, 0xff, 0xff, 0xff, 0xff, 0xff
-};
-
-
-struct login_ctx *login_create(char *username, char *password) {
+/*
+ * Create a login context, taking the client's keys from 'pool'
+ * With a NULL pool, or an empty one, the keys are generated right away.
+ *
+ */
+struct login_ctx *login_create(char *username, char *password, const char *settings_location,
+		struct keypool *pool) {
 	struct login_ctx *l;
+	struct login_keys *keys;
 
 	l = malloc(sizeof(struct login_ctx));
 	if(l == NULL)
 		return NULL;
 
+	if((keys = keypool_get(pool)) == NULL) {
+		free(l);
+		return NULL;
+	}
+
 	l->state = 0;
 
 	l->error = SP_LOGIN_ERROR_OK;
 
 	l->sock = -1;
 	l->service_records = NULL;
-	l->server_ai = NULL;
+	l->race.num_attempts = 0;
+
+	l->dns_cache_file[0] = 0;
+	if(settings_location != NULL)
+		snprintf(l->dns_cache_file, sizeof(l->dns_cache_file), "%s/%s",
+			settings_location, DNS_CACHE_FILE);
 
 	l->client_parameters = NULL;
 	l->server_parameters = NULL;
 
-	/* Client key pair */
-	l->rsa = RSA_generate_key(1024, 65537, NULL, NULL);
-
-	/* Diffie-Hellman parameters */
-	l->dh = DH_new ();
-	l->dh->p = BN_bin2bn(DH_prime, 96, NULL);
-	l->dh->g = BN_bin2bn(DH_generator, 1, NULL);
-	DH_generate_key(l->dh);
+	/* Client key pair and Diffie-Hellman key */
+	l->rsa = keys->rsa;
+	l->dh = keys->dh;
+	free(keys);
 
         strncpy(l->username, username, sizeof(l->username) - 1);
         l->username[sizeof(l->username) - 1] = 0;
@@ -119,11 +122,15 @@ void login_release(struct login_ctx *l) {
 #endif
 	}
 
-	if(l->service_records)
-		dns_free_list(l->service_records);
+	connect_race_cancel(&l->race);
+
+	/* Remember how the access points did for the next login */
+	if(l->service_records) {
+		if(l->dns_cache_file[0])
+			dns_save_service_list(l->dns_cache_file, SPOTIFY_SRV_HOSTNAME, l->service_records);
 
-	if(l->server_ai != NULL)
-		freeaddrinfo(l->server_ai);
+		dns_free_list(l->service_records);
+	}
 
 	RSA_free(l->rsa);
 	DH_free(l->dh);
@@ -142,13 +149,8 @@ void login_release(struct login_ctx *l) {
 
 
 int login_process(struct login_ctx *l) {
-	int connect_error, i;
+	unsigned long long seed;
 	int ret = 0;
-	socklen_t len;
-	struct dns_srv_records *svc;
-	struct addrinfo h, *ai;
-	fd_set wfds;
-	struct timeval tv;
 
 	l->error = SP_LOGIN_ERROR_OK;
 	switch(l->state) {
@@ -158,7 +160,8 @@ int login_process(struct login_ctx *l) {
 		if(l->service_records)
 			dns_free_list(l->service_records);
 
-		l->service_records = dns_get_service_list(SPOTIFY_SRV_HOSTNAME);
+		l->service_records = dns_get_service_list(SPOTIFY_SRV_HOSTNAME,
+				l->dns_cache_file[0]? l->dns_cache_file: NULL);
 		if(l->service_records == NULL) {
 			l->error = SP_LOGIN_ERROR_DNS_FAILURE;
 			DSFYDEBUG("Failed to lookup Spotify service in DNS\n");
@@ -169,169 +172,51 @@ int login_process(struct login_ctx *l) {
 		break;
 
 	case 1:
-		/* Pick a host in the list we have not yet tried */
-		for(svc = l->service_records; svc; svc = svc->next)
-			if(svc->tried == 0)
-				break;
-
-		if(svc == NULL) {
-			l->state = 0;
-			l->error = SP_LOGIN_ERROR_NO_MORE_SERVERS;
-			DSFYDEBUG("Run out of hostnames in SRV record list\n");
-			return -1;
-		}
-
-
-		/* Lookup available address records (IPv4/IPv6) for the host */
-		l->server_ai_skip = 0;
-		l->server_ai_wait = 0;
-		if(l->server_ai) {
-			freeaddrinfo(l->server_ai);
-			l->server_ai = NULL;
-		}
-
-		memset(&h, 0, sizeof(h));
-		h.ai_family = PF_UNSPEC;
-		h.ai_socktype = SOCK_STREAM;
-		h.ai_protocol = IPPROTO_TCP;
-		ret = getaddrinfo(svc->host, svc->port, &h, &l->server_ai);
-		if(ret < 0) {
-			l->state = 0;
-			l->error = SP_LOGIN_ERROR_DNS_FAILURE;
-			DSFYDEBUG("Failed to lookup addresses for %s:%s\n", svc->host, svc->port);
-			return -1;
-		}
-
-		DSFYDEBUG("Will connect to host %s:%s\n", svc->host, svc->port);
-		l->state++;
-		break;
-
-	case 2:
-		/* Pick a suitable address we have not yet tried to connect to */
-		i = 0;
-		for(ai = l->server_ai; ai; ai = ai->ai_next) {
-			if(i++ != l->server_ai_skip)
-				continue;
-
-			l->server_ai_skip++;
-			if(ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
-				continue;
-
-			break;
-		}
-
-		if(ai == NULL) {
-			/* Out of addresses for this server, try next server */
-			DSFYDEBUG("Run out of addresses for this host\n");
-			l->state--;
-			break;
-		}
-
-
+		/* Close the socket of an access point that failed the handshake */
 		if(l->sock != -1) {
+			dns_host_failed(l->race.host);
 			DSFYDEBUG("Closing already open socket %d\n", l->sock);
 #ifdef _WIN32
 			closesocket(l->sock);
 #else
 			close(l->sock);
 #endif
+			l->sock = -1;
 		}
 
-
-		l->sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-		if(l->sock < 0) {
+		/* Race connects to the next few hosts we have not yet tried */
+		if(connect_race_start(&l->race, l->service_records) < 0) {
 			l->state = 0;
-			l->error = SP_LOGIN_ERROR_SOCKET_ERROR;
+			l->error = SP_LOGIN_ERROR_NO_MORE_SERVERS;
 			return -1;
 		}
 
-
-		DSFYDEBUG("Initiating connect()\n");
-#ifdef _WIN32
-		i = 1;
-		if(ioctlsocket(l->sock, FIONBIO, &i) < 0 
-			|| (connect(l->sock, (struct sockaddr *)ai->ai_addr, ai->ai_addrlen) < 0 && WSAGetLastError() != WSAEWOULDBLOCK)) {
-#else
-		if((i = fcntl(l->sock, F_GETFL, 0)) < 0
-			|| fcntl(l->sock, F_SETFL, i | O_NONBLOCK) < 0
-			|| (connect(l->sock, (struct sockaddr *)ai->ai_addr, ai->ai_addrlen) < 0 && errno != EINPROGRESS)) {
-#endif
-
-			/* XXX - We'll just try with the next server */
-			DSFYDEBUG("fcntl() or connect() failed with errno %d, will retry with next server\n", errno);
-			l->state--;
-			break;
-		}
-
 		l->state++;
 		break;
 
-	case 3:
-		FD_ZERO(&wfds);
-		FD_SET(l->sock, &wfds);
-
-#define WAIT_MS	200
-#define MAX_WAIT_MS 3000
-		tv.tv_sec = 0;
-		tv.tv_usec = WAIT_MS * 1000;
-		l->server_ai_wait += WAIT_MS;
-
-		ret = select(l->sock + 1, NULL, &wfds, NULL, &tv);
-		if(ret < 0) {
-			l->state = 0;
-			l->error = SP_LOGIN_ERROR_SOCKET_ERROR;
-
-			break;
-		}
-		else if(ret == 0) {
-			if(l->server_ai_wait >= MAX_WAIT_MS) {
-				DSFYDEBUG("Connection timeout out (waited %dms), retrying with next server in list\n", l->server_ai_wait);
-				/* Connect timeout */
-#ifdef _WIN32
-				closesocket(l->sock);
-#else
-				close(l->sock);
-#endif
-				l->sock = -1;
-
-				/* Retry with next server */
-				l->state--;
-			}
-
-			break;
-		}
-
-
-		len = sizeof(connect_error);
-		if((ret = getsockopt(l->sock, SOL_SOCKET, SO_ERROR, (char *)&connect_error, &len)) < 0) {
-			l->state = 0;
-			l->error = SP_LOGIN_ERROR_SOCKET_ERROR;
+	case 2:
+		ret = connect_race_process(&l->race);
+		if(ret == 0)
 			break;
-		}
-		else if(connect_error != 0) {
-			DSFYDEBUG("Connection failed with error %d, retrying with next server in list\n", connect_error);
-#ifdef _WIN32
-			closesocket(l->sock);
-#else
-			close(l->sock);
-#endif
-			l->sock = -1;
-
-			/* Retry with next server */
+		else if(ret < 0) {
+			/* All of them failed, try the next hosts */
+			DSFYDEBUG("Failed to connect to any of the hosts, retrying with the next ones\n");
 			l->state--;
+			ret = 0;
 			break;
 		}
 
-		DSFYDEBUG("Connected to server\n");
+		l->sock = l->race.sock;
 		l->state++;
+		ret = 0;
 		break;
 
-	case 4:
+	case 3:
 		ret = send_client_parameters(l);
 		if(ret < 0) {
 			if(l->error == SP_ERROR_OTHER_TRANSIENT || l->error == SP_LOGIN_ERROR_SOCKET_ERROR) {
 				DSFYDEBUG("Retrying with next server\n");
-				l->state = 2;
+				l->state = 1;
 				return 0;
 			}
 			else {
@@ -345,14 +230,14 @@ int login_process(struct login_ctx *l) {
 		DSFYDEBUG("Initial packet sent, return value was %d, login error is %d\n", ret, l->error);
 		break;
 
-	case 5:
+	case 4:
 		/* Receive server parameters and eventually compute session key */
 		ret = receive_server_parameters(l);
 		DSFYDEBUG("Recieved initial packet, return value was %d, login error is %d\n", ret, l->error);
 		if(ret < 0) {
 			if(l->error == SP_ERROR_OTHER_TRANSIENT || l->error == SP_LOGIN_ERROR_SOCKET_ERROR) {
 				DSFYDEBUG("Retrying with next server\n");
-				l->state = 2;
+				l->state = 1;
 				return 0;
 			}
 			else
@@ -363,13 +248,18 @@ int login_process(struct login_ctx *l) {
 
 		break;
 
-	case 6:
+	case 5:
 		/* Compute a session key and authenticate the client */
 		auth_generate_auth_hash(l);
 		key_init(l);
 
 		/* Solve the puzzle, might take some time.. */
-		puzzle_solve(l);
+		RAND_bytes((unsigned char *)&seed, sizeof(seed));
+		puzzle_solve(l->server_random_16, l->puzzle_denominator, l->puzzle_magic,
+				seed, puzzle_num_threads(), l->puzzle_solution);
+#ifdef DEBUG_LOGIN
+		hexdump8x32 ("login_process, puzzle_solution", l->puzzle_solution, 8);
+#endif
 
 		/*
 	         * Compute HMAC over the initial packets, a byte representing
@@ -386,7 +276,7 @@ int login_process(struct login_ctx *l) {
 		l->state++;
 		break;
 
-	case 7:
+	case 6:
 		/* Authenticate the client */
 		ret = send_client_auth_packet(l);
 		DSFYDEBUG("Sent auth packet, return value was %d, login error is %d\n", ret, l->error);
@@ -397,7 +287,7 @@ int login_process(struct login_ctx *l) {
 
 		break;
 
-	case 8:
+	case 7:
 		/* Read the server's authentication response */
 		ret = receive_server_auth_response(l);
 		DSFYDEBUG("Got auth response, return value was %d, login error is %d\n", ret, l->error);
@@ -946,68 +836,3 @@ static int receive_server_auth_response(struct login_ctx *l) {
 	return 0;
 }
 
-
-
-/*
- * $Id: puzzle.c 291 2009-04-08 14:22:33Z zagor $
- *
- * Zero-modulus bruteforce puzzle to prevent 
- * Denial of Service and password bruteforce attacks
- *
- */
-
-
-#if !defined srandom || !defined random
-#define srandom srand
-#define random rand
-#endif
-
-static void puzzle_solve (struct login_ctx *l) {
-	SHA1_CTX ctx;
-	unsigned char digest[20];
-	unsigned int *nominator_from_hash;
-	unsigned int denominator;
-	unsigned int seed;
-	int i;
-
-	/*
-	 * Modulus operation by a power of two.
-	 * "Most programmers learn this trick early"
-	 * Well, fuck me. I'm just here for the party.
-	 *
-	 */
-	denominator = 1 << l->puzzle_denominator;
-	denominator--;
-
-	/*
-	 * Compute a hash over random data until
-	 * (last dword byteswapped XOR magic number) mod
-	 * denominator by server produces zero.
-	 *
-	 */
-
-	seed = get_millisecs() ^ (get_millisecs() << 9);
-	srandom(seed);
-	nominator_from_hash = (unsigned int *) (digest + 16);
-	do {
-		SHA1Init (&ctx);
-		SHA1Update (&ctx, l->server_random_16, 16);
-
-		/* Let's waste some precious pseudorandomness */
-		for (i = 0; i < 8; i++)
-			l->puzzle_solution[i] = random ();
-		SHA1Update (&ctx, l->puzzle_solution, 8);
-
-		SHA1Final (digest, &ctx);
-
-		/* byteswap (XXX - htonl() won't work on bigendian machines!) */
-		*nominator_from_hash = htonl (*nominator_from_hash);
-
-		/* XOR with a fancy magic */
-		*nominator_from_hash ^= l->puzzle_magic;
-	} while (*nominator_from_hash & denominator);
-
-#ifdef DEBUG_LOGIN
-	hexdump8x32 ("auth_solve_puzzle, puzzle_solution", l->puzzle_solution, 8);
-#endif
-}
@@ -12,7 +12,9 @@
 #include <openssl/rsa.h>
 
 #include "buf.h"
+#include "connect.h"
 #include "dns.h"
+#include "keypool.h"
 
 enum sp_login_error {
 	SP_LOGIN_ERROR_OK = 0,
@@ -37,9 +39,12 @@ struct login_ctx {
 
 	int sock;
         struct dns_srv_records *service_records;
-        struct addrinfo *server_ai;
-        int server_ai_skip;
-        int server_ai_wait;
+
+	/* Where SRV records and access point health are cached, empty for none */
+	char dns_cache_file[1024];
+
+	/* Connects in progress to the access points, see connect.c */
+	struct connect_race race;
 	
         char username[256];
         char password[256];
@@ -100,7 +105,8 @@ struct login_ctx {
         int puzzle_magic;
 };
 
-struct login_ctx *login_create(char *username, char *password);
+struct login_ctx *login_create(char *username, char *password, const char *settings_location,
+		struct keypool *pool);
 void login_release(struct login_ctx *l);
 int login_process(struct login_ctx *);
 void login_export_session(struct login_ctx *login, int *sock, unsigned char *key_recv, unsigned char *key_send);
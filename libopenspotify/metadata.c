@@ -0,0 +1,470 @@
+/*
+ * Tracks, albums and artists collected from XML as it's parsed
+ *
+ * The handlers xmlparser.c calls for browse, search and toplist replies
+ * pass everything inside a track, album or artist element on to the
+ * functions here, which keep what the loaders in sp_track.c, sp_album.c
+ * and sp_artist.c need. When the object's element closes, the record is
+ * complete and is handed to the loader.
+ *
+ * What's kept of each element is described by metadata_elements[], which
+ * says where in each kind of record it goes and how its text is converted.
+ * Element names are looked up with a perfect hash, so one table lookup and
+ * one strcmp() is all it takes to place an element or to skip it.
+ *
+ * Text and lists are allocated from the response's arena, so emptying a
+ * record for the next element frees nothing.
+ *
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "debug.h"
+#include "metadata.h"
+#include "util.h"
+#include "xmlparser.h"
+
+
+/*
+ * How an element is stored in a record
+ * The first two are read from a start tag's attributes, the rest from the
+ * element's text when it closes.
+ *
+ */
+#define METADATA_NONE		0
+#define METADATA_FILE		1	/* 'id' of a file element, if it's 160 kbit/s */
+#define METADATA_COUNTRIES	2	/* Country lists of a restriction element */
+#define METADATA_ID		3	/* Hex string, 'size' bytes once decoded */
+#define METADATA_STRING		4
+#define METADATA_INT		5
+#define METADATA_DOUBLE		6
+#define METADATA_BOOL		7	/* "true", in any case */
+#define METADATA_ALBUM_TYPE	8
+#define METADATA_ARTIST_ID	9	/* ID of the next artist in a struct artist_list_xml */
+#define METADATA_ARTIST_NAME	10	/* Name of the next artist in a struct artist_list_xml */
+#define METADATA_REDIRECT	11	/* Hex string appended to a list of IDs */
+
+/* Columns of metadata_elements[], one for each kind of record */
+#define METADATA_ARTIST		0
+#define METADATA_ALBUM		1
+#define METADATA_TRACK		2
+
+struct metadata_field {
+	int type;
+
+	/* Depth below the object's element */
+	int depth;
+
+	/* Bit set in the record's 'found' */
+	unsigned int flag;
+
+	/* Where it goes in the record, and the size of an ID */
+	size_t offset;
+	size_t size;
+
+	/* Offset of the number of IDs in a redirect list */
+	size_t count;
+};
+
+struct metadata_element {
+	const char *name;
+	struct metadata_field fields[3];
+};
+
+#define FIELD(type, depth, record, member, flag) \
+	{ type, depth, flag, offsetof(record, member), sizeof(((record *)0)->member), 0 }
+#define ARTIST(type, member, flag)	FIELD(type, 1, struct artist_xml, member, flag)
+#define ALBUM(type, member, flag)	FIELD(type, 1, struct album_xml, member, flag)
+#define TRACK(type, member, flag)	FIELD(type, 1, struct track_xml, member, flag)
+#define NONE				{ METADATA_NONE, 0, 0, 0, 0, 0 }
+
+/*
+ * Everything the loaders are told about artists, albums and tracks
+ * Adding a field to a record takes a row here, or a column in an existing
+ * row, and its slot in metadata_slots[] below.
+ *
+ */
+static const struct metadata_element metadata_elements[] = {
+	{ "id",			{ ARTIST(METADATA_ID, id, ARTIST_XML_ID),
+				  ALBUM(METADATA_ID, id, ALBUM_XML_ID),
+				  TRACK(METADATA_ID, id, TRACK_XML_ID) } },
+	{ "name",		{ ARTIST(METADATA_STRING, name, ARTIST_XML_NAME),
+				  ALBUM(METADATA_STRING, name, ALBUM_XML_NAME),
+				  NONE } },
+	{ "year",		{ NONE,
+				  ALBUM(METADATA_INT, year, ALBUM_XML_YEAR),
+				  TRACK(METADATA_INT, year, TRACK_XML_YEAR) } },
+	{ "album-type",		{ NONE,
+				  ALBUM(METADATA_ALBUM_TYPE, type, ALBUM_XML_TYPE),
+				  NONE } },
+	{ "cover",		{ NONE,
+				  ALBUM(METADATA_ID, cover, ALBUM_XML_COVER),
+				  TRACK(METADATA_ID, cover, TRACK_XML_COVER) } },
+	{ "artist-id",		{ NONE,
+				  ALBUM(METADATA_ARTIST_ID, artist_list, 0),
+				  TRACK(METADATA_ARTIST_ID, artist_list, 0) } },
+	{ "artist",		{ NONE,
+				  ALBUM(METADATA_ARTIST_NAME, artist_list, 0),
+				  TRACK(METADATA_ARTIST_NAME, artist_list, 0) } },
+	{ "artist-name",	{ NONE,
+				  ALBUM(METADATA_STRING, artist_name, ALBUM_XML_ARTIST_NAME),
+				  NONE } },
+	{ "redirect",		{ NONE,
+				  NONE,
+				  { METADATA_REDIRECT, 1, 0, offsetof(struct track_xml, redirects), 16,
+				    offsetof(struct track_xml, num_redirects) } } },
+	{ "title",		{ NONE,
+				  NONE,
+				  TRACK(METADATA_STRING, title, TRACK_XML_TITLE) } },
+	{ "explicit",		{ NONE,
+				  NONE,
+				  TRACK(METADATA_BOOL, has_explicit_lyrics, 0) } },
+	{ "popularity",		{ NONE,
+				  NONE,
+				  TRACK(METADATA_DOUBLE, popularity, TRACK_XML_POPULARITY) } },
+	{ "length",		{ NONE,
+				  NONE,
+				  TRACK(METADATA_INT, length, TRACK_XML_LENGTH) } },
+	{ "album",		{ NONE,
+				  NONE,
+				  TRACK(METADATA_STRING, album, TRACK_XML_ALBUM) } },
+	{ "album-id",		{ NONE,
+				  NONE,
+				  TRACK(METADATA_ID, album_id, TRACK_XML_ALBUM_ID) } },
+	{ "album-artist",	{ NONE,
+				  NONE,
+				  TRACK(METADATA_STRING, album_artist, TRACK_XML_ALBUM_ARTIST) } },
+	{ "album-artist-id",	{ NONE,
+				  NONE,
+				  TRACK(METADATA_ID, album_artist_id, TRACK_XML_ALBUM_ARTIST_ID) } },
+
+	/*
+	 * Multiple files might be listed, all with different bit rates
+	 * Zero 'file' elements indicates the file is not available.
+	 *
+	 * Example:
+	 * <files>
+	 *   <file id="cfe68177e9eb9526b7b441f6147d1c5a9a07ca62" format="Ogg Vorbis,160000,1,32,4"/>
+	 *   <file id="bf1314d9814795f64a995c6dc8a9b6cc12b952d6" format="Ogg Vorbis,96000,1,32,4"/>
+	 * </files>
+	 *
+	 */
+	{ "file",		{ NONE,
+				  NONE,
+				  FIELD(METADATA_FILE, 2, struct track_xml, file_id, 0) } },
+	{ "restriction",	{ NONE,
+				  FIELD(METADATA_COUNTRIES, 2, struct album_xml, restriction, 0),
+				  FIELD(METADATA_COUNTRIES, 2, struct track_xml, restriction, 0) } }
+};
+
+/*
+ * Perfect hash of the names in metadata_elements[]
+ * A name hashes to the slot holding its row number plus one, zero means no
+ * row. With any other name, the one strcmp() against the row found fails.
+ *
+ */
+#define METADATA_HASH(name, len) \
+	(((len) + 2 * (unsigned char)(name)[0] + 3 * (unsigned char)(name)[(len) - 1]) & 63)
+
+static const unsigned char metadata_slots[64] = {
+	 1,  0,  0,  0,  0,  0,  0,  0,  9,  0,  0,  0,  3,  0, 14,  2,
+	 0,  0,  0,  0,  0, 12, 13,  0,  0,  0,  0,  0, 10,  0,  0,  0,
+	 0,  5,  0,  0,  7,  0,  0,  0,  0,  0, 16,  0,  0,  0, 11,  0,
+	 0,  0,  0,  0,  0,  0, 15,  6,  0, 19,  0,  4,  8, 17,  0, 18
+};
+
+
+/* Records start with their 'found' bits and the arena they allocate from */
+struct metadata_record {
+	unsigned int found;
+	struct arena *arena;
+};
+
+#define metadata_arena(record)	(((struct metadata_record *)(record))->arena)
+
+static const struct metadata_field *metadata_field(int column, int depth, const char *name);
+static void metadata_start(void *record, int column, int depth, const char *name, const char **attrs);
+static void metadata_end(void *record, int column, int depth, const char *name, char *text);
+static void metadata_set_string(struct arena *arena, char **str, const char *text);
+static void metadata_restriction(struct arena *arena, struct restriction_xml *restriction, const char **attrs);
+static struct artist_xml *metadata_artist(struct arena *arena, struct artist_list_xml *list, int index);
+
+
+void artist_xml_init(struct artist_xml *artist, struct arena *arena) {
+	artist->found = 0;
+	artist->arena = arena;
+	artist->name = NULL;
+}
+
+
+void artist_xml_end(struct artist_xml *artist, int depth, const char *name, char *text) {
+	metadata_end(artist, METADATA_ARTIST, depth, name, text);
+}
+
+
+void artist_xml_free(struct artist_xml *artist) {
+	artist_xml_init(artist, artist->arena);
+}
+
+
+void album_xml_init(struct album_xml *album, struct arena *arena, const char *country) {
+	album->found = 0;
+	album->arena = arena;
+
+	album->name = NULL;
+	album->year = 0;
+	album->type = SP_ALBUMTYPE_UNKNOWN;
+
+	album->restriction.country = country;
+	album->restriction.allowed_countries = NULL;
+	album->restriction.restricted_countries = NULL;
+	album->restriction.is_available = 0;
+
+	album->artist_list.artists = NULL;
+	album->artist_list.num_artists = 0;
+	album->artist_list.num_ids = 0;
+	album->artist_list.num_names = 0;
+	album->artist_name = NULL;
+}
+
+
+void album_xml_start(struct album_xml *album, int depth, const char *name, const char **attrs) {
+	metadata_start(album, METADATA_ALBUM, depth, name, attrs);
+}
+
+
+void album_xml_end(struct album_xml *album, int depth, const char *name, char *text) {
+	metadata_end(album, METADATA_ALBUM, depth, name, text);
+}
+
+
+void album_xml_free(struct album_xml *album) {
+	album_xml_init(album, album->arena, album->restriction.country);
+}
+
+
+void track_xml_init(struct track_xml *track, struct arena *arena, const char *country) {
+	track->found = 0;
+	track->arena = arena;
+
+	track->num_redirects = 0;
+	track->redirects = NULL;
+
+	track->title = NULL;
+	track->has_explicit_lyrics = 0;
+	track->popularity = 0.0;
+	track->length = 0;
+
+	memset(track->file_id, 0, sizeof(track->file_id));
+
+	track->restriction.country = country;
+	track->restriction.allowed_countries = NULL;
+	track->restriction.restricted_countries = NULL;
+	track->restriction.is_available = 0;
+
+	track->artist_list.artists = NULL;
+	track->artist_list.num_artists = 0;
+	track->artist_list.num_ids = 0;
+	track->artist_list.num_names = 0;
+
+	track->album = NULL;
+	track->year = 0;
+	track->album_artist = NULL;
+}
+
+
+void track_xml_start(struct track_xml *track, int depth, const char *name, const char **attrs) {
+	metadata_start(track, METADATA_TRACK, depth, name, attrs);
+}
+
+
+void track_xml_end(struct track_xml *track, int depth, const char *name, char *text) {
+	metadata_end(track, METADATA_TRACK, depth, name, text);
+}
+
+
+void track_xml_free(struct track_xml *track) {
+	track_xml_init(track, track->arena, track->restriction.country);
+}
+
+
+/* The field an element at 'depth' is stored in, or NULL if it's of no interest */
+static const struct metadata_field *metadata_field(int column, int depth, const char *name) {
+	const struct metadata_field *field;
+	size_t len;
+	int row;
+
+	if((len = strlen(name)) == 0)
+		return NULL;
+
+	if((row = metadata_slots[METADATA_HASH(name, len)]) == 0)
+		return NULL;
+
+	field = &metadata_elements[row - 1].fields[column];
+	if(field->type == METADATA_NONE || field->depth != depth)
+		return NULL;
+
+	if(strcmp(metadata_elements[row - 1].name, name))
+		return NULL;
+
+	return field;
+}
+
+
+static void metadata_start(void *record, int column, int depth, const char *name, const char **attrs) {
+	const struct metadata_field *field;
+	struct arena *arena;
+	unsigned char *ptr;
+	const char *format, *id;
+
+	if((field = metadata_field(column, depth, name)) == NULL)
+		return;
+
+	arena = metadata_arena(record);
+	ptr = (unsigned char *)record + field->offset;
+	switch(field->type) {
+		case METADATA_FILE:
+			/* XXX - Only care about 160kbit/s files for now */
+			format = xml_attr(attrs, "format");
+			if(format == NULL || !strstr(format, "160000"))
+				break;
+
+			if((id = xml_attr(attrs, "id")) != NULL)
+				hex_ascii_to_bytes(id, ptr, field->size);
+			break;
+
+		case METADATA_COUNTRIES:
+			metadata_restriction(arena, (struct restriction_xml *)ptr, attrs);
+			break;
+	}
+}
+
+
+static void metadata_end(void *record, int column, int depth, const char *name, char *text) {
+	const struct metadata_field *field;
+	struct artist_list_xml *list;
+	struct artist_xml *artist;
+	struct arena *arena;
+	unsigned char (**redirects)[16];
+	unsigned char *ptr;
+	unsigned int *found;
+	int *count;
+
+	if((field = metadata_field(column, depth, name)) == NULL)
+		return;
+
+	found = &((struct metadata_record *)record)->found;
+	arena = metadata_arena(record);
+	ptr = (unsigned char *)record + field->offset;
+
+	switch(field->type) {
+		case METADATA_ID:
+			if(hex_ascii_to_bytes(text, ptr, field->size))
+				*found |= field->flag;
+			break;
+
+		case METADATA_STRING:
+			metadata_set_string(arena, (char **)ptr, text);
+			*found |= field->flag;
+			break;
+
+		case METADATA_INT:
+			/* Might be empty, i.e '<year/>' */
+			*(int *)ptr = atoi(text);
+			*found |= field->flag;
+			break;
+
+		case METADATA_DOUBLE:
+			*(double *)ptr = strtod(text, NULL);
+			*found |= field->flag;
+			break;
+
+		case METADATA_BOOL:
+#ifdef _WIN32
+			if(!stricmp(text, "true"))
+#else
+			if(!strcasecmp(text, "true"))
+#endif
+				*(int *)ptr = 1;
+			break;
+
+		case METADATA_ALBUM_TYPE:
+			if(!strcmp(text, "album"))
+				*(sp_albumtype *)ptr = SP_ALBUMTYPE_ALBUM;
+			else if(!strcmp(text, "single"))
+				*(sp_albumtype *)ptr = SP_ALBUMTYPE_SINGLE;
+			else if(!strcmp(text, "compilation"))
+				*(sp_albumtype *)ptr = SP_ALBUMTYPE_COMPILATION;
+			else
+				*(sp_albumtype *)ptr = SP_ALBUMTYPE_UNKNOWN;
+
+			*found |= field->flag;
+			break;
+
+		case METADATA_ARTIST_ID:
+			list = (struct artist_list_xml *)ptr;
+			artist = metadata_artist(arena, list, list->num_ids++);
+			if(hex_ascii_to_bytes(text, artist->id, sizeof(artist->id)))
+				artist->found |= ARTIST_XML_ID;
+			break;
+
+		case METADATA_ARTIST_NAME:
+			list = (struct artist_list_xml *)ptr;
+			artist = metadata_artist(arena, list, list->num_names++);
+			metadata_set_string(arena, &artist->name, text);
+			artist->found |= ARTIST_XML_NAME;
+			break;
+
+		case METADATA_REDIRECT:
+			redirects = (unsigned char (**)[16])ptr;
+			count = (int *)((unsigned char *)record + field->count);
+
+			*redirects = arena_realloc(arena, *redirects, field->size * *count, field->size * (*count + 1));
+			if(hex_ascii_to_bytes(text, (*redirects)[*count], field->size))
+				(*count)++;
+			break;
+	}
+}
+
+
+static void metadata_set_string(struct arena *arena, char **str, const char *text) {
+	*str = arena_strdup(arena, text);
+}
+
+
+/* There might be restrictions that do not apply for premium users */
+static void metadata_restriction(struct arena *arena, struct restriction_xml *restriction, const char **attrs) {
+	const char *str;
+
+	str = xml_attr(attrs, "catalogues");
+	if(!str || !strstr(str, "premium"))
+		return;
+
+	if((str = xml_attr(attrs, "allowed")) != NULL) {
+		metadata_set_string(arena, &restriction->allowed_countries, str);
+
+		if(strstr(str, restriction->country))
+			restriction->is_available = 1;
+	}
+
+	if((str = xml_attr(attrs, "forbidden")) != NULL) {
+		metadata_set_string(arena, &restriction->restricted_countries, str);
+
+		restriction->is_available = strstr(str, restriction->country) == NULL;
+	}
+}
+
+
+/* The artist at 'index' in a track's or album's list, added if it's not there yet */
+static struct artist_xml *metadata_artist(struct arena *arena, struct artist_list_xml *list, int index) {
+	while(list->num_artists <= index) {
+		list->artists = arena_realloc(arena, list->artists, sizeof(struct artist_xml) * list->num_artists,
+				sizeof(struct artist_xml) * (list->num_artists + 1));
+		artist_xml_init(&list->artists[list->num_artists++], arena);
+	}
+
+	return &list->artists[index];
+}
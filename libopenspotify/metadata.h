@@ -0,0 +1,146 @@
+/*
+ * Tracks, albums and artists collected from XML as it's parsed, see metadata.c
+ *
+ */
+
+#ifndef LIBOPENSPOTIFY_METADATA_H
+#define LIBOPENSPOTIFY_METADATA_H
+
+#include <spotify/api.h>
+
+#include "arena.h"
+
+
+/* Bits in artist_xml.found */
+#define ARTIST_XML_ID			(1 << 0)
+#define ARTIST_XML_NAME			(1 << 1)
+
+/*
+ * An 'artist' element, or an 'artist-id' element and the 'artist'
+ * element (the name) that goes with it in a track or album
+ *
+ */
+struct artist_xml {
+	unsigned int found;
+
+	/* Text and lists are allocated from this */
+	struct arena *arena;
+
+	unsigned char id[16];
+	char *name;
+};
+
+/* Paired up in the order the 'artist-id' and 'artist' elements come */
+struct artist_list_xml {
+	struct artist_xml *artists;
+	int num_artists;
+	int num_ids;
+	int num_names;
+};
+
+/* From the restrictions that apply to premium users */
+struct restriction_xml {
+	/* The country the lists are checked against */
+	const char *country;
+
+	char *allowed_countries;
+	char *restricted_countries;
+	int is_available;
+};
+
+
+/* Bits in album_xml.found */
+#define ALBUM_XML_ID			(1 << 0)
+#define ALBUM_XML_NAME			(1 << 1)
+#define ALBUM_XML_YEAR			(1 << 2)
+#define ALBUM_XML_TYPE			(1 << 3)
+#define ALBUM_XML_ARTIST_NAME		(1 << 4)
+#define ALBUM_XML_COVER			(1 << 5)
+
+/* An 'album' element returned by album, artist and search browsing */
+struct album_xml {
+	unsigned int found;
+	struct arena *arena;
+
+	unsigned char id[16];
+	char *name;
+	int year;
+	sp_albumtype type;
+	unsigned char cover[20];
+
+	struct restriction_xml restriction;
+
+	/* Search replies have 'artist-name' instead */
+	struct artist_list_xml artist_list;
+	char *artist_name;
+};
+
+
+/* Bits in track_xml.found */
+#define TRACK_XML_ID			(1 << 0)
+#define TRACK_XML_TITLE			(1 << 1)
+#define TRACK_XML_POPULARITY		(1 << 2)
+#define TRACK_XML_LENGTH		(1 << 3)
+#define TRACK_XML_ALBUM_ID		(1 << 4)
+#define TRACK_XML_ALBUM			(1 << 5)
+#define TRACK_XML_YEAR			(1 << 6)
+#define TRACK_XML_ALBUM_ARTIST_ID	(1 << 7)
+#define TRACK_XML_ALBUM_ARTIST		(1 << 8)
+#define TRACK_XML_COVER			(1 << 9)
+
+/* A 'track' element, along with what it says about the track's album */
+struct track_xml {
+	unsigned int found;
+	struct arena *arena;
+
+	unsigned char id[16];
+	int num_redirects;
+	unsigned char (*redirects)[16];
+
+	char *title;
+	int has_explicit_lyrics;
+	double popularity;
+	int length;
+
+	/* The 160 kbit/s file, all zeros if there's none */
+	unsigned char file_id[20];
+
+	struct restriction_xml restriction;
+	struct artist_list_xml artist_list;
+
+	unsigned char album_id[16];
+	char *album;
+	int year;
+	unsigned char album_artist_id[16];
+	char *album_artist;
+	unsigned char cover[20];
+};
+
+
+/*
+ * The *_start() and *_end() functions are given the elements inside the
+ * object's element as they open and close, 'depth' is 1 for its children.
+ * *_init() sets up an empty record, *_free() leaves it empty for the next
+ * element of its kind. What it held stays in the arena until the response
+ * has been handled.
+ *
+ * Each record starts with its 'found' bits, which metadata.c sets as the
+ * fields listed in its element table are filled in, and the arena its
+ * text and lists are allocated from.
+ *
+ */
+void artist_xml_init(struct artist_xml *artist, struct arena *arena);
+void artist_xml_end(struct artist_xml *artist, int depth, const char *name, char *text);
+void artist_xml_free(struct artist_xml *artist);
+
+void album_xml_init(struct album_xml *album, struct arena *arena, const char *country);
+void album_xml_start(struct album_xml *album, int depth, const char *name, const char **attrs);
+void album_xml_end(struct album_xml *album, int depth, const char *name, char *text);
+void album_xml_free(struct album_xml *album);
+
+void track_xml_init(struct track_xml *track, struct arena *arena, const char *country);
+void track_xml_start(struct track_xml *track, int depth, const char *name, const char **attrs);
+void track_xml_end(struct track_xml *track, int depth, const char *name, char *text);
+void track_xml_free(struct track_xml *track);
+
+#endif
@@ -3,13 +3,16 @@
  *
  */
 
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #ifdef _WIN32
 #include <ws2tcpip.h>
 #else
 #include <unistd.h>
 #include <sys/select.h>
+#include <sys/socket.h>
 #include <time.h>
 #endif
 #include <assert.h>
@@ -21,21 +24,54 @@
 #include "util.h"
 
 
+/*
+ * Forget any buffered data, called when a new connection is set up
+ *
+ */
+void packet_reset(sp_session *session) {
+	session->recv_head = 0;
+	session->recv_tail = 0;
+	session->recv_payload_len = -1;
+
+	session->send_head = 0;
+	session->send_tail = 0;
+}
+
+
+/*
+ * Read and process zero or more packets
+ *
+ * On Linux the iothread's epoll loop only calls us once the socket
+ * is readable. Elsewhere we sleep up to 64ms waiting for data.
+ *
+ * Data is received into a fixed-size buffer and packets are decrypted
+ * in place, so handle_packet() gets a view into the buffer and nothing
+ * is allocated or copied per packet. A packet always starts at least
+ * PACKET_MAX_SIZE bytes before the end of the buffer so it's contiguous:
+ * once the first unprocessed byte gets closer to the end, the trailing
+ * partial packet is moved to the front of the buffer.
+ *
+ */
 int packet_read_and_process(sp_session *session) {
+#ifndef __linux__
 	fd_set rfds;
 	struct timeval tv;
+#endif
 	int ret;
-	struct buf *packet;
-	PHEADER header;
+	unsigned char *packet;
 	unsigned char nonce[4];
 
 
-	if(session->packet == NULL)
-		session->packet = buf_new();
-	else if(session->packet->len == session->packet->size)
-		buf_extend(session->packet, session->packet->size);
+	if(session->recv_buf == NULL) {
+		session->recv_buf = (unsigned char *)malloc(PACKET_RECV_BUFFER_SIZE);
+		if(session->recv_buf == NULL)
+			return -1;
+
+		packet_reset(session);
+	}
 
 
+#ifndef __linux__
 	FD_ZERO(&rfds);
 	FD_SET(session->sock, &rfds);
 	
@@ -45,71 +81,132 @@ int packet_read_and_process(sp_session *session) {
 	ret = select(session->sock + 1, &rfds, NULL, NULL, &tv);
 	if(ret <= 0)
 		return ret;
+#endif
 
 
 	ret = recv(session->sock,
-			session->packet->ptr + session->packet->len, 
-			session->packet->size - session->packet->len, 0);
+			session->recv_buf + session->recv_tail,
+			PACKET_RECV_BUFFER_SIZE - session->recv_tail, 0);
+#ifdef __linux__
+	/* Spurious wakeup, the socket is non-blocking */
+	if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return 0;
+#endif
 	if(ret <= 0)
 		return -1;
 
 
-	/* We need a complete packet header of three bytes */
-	session->packet->len += ret;
-	while(session->packet->len >= 3) {
+	session->recv_tail += ret;
+	for(;;) {
+		packet = session->recv_buf + session->recv_head;
 
-		/* Set nonce for Shannon */
-		nonce[0] = (session->key_recv_IV >> 24) & 0xff; 
-		nonce[1] = (session->key_recv_IV >> 16) & 0xff; 
-		nonce[2] = (session->key_recv_IV >> 8) & 0xff; 
-		nonce[3] = session->key_recv_IV & 0xff; 
-		shn_nonce(&session->shn_recv, nonce, 4);
+		/* Decrypt the header once we have all three bytes of it */
+		if(session->recv_payload_len == -1) {
+			if(session->recv_tail - session->recv_head < 3)
+				break;
 
+			/* Set nonce for Shannon */
+			nonce[0] = (session->key_recv_IV >> 24) & 0xff; 
+			nonce[1] = (session->key_recv_IV >> 16) & 0xff; 
+			nonce[2] = (session->key_recv_IV >> 8) & 0xff; 
+			nonce[3] = session->key_recv_IV & 0xff; 
+			shn_nonce(&session->shn_recv, nonce, 4);
 
-		/* Decrypt the packet header */
-		memcpy(&header, session->packet->ptr, 3);
-		shn_decrypt(&session->shn_recv, (unsigned char *)&header, 3);
+			shn_decrypt(&session->shn_recv, packet, 3);
+			session->recv_payload_len = (packet[1] << 8) | packet[2];
+		}
 
 
 		/* Make sure we have the entire payload aswell as the MAC */
-		header.len = ntohs(header.len);
 		DSFYDEBUG("%d bytes buffered, header.cmd=0x%02x, header.len=%d\n",
-			session->packet->len, header.cmd, header.len);
-		if(session->packet->len < 3 + header.len + 4)
+			session->recv_tail - session->recv_head, packet[0], session->recv_payload_len);
+		if(session->recv_tail - session->recv_head < 3 + session->recv_payload_len + 4)
 			break;
 
 
-		/* Extract the full packet, leaving eventual additional data as is */
-		packet = buf_consume(session->packet, 3 + header.len + 4);
-
-
-		/* Copy back the decrypted header and decrypt the payload */
-		memcpy(packet->ptr, &header, 3);
-		shn_decrypt(&session->shn_recv, packet->ptr + 3, header.len);
+		/* Decrypt the payload in place */
+		shn_decrypt(&session->shn_recv, packet + 3, session->recv_payload_len);
 
 
 		/* Increment receiving IV */
 		session->key_recv_IV++;
 
 
-		if(handle_packet(session, header.cmd, packet->ptr + 3, header.len)) {
+		session->recv_head += 3 + session->recv_payload_len + 4;
+		ret = handle_packet(session, packet[0], packet + 3, session->recv_payload_len);
+		session->recv_payload_len = -1;
+
+		if(ret) {
 			DSFYDEBUG("handle_packet() failed with an error\n");
 			return -1;
 		}
 	}
 
 
+	/* Keep room for a full packet after the first unprocessed byte */
+	if(session->recv_head == session->recv_tail)
+		session->recv_head = session->recv_tail = 0;
+	else if(PACKET_RECV_BUFFER_SIZE - session->recv_head < PACKET_MAX_SIZE) {
+		memmove(session->recv_buf, session->recv_buf + session->recv_head,
+			session->recv_tail - session->recv_head);
+		session->recv_tail -= session->recv_head;
+		session->recv_head = 0;
+	}
+
+
 	return 0;
 }
 
 
+/*
+ * Queue a packet for sending
+ *
+ * The packet is encrypted straight into the send buffer and goes out
+ * with the next packet_flush(), together with any other packets queued
+ * in the meantime. Nothing here touches the socket so the iothread
+ * never blocks on a slow uplink. If the uplink stalls long enough for
+ * the buffer to fill up we grow it rather than block or drop packets.
+ *
+ */
 int packet_write (sp_session * session, unsigned char cmd,
 		  unsigned char *payload, unsigned short len)
 {
 	unsigned char nonce[4];
 	unsigned char *buf, *ptr;
 	PHEADER *h;
-	int ret;
+	int size;
+
+	if(session->send_buf == NULL) {
+		session->send_buf = (unsigned char *)malloc(PACKET_SEND_BUFFER_SIZE);
+		if(session->send_buf == NULL)
+			return -1;
+
+		session->send_size = PACKET_SEND_BUFFER_SIZE;
+		session->send_head = session->send_tail = 0;
+	}
+
+
+	/* Make room for the packet at the end of the buffer */
+	size = 3 + len + 4;
+	if(session->send_size - session->send_tail < size && session->send_head > 0) {
+		memmove(session->send_buf, session->send_buf + session->send_head,
+			session->send_tail - session->send_head);
+		session->send_tail -= session->send_head;
+		session->send_head = 0;
+	}
+
+	if(session->send_size - session->send_tail < size) {
+		DSFYDEBUG("Send buffer full with %d bytes queued, growing it to %d bytes\n",
+			session->send_tail, 2 * session->send_size);
+
+		buf = (unsigned char *)realloc(session->send_buf, 2 * session->send_size);
+		if(buf == NULL)
+			return -1;
+
+		session->send_buf = buf;
+		session->send_size *= 2;
+	}
+
 
 	nonce[0] = (session->key_send_IV >> 24) & 0xff; 
 	nonce[1] = (session->key_send_IV >> 16) & 0xff; 
@@ -117,7 +214,7 @@ int packet_write (sp_session * session, unsigned char cmd,
 	nonce[3] = session->key_send_IV & 0xff; 
 	shn_nonce (&session->shn_send, nonce, 4);
 
-	buf = (unsigned char *) malloc (3 + len + 4);
+	buf = session->send_buf + session->send_tail;
 
 	h = (PHEADER *) buf;
 	h->cmd = cmd;
@@ -129,7 +226,7 @@ int packet_write (sp_session * session, unsigned char cmd,
  		memcpy (ptr, payload, len);
 	}
 	
-	DSFYDEBUG("Sending packet with command 0x%02x, length %d, IV=%d\n",
+	DSFYDEBUG("Queueing packet with command 0x%02x, length %d, IV=%d\n",
 		 h->cmd, ntohs (h->len), session->key_send_IV);
 
 	shn_encrypt (&session->shn_send, buf, 3 + len);
@@ -137,18 +234,60 @@ int packet_write (sp_session * session, unsigned char cmd,
 
 	shn_finish (&session->shn_send, ptr, 4);
 
-	ret = block_write (session->sock, buf, 3 + len + 4);
+	session->send_tail += size;
+	session->key_send_IV++;
 
-	free(buf);
+	return 0;
+}
 
-	session->key_send_IV++;
 
+/*
+ * Write as much of the send buffer as the socket will take
+ *
+ * Since queued packets are contiguous in the buffer a single send()
+ * covers all of them. Whatever the socket doesn't accept is kept for
+ * the next call; on Linux the iothread then waits for the socket to
+ * become writable, elsewhere it retries on the next pass.
+ *
+ * Returns 0 on success (including a partial write) and -1 if the
+ * connection failed
+ *
+ */
+int packet_flush(sp_session *session) {
+	int ret, flags;
 
-	if(ret != 3 + len + 4) {
-		DSFYDEBUG ("block_write() only wrote %d of %d bytes\n", ret,
-			   3 + len + 4);
-		return -1;
+	flags = 0;
+#ifdef MSG_NOSIGNAL
+	/* Report a closed connection as EPIPE instead of raising SIGPIPE */
+	flags |= MSG_NOSIGNAL;
+#endif
+
+	while(session->send_head < session->send_tail) {
+		ret = send(session->sock,
+				(const char *)session->send_buf + session->send_head,
+				session->send_tail - session->send_head, flags);
+		if(ret < 0) {
+#ifdef _WIN32
+			if(WSAGetLastError() == WSAEWOULDBLOCK)
+				return 0;
+#else
+			if(errno == EINTR)
+				continue;
+			else if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+#endif
+
+			DSFYDEBUG("send() failed with %d bytes queued, errno %d\n",
+				session->send_tail - session->send_head, errno);
+			return -1;
+		}
+
+		DSFYDEBUG("Sent %d of %d queued bytes\n",
+			ret, session->send_tail - session->send_head);
+		session->send_head += ret;
 	}
 
+	session->send_head = session->send_tail = 0;
+
 	return 0;
 }
@@ -31,6 +31,19 @@ struct packet_header
 typedef struct packet_header PHEADER;
 
 
+/* Largest possible packet: header, 64kB payload and MAC */
+#define PACKET_MAX_SIZE		(3 + 65535 + 4)
+
+/* Receive buffer, see packet_read_and_process() */
+#define PACKET_RECV_BUFFER_SIZE	(4 * PACKET_MAX_SIZE)
+
+/* Initial size of the send buffer, see packet_write() */
+#define PACKET_SEND_BUFFER_SIZE	(4 * PACKET_MAX_SIZE)
+
+
+void packet_reset(sp_session *session);
+
 int packet_read_and_process(sp_session *session);
 int packet_write (sp_session *, unsigned char, unsigned char *, unsigned short);
+int packet_flush(sp_session *session);
 #endif
@@ -0,0 +1,344 @@
+/*
+ * Worker threads for inflating and parsing replies
+ *
+ * A large reply, such as an artist browse, takes long enough to inflate
+ * and parse that packets pile up on the socket while the networking
+ * thread is busy with it, and audio data and pings are late. Replies
+ * are therefore collected as they arrive and handed to the pool when
+ * the channel ends. A worker runs the job's work callback and queues
+ * the job for the networking thread, which runs its done callback on
+ * its next pass through the main loop. Only the done callbacks touch
+ * the session, so the hashtables and the objects in them are still
+ * only changed by the networking thread. See xmlreply.c for the job
+ * that parses a reply.
+ *
+ * Workers are started as jobs come in, up to the pool's limit. With a
+ * limit of 0, or if no worker could be started, parsepool_submit()
+ * fails and the caller does the work itself.
+ *
+ */
+
+#include <stdlib.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include "debug.h"
+#include "parsepool.h"
+#include "request.h"
+
+
+static void parsepool_lock(struct parsepool *pool) {
+#ifdef _WIN32
+	WaitForSingleObject(pool->mutex, INFINITE);
+#else
+	pthread_mutex_lock(&pool->mutex);
+#endif
+}
+
+
+static void parsepool_unlock(struct parsepool *pool) {
+#ifdef _WIN32
+	ReleaseMutex(pool->mutex);
+#else
+	pthread_mutex_unlock(&pool->mutex);
+#endif
+}
+
+
+/* Run queued jobs, sleep while there are none */
+#ifdef _WIN32
+static DWORD WINAPI parsepool_thread(LPVOID arg) {
+#else
+static void *parsepool_thread(void *arg) {
+#endif
+	struct parsepool *pool = (struct parsepool *)arg;
+	struct parsepool_job *job;
+
+	parsepool_lock(pool);
+	while(!pool->done) {
+		if((job = pool->queue_head) == NULL) {
+			pool->num_idle++;
+#ifdef _WIN32
+			parsepool_unlock(pool);
+			WaitForSingleObject(pool->wakeup, INFINITE);
+			parsepool_lock(pool);
+#else
+			pthread_cond_wait(&pool->wakeup, &pool->mutex);
+#endif
+			pool->num_idle--;
+			continue;
+		}
+
+		pool->queue_head = job->next;
+		if(pool->queue_head == NULL)
+			pool->queue_tail = NULL;
+
+		parsepool_unlock(pool);
+		job->ret = job->work(job->arg);
+		parsepool_lock(pool);
+
+		job->next = NULL;
+		if(pool->finished_tail)
+			pool->finished_tail->next = job;
+		else
+			pool->finished_head = job;
+
+		pool->finished_tail = job;
+		pool->num_jobs++;
+
+		/* Have the networking thread run the done callback */
+		parsepool_unlock(pool);
+		request_wakeup_iothread(pool->session);
+		parsepool_lock(pool);
+	}
+	parsepool_unlock(pool);
+
+#ifdef _WIN32
+	return 0;
+#else
+	return NULL;
+#endif
+}
+
+
+/* Start another worker, called with the mutex held */
+static int parsepool_start_thread(struct parsepool *pool) {
+#ifdef _WIN32
+	HANDLE thread;
+
+	if((thread = CreateThread(NULL, 0, parsepool_thread, pool, 0, NULL)) == NULL)
+		return -1;
+
+	pool->threads[pool->num_threads++] = thread;
+#else
+	if(pthread_create(&pool->threads[pool->num_threads], NULL, parsepool_thread, pool))
+		return -1;
+
+	pool->num_threads++;
+#endif
+
+	DSFYDEBUG("Started parse worker %d of at most %d\n", pool->num_threads, pool->limit);
+
+	return 0;
+}
+
+
+struct parsepool *parsepool_create(sp_session *session, int limit) {
+	struct parsepool *pool;
+
+	if((pool = malloc(sizeof(struct parsepool))) == NULL)
+		return NULL;
+
+	pool->session = session;
+	pool->limit = 0;
+	parsepool_set_limit(pool, limit);
+
+	pool->queue_head = NULL;
+	pool->queue_tail = NULL;
+	pool->finished_head = NULL;
+	pool->finished_tail = NULL;
+	pool->num_threads = 0;
+	pool->num_idle = 0;
+	pool->done = 0;
+	pool->num_jobs = 0;
+
+#ifdef _WIN32
+	pool->mutex = CreateMutex(NULL, FALSE, NULL);
+
+	/* A semaphore rather than an event, so every worker can be woken up */
+	pool->wakeup = CreateSemaphore(NULL, 0, 0x7fffffff, NULL);
+#else
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->wakeup, NULL);
+#endif
+
+	return pool;
+}
+
+
+/*
+ * Stop and join the workers, finishing the jobs they're running
+ * Called by sp_session_release() before the networking thread is
+ * terminated, since the workers wake it up.
+ *
+ */
+void parsepool_stop(struct parsepool *pool) {
+	int i;
+
+	parsepool_lock(pool);
+	pool->done = 1;
+#ifdef _WIN32
+	if(pool->num_threads > 0)
+		ReleaseSemaphore(pool->wakeup, pool->num_threads, NULL);
+#else
+	pthread_cond_broadcast(&pool->wakeup);
+#endif
+	parsepool_unlock(pool);
+
+	for(i = 0; i < pool->num_threads; i++) {
+#ifdef _WIN32
+		WaitForSingleObject(pool->threads[i], INFINITE);
+		CloseHandle(pool->threads[i]);
+#else
+		pthread_join(pool->threads[i], NULL);
+#endif
+	}
+
+	/* Jobs submitted from now on are left to the caller */
+	parsepool_lock(pool);
+	pool->num_threads = 0;
+	parsepool_unlock(pool);
+}
+
+
+/*
+ * Free the pool, stopping the workers if that wasn't done already
+ * Jobs the networking thread didn't complete have their done callbacks
+ * called with PARSEPOOL_DROPPED, for freeing what they hold.
+ *
+ */
+void parsepool_release(struct parsepool *pool) {
+	struct parsepool_job *job;
+
+	parsepool_stop(pool);
+
+	while((job = pool->queue_head) != NULL) {
+		pool->queue_head = job->next;
+		job->done(job->arg, PARSEPOOL_DROPPED);
+		free(job);
+	}
+
+	while((job = pool->finished_head) != NULL) {
+		pool->finished_head = job->next;
+		job->done(job->arg, PARSEPOOL_DROPPED);
+		free(job);
+	}
+
+#ifdef _WIN32
+	CloseHandle(pool->wakeup);
+	CloseHandle(pool->mutex);
+#else
+	pthread_cond_destroy(&pool->wakeup);
+	pthread_mutex_destroy(&pool->mutex);
+#endif
+
+	DSFYDEBUG("Parse pool released, %d jobs were run by workers\n", pool->num_jobs);
+
+	free(pool);
+}
+
+
+/*
+ * Takes effect for jobs submitted from now on. Workers that are already
+ * running are kept until the session is released.
+ *
+ */
+void parsepool_set_limit(struct parsepool *pool, int limit) {
+	if(limit < 0)
+		limit = 0;
+	else if(limit > PARSEPOOL_MAX_THREADS)
+		limit = PARSEPOOL_MAX_THREADS;
+
+	pool->limit = limit;
+}
+
+
+/*
+ * Queue a job, starting a worker for it if none is idle
+ * Returns -1 if the job wasn't queued, in which case the caller should
+ * do the work itself. A NULL pool never queues.
+ *
+ */
+int parsepool_submit(struct parsepool *pool, parsepool_work work, parsepool_done done, void *arg) {
+	struct parsepool_job *job;
+
+	if(pool == NULL || pool->limit == 0)
+		return -1;
+
+	if((job = malloc(sizeof(struct parsepool_job))) == NULL)
+		return -1;
+
+	job->work = work;
+	job->done = done;
+	job->arg = arg;
+	job->ret = 0;
+	job->next = NULL;
+
+	parsepool_lock(pool);
+	if(pool->num_idle == 0 && pool->num_threads < pool->limit && !pool->done)
+		parsepool_start_thread(pool);
+
+	if(pool->num_threads == 0) {
+		parsepool_unlock(pool);
+		free(job);
+
+		return -1;
+	}
+
+	if(pool->queue_tail)
+		pool->queue_tail->next = job;
+	else
+		pool->queue_head = job;
+
+	pool->queue_tail = job;
+
+#ifdef _WIN32
+	ReleaseSemaphore(pool->wakeup, 1, NULL);
+#else
+	pthread_cond_signal(&pool->wakeup);
+#endif
+	parsepool_unlock(pool);
+
+	return 0;
+}
+
+
+/*
+ * For the iothread: Run the done callbacks of the jobs the workers have
+ * finished. Returns the number of jobs completed.
+ *
+ */
+int parsepool_complete(struct parsepool *pool) {
+	struct parsepool_job *job, *next;
+	int n = 0;
+
+	if(pool == NULL)
+		return 0;
+
+	parsepool_lock(pool);
+	job = pool->finished_head;
+	pool->finished_head = NULL;
+	pool->finished_tail = NULL;
+	parsepool_unlock(pool);
+
+	for(; job != NULL; job = next) {
+		next = job->next;
+		job->done(job->arg, job->ret);
+		free(job);
+		n++;
+	}
+
+	return n;
+}
+
+
+/*
+ * For the iothread: Check whether there are jobs to complete
+ * Called with request_mutex held before sleeping, see iothread.c
+ *
+ */
+int parsepool_has_finished(struct parsepool *pool) {
+	int finished;
+
+	if(pool == NULL)
+		return 0;
+
+	parsepool_lock(pool);
+	finished = pool->finished_head != NULL;
+	parsepool_unlock(pool);
+
+	return finished;
+}
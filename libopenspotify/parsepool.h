@@ -0,0 +1,81 @@
+/*
+ * Worker threads for inflating and parsing replies, see parsepool.c
+ *
+ */
+
+#ifndef LIBOPENSPOTIFY_PARSEPOOL_H
+#define LIBOPENSPOTIFY_PARSEPOOL_H
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include <spotify/api.h>
+
+/* Workers used unless changed with opensp_session_set_parse_threads() */
+#define PARSEPOOL_THREADS	2
+
+/* Upper limit on the number of workers */
+#define PARSEPOOL_MAX_THREADS	8
+
+/* Passed to a job's done callback when the pool is released before it ran */
+#define PARSEPOOL_DROPPED	-2
+
+/*
+ * A job's work callback runs on a worker and must leave the session
+ * alone. Its return value is passed to the done callback, which runs on
+ * the networking thread.
+ *
+ */
+typedef int (*parsepool_work)(void *arg);
+typedef void (*parsepool_done)(void *arg, int ret);
+
+struct parsepool_job {
+	parsepool_work work;
+	parsepool_done done;
+	void *arg;
+	int ret;
+
+	struct parsepool_job *next;
+};
+
+struct parsepool {
+	sp_session *session;
+
+	/* Workers to start at most, 0 to parse on the networking thread */
+	volatile int limit;
+
+	/* Protected by the mutex */
+	struct parsepool_job *queue_head;
+	struct parsepool_job *queue_tail;
+	struct parsepool_job *finished_head;
+	struct parsepool_job *finished_tail;
+	int num_threads;
+	int num_idle;
+	int done;
+
+	/* Jobs run by the workers since the pool was created */
+	int num_jobs;
+
+#ifdef _WIN32
+	HANDLE mutex;
+	HANDLE wakeup;
+	HANDLE threads[PARSEPOOL_MAX_THREADS];
+#else
+	pthread_mutex_t mutex;
+	pthread_cond_t wakeup;
+	pthread_t threads[PARSEPOOL_MAX_THREADS];
+#endif
+};
+
+struct parsepool *parsepool_create(sp_session *session, int limit);
+void parsepool_stop(struct parsepool *pool);
+void parsepool_release(struct parsepool *pool);
+void parsepool_set_limit(struct parsepool *pool, int limit);
+int parsepool_submit(struct parsepool *pool, parsepool_work work, parsepool_done done, void *arg);
+int parsepool_complete(struct parsepool *pool);
+int parsepool_has_finished(struct parsepool *pool);
+
+#endif
@@ -13,7 +13,7 @@
 #include <spotify/api.h>
 #include <vorbis/vorbisfile.h>
 
-#include "aes.h"
+#include "aesctr.h"
 #include "buf.h"
 #include "channel.h"
 #include "commands.h"
@@ -419,7 +419,7 @@ static int player_schedule(sp_session *session) {
 			memcpy(player->key, item->data, item->len);
 
 			/* Expand file key */
-			rijndaelKeySetupEnc (player->aes.state, player->key, 128);
+			aes_ctr_key(&player->aes, player->key);
 
 
 			/*
@@ -633,13 +633,11 @@ static size_t player_ov_read(void *dest, size_t size, size_t nmemb, void *privat
 	size_t request_offset;
 	void *data;
 	size_t bytes_to_consume, previous_bytes;
+	size_t remaining, len;
 	int did_download;
 	struct player_substream_ctx *psc;
 
-	int i, j;
-	int block;
 	unsigned char *plaintext;
-	unsigned char *ciphertext, *w, *x, *y, *z;
 	int do_spotify_header = 0;
 
 
@@ -744,56 +742,29 @@ static size_t player_ov_read(void *dest, size_t size, size_t nmemb, void *privat
 	player_seek_counter(player);
 
 
-	/* Load data from the rbuf */
-	data = malloc(bytes_to_consume);
-	if(data == NULL)
-		return 0;
-
-	rbuf_read(player->ogg, data, bytes_to_consume);
-
-
-	/* Decrypt each 1024 byte block */
+	/*
+	 * Deinterleave and decrypt straight from the rbuf's regions into
+	 * libvorbis' buffer. The reader is at a region boundary and both
+	 * regions and bytes_to_consume are multiples of the 1024 byte blocks.
+	 *
+	 */
 	plaintext = dest;
-	for (block = 0; block < bytes_to_consume / 1024; block++) {
-
-		/* Deinterleave the 4x256 byte blocks */
-		ciphertext = plaintext + block * 1024;
-		w = (unsigned char *)data + block * 1024 + 0 * 256;
-		x = (unsigned char *)data + block * 1024 + 1 * 256;
-		y = (unsigned char *)data + block * 1024 + 2 * 256;
-		z = (unsigned char *)data + block * 1024 + 3 * 256;
-
-		for (i = 0; i < 1024 && (block * 1024 + i) < bytes_to_consume; i += 4) {
-			*ciphertext++ = *w++;
-			*ciphertext++ = *x++;
-			*ciphertext++ = *y++;
-			*ciphertext++ = *z++;
-		}
-
+	remaining = bytes_to_consume;
+	while(remaining) {
+		len = rbuf_peek(player->ogg, &data);
+		if(len > remaining)
+			len = remaining;
 
-		/* Decrypt 1024 bytes block. This will fail for the last block. */
-		for (i = 0; i < 1024 && (block * 1024 + i) < bytes_to_consume; i += 16) {
+		len &= ~1023;
+		assert(len > 0);
 
-			/* Produce 16 bytes of keystream from the counter */
-			rijndaelEncrypt(player->aes.state, 10,
-							player->aes.counter,
-							player->aes.keystream);
-
-			/* Increment counter */
-			for (j = 15; j >= 0; j--) {
-				player->aes.counter[j] += 1;
-				if (player->aes.counter[j] != 0)
-					break;
-			}
+		aes_ctr_xor_interleaved(&player->aes, plaintext, data, len);
+		rbuf_seek_reader(player->ogg, len, SEEK_CUR);
 
-			/* Produce plaintext by XORing ciphertext with keystream */
-			for (j = 0; j < 16; j++)
-				plaintext[block * 1024 + i + j] ^= player->aes.keystream[j];
-		}
+		plaintext += len;
+		remaining -= len;
 	}
 
-	free(data);
-
 
 	/*
 	 * If we had to request the beginning of the block
@@ -897,18 +868,9 @@ static int player_deliver_pcm(sp_session *session, int ms) {
  *
  */
 static void player_seek_counter(struct player *player) {
-	int i;
-	size_t pos;
-
 	/* Nonce */
-	memcpy(player->aes.counter, "\x72\xe0\x67\xfb\xdd\xcb\xcf\x77"
-			"\xeb\xe8\xbc\x64\x3f\x63\x0d\x93", 16);
-
-	pos = rbuf_tell(player->ogg) >> 4;
-        for(i = 15; pos; pos >>= 8) {
-                pos += player->aes.counter[i];
-                player->aes.counter[i--] = pos & 0xff;
-        }
+	aes_ctr_seek(&player->aes, (unsigned char *)"\x72\xe0\x67\xfb\xdd\xcb\xcf\x77"
+			"\xeb\xe8\xbc\x64\x3f\x63\x0d\x93", rbuf_tell(player->ogg));
 }
 
 
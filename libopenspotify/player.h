@@ -10,7 +10,7 @@
 #include <spotify/api.h>
 #include <vorbis/vorbisfile.h>
 
-#include "aes.h"
+#include "aesctr.h"
 #include "buf.h"
 #include "channel.h"
 #include "rbuf.h"
@@ -83,11 +83,7 @@ struct player {
 
 
 	/* AES state */
-	struct {
-		unsigned int  state[4 * (10 + 1)];
-		unsigned char counter[16];
-		unsigned char keystream[16];
-	} aes;
+	struct aes_ctr aes;
 
 	/* AES key for this track */
 	unsigned char *key;
@@ -78,6 +78,8 @@ static int playlist_callback(CHANNEL *ch, unsigned char *payload, unsigned short
 static int playlist_parse_xml(sp_session *session, sp_playlist *playlist);
 
 static int osfy_playlist_browse(sp_session *session, sp_playlist *playlist);
+static void osfy_playlist_browse_xml_start(void *arg, int depth, const char *name, const char **attrs);
+static void osfy_playlist_browse_xml_end(void *arg, int depth, const char *name, char *text);
 static int osfy_playlist_browse_callback(struct browse_callback_ctx *brctx);
 
 
@@ -220,7 +222,7 @@ static int playlistcontainer_callback(CHANNEL *ch, unsigned char *payload, unsig
 			ch->name, PLAYLIST_RETRY_TIMEOUT*1000);
 
 		/* Reset timeout so the request can be retried */
-		callback_ctx->req->next_timeout = get_millisecs() + PLAYLIST_RETRY_TIMEOUT*1000;
+		request_set_next_timeout(callback_ctx->session, callback_ctx->req, get_millisecs() + PLAYLIST_RETRY_TIMEOUT*1000);
 
 		buf_free(callback_ctx->session->playlistcontainer->buf);
 		callback_ctx->session->playlistcontainer->buf = NULL;
@@ -466,7 +468,7 @@ static int playlist_callback(CHANNEL *ch, unsigned char *payload, unsigned short
 			ch->name, PLAYLIST_RETRY_TIMEOUT*1000);
 
 		/* Reset timeout so the request is retried */
-		callback_ctx->req->next_timeout = get_millisecs() + PLAYLIST_RETRY_TIMEOUT*1000;
+		request_set_next_timeout(callback_ctx->session, callback_ctx->req, get_millisecs() + PLAYLIST_RETRY_TIMEOUT*1000);
 
 		buf_free(playlist->buf);
 		playlist->buf = NULL;
@@ -621,17 +623,24 @@ int osfy_playlist_browse(sp_session *session, sp_playlist *playlist) {
 	
 	brctx->session = session;
 	brctx->req = NULL; /* Filled in by the request processor */
-	brctx->buf = NULL; /* Filled in by the request processor */
+	brctx->reply = NULL; /* Filled in by the request processor */
 	
 	brctx->type = REQ_TYPE_BROWSE_PLAYLIST_TRACKS;
 	brctx->data.playlist = playlist;
 	brctx->num_total = playlist->num_tracks;
 	brctx->num_browsed = 0;
 	brctx->num_in_request = 0;
+
+	/* Concurrent chunks, see browse_send_chunks() */
+	brctx->num_sent = 0;
+	brctx->num_chunks = 0;
+	brctx->failed_chunks = NULL;
 	
 	
-	/* Our gzip'd XML parser */
+	/* Our XML handlers */
 	brctx->browse_parser = osfy_playlist_browse_callback;
+	brctx->xml_start = osfy_playlist_browse_xml_start;
+	brctx->xml_end = osfy_playlist_browse_xml_end;
 	
 	/* Request input container. Will be free'd when the request is finished. */
 	container = (void **)malloc(sizeof(void *));
@@ -641,106 +650,87 @@ int osfy_playlist_browse(sp_session *session, sp_playlist *playlist) {
 }
 
 
-static int osfy_playlist_browse_callback(struct browse_callback_ctx *brctx) {
-	int i;
-	struct buf *xml;
-	unsigned char id[16];
-	ezxml_t root, track_node, node;
+/* Tracks are at <result><tracks><track> */
+static void osfy_playlist_browse_xml_start(void *arg, int depth, const char *name, const char **attrs) {
+	struct browse_callback_ctx *brctx = (struct browse_callback_ctx *)arg;
+
+	if(depth == 3)
+		track_xml_free(&brctx->track);
+	else if(depth > 3)
+		track_xml_start(&brctx->track, depth - 3, name, attrs);
+}
+
+
+/* Load each track as its element closes */
+static void osfy_playlist_browse_xml_end(void *arg, int depth, const char *name, char *text) {
+	struct browse_callback_ctx *brctx = (struct browse_callback_ctx *)arg;
+	struct track_xml *xml = &brctx->track;
 	sp_track *track;
-	
-	
-	/* Decompress the XML returned by track browsing */
-	xml = despotify_inflate(brctx->buf->ptr, brctx->buf->len);
-#ifdef DEBUG
-	{
-		FILE *fd;
-		char buf[35];
-		char filename[100];
-
-		hex_bytes_to_ascii(brctx->data.playlist->id, buf, 17);
-		sprintf(filename, "browse-playlist-%s-%d-%d.xml", buf, brctx->num_browsed, brctx->num_in_request);
-		DSFYDEBUG("Decompresed %d bytes data for playlist '%s', xml=%p, saving raw XML to %s\n",
-			  brctx->buf->len, buf, xml, filename);
-		fd = fopen(filename, "w");
-		if(fd) {
-			(void)fwrite(xml->ptr, xml->len, 1, fd);
-			fclose(fd);
-		}
-	}
-#endif
-	
+	int i;
 
-	/* Load XML */
-	root = ezxml_parse_str((char *) xml->ptr, xml->len);
-	if(root == NULL) {
-		DSFYDEBUG("Failed to parse XML\n");
-		buf_free(xml);
-		return -1;
+	if(depth > 3) {
+		track_xml_end(xml, depth - 3, name, text);
+		return;
 	}
-	
 
-	/* Loop over each track in the list */
-	for(i = 1, track_node = ezxml_get(root, "tracks", 0, "track", -1);
-	    track_node;
-	    track_node = track_node->next, i++) {
-		
-		/* Get ID of track */
-		node = ezxml_get(track_node, "id", -1);
-		hex_ascii_to_bytes(node->txt, id, 16);
-		
+	if(depth < 3)
+		return;
+
+
+	/* Get ID of track */
+	if(xml->found & TRACK_XML_ID) {
 		/* We'll simply use ofsy_track_add() to find a track by its ID */
-		track = osfy_track_add(brctx->session, id);
+		track = osfy_track_add(brctx->session, xml->id);
 		
 		/* Skip loading of already loaded tracks */
 		if(!sp_track_is_loaded(track)) {
 			/* Load the track from XML */
-			osfy_track_load_from_xml(brctx->session, track, track_node);
+			osfy_track_load_from_xml(brctx->session, track, xml);
 		}
+	}
 
 
-		/*
-		 * FIXME:
-		 * A request for track with id X might return a different track
-		 * (i.e, the 'id' element differs from the id of the track requested)
-		 * with one of the 'redirect' elements set to the requested track's id.
-		 *
-		 * Below is an example where track with id '3c1919e237ca4f2c9b5fc686b7a6f6c3'
-		 * was browsed but a different track returned (a5a43c74af924171a50f0668aee36b43)
-		 * '3c1919e237ca4f2c9b5fc686b7a6f6c3' appears in the redirect element.
-		 *
-		 * <id>a5a43c74af924171a50f0668aee36b43</id>
-		 * <redirect>3c1919e237ca4f2c9b5fc686b7a6f6c3</redirect>
-		 * <redirect>93934b1df8984c6586a63d18cd6ecfa6</redirect>
-		 * <redirect>2e0d3f5a98014c40932a014b2a9eca69</redirect>
-		 * <title>Insane in the Brain</title>
-		 * <artist-id>9e74e7856a07496190ef2180d26003db</artist-id>
-		 * <artist>Cypress Hill</artist>
-		 * <album>Black Sunday</album>
-		 * <album-id>c3711d81999b48529903bf708b8192da</album-id>
-		 * <album-artist>Cypress Hill</album-artist>
-		 * <album-artist-id>9e74e7856a07496190ef2180d26003db</album-artist-id>
-		 * <year>1993</year>
-		 * <track-number>3</track-number>
-		 *
-		 */
-		for(node = ezxml_get(track_node, "redirect", -1); node; node = node->next) {
-			hex_ascii_to_bytes(node->txt, id, 16);
-		
-			/* We'll simply use ofsy_track_add() to find a track by its ID */
-			track = osfy_track_add(brctx->session, id);
-		
-			/* Skip loading of already loaded tracks */
-			if(!sp_track_is_loaded(track)) {
-				/* Load the track from XML */
-				osfy_track_load_from_xml(brctx->session, track, track_node);
-			}
+	/*
+	 * FIXME:
+	 * A request for track with id X might return a different track
+	 * (i.e, the 'id' element differs from the id of the track requested)
+	 * with one of the 'redirect' elements set to the requested track's id.
+	 *
+	 * Below is an example where track with id '3c1919e237ca4f2c9b5fc686b7a6f6c3'
+	 * was browsed but a different track returned (a5a43c74af924171a50f0668aee36b43)
+	 * '3c1919e237ca4f2c9b5fc686b7a6f6c3' appears in the redirect element.
+	 *
+	 * <id>a5a43c74af924171a50f0668aee36b43</id>
+	 * <redirect>3c1919e237ca4f2c9b5fc686b7a6f6c3</redirect>
+	 * <redirect>93934b1df8984c6586a63d18cd6ecfa6</redirect>
+	 * <redirect>2e0d3f5a98014c40932a014b2a9eca69</redirect>
+	 * <title>Insane in the Brain</title>
+	 * <artist-id>9e74e7856a07496190ef2180d26003db</artist-id>
+	 * <artist>Cypress Hill</artist>
+	 * <album>Black Sunday</album>
+	 * <album-id>c3711d81999b48529903bf708b8192da</album-id>
+	 * <album-artist>Cypress Hill</album-artist>
+	 * <album-artist-id>9e74e7856a07496190ef2180d26003db</album-artist-id>
+	 * <year>1993</year>
+	 * <track-number>3</track-number>
+	 *
+	 */
+	for(i = 0; i < xml->num_redirects; i++) {
+		/* We'll simply use ofsy_track_add() to find a track by its ID */
+		track = osfy_track_add(brctx->session, xml->redirects[i]);
+	
+		/* Skip loading of already loaded tracks */
+		if(!sp_track_is_loaded(track)) {
+			/* Load the track from XML */
+			osfy_track_load_from_xml(brctx->session, track, xml);
 		}
 	}
+}
 
-	/* Free XML structures and buffer */
-	ezxml_free(root);
-	buf_free(xml);
 
+static int osfy_playlist_browse_callback(struct browse_callback_ctx *brctx) {
+	int i;
+	
 	
 	/* Release references made in osfy_playlist_browse() */
 	for(i = 0; i < brctx->num_in_request; i++)
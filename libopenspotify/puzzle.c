@@ -0,0 +1,247 @@
+/*
+ * Zero-modulus bruteforce puzzle to prevent
+ * Denial of Service and password bruteforce attacks
+ *
+ * The client has to find 8 bytes that, hashed with SHA-1 after the
+ * server's 16 random bytes, give a digest whose last word XOR'ed with a
+ * magic from the server is zero modulo 2^denominator_bits.
+ *
+ * Candidate number i is splitmix64(seed + i), so a search is a walk over
+ * candidate numbers rather than a PRNG's internal state. The numbers are
+ * handed out to the threads PUZZLE_CHUNK_SIZE at a time, and the solution
+ * with the lowest number wins. That makes the result depend only on the
+ * server's random bytes, the magic and the seed, not on how many threads
+ * took part or how they were scheduled.
+ *
+ * The 24 bytes of input fit in one SHA-1 block, so each candidate costs a
+ * single SHA1Transform() on a block that is padded once up front.
+ *
+ */
+
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "debug.h"
+#include "puzzle.h"
+#include "sha1.h"
+
+
+struct puzzle_search {
+	unsigned char block[64];
+	unsigned int mask;
+	unsigned int magic;
+	unsigned long long seed;
+
+	/* Protected by the mutex */
+	unsigned long long next_chunk;
+	unsigned long long best;
+	unsigned char solution[8];
+
+#ifdef _WIN32
+	HANDLE mutex;
+#else
+	pthread_mutex_t mutex;
+#endif
+};
+
+
+static unsigned long long splitmix64(unsigned long long x) {
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+
+	return x ^ (x >> 31);
+}
+
+
+/* Claim the next chunk of candidates, or return 0 once a solution before it is known */
+static int puzzle_next_chunk(struct puzzle_search *search, unsigned long long *first) {
+	int ret;
+
+#ifdef _WIN32
+	WaitForSingleObject(search->mutex, INFINITE);
+#else
+	pthread_mutex_lock(&search->mutex);
+#endif
+
+	*first = search->next_chunk * PUZZLE_CHUNK_SIZE;
+	ret = *first < search->best;
+	if(ret)
+		search->next_chunk++;
+
+#ifdef _WIN32
+	ReleaseMutex(search->mutex);
+#else
+	pthread_mutex_unlock(&search->mutex);
+#endif
+
+	return ret;
+}
+
+
+static void puzzle_found(struct puzzle_search *search, unsigned long long index, unsigned char *solution) {
+#ifdef _WIN32
+	WaitForSingleObject(search->mutex, INFINITE);
+#else
+	pthread_mutex_lock(&search->mutex);
+#endif
+
+	if(index < search->best) {
+		search->best = index;
+		memcpy(search->solution, solution, 8);
+	}
+
+#ifdef _WIN32
+	ReleaseMutex(search->mutex);
+#else
+	pthread_mutex_unlock(&search->mutex);
+#endif
+}
+
+
+#ifdef _WIN32
+static DWORD WINAPI puzzle_worker(LPVOID arg) {
+#else
+static void *puzzle_worker(void *arg) {
+#endif
+	struct puzzle_search *search = (struct puzzle_search *)arg;
+	unsigned char block[64];
+	u_int32_t state[5];
+	unsigned long long first, index, candidate;
+	int i;
+
+	memcpy(block, search->block, 64);
+
+	while(puzzle_next_chunk(search, &first)) {
+		for(index = first; index < first + PUZZLE_CHUNK_SIZE; index++) {
+			candidate = splitmix64(search->seed + index);
+			for(i = 0; i < 8; i++)
+				block[16 + i] = (candidate >> (8 * i)) & 0xff;
+
+			state[0] = 0x67452301;
+			state[1] = 0xefcdab89;
+			state[2] = 0x98badcfe;
+			state[3] = 0x10325476;
+			state[4] = 0xc3d2e1f0;
+			SHA1Transform(state, block);
+
+			/* The digest's last word, read big endian */
+			if(((state[4] ^ search->magic) & search->mask) == 0) {
+				puzzle_found(search, index, block + 16);
+				break;
+			}
+		}
+	}
+
+#ifdef _WIN32
+	return 0;
+#else
+	return NULL;
+#endif
+}
+
+
+/*
+ * Find a solution, using up to 'num_threads' threads including the
+ * calling one. The 8 byte solution is written to 'solution' and the
+ * number of the candidate that solved it is returned.
+ *
+ */
+unsigned long long puzzle_solve(const unsigned char *server_random_16, int denominator_bits,
+		unsigned int magic, unsigned long long seed, int num_threads, unsigned char *solution) {
+	struct puzzle_search search;
+#ifdef _WIN32
+	HANDLE threads[PUZZLE_MAX_THREADS];
+#else
+	pthread_t threads[PUZZLE_MAX_THREADS];
+#endif
+	int i, num_started;
+
+	/* Server random, room for the solution, then SHA-1 padding for 24 bytes */
+	memset(search.block, 0, sizeof(search.block));
+	memcpy(search.block, server_random_16, 16);
+	search.block[24] = 0x80;
+	search.block[63] = 24 * 8;
+
+	search.mask = denominator_bits >= 32? ~0U: (1U << denominator_bits) - 1;
+	search.magic = magic;
+	search.seed = seed;
+	search.next_chunk = 0;
+	search.best = ~0ULL;
+
+	if(denominator_bits < PUZZLE_THREAD_MIN_BITS || num_threads < 1)
+		num_threads = 1;
+	else if(num_threads > PUZZLE_MAX_THREADS)
+		num_threads = PUZZLE_MAX_THREADS;
+
+#ifdef _WIN32
+	search.mutex = CreateMutex(NULL, FALSE, NULL);
+#else
+	pthread_mutex_init(&search.mutex, NULL);
+#endif
+
+	for(num_started = 0; num_started < num_threads - 1; num_started++) {
+#ifdef _WIN32
+		threads[num_started] = CreateThread(NULL, 0, puzzle_worker, &search, 0, NULL);
+		if(threads[num_started] == NULL)
+			break;
+#else
+		if(pthread_create(&threads[num_started], NULL, puzzle_worker, &search))
+			break;
+#endif
+	}
+
+	puzzle_worker(&search);
+
+	for(i = 0; i < num_started; i++) {
+#ifdef _WIN32
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+#else
+		pthread_join(threads[i], NULL);
+#endif
+	}
+
+#ifdef _WIN32
+	CloseHandle(search.mutex);
+#else
+	pthread_mutex_destroy(&search.mutex);
+#endif
+
+	DSFYDEBUG("Solved %d bit puzzle with candidate %llu using %d threads\n",
+		denominator_bits, search.best, num_started + 1);
+
+	memcpy(solution, search.solution, 8);
+
+	return search.best;
+}
+
+
+/*
+ * Number of threads worth using, one per online CPU
+ *
+ */
+int puzzle_num_threads(void) {
+	int n;
+
+#ifdef _WIN32
+	SYSTEM_INFO info;
+
+	GetSystemInfo(&info);
+	n = info.dwNumberOfProcessors;
+#else
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+	if(n < 1)
+		n = 1;
+	else if(n > PUZZLE_MAX_THREADS)
+		n = PUZZLE_MAX_THREADS;
+
+	return n;
+}
@@ -0,0 +1,22 @@
+/*
+ * Login puzzle solver, see puzzle.c
+ *
+ */
+
+#ifndef LIBOPENSPOTIFY_PUZZLE_H
+#define LIBOPENSPOTIFY_PUZZLE_H
+
+/* Upper bound on the number of threads searching for a solution */
+#define PUZZLE_MAX_THREADS	8
+
+/* Puzzles with fewer bits than this are solved on the calling thread alone */
+#define PUZZLE_THREAD_MIN_BITS	12
+
+/* Candidates a thread tries before checking whether another one is done */
+#define PUZZLE_CHUNK_SIZE	1024
+
+unsigned long long puzzle_solve(const unsigned char *server_random_16, int denominator_bits,
+		unsigned int magic, unsigned long long seed, int num_threads, unsigned char *solution);
+int puzzle_num_threads(void);
+
+#endif
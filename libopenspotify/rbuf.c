@@ -205,6 +205,32 @@ size_t rbuf_read(struct rbuf *b, void *dest, size_t len) {
 }
 
 
+/*
+ * Get a pointer to the data at the buffer's current position
+ * Returns the number of bytes that can be read from it, which
+ * is at most what's left of the current region. Doesn't move
+ * the reader, use rbuf_seek_reader() with SEEK_CUR for that.
+ *
+ */
+size_t rbuf_peek(struct rbuf *b, void **ptr) {
+	unsigned int n;
+	struct region *reg;
+	size_t reg_offset;
+
+	n = b->read_offset / CHUNK_SIZE;
+	if(n >= b->n_regions || (reg = b->regions[n]) == NULL)
+		return 0;
+
+	reg_offset = b->read_offset % CHUNK_SIZE;
+	if(reg_offset > reg->len)
+		return 0;
+
+	*ptr = reg->data + reg_offset;
+
+	return reg->len - reg_offset;
+}
+
+
 /*
  * Return the number of bytes that can be
  * read from the current position
@@ -20,5 +20,6 @@ void rbuf_seek_writer(struct rbuf *b, size_t offset, int whence);
 size_t rbuf_tell(struct rbuf *b);
 void rbuf_write(struct rbuf *b, void *data, size_t len);
 size_t rbuf_read(struct rbuf *b, void *dest, size_t len);
+size_t rbuf_peek(struct rbuf *b, void **ptr);
 size_t rbuf_length(struct rbuf *b);
 #endif
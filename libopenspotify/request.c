@@ -5,6 +5,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include "sp_opaque.h"
 #ifdef _WIN32
 #include <windows.h>
@@ -12,6 +13,15 @@
 #include <pthread.h>
 #include <time.h>
 #endif
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/eventfd.h>
+#elif !defined(_WIN32)
+#include <fcntl.h>
+#endif
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 #include <spotify/api.h>
 
@@ -21,6 +31,132 @@
 
 
 static void request_notify_main_thread(sp_session *session, struct request *request);
+static int request_on_main_thread(struct request_scheduler *sched);
+static int request_on_iothread(struct request_scheduler *sched);
+static void request_send_to_io(sp_session *session, struct request *req);
+static void request_send_to_main(sp_session *session, struct request *req);
+static struct request *request_pop_result(sp_session *session);
+static void request_signal_result_fd(struct request_scheduler *sched);
+static void request_clear_result_fd(struct request_scheduler *sched);
+static void request_free_list(struct request *req);
+static unsigned int request_ring_load(volatile unsigned int *p);
+static void request_ring_store(volatile unsigned int *p, unsigned int value);
+static int request_ring_push(struct request_ring *ring, struct request *req);
+static struct request *request_ring_pop(struct request_ring *ring);
+static void request_enqueue(struct request_scheduler *sched, struct request *req, int now);
+static void request_dequeue(struct request_scheduler *sched, struct request *req);
+static void request_heap_insert(struct request_scheduler *sched, struct request *req);
+static void request_heap_remove(struct request_scheduler *sched, struct request *req);
+static void request_heap_sift_up(struct request_scheduler *sched, int index);
+static void request_heap_sift_down(struct request_scheduler *sched, int index);
+
+
+/* Allocate the request scheduler, called by sp_session_init() */
+int request_init(sp_session *session) {
+	struct request_scheduler *sched;
+
+	sched = (struct request_scheduler *)malloc(sizeof(struct request_scheduler));
+	if(sched == NULL)
+		return -1;
+
+	memset(sched, 0, sizeof(struct request_scheduler));
+
+	sched->timers_size = 64;
+	sched->timers = (struct request **)malloc(sizeof(struct request *) * sched->timers_size);
+	if(sched->timers == NULL) {
+		free(sched);
+		return -1;
+	}
+
+	/* Pollable descriptor for the main thread */
+#ifdef __linux__
+	sched->result_fd[0] = sched->result_fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#elif !defined(_WIN32)
+	if(pipe(sched->result_fd) == 0) {
+		fcntl(sched->result_fd[0], F_SETFL, fcntl(sched->result_fd[0], F_GETFL) | O_NONBLOCK);
+		fcntl(sched->result_fd[1], F_SETFL, fcntl(sched->result_fd[1], F_GETFL) | O_NONBLOCK);
+	}
+	else
+		sched->result_fd[0] = sched->result_fd[1] = -1;
+#else
+	sched->result_fd[0] = sched->result_fd[1] = -1;
+#endif
+
+	/* sp_session_init() is run by the main thread */
+#ifdef _WIN32
+	sched->main_thread = GetCurrentThreadId();
+#else
+	sched->main_thread = pthread_self();
+#endif
+
+	session->requests = sched;
+
+	return 0;
+}
+
+
+/* Free all requests, called by sp_session_release() once the iothread is gone */
+void request_release(sp_session *session) {
+	struct request_scheduler *sched = session->requests;
+	struct request *req;
+	int i;
+
+	if(sched == NULL)
+		return;
+
+	request_free_list(sched->ready_head);
+	request_free_list(sched->inbox_head);
+	request_free_list(sched->outbox_head);
+
+	while((req = request_ring_pop(&sched->to_io)) != NULL) {
+		req->next = NULL;
+		request_free_list(req);
+	}
+
+	while((req = request_ring_pop(&sched->to_main)) != NULL) {
+		req->next = NULL;
+		request_free_list(req);
+	}
+
+	for(i = 0; i < sched->num_timers; i++) {
+		sched->timers[i]->next = NULL;
+		request_free_list(sched->timers[i]);
+	}
+
+#ifndef _WIN32
+	if(sched->result_fd[0] != -1)
+		close(sched->result_fd[0]);
+
+	if(sched->result_fd[1] != sched->result_fd[0])
+		close(sched->result_fd[1]);
+#endif
+
+	free(sched->timers);
+	free(sched);
+	session->requests = NULL;
+}
+
+
+/* Called by the iothread when it starts, to enable the lock-free paths */
+void request_set_iothread(sp_session *session) {
+	struct request_scheduler *sched = session->requests;
+
+#ifdef _WIN32
+	sched->io_thread = GetCurrentThreadId();
+	MemoryBarrier();
+#else
+	sched->io_thread = pthread_self();
+	__sync_synchronize();
+#endif
+	sched->have_io_thread = 1;
+}
+
+
+/* For opensp_session_fd(), -1 if unsupported */
+int request_result_fd(sp_session *session) {
+
+	return session->requests->result_fd[0];
+}
 
 
 /*
@@ -31,38 +167,28 @@ static void request_notify_main_thread(sp_session *session, struct request *requ
 int request_post(sp_session *session, request_type type, void *input) {
 	struct request *req;
 
-#ifdef _WIN32
-	WaitForSingleObject(session->request_mutex, INFINITE);
-#else
-	pthread_mutex_lock(&session->request_mutex);
-#endif
-
-	if(session->requests == NULL) {
-		req = session->requests = malloc(sizeof(struct request));
-	}
-	else {
-		for(req = session->requests; req->next; req = req->next);
-		req->next = malloc(sizeof(struct request));
-		req = req->next;
-	}
+	req = malloc(sizeof(struct request));
+	if(req == NULL)
+		return -1;
 
 	req->type = type;
 	req->state = REQ_STATE_NEW;
 	req->error = 0;
 	req->input = input;
 	req->output = NULL;
-	req->next = NULL;
 	req->next_timeout = 0;
+	req->queue = REQ_QUEUE_NONE;
+	req->heap_index = -1;
+	req->prev = NULL;
+	req->next = NULL;
 
-#ifdef _WIN32
-	/* Notify the network thread if it's waiting for something to do */
-	PulseEvent(session->idle_wakeup);
-	ReleaseMutex(session->request_mutex);
-#else
-	/* Notify the network thread if it's waiting for something to do */
-	pthread_cond_signal(&session->idle_wakeup);
-	pthread_mutex_unlock(&session->request_mutex);
-#endif
+	/* The iothread owns the scheduler and can queue the request right away */
+	if(request_on_iothread(session->requests)) {
+		request_enqueue(session->requests, req, 0);
+		return 0;
+	}
+
+	request_send_to_io(session, req);
 
 	return 0;
 }
@@ -79,40 +205,26 @@ int request_post(sp_session *session, request_type type, void *input) {
 int request_post_result(sp_session *session, request_type type, sp_error error, void *output) {
 	struct request *req;
 
-#ifdef _WIN32
-	WaitForSingleObject(session->request_mutex, INFINITE);
-#else
-	pthread_mutex_lock(&session->request_mutex);
-#endif
-
-	if(session->requests == NULL) {
-		req = session->requests = malloc(sizeof(struct request));
-	}
-	else {
-		for(req = session->requests; req->next; req = req->next);
-		req->next = malloc(sizeof(struct request));
-		req = req->next;
-	}
+	req = malloc(sizeof(struct request));
+	if(req == NULL)
+		return -1;
 
 	req->type = type;
 	req->state = REQ_STATE_RETURNED;
 	req->error = error;
 	req->input = NULL;
 	req->output = output;
-	req->next = NULL;
 	req->next_timeout = 0;
+	req->queue = REQ_QUEUE_NONE;
+	req->heap_index = -1;
+	req->prev = NULL;
+	req->next = NULL;
 
 	DSFYDEBUG("Posted results for <type %s, state %s, input %p, timeout %d> with output <error %d, output %p>\n",
 		REQUEST_TYPE_STR(req->type), REQUEST_STATE_STR(req->state), req->input, req->next_timeout,
 		req->error, req->output);
 
-	request_notify_main_thread(session, req);
-
-#ifdef _WIN32
-	ReleaseMutex(session->request_mutex);
-#else
-	pthread_mutex_unlock(&session->request_mutex);
-#endif
+	request_send_to_main(session, req);
 
 	return 0;
 }
@@ -123,13 +235,13 @@ int request_post_result(sp_session *session, request_type type, sp_error error,
  * The output value will need to be free'd by the consumer,
  * i.e. sp_session_process_events() or the callback
  *
+ * Only called by the iothread
+ *
  */
 int request_set_result(sp_session *session, struct request *req, sp_error error, void *output) {
-#ifdef _WIN32
-	WaitForSingleObject(session->request_mutex, INFINITE);
-#else
-	pthread_mutex_lock(&session->request_mutex);
-#endif
+
+	/* Might be called from a channel callback while the request is queued */
+	request_dequeue(session->requests, req);
 
 	req->error = error;
 	req->output = output;
@@ -138,15 +250,54 @@ int request_set_result(sp_session *session, struct request *req, sp_error error,
 	DSFYDEBUG("Returned results for <type %s, state %s, input %p, timeout %d> with output <error %d, output %p>\n",
 		REQUEST_TYPE_STR(req->type), REQUEST_STATE_STR(req->state), req->input, req->next_timeout,
 		req->error, req->output);
-	request_notify_main_thread(session, req);
 
-#ifdef _WIN32
+	request_send_to_main(session, req);
+
+	return 0;
+}
+
+
+/*
+ * Update a request's timeout, moving it between the ready
+ * queue and the timer heap as needed.
+ * Used by channel callbacks (in the iothread) to retry or resume a request.
+ *
+ */
+int request_set_next_timeout(sp_session *session, struct request *req, int next_timeout) {
+
+	req->next_timeout = next_timeout;
+
+	/* Requests being processed are rescheduled by request_reschedule() */
+	if(req->queue == REQ_QUEUE_READY || req->queue == REQ_QUEUE_TIMER) {
+		request_dequeue(session->requests, req);
+		request_enqueue(session->requests, req, get_millisecs());
+	}
+
+	return 0;
+}
+
+
+/* Interrupt the networking thread's epoll_wait() so it picks up new requests or parse results */
+void request_wakeup_iothread(sp_session *session) {
+#ifdef __linux__
+	uint64_t one = 1;
+
+	if(session->wakeup_fd == -1)
+		return;
+
+	if(write(session->wakeup_fd, &one, sizeof(one)) != sizeof(one))
+		DSFYDEBUG("Failed to signal the networking thread's eventfd\n");
+#elif defined(_WIN32)
+	/* Notify the network thread if it's waiting for something to do */
+	WaitForSingleObject(session->request_mutex, INFINITE);
+	PulseEvent(session->idle_wakeup);
 	ReleaseMutex(session->request_mutex);
 #else
+	/* Notify the network thread if it's waiting for something to do */
+	pthread_mutex_lock(&session->request_mutex);
+	pthread_cond_signal(&session->idle_wakeup);
 	pthread_mutex_unlock(&session->request_mutex);
 #endif
-
-	return 0;
 }
 
 
@@ -210,112 +361,600 @@ static void request_notify_main_thread(sp_session *session, struct request *requ
 
 /* For the main thread: Fetch next entry with state REQ_STATE_RETURNED */
 struct request *request_fetch_next_result(sp_session *session, int *next_timeout) {
-	struct request *walker, *request;
-	int timeout;
+	struct request_scheduler *sched = session->requests;
+	struct request *request;
+	int timeout, next_timer;
+
+	/* Default timeout (milliseconds) */
+	*next_timeout = 5000;
+
+	/* The earliest timer, as published by the iothread */
+	next_timer = (int)request_ring_load((volatile unsigned int *)&sched->next_timer);
+	if(next_timer) {
+		timeout = (int) (next_timer - get_millisecs());
+
+		/* Overdue timers are the iothread's business, don't spin on them */
+		if(timeout < 1)
+			timeout = 1;
+
+		if(timeout < *next_timeout)
+			*next_timeout = timeout;
+	}
+
+	request = request_pop_result(session);
+	if(request == NULL && sched->result_fd[0] != -1) {
+		/*
+		 * No more results, make the session fd unreadable and check
+		 * again in case a result was posted in the meantime
+		 *
+		 */
+		request_clear_result_fd(sched);
+		request = request_pop_result(session);
+	}
+
+	return request;
+}
+
+
+/*
+ * Mark an request as processed by request_process_requests()
+ * Data will be free'd by request_cleanup()
+ *
+ */
+void request_mark_processed(sp_session *session, struct request *req) {
+
+	req->state = REQ_STATE_PROCESSED;
+	DSFYDEBUG("Finished processing for <type %s, state %s, input %p, timeout %d> with output <error %d, output %p>\n",
+		REQUEST_TYPE_STR(req->type), REQUEST_STATE_STR(req->state), req->input, req->next_timeout,
+		req->error, req->output);
+
+	/* Hand it back to the iothread for deletion */
+	request_send_to_io(session, req);
+}
+
 
+/*
+ * For the iothread: Queue requests posted by other threads
+ * and free requests in REQ_STATE_PROCESSED state
+ *
+ */
+void request_cleanup(sp_session *session) {
+	struct request_scheduler *sched = session->requests;
+	struct request *req, *inbox;
+	unsigned int older;
+
+	/*
+	 * Requests that were in the ring when the inbox was taken are older
+	 * than the ones in it, requests pushed to the ring after that are newer
+	 *
+	 */
+	inbox = NULL;
+	older = 0;
+	if(request_ring_load(&sched->inbox_pending)) {
 #ifdef _WIN32
-	WaitForSingleObject(session->request_mutex, INFINITE);
+		WaitForSingleObject(session->request_mutex, INFINITE);
 #else
-	pthread_mutex_lock(&session->request_mutex);
+		pthread_mutex_lock(&session->request_mutex);
 #endif
 
-	/* Default timeout (milliseconds) */
-	*next_timeout = 5000;
+		inbox = sched->inbox_head;
+		sched->inbox_head = sched->inbox_tail = NULL;
+		request_ring_store(&sched->inbox_pending, 0);
+		older = request_ring_load(&sched->to_io.tail) - sched->to_io.head;
+
+#ifdef _WIN32
+		ReleaseMutex(session->request_mutex);
+#else
+		pthread_mutex_unlock(&session->request_mutex);
+#endif
+	}
+
+	for(;;) {
+		if(older == 0 && inbox != NULL) {
+			req = inbox;
+			inbox = req->next;
+		}
+		else if((req = request_ring_pop(&sched->to_io)) == NULL)
+			break;
+		else if(older > 0)
+			older--;
 
-	request = NULL;
-	for(walker = session->requests; walker; walker = walker->next) {
-		if(!request && walker->state == REQ_STATE_RETURNED)
-			request = walker;
+		req->next = NULL;
 
-		if(walker->next_timeout == 0)
+		if(req->state == REQ_STATE_PROCESSED) {
+			/* Free input variable, if set */
+			if(req->input)
+				free(req->input);
+
+			free(req);
 			continue;
+		}
 
-		timeout = (int) (walker->next_timeout - get_millisecs());
+		request_enqueue(sched, req, 0);
+	}
+}
 
-		/* FIXME: Sensible to always sleep one second? */
-		if(timeout < 1000)
-			timeout = 1000;
 
-		if(timeout < *next_timeout)
-			*next_timeout = timeout;
+/*
+ * For the iothread: Move requests whose timeout expired from the
+ * timer heap to the ready queue.
+ * Returns the number of requests ready for processing.
+ *
+ */
+int request_schedule_due(sp_session *session) {
+	struct request_scheduler *sched = session->requests;
+	struct request *req;
+	int now;
+
+	now = get_millisecs();
+	while(sched->num_timers && sched->timers[0]->next_timeout <= now) {
+		req = sched->timers[0];
+		request_dequeue(sched, req);
+		request_enqueue(sched, req, now);
 	}
 
+	return sched->num_ready;
+}
+
+
+/*
+ * For the iothread: Fetch the next request from the ready queue.
+ * The request must be handed back with request_reschedule() after processing.
+ *
+ */
+struct request *request_fetch_next_due(sp_session *session) {
+	struct request *req;
+
+	req = session->requests->ready_head;
+	if(req)
+		request_dequeue(session->requests, req);
+
+	return req;
+}
+
+
+/*
+ * For the iothread: Put a request back into the ready queue or the
+ * timer heap after processing, unless it has returned a result.
+ *
+ */
+void request_reschedule(sp_session *session, struct request *req) {
+
+	if(req->queue == REQ_QUEUE_NONE
+		&& (req->state == REQ_STATE_NEW || req->state == REQ_STATE_RUNNING))
+		request_enqueue(session->requests, req, get_millisecs());
+}
+
 
+/*
+ * For the iothread: Milliseconds until the next request is due,
+ * zero if requests are ready and -1 if there's nothing to wait for
+ *
+ */
+int request_next_timeout(sp_session *session) {
+	struct request_scheduler *sched = session->requests;
+	int timeout;
+
+	if(sched->ready_head)
+		timeout = 0;
+	else if(sched->num_timers) {
+		timeout = sched->timers[0]->next_timeout - get_millisecs();
+		if(timeout < 0)
+			timeout = 0;
+	}
+	else
+		timeout = -1;
+
+	return timeout;
+}
+
+
+/*
+ * For the iothread: Check whether there's nothing to do
+ * Called with request_mutex held to not miss wakeups
+ *
+ */
+int request_is_idle(sp_session *session) {
+	struct request_scheduler *sched = session->requests;
+
+	return sched->ready_head == NULL && sched->num_timers == 0
+		&& sched->to_io.head == request_ring_load(&sched->to_io.tail)
+		&& request_ring_load(&sched->inbox_pending) == 0;
+}
+
+
+static int request_on_main_thread(struct request_scheduler *sched) {
 #ifdef _WIN32
-	ReleaseMutex(session->request_mutex);
+	return sched->main_thread == GetCurrentThreadId();
 #else
-	pthread_mutex_unlock(&session->request_mutex);
+	return pthread_equal(sched->main_thread, pthread_self());
 #endif
+}
 
-	return request;
+
+static int request_on_iothread(struct request_scheduler *sched) {
+	if(!sched->have_io_thread)
+		return 0;
+
+#ifdef _WIN32
+	return sched->io_thread == GetCurrentThreadId();
+#else
+	return pthread_equal(sched->io_thread, pthread_self());
+#endif
 }
 
 
 /*
- * Mark an request as processed by request_process_requests()
- * Data will be free'd by request_cleanup()
+ * Pass a new or processed request to the iothread
+ * Lock-free from the main thread, other threads use the inbox. Once the
+ * ring has overflowed, the main thread keeps using the inbox until the
+ * iothread has taken it, so requests are queued in the order posted.
  *
  */
-void request_mark_processed(sp_session *session, struct request *req) {
+static void request_send_to_io(sp_session *session, struct request *req) {
+	struct request_scheduler *sched = session->requests;
+	int processed;
+
+	/* The request might be free'd as soon as it's handed over */
+	processed = req->state == REQ_STATE_PROCESSED;
+
+	if(!request_on_main_thread(sched) || request_ring_load(&sched->inbox_pending)
+			|| request_ring_push(&sched->to_io, req)) {
 #ifdef _WIN32
-	WaitForSingleObject(session->request_mutex, INFINITE);
+		WaitForSingleObject(session->request_mutex, INFINITE);
 #else
-	pthread_mutex_lock(&session->request_mutex);
+		pthread_mutex_lock(&session->request_mutex);
 #endif
 
-	req->state = REQ_STATE_PROCESSED;
-	DSFYDEBUG("Finished processing for <type %s, state %s, input %p, timeout %d> with output <error %d, output %p>\n",
-		REQUEST_TYPE_STR(req->type), REQUEST_STATE_STR(req->state), req->input, req->next_timeout,
-		req->error, req->output);
+		req->next = NULL;
+		if(sched->inbox_tail)
+			sched->inbox_tail->next = req;
+		else
+			sched->inbox_head = req;
+
+		sched->inbox_tail = req;
+		request_ring_store(&sched->inbox_pending, 1);
 
 #ifdef _WIN32
-	ReleaseMutex(session->request_mutex);
+		ReleaseMutex(session->request_mutex);
 #else
-	pthread_mutex_unlock(&session->request_mutex);
+		pthread_mutex_unlock(&session->request_mutex);
 #endif
+	}
+
+	/* Processed requests can wait until the iothread wakes up anyway */
+	if(processed)
+		return;
+
+	request_wakeup_iothread(session);
 }
 
 
 /*
- * Remove requests in REQ_STATE_PROCESSED state
+ * Pass a result to the main thread
+ * Lock-free from the iothread, other threads use the outbox. As with
+ * requests, the iothread keeps using the outbox until it's empty.
  *
  */
-void request_cleanup(sp_session *session) {
-	struct request *prev, *walker;
+static void request_send_to_main(sp_session *session, struct request *req) {
+	struct request_scheduler *sched = session->requests;
+	struct request copy;
+
+	/* The main thread owns the request as soon as it's handed over */
+	req->queue = REQ_QUEUE_RESULT;
+	copy = *req;
+
+	if(!request_on_iothread(sched) || request_ring_load(&sched->outbox_pending)
+			|| request_ring_push(&sched->to_main, req)) {
 #ifdef _WIN32
-	WaitForSingleObject(session->request_mutex, INFINITE);
+		WaitForSingleObject(session->request_mutex, INFINITE);
 #else
-	pthread_mutex_lock(&session->request_mutex);
+		pthread_mutex_lock(&session->request_mutex);
+#endif
+
+		req->next = NULL;
+		if(sched->outbox_tail)
+			sched->outbox_tail->next = req;
+		else
+			sched->outbox_head = req;
+
+		sched->outbox_tail = req;
+		request_ring_store(&sched->outbox_pending, 1);
+
+#ifdef _WIN32
+		ReleaseMutex(session->request_mutex);
+#else
+		pthread_mutex_unlock(&session->request_mutex);
 #endif
+	}
+
+	request_signal_result_fd(sched);
+	request_notify_main_thread(session, &copy);
+}
 
 
-	do {
-		prev = NULL;
-		for(walker = session->requests; walker; walker = walker->next) {
-			if(walker->state == REQ_STATE_PROCESSED)
-				break;
+/*
+ * Take the next result from the to_main ring or the outbox
+ * Results in the ring are older than the ones in the outbox, the ring is
+ * checked again with the mutex held to see everything pushed before them.
+ *
+ */
+static struct request *request_pop_result(sp_session *session) {
+	struct request_scheduler *sched = session->requests;
+	struct request *request;
+
+	request = request_ring_pop(&sched->to_main);
+	if(request == NULL && request_ring_load(&sched->outbox_pending)) {
+#ifdef _WIN32
+		WaitForSingleObject(session->request_mutex, INFINITE);
+#else
+		pthread_mutex_lock(&session->request_mutex);
+#endif
+
+		if((request = request_ring_pop(&sched->to_main)) == NULL
+			&& (request = sched->outbox_head) != NULL) {
+			sched->outbox_head = request->next;
+			if(sched->outbox_head == NULL) {
+				sched->outbox_tail = NULL;
+				request_ring_store(&sched->outbox_pending, 0);
+			}
 
-			prev = walker;
+			request->next = NULL;
 		}
 
-		if(!walker)
-			break;
+#ifdef _WIN32
+		ReleaseMutex(session->request_mutex);
+#else
+		pthread_mutex_unlock(&session->request_mutex);
+#endif
+	}
 
-		if(prev)
-			prev->next = walker->next;
-		else
-			session->requests = walker->next;
+	return request;
+}
+
+
+/*
+ * Make the session fd readable, unless it already is
+ * Called after a result has been handed over to the main thread
+ *
+ */
+static void request_signal_result_fd(struct request_scheduler *sched) {
+#ifdef _WIN32
+	(void)sched;
+#else
+#ifdef __linux__
+	uint64_t one = 1;
+#else
+	char one = 1;
+#endif
+
+	if(sched->result_fd[1] == -1)
+		return;
+
+	/* Pairs with the exchange in request_clear_result_fd() */
+	if(__atomic_exchange_n(&sched->result_armed, 1, __ATOMIC_SEQ_CST))
+		return;
+
+	if(write(sched->result_fd[1], &one, sizeof(one)) != sizeof(one))
+		DSFYDEBUG("Failed to signal the session fd\n");
+#endif
+}
+
+
+/* Make the session fd unreadable, the caller must check for results afterwards */
+static void request_clear_result_fd(struct request_scheduler *sched) {
+#ifndef _WIN32
+	char buf[64];
+
+	if(__atomic_exchange_n(&sched->result_armed, 0, __ATOMIC_SEQ_CST) == 0)
+		return;
+
+	while(read(sched->result_fd[0], buf, sizeof(buf)) > 0);
+#else
+	(void)sched;
+#endif
+}
+
+
+static void request_free_list(struct request *req) {
+	struct request *next;
+
+	for(; req; req = next) {
+		next = req->next;
+		if(req->input)
+			free(req->input);
 
-		/* Free input variable, if set */
-		if(walker->input)
-			free(walker->input);
+		free(req);
+	}
+}
 
-		free(walker);
-	} while(1);
 
+/*
+ * Lock-free ring operations
+ * Slots are written before tail is published and read before head is.
+ *
+ */
+static unsigned int request_ring_load(volatile unsigned int *p) {
 #ifdef _WIN32
-	ReleaseMutex(session->request_mutex);
+	unsigned int value = *p;
+	MemoryBarrier();
+	return value;
 #else
-	pthread_mutex_unlock(&session->request_mutex);
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#endif
+}
+
+
+static void request_ring_store(volatile unsigned int *p, unsigned int value) {
+#ifdef _WIN32
+	MemoryBarrier();
+	*p = value;
+#else
+	__atomic_store_n(p, value, __ATOMIC_RELEASE);
 #endif
 }
+
+
+static int request_ring_push(struct request_ring *ring, struct request *req) {
+	unsigned int tail = ring->tail;
+
+	if(tail - request_ring_load(&ring->head) == REQUEST_RING_SIZE)
+		return -1;
+
+	ring->slots[tail & (REQUEST_RING_SIZE - 1)] = req;
+	request_ring_store(&ring->tail, tail + 1);
+
+	return 0;
+}
+
+
+static struct request *request_ring_pop(struct request_ring *ring) {
+	unsigned int head = ring->head;
+	struct request *req;
+
+	if(head == request_ring_load(&ring->tail))
+		return NULL;
+
+	req = ring->slots[head & (REQUEST_RING_SIZE - 1)];
+	request_ring_store(&ring->head, head + 1);
+
+	return req;
+}
+
+
+/*
+ * Link a request into the ready queue or the timer heap
+ * Only called by the iothread
+ *
+ */
+static void request_enqueue(struct request_scheduler *sched, struct request *req, int now) {
+	req->prev = NULL;
+	req->next = NULL;
+
+	if(req->next_timeout > now) {
+		req->queue = REQ_QUEUE_TIMER;
+		request_heap_insert(sched, req);
+		request_ring_store((volatile unsigned int *)&sched->next_timer, sched->timers[0]->next_timeout);
+		return;
+	}
+
+	req->queue = REQ_QUEUE_READY;
+	req->prev = sched->ready_tail;
+	if(sched->ready_tail)
+		sched->ready_tail->next = req;
+	else
+		sched->ready_head = req;
+
+	sched->ready_tail = req;
+	sched->num_ready++;
+}
+
+
+/*
+ * Unlink a request from the ready queue or the timer heap
+ * Only called by the iothread
+ *
+ */
+static void request_dequeue(struct request_scheduler *sched, struct request *req) {
+
+	switch(req->queue) {
+	case REQ_QUEUE_READY:
+		if(req->prev)
+			req->prev->next = req->next;
+		else
+			sched->ready_head = req->next;
+
+		if(req->next)
+			req->next->prev = req->prev;
+		else
+			sched->ready_tail = req->prev;
+
+		sched->num_ready--;
+		break;
+
+	case REQ_QUEUE_TIMER:
+		request_heap_remove(sched, req);
+		request_ring_store((volatile unsigned int *)&sched->next_timer,
+				sched->num_timers? sched->timers[0]->next_timeout: 0);
+		break;
+
+	default:
+		break;
+	}
+
+	req->queue = REQ_QUEUE_NONE;
+	req->prev = NULL;
+	req->next = NULL;
+}
+
+
+/* Binary min-heap on next_timeout */
+static void request_heap_insert(struct request_scheduler *sched, struct request *req) {
+
+	if(sched->num_timers == sched->timers_size) {
+		sched->timers_size *= 2;
+		sched->timers = (struct request **)realloc(sched->timers,
+				sizeof(struct request *) * sched->timers_size);
+	}
+
+	req->heap_index = sched->num_timers++;
+	sched->timers[req->heap_index] = req;
+	request_heap_sift_up(sched, req->heap_index);
+}
+
+
+static void request_heap_remove(struct request_scheduler *sched, struct request *req) {
+	int index = req->heap_index;
+
+	sched->num_timers--;
+	if(index != sched->num_timers) {
+		sched->timers[index] = sched->timers[sched->num_timers];
+		sched->timers[index]->heap_index = index;
+
+		request_heap_sift_up(sched, index);
+		request_heap_sift_down(sched, sched->timers[index]->heap_index);
+	}
+
+	req->heap_index = -1;
+}
+
+
+static void request_heap_sift_up(struct request_scheduler *sched, int index) {
+	struct request *req = sched->timers[index];
+	int parent;
+
+	while(index > 0) {
+		parent = (index - 1) / 2;
+		if(sched->timers[parent]->next_timeout <= req->next_timeout)
+			break;
+
+		sched->timers[index] = sched->timers[parent];
+		sched->timers[index]->heap_index = index;
+		index = parent;
+	}
+
+	sched->timers[index] = req;
+	req->heap_index = index;
+}
+
+
+static void request_heap_sift_down(struct request_scheduler *sched, int index) {
+	struct request *req = sched->timers[index];
+	int child;
+
+	while((child = 2 * index + 1) < sched->num_timers) {
+		if(child + 1 < sched->num_timers
+			&& sched->timers[child + 1]->next_timeout < sched->timers[child]->next_timeout)
+			child++;
+
+		if(req->next_timeout <= sched->timers[child]->next_timeout)
+			break;
+
+		sched->timers[index] = sched->timers[child];
+		sched->timers[index]->heap_index = index;
+		index = child;
+	}
+
+	sched->timers[index] = req;
+	req->heap_index = index;
+}
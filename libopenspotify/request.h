@@ -6,6 +6,12 @@
 #ifndef LIBOPENSPOTIFY_REQUEST_H
 #define LIBOPENSPOTIFY_REQUEST_H
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
 #include <spotify/api.h>
 
 typedef enum {
@@ -31,6 +37,25 @@ typedef enum {
 } request_state;
 
 
+/* Which of the scheduler's queues a request is currently linked into */
+typedef enum {
+	/* Not queued, i.e. being processed by the iothread or the main thread */
+	REQ_QUEUE_NONE = 0,
+
+	/* Due for processing by the iothread */
+	REQ_QUEUE_READY,
+
+	/* Waiting in the timer heap for req->next_timeout to expire */
+	REQ_QUEUE_TIMER,
+
+	/* Returned and handed over to the main thread */
+	REQ_QUEUE_RESULT,
+
+	/* Processed by the main thread and handed back to request_cleanup() */
+	REQ_QUEUE_PROCESSED
+} request_queue;
+
+
 /*
  * When adding new types, have a look at request.c:request_notify_main_thread()
  * and session.c:sp_session_process_events() and add them to the
@@ -176,7 +201,15 @@ typedef enum {
 	 * Never returns.
 	 *
 	 */
-	REQ_TYPE_CACHE_PERIODIC
+	REQ_TYPE_CACHE_PERIODIC,
+
+	/*
+	 * Posted by the iothread when the connection is lost while logged
+	 * in. Processed by process_reconnect_request() which logs in again
+	 * with backoff and replays the requests of open channels.
+	 *
+	 */
+	REQ_TYPE_RECONNECT
 } request_type;
 
 
@@ -186,10 +219,95 @@ struct request {
 	void *input;
 	void *output;
 	sp_error error;
+
+	/*
+	 * Owned by the scheduler once the request is queued.
+	 * Outside of process_request() it must be updated with
+	 * request_set_next_timeout() to keep the timer heap in order.
+	 *
+	 */
 	int next_timeout;
+
+	/* Scheduler bookkeeping, see request.c */
+	request_queue queue;
+	int heap_index;
+	struct request *prev;
 	struct request *next;
 };
 
+
+/*
+ * Single-producer/single-consumer ring of requests
+ * head is only written by the consumer and tail only by the producer
+ *
+ */
+#define REQUEST_RING_SIZE 1024
+
+struct request_ring {
+	volatile unsigned int head;
+	char pad0[60];
+	volatile unsigned int tail;
+	char pad1[60];
+	struct request *slots[REQUEST_RING_SIZE];
+};
+
+
+/*
+ * The request scheduler
+ *
+ * Requests that are due are kept in a FIFO ready queue and requests
+ * waiting for their next_timeout in a min-heap. Both are private to
+ * the iothread.
+ *
+ * New requests and processed results are passed from the main thread to
+ * the iothread in the to_io ring and results are passed back in the
+ * to_main ring. Neither needs a lock. Other threads (i.e, the player)
+ * and overflowing rings fall back on the inbox and outbox lists which
+ * are protected by request_mutex.
+ *
+ */
+struct request_scheduler {
+	struct request *ready_head;
+	struct request *ready_tail;
+	int num_ready;
+
+	struct request **timers;
+	int num_timers;
+	int timers_size;
+
+	/* Absolute time of the earliest timer or 0, for the main thread */
+	volatile int next_timer;
+
+	struct request_ring to_io;
+	struct request_ring to_main;
+
+	volatile unsigned int inbox_pending;
+	struct request *inbox_head;
+	struct request *inbox_tail;
+
+	volatile unsigned int outbox_pending;
+	struct request *outbox_head;
+	struct request *outbox_tail;
+
+	/*
+	 * Readable while results are pending, see opensp_session_fd()
+	 * result_fd[0] is the read end and result_fd[1] the write end
+	 *
+	 */
+	int result_fd[2];
+	volatile unsigned int result_armed;
+
+	/* Thread identities for picking the lock-free paths */
+#ifdef _WIN32
+	DWORD main_thread;
+	DWORD io_thread;
+#else
+	pthread_t main_thread;
+	pthread_t io_thread;
+#endif
+	volatile int have_io_thread;
+};
+
 #define REQUEST_TYPE_STR(type) (type == REQ_TYPE_LOGIN? "LOGIN": \
 				type == REQ_TYPE_LOGOUT? "LOGOUT": \
 				type == REQ_TYPE_NOTIFY? "REQ_TYPE_NOTIFY": \
@@ -218,6 +336,7 @@ struct request {
 				type == REQ_TYPE_PLAY_TOKEN_ACQUIRE? "PLAY_TOKEN_ACQUIRE": \
 				type == REQ_TYPE_PLAY_TOKEN_LOST? "PLAY_TOKEN_LOST": \
 				type == REQ_TYPE_CACHE_PERIODIC? "CACHE_PERIODIC": \
+				type == REQ_TYPE_RECONNECT? "RECONNECT": \
 				"UNKNOWN")
 
 #define REQUEST_STATE_STR(state) (state == REQ_STATE_NEW? "NEW": \
@@ -229,7 +348,19 @@ struct request {
 int request_post(sp_session *session, request_type type, void *input);
 int request_post_result(sp_session *session, request_type type, sp_error error, void *output);
 int request_set_result(sp_session *session, struct request *req, sp_error error, void *output);
+int request_set_next_timeout(sp_session *session, struct request *req, int next_timeout);
 struct request *request_fetch_next_result(sp_session *session, int *next_timeout);
 void request_mark_processed(sp_session *session, struct request *req);
 void request_cleanup(sp_session *session);
+
+int request_init(sp_session *session);
+void request_release(sp_session *session);
+void request_set_iothread(sp_session *session);
+int request_result_fd(sp_session *session);
+int request_is_idle(sp_session *session);
+int request_schedule_due(sp_session *session);
+struct request *request_fetch_next_due(sp_session *session);
+void request_reschedule(sp_session *session, struct request *req);
+int request_next_timeout(sp_session *session);
+void request_wakeup_iothread(sp_session *session);
 #endif
@@ -9,15 +9,37 @@
 #include "buf.h"
 #include "commands.h"
 #include "debug.h"
-#include "ezxml.h"
 #include "search.h"
 #include "sp_opaque.h"
 #include "track.h"
 #include "util.h"
+#include "xmlparser.h"
+#include "xmlreply.h"
+
+
+/* Lists in the XML, kept in search_ctx->section */
+#define SEARCH_XML_NONE		0
+#define SEARCH_XML_ARTISTS	1
+#define SEARCH_XML_ALBUMS	2
+#define SEARCH_XML_TRACKS	3
+
+/* Bits in search_ctx->found */
+#define SEARCH_XML_VERSION		(1 << 0)
+#define SEARCH_XML_TOTAL_ARTISTS	(1 << 1)
+#define SEARCH_XML_TOTAL_ALBUMS		(1 << 2)
+#define SEARCH_XML_TOTAL_TRACKS		(1 << 3)
 
 
 static int search_callback(CHANNEL *ch, unsigned char *payload, unsigned short len);
-static int search_parse_xml(struct search_ctx *search_ctx);
+static void search_parsed(void *arg, int ret);
+static int search_xml_start(struct search_ctx *search_ctx);
+static int search_xml_end(struct search_ctx *search_ctx, int ret);
+static void search_xml_free(struct search_ctx *search_ctx);
+static void search_xml_element_start(void *arg, int depth, const char *name, const char **attrs);
+static void search_xml_element_end(void *arg, int depth, const char *name, char *text);
+static void search_add_artist(struct search_ctx *search_ctx);
+static void search_add_album(struct search_ctx *search_ctx);
+static void search_add_track(struct search_ctx *search_ctx);
 
 
 int search_process_request(sp_session *session, struct request *req) {
@@ -40,55 +62,35 @@ int search_process_request(sp_session *session, struct request *req) {
 		  search->artist_offset, search->artist_count);
 
 
+	/* Parser for the XML retrieved, a new one for each attempt */
+	search_xml_free(search_ctx);
+	if(search_xml_start(search_ctx))
+		return -1;
+
 	/* FIXME: Should investigate how album/artist offset/count is supplied */
 	return cmd_search(session, search->query, search->track_offset, search->track_count, search_callback, search_ctx);
 }
 
 
 static int search_callback(CHANNEL *ch, unsigned char *payload, unsigned short len) {
-	int skip_len;
 	struct search_ctx *search_ctx = (struct search_ctx *)ch->private;
 
 	switch(ch->state) {
 		case CHANNEL_DATA:
-			/* Skip a minimal gzip header */
-			if (ch->total_data_len < 10) {
-				skip_len = 10 - ch->total_data_len;
-				while(skip_len && len) {
-					skip_len--;
-					len--;
-					payload++;
-				}
-
-				if (len == 0)
-					break;
-			}
-
-			buf_append_data(search_ctx->buf, payload, len);
+			xml_reply_write(search_ctx->reply, payload, len);
 			break;
 
 		case CHANNEL_ERROR:
 			DSFYDEBUG("Got a channel ERROR, retrying within %d seconds\n", SEARCH_RETRY_TIMEOUT);
-			buf_free(search_ctx->buf);
-			search_ctx->buf = buf_new();
+			search_xml_free(search_ctx);
 
 			/* Reset timeout so the request can be retried */
-			search_ctx->req->next_timeout = get_millisecs() + SEARCH_RETRY_TIMEOUT*1000;
+			request_set_next_timeout(search_ctx->session, search_ctx->req, get_millisecs() + SEARCH_RETRY_TIMEOUT*1000);
 
 			break;
 
 		case CHANNEL_END:
-			if(search_parse_xml(search_ctx) == 0) {
-				search_ctx->search->error = SP_ERROR_OK;
-				search_ctx->search->is_loaded = 1;
-			}
-			else
-				search_ctx->search->error = SP_ERROR_OTHER_PERMANENT;
-
-			request_set_result(search_ctx->session, search_ctx->req, search_ctx->search->error, search_ctx->search);
-
-			buf_free(search_ctx->buf);
-			free(search_ctx);
+			xml_reply_finish(search_ctx->reply, search_parsed, search_ctx);
 			break;
 
 		default:
@@ -100,154 +102,283 @@ static int search_callback(CHANNEL *ch, unsigned char *payload, unsigned short l
 }
 
 
-static int search_parse_xml(struct search_ctx *search_ctx) {
-	int i, count;
-	struct buf *xml;
-	unsigned char id[16];
-	sp_search *search = search_ctx->search;
-	ezxml_t root, node, artist_node, album_node, track_node;
-	sp_artist *artist;
-	sp_album *album;
-	sp_track *track;
+/* Called once the XML has been parsed, which may be after the channel has gone */
+static void search_parsed(void *arg, int ret) {
+	struct search_ctx *search_ctx = (struct search_ctx *)arg;
+
+	if(search_xml_end(search_ctx, ret) == 0) {
+		search_ctx->search->error = SP_ERROR_OK;
+		search_ctx->search->is_loaded = 1;
+	}
+	else
+		search_ctx->search->error = SP_ERROR_OTHER_PERMANENT;
+
+	request_set_result(search_ctx->session, search_ctx->req, search_ctx->search->error, search_ctx->search);
+
+	search_xml_free(search_ctx);
+	free(search_ctx);
+}
+
 
-	xml = despotify_inflate(search_ctx->buf->ptr, search_ctx->buf->len);
-	if(xml == NULL)
+/* Set up for parsing the XML */
+static int search_xml_start(struct search_ctx *search_ctx) {
+	search_ctx->reply = xml_reply_new(search_ctx->session->parsepool, search_xml_element_start, search_xml_element_end, search_ctx);
+	if(search_ctx->reply == NULL)
 		return -1;
 
-#ifdef DEBUG
-	{
-		FILE *fd;
-		fd = fopen("search.xml", "w");
-		if(fd) {
-			fwrite(xml->ptr, xml->len, 1, fd);
-			fclose(fd);
-		}
-	}
-#endif
+	search_ctx->section = SEARCH_XML_NONE;
+	artist_xml_init(&search_ctx->artist, search_ctx->reply->arena);
+	album_xml_init(&search_ctx->album, search_ctx->reply->arena, search_ctx->session->country);
+	track_xml_init(&search_ctx->track, search_ctx->reply->arena, search_ctx->session->country);
+
+	search_ctx->found = 0;
+	search_ctx->total_artists = 0;
+	search_ctx->total_albums = 0;
+
+	return 0;
+}
 
-	root = ezxml_parse_str((char *) xml->ptr, xml->len);
-	if(root == NULL) {
+
+/* Returns 0 if a complete document was parsed (ret is 0) and it's usable, or -1 */
+static int search_xml_end(struct search_ctx *search_ctx, int ret) {
+	sp_search *search = search_ctx->search;
+
+	if(ret) {
 		DSFYDEBUG("Failed to parse XML\n");
-		buf_free(xml);
 		return -1;
 	}
 
+	if(search_ctx->found == -1)
+		return -1;
 
 	/* Version check */
-	if((node = ezxml_get(root, "version", -1)) == NULL
-		|| atoi(node->txt) != 1) {
+	if(!(search_ctx->found & SEARCH_XML_VERSION)) {
 		DSFYDEBUG("Unsupported search XML version!\n");
-		buf_free(xml);
 		return -1;
 	}
 
+	if((search_ctx->found & (SEARCH_XML_TOTAL_ARTISTS | SEARCH_XML_TOTAL_ALBUMS | SEARCH_XML_TOTAL_TRACKS))
+		!= (SEARCH_XML_TOTAL_ARTISTS | SEARCH_XML_TOTAL_ALBUMS | SEARCH_XML_TOTAL_TRACKS))
+		return -1;
 
 	/* Search hint */
-	if(search->did_you_mean)
-		free(search->did_you_mean);
-
-	if((node = ezxml_get(root, "did-you-mean", -1)) != NULL)
-		search->did_you_mean = strdup(node->txt);
-	else
+	if(search->did_you_mean == NULL)
 		search->did_you_mean = strdup("");
 
+	return 0;
+}
 
-	/*
-	 * Get number of total artists
-	 * The value of the 'total-artists' element might be larger than the
-	 * number of artists actually returned.
-	 *
-	 */
-	if((node = ezxml_get(root, "total-artists", -1)) == NULL)
-		return -1;
 
-	count = atoi(node->txt);
-	search->artists = malloc(count * sizeof(sp_artist *));
+static void search_xml_free(struct search_ctx *search_ctx) {
+	/* The records' contents go with it */
+	if(search_ctx->reply) {
+		xml_reply_free(search_ctx->reply);
+		search_ctx->reply = NULL;
+	}
+}
 
 
-	/* Load artists */
-	search->num_artists = 0;
-	for(i = 0, artist_node = ezxml_get(root, "artists", 0, "artist", -1);
-	    i < count && artist_node;
-	    i++, artist_node = artist_node->next) {
+/*
+ * The root element holds the number of hits and a list each of artists,
+ * albums and tracks
+ *
+ */
+static void search_xml_element_start(void *arg, int depth, const char *name, const char **attrs) {
+	struct search_ctx *search_ctx = (struct search_ctx *)arg;
+	sp_search *search = search_ctx->search;
+	int i;
 
-		if((node = ezxml_get(artist_node, "id", -1)) == NULL)
-			return -1;
+	if(depth == 1) {
+		/* Drop what an earlier attempt returned */
+		for(i = 0; i < search->num_artists; i++)
+			sp_artist_release(search->artists[i]);
 
+		for(i = 0; i < search->num_albums; i++)
+			sp_album_release(search->albums[i]);
 
-		hex_ascii_to_bytes(node->txt, id, 16);
-		artist = osfy_artist_add(search_ctx->session, id);
+		for(i = 0; i < search->num_tracks; i++)
+			sp_track_release(search->tracks[i]);
 
-		if(!sp_artist_is_loaded(artist))
-			osfy_artist_load_artist_from_xml(search_ctx->session, artist, artist_node);
+		search->num_artists = 0;
+		search->num_albums = 0;
+		search->num_tracks = 0;
 
-		sp_artist_add_ref(artist);
-		search->artists[search->num_artists] = artist;
-		search->num_artists++;
+		if(search->did_you_mean) {
+			free(search->did_you_mean);
+			search->did_you_mean = NULL;
+		}
+	}
+	else if(depth == 2) {
+		if(!strcmp(name, "artists"))
+			search_ctx->section = SEARCH_XML_ARTISTS;
+		else if(!strcmp(name, "albums"))
+			search_ctx->section = SEARCH_XML_ALBUMS;
+		else if(!strcmp(name, "tracks"))
+			search_ctx->section = SEARCH_XML_TRACKS;
+		else
+			search_ctx->section = SEARCH_XML_NONE;
+	}
+	else if(search_ctx->section == SEARCH_XML_ARTISTS) {
+		if(depth == 3)
+			artist_xml_free(&search_ctx->artist);
 	}
+	else if(search_ctx->section == SEARCH_XML_ALBUMS) {
+		if(depth == 3)
+			album_xml_free(&search_ctx->album);
+		else
+			album_xml_start(&search_ctx->album, depth - 3, name, attrs);
+	}
+	else if(search_ctx->section == SEARCH_XML_TRACKS) {
+		if(depth == 3)
+			track_xml_free(&search_ctx->track);
+		else
+			track_xml_start(&search_ctx->track, depth - 3, name, attrs);
+	}
+}
 
 
-	/* Get number of total albums */
-	if((node = ezxml_get(root, "total-albums", -1)) == NULL)
-		return -1;
+static void search_xml_element_end(void *arg, int depth, const char *name, char *text) {
+	struct search_ctx *search_ctx = (struct search_ctx *)arg;
+	sp_search *search = search_ctx->search;
+
+	/* Stop loading objects once something's wrong */
+	if(search_ctx->found == -1)
+		return;
+
+	if(depth == 2) {
+		if(!strcmp(name, "version")) {
+			if(atoi(text) != 1) {
+				DSFYDEBUG("Unsupported search XML version!\n");
+				search_ctx->found = -1;
+				return;
+			}
 
-	count = atoi(node->txt);
-	search->albums = malloc(count * sizeof(sp_album *));
+			search_ctx->found |= SEARCH_XML_VERSION;
+		}
+		else if(!strcmp(name, "did-you-mean")) {
+			if(search->did_you_mean)
+				free(search->did_you_mean);
+
+			search->did_you_mean = strdup(text);
+		}
+		/*
+		 * The value of the 'total-artists' element might be larger
+		 * than the number of artists actually returned.
+		 *
+		 */
+		else if(!strcmp(name, "total-artists")) {
+			search_ctx->total_artists = atoi(text);
+			search_ctx->found |= SEARCH_XML_TOTAL_ARTISTS;
+		}
+		else if(!strcmp(name, "total-albums")) {
+			search_ctx->total_albums = atoi(text);
+			search_ctx->found |= SEARCH_XML_TOTAL_ALBUMS;
+		}
+		else if(!strcmp(name, "total-tracks")) {
+			search->total_tracks = atoi(text);
+			search_ctx->found |= SEARCH_XML_TOTAL_TRACKS;
+		}
+
+		search_ctx->section = SEARCH_XML_NONE;
+		return;
+	}
+
+	switch(search_ctx->section) {
+		case SEARCH_XML_ARTISTS:
+			if(depth == 3)
+				search_add_artist(search_ctx);
+			else
+				artist_xml_end(&search_ctx->artist, depth - 3, name, text);
+			break;
 
+		case SEARCH_XML_ALBUMS:
+			if(depth == 3)
+				search_add_album(search_ctx);
+			else
+				album_xml_end(&search_ctx->album, depth - 3, name, text);
+			break;
 
-	/* Load albums */
-	search->num_albums = 0;
-	for(i = 0, album_node = ezxml_get(root, "albums", 0, "album", -1);
-	    i < count && album_node;
-	    i++, album_node = album_node->next) {
+		case SEARCH_XML_TRACKS:
+			if(depth == 3)
+				search_add_track(search_ctx);
+			else
+				track_xml_end(&search_ctx->track, depth - 3, name, text);
+			break;
 
-		if((node = ezxml_get(album_node, "id", -1)) == NULL)
-			return -1;
+		default:
+			break;
+	}
+}
 
 
-		hex_ascii_to_bytes(node->txt, id, 16);
-		album = sp_album_add(search_ctx->session, id);
+static void search_add_artist(struct search_ctx *search_ctx) {
+	sp_search *search = search_ctx->search;
+	sp_artist *artist;
 
-		if(!sp_album_is_loaded(album))
-			osfy_album_load_from_search_xml(search_ctx->session, album, album_node);
+	/* Never more than the total, when it's known */
+	if((search_ctx->found & SEARCH_XML_TOTAL_ARTISTS)
+		&& search->num_artists >= search_ctx->total_artists)
+		return;
 
-		sp_album_add_ref(album);
-		search->albums[search->num_albums] = album;
-		search->num_albums++;
+	if(!(search_ctx->artist.found & ARTIST_XML_ID)) {
+		search_ctx->found = -1;
+		return;
 	}
 
+	artist = osfy_artist_add(search_ctx->session, search_ctx->artist.id);
 
-	/* Get number of total tracks */
-	if((node = ezxml_get(root, "total-tracks", -1)) == NULL)
-		return -1;
+	if(!sp_artist_is_loaded(artist))
+		osfy_artist_load_artist_from_xml(search_ctx->session, artist, &search_ctx->artist);
+
+	search->artists = realloc(search->artists, sizeof(sp_artist *) * (1 + search->num_artists));
+	sp_artist_add_ref(artist);
+	search->artists[search->num_artists] = artist;
+	search->num_artists++;
+}
 
-	search->total_tracks = atoi(node->txt);
 
+static void search_add_album(struct search_ctx *search_ctx) {
+	sp_search *search = search_ctx->search;
+	sp_album *album;
 
-	/* Load tracks */
-	search->num_tracks = 0;
-	for(i = 0, track_node = ezxml_get(root, "tracks", 0, "track", -1);
-	    track_node;
-	    i++, track_node = track_node->next) {
+	/* Never more than the total, when it's known */
+	if((search_ctx->found & SEARCH_XML_TOTAL_ALBUMS)
+		&& search->num_albums >= search_ctx->total_albums)
+		return;
 
-		if((node = ezxml_get(track_node, "id", -1)) == NULL)
-			return -1;
+	if(!(search_ctx->album.found & ALBUM_XML_ID)) {
+		search_ctx->found = -1;
+		return;
+	}
 
+	album = sp_album_add(search_ctx->session, search_ctx->album.id);
 
-		hex_ascii_to_bytes(node->txt, id, 16);
-		track = osfy_track_add(search_ctx->session, id);
+	if(!sp_album_is_loaded(album))
+		osfy_album_load_from_search_xml(search_ctx->session, album, &search_ctx->album);
 
-		if(!sp_track_is_loaded(track))
-			osfy_track_load_from_xml(search_ctx->session, track, track_node);
+	search->albums = realloc(search->albums, sizeof(sp_album *) * (1 + search->num_albums));
+	sp_album_add_ref(album);
+	search->albums[search->num_albums] = album;
+	search->num_albums++;
+}
 
-		search->tracks = realloc(search->tracks, sizeof(sp_track *) * (1 + search->num_tracks));
-		sp_track_add_ref(track);
-		search->tracks[search->num_tracks] = track;
-		search->num_tracks++;
+
+static void search_add_track(struct search_ctx *search_ctx) {
+	sp_search *search = search_ctx->search;
+	sp_track *track;
+
+	if(!(search_ctx->track.found & TRACK_XML_ID)) {
+		search_ctx->found = -1;
+		return;
 	}
 
+	track = osfy_track_add(search_ctx->session, search_ctx->track.id);
 
-	ezxml_free(root);
+	if(!sp_track_is_loaded(track))
+		osfy_track_load_from_xml(search_ctx->session, track, &search_ctx->track);
 
-	return 0;
+	search->tracks = realloc(search->tracks, sizeof(sp_track *) * (1 + search->num_tracks));
+	sp_track_add_ref(track);
+	search->tracks[search->num_tracks] = track;
+	search->num_tracks++;
 }
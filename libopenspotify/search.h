@@ -4,7 +4,10 @@
 #include <spotify/api.h>
 
 #include "buf.h"
+#include "metadata.h"
 #include "request.h"
+#include "xmlparser.h"
+#include "xmlreply.h"
 
 
 #define SEARCH_RETRY_TIMEOUT	30*1000
@@ -13,8 +16,19 @@
 struct search_ctx {
         sp_session *session;
         struct request *req;
-	struct buf *buf;
+	struct xml_reply *reply;
         sp_search *search;
+
+	/* The list and object being read, see search.c */
+	int section;
+	struct artist_xml artist;
+	struct album_xml album;
+	struct track_xml track;
+
+	/* Elements found so far, -1 if the XML is unusable */
+	int found;
+	int total_artists;
+	int total_albums;
 };
 
 
@@ -1,5 +1,6 @@
 /* $Id: shn.c 182 2009-03-12 08:21:53Z zagor $ */
-/* Shannon: Shannon stream cipher and MAC -- reference implementation */
+/* Shannon: Shannon stream cipher and MAC -- reference implementation,
+ * with the word loops unrolled over the register length */
 
 /*
 THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED
@@ -52,6 +53,29 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 	(b)[0] ^= Byte(w,0); \
 }
 
+/* Whole words straight from memory, where the byte order allows it.
+ * memcpy() is fine for unaligned pointers and compiles to a plain load.
+ */
+#if WORD_MAX == 0xffffffff && ((defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) \
+	|| defined(_M_IX86) || defined(_M_X64))
+static WORD loadword (UCHAR * b)
+{
+	WORD w;
+
+	memcpy (&w, b, 4);
+	return w;
+}
+static void storeword (WORD w, UCHAR * b)
+{
+	memcpy (b, &w, 4);
+}
+#define LOADWORD(b) loadword (b)
+#define STOREWORD(w, b) storeword ((w), (b))
+#else
+#define LOADWORD(b) BYTE2WORD (b)
+#define STOREWORD(w, b) WORD2BYTE ((w), (b))
+#endif
+
 /* Nonlinear transform (sbox) of a word.
  * There are two slightly different combinations.
  */
@@ -88,6 +112,35 @@ static void cycle (shn_ctx * c)
 	c->sbuf = t ^ c->R[8] ^ c->R[12];
 }
 
+/* cycle() without moving the register contents around.
+ * Register word i is kept in c->R[(i + z) % N] instead, so z goes up by one
+ * per cycle and the registers are back in place after N of them. This
+ * lets the loops below do N words in a row with constant indices.
+ */
+#define CYCLE_AT(c, z) { \
+	WORD t_; \
+	t_ = (c)->R[((z) + 12) % N] ^ (c)->R[((z) + 13) % N] ^ (c)->konst; \
+	t_ = sbox1 (t_) ^ ROTL ((c)->R[(z) % N], 1); \
+	(c)->R[(z) % N] = t_; \
+	t_ = sbox2 ((c)->R[((z) + 3) % N] ^ t_); \
+	(c)->R[((z) + 1) % N] ^= t_; \
+	(c)->sbuf = t_ ^ (c)->R[((z) + 9) % N] ^ (c)->R[((z) + 13) % N]; \
+}
+
+/* macfunc() to go with CYCLE_AT(), the CRC register rotates the same way */
+#define MACFUNC_AT(c, z, i) { \
+	(c)->CRC[(z) % N] ^= (c)->CRC[((z) + 2) % N] ^ (c)->CRC[((z) + 15) % N] ^ (i); \
+	(c)->R[((z) + 1 + KEYP) % N] ^= (i); \
+}
+
+/* Repeat a step for all N register positions */
+#define UNROLL_N(step) { \
+	step (0); step (1); step (2); step (3); \
+	step (4); step (5); step (6); step (7); \
+	step (8); step (9); step (10); step (11); \
+	step (12); step (13); step (14); step (15); \
+}
+
 /* The Shannon MAC function is modelled after the concepts of Phelix and SHA.
  * Basically, words to be accumulated in the MAC are incorporated in two
  * different ways:
@@ -170,10 +223,16 @@ static void shn_genkonst (shn_ctx * c)
 /* extra nonlinear diffusion of register for key and MAC */
 static void shn_diffuse (shn_ctx * c)
 {
+#if FOLD == N
+#define DIFFUSE_STEP(z) CYCLE_AT (c, z)
+	UNROLL_N (DIFFUSE_STEP);
+#undef DIFFUSE_STEP
+#else
 	int i;
 
 	for (i = 0; i < FOLD; ++i)
 		cycle (c);
+#endif
 }
 
 /* Common actions for loading key material
@@ -257,8 +316,17 @@ void shn_stream (shn_ctx * c, UCHAR * buf, int nbytes)
 		--nbytes;
 	}
 
-	/* handle whole words */
+	/* handle whole words, N at a time while we can */
 	endbuf = &buf[nbytes & ~((WORD) 0x03)];
+#define STREAM_STEP(z) { \
+	CYCLE_AT (c, z); \
+	STOREWORD (LOADWORD (buf + 4 * (z)) ^ c->sbuf, buf + 4 * (z)); \
+}
+	while (endbuf - buf >= 4 * N) {
+		UNROLL_N (STREAM_STEP);
+		buf += 4 * N;
+	}
+#undef STREAM_STEP
 	while (buf < endbuf) {
 		cycle (c);
 		XORWORD (c->sbuf, buf);
@@ -285,11 +353,12 @@ void shn_stream (shn_ctx * c, UCHAR * buf, int nbytes)
 void shn_maconly (shn_ctx * c, UCHAR * buf, int nbytes)
 {
 	UCHAR *endbuf;
+	WORD t;
 
 	/* handle any previously buffered bytes */
 	if (c->nbuf != 0) {
 		while (c->nbuf != 0 && nbytes != 0) {
-			c->mbuf ^= (*buf++) << (32 - c->nbuf);
+			c->mbuf ^= (WORD) (*buf++) << (32 - c->nbuf);
 			c->nbuf -= 8;
 			--nbytes;
 		}
@@ -299,11 +368,21 @@ void shn_maconly (shn_ctx * c, UCHAR * buf, int nbytes)
 		macfunc (c, c->mbuf);
 	}
 
-	/* handle whole words */
+	/* handle whole words, N at a time while we can */
 	endbuf = &buf[nbytes & ~((WORD) 0x03)];
+#define MACONLY_STEP(z) { \
+	CYCLE_AT (c, z); \
+	t = LOADWORD (buf + 4 * (z)); \
+	MACFUNC_AT (c, z, t); \
+}
+	while (endbuf - buf >= 4 * N) {
+		UNROLL_N (MACONLY_STEP);
+		buf += 4 * N;
+	}
+#undef MACONLY_STEP
 	while (buf < endbuf) {
 		cycle (c);
-		macfunc (c, BYTE2WORD (buf));
+		macfunc (c, LOADWORD (buf));
 		buf += 4;
 	}
 
@@ -314,7 +393,7 @@ void shn_maconly (shn_ctx * c, UCHAR * buf, int nbytes)
 		c->mbuf = 0;
 		c->nbuf = 32;
 		while (c->nbuf != 0 && nbytes != 0) {
-			c->mbuf ^= (*buf++) << (32 - c->nbuf);
+			c->mbuf ^= (WORD) (*buf++) << (32 - c->nbuf);
 			c->nbuf -= 8;
 			--nbytes;
 		}
@@ -332,7 +411,7 @@ void shn_encrypt (shn_ctx * c, UCHAR * buf, int nbytes)
 	/* handle any previously buffered bytes */
 	if (c->nbuf != 0) {
 		while (c->nbuf != 0 && nbytes != 0) {
-			c->mbuf ^= *buf << (32 - c->nbuf);
+			c->mbuf ^= (WORD) *buf << (32 - c->nbuf);
 			*buf ^= (c->sbuf >> (32 - c->nbuf)) & 0xFF;
 			++buf;
 			c->nbuf -= 8;
@@ -344,14 +423,25 @@ void shn_encrypt (shn_ctx * c, UCHAR * buf, int nbytes)
 		macfunc (c, c->mbuf);
 	}
 
-	/* handle whole words */
+	/* handle whole words, N at a time while we can */
 	endbuf = &buf[nbytes & ~((WORD) 0x03)];
+#define ENCRYPT_STEP(z) { \
+	CYCLE_AT (c, z); \
+	t = LOADWORD (buf + 4 * (z)); \
+	MACFUNC_AT (c, z, t); \
+	STOREWORD (t ^ c->sbuf, buf + 4 * (z)); \
+}
+	while (endbuf - buf >= 4 * N) {
+		UNROLL_N (ENCRYPT_STEP);
+		buf += 4 * N;
+	}
+#undef ENCRYPT_STEP
 	while (buf < endbuf) {
 		cycle (c);
-		t = BYTE2WORD (buf);
+		t = LOADWORD (buf);
 		macfunc (c, t);
 		t ^= c->sbuf;
-		WORD2BYTE (t, buf);
+		STOREWORD (t, buf);
 		buf += 4;
 	}
 
@@ -362,7 +452,7 @@ void shn_encrypt (shn_ctx * c, UCHAR * buf, int nbytes)
 		c->mbuf = 0;
 		c->nbuf = 32;
 		while (c->nbuf != 0 && nbytes != 0) {
-			c->mbuf ^= *buf << (32 - c->nbuf);
+			c->mbuf ^= (WORD) *buf << (32 - c->nbuf);
 			*buf ^= (c->sbuf >> (32 - c->nbuf)) & 0xFF;
 			++buf;
 			c->nbuf -= 8;
@@ -383,7 +473,7 @@ void shn_decrypt (shn_ctx * c, UCHAR * buf, int nbytes)
 	if (c->nbuf != 0) {
 		while (c->nbuf != 0 && nbytes != 0) {
 			*buf ^= (c->sbuf >> (32 - c->nbuf)) & 0xFF;
-			c->mbuf ^= *buf << (32 - c->nbuf);
+			c->mbuf ^= (WORD) *buf << (32 - c->nbuf);
 			++buf;
 			c->nbuf -= 8;
 			--nbytes;
@@ -394,13 +484,24 @@ void shn_decrypt (shn_ctx * c, UCHAR * buf, int nbytes)
 		macfunc (c, c->mbuf);
 	}
 
-	/* handle whole words */
+	/* handle whole words, N at a time while we can */
 	endbuf = &buf[nbytes & ~((WORD) 0x03)];
+#define DECRYPT_STEP(z) { \
+	CYCLE_AT (c, z); \
+	t = LOADWORD (buf + 4 * (z)) ^ c->sbuf; \
+	MACFUNC_AT (c, z, t); \
+	STOREWORD (t, buf + 4 * (z)); \
+}
+	while (endbuf - buf >= 4 * N) {
+		UNROLL_N (DECRYPT_STEP);
+		buf += 4 * N;
+	}
+#undef DECRYPT_STEP
 	while (buf < endbuf) {
 		cycle (c);
-		t = BYTE2WORD (buf) ^ c->sbuf;
+		t = LOADWORD (buf) ^ c->sbuf;
 		macfunc (c, t);
-		WORD2BYTE (t, buf);
+		STOREWORD (t, buf);
 		buf += 4;
 	}
 
@@ -412,7 +513,7 @@ void shn_decrypt (shn_ctx * c, UCHAR * buf, int nbytes)
 		c->nbuf = 32;
 		while (c->nbuf != 0 && nbytes != 0) {
 			*buf ^= (c->sbuf >> (32 - c->nbuf)) & 0xFF;
-			c->mbuf ^= *buf << (32 - c->nbuf);
+			c->mbuf ^= (WORD) *buf << (32 - c->nbuf);
 			++buf;
 			c->nbuf -= 8;
 			--nbytes;
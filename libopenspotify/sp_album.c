@@ -8,7 +8,6 @@
 #include "artist.h"
 #include "browse.h"
 #include "debug.h"
-#include "ezxml.h"
 #include "image.h"
 #include "request.h"
 #include "sp_opaque.h"
@@ -142,10 +141,7 @@ void osfy_album_free(sp_album *album) {
 
 
 /* Load an album from XML returned by album browsing */
-int osfy_album_load_from_album_xml(sp_session *session, sp_album *album, ezxml_t album_node) {
-	unsigned char id[20];
-	const char *str;
-	ezxml_t node;
+int osfy_album_load_from_album_xml(sp_session *session, sp_album *album, struct album_xml *xml) {
 
 	{
 		char buf[33];
@@ -154,73 +150,58 @@ int osfy_album_load_from_album_xml(sp_session *session, sp_album *album, ezxml_t
 	}
 
 	/* Verify we're loading XML for the expected album ID */
-	if((node = ezxml_get(album_node, "id", -1)) == NULL) {
+	if(!(xml->found & ALBUM_XML_ID)) {
 		DSFYDEBUG("Failed to find element 'id'\n");
 		return -1;
 	}
 
-	hex_ascii_to_bytes(node->txt, id, sizeof(album->id));
-	if(memcmp(album->id, id, sizeof(album->id)) != 0) {
+	if(memcmp(album->id, xml->id, sizeof(album->id)) != 0) {
 		/*
 		 * XXX - This used to be an assert() - safe to ignore?
 		 * A browse for album ID 'A' might return album with ID 'B'
 		 *
 		 */
-		DSFYDEBUG("Browse returned ID '%s' instead of the one we expected\n", node->txt);
+		DSFYDEBUG("Browse returned a different ID than the one we expected\n");
 	}
 
 
 	/* Album name */
-	if((node = ezxml_get(album_node, "name", -1)) == NULL) {
+	if(!(xml->found & ALBUM_XML_NAME)) {
 		DSFYDEBUG("Failed to find element 'name'\n");
 		return -1;
 	}
 
-	album->name = realloc(album->name, strlen(node->txt) + 1);
-	strcpy(album->name, node->txt);
+	album->name = realloc(album->name, strlen(xml->name) + 1);
+	strcpy(album->name, xml->name);
 
 
 	/* Album year. Might be empty, i.e '<year/>' */
-	if((node = ezxml_get(album_node, "year", -1)) == NULL) {
+	if(!(xml->found & ALBUM_XML_YEAR)) {
 		DSFYDEBUG("Failed to find element 'year'\n");
 		return -1;
 	}
 
-	DSFYDEBUG("Got album year '%s'\n", node->txt);
-	album->year = atoi(node->txt);
+	DSFYDEBUG("Got album year %d\n", xml->year);
+	album->year = xml->year;
 
 
 	/* Country restrictions */
-	for(node = ezxml_get(album_node, "restrictions", 0, "restriction", -1);
-	    node;
-	    node = node->next) {
-		str = ezxml_attr(node, "catalogues");
-
-		/* There might be restrictions that do not apply for premium users */
-		if(!str || !strstr(str, "premium"))
-			continue;
-
-		if((str = ezxml_attr(node, "allowed")) != NULL) {
-			album->allowed_countries = realloc(album->allowed_countries, strlen(str) + 1);
-			strcpy(album->allowed_countries, str);
+	if(xml->restriction.allowed_countries) {
+		album->allowed_countries = realloc(album->allowed_countries, strlen(xml->restriction.allowed_countries) + 1);
+		strcpy(album->allowed_countries, xml->restriction.allowed_countries);
+	}
 
-			if(strstr(album->allowed_countries, session->country))
-				album->is_available = 1;
-		}
+	if(xml->restriction.restricted_countries) {
+		album->restricted_countries = realloc(album->restricted_countries, strlen(xml->restriction.restricted_countries) + 1);
+		strcpy(album->restricted_countries, xml->restriction.restricted_countries);
+	}
 
-		if((str = ezxml_attr(node, "forbidden")) != NULL) {
-			album->restricted_countries = realloc(album->restricted_countries, strlen(str) + 1);
-			strcpy(album->restricted_countries, str);
+	if(xml->restriction.allowed_countries || xml->restriction.restricted_countries)
+		album->is_available = xml->restriction.is_available;
 
-			if(strstr(album->restricted_countries, session->country))
-				album->is_available = 0;
-			else
-				album->is_available = 1;
-		}
-	}
 
 	/* Album artist */
-	if((node = ezxml_get(album_node, "artist-id", -1)) == NULL) {
+	if(xml->artist_list.num_artists == 0 || !(xml->artist_list.artists[0].found & ARTIST_XML_ID)) {
 		DSFYDEBUG("Failed to find element 'artist-id'\n");
 		return -1;
 	}
@@ -228,8 +209,7 @@ int osfy_album_load_from_album_xml(sp_session *session, sp_album *album, ezxml_t
 	if(album->artist != NULL)
 		sp_artist_release(album->artist);
 
-	hex_ascii_to_bytes(node->txt, id, 16);
-	album->artist = osfy_artist_add(session, id);
+	album->artist = osfy_artist_add(session, xml->artist_list.artists[0].id);
 	sp_artist_add_ref(album->artist);
 
 	if(sp_artist_is_loaded(album->artist) == 0) {
@@ -245,7 +225,7 @@ int osfy_album_load_from_album_xml(sp_session *session, sp_album *album, ezxml_t
 		 * just returns artist information in elements such as 
 		 * 'artist' (name) and 'artist-id' (id)
 		 */
-		osfy_artist_load_track_artist_from_xml(session, album->artist, album_node);
+		osfy_artist_load_track_artist_from_xml(session, album->artist, xml->artist_list.artists, xml->artist_list.num_artists);
 	}
 
 	assert(sp_artist_is_loaded(album->artist));
@@ -255,16 +235,9 @@ int osfy_album_load_from_album_xml(sp_session *session, sp_album *album, ezxml_t
 	 * Load album type
 	 * FIXME: Not sure if this code is actually used ever.
 	 */
-	if((node = ezxml_get(album_node, "album-type", -1)) != NULL) {
-		DSFYDEBUG("Got album-type %s\n", node->txt);
-		if(!strcmp(node->txt, "album"))
-			album->type = SP_ALBUMTYPE_ALBUM;
-		else if(!strcmp(node->txt, "single"))
-			album->type = SP_ALBUMTYPE_SINGLE;
-		else if(!strcmp(node->txt, "compilation"))
-			album->type = SP_ALBUMTYPE_COMPILATION;
-		else
-			album->type = SP_ALBUMTYPE_UNKNOWN;
+	if(xml->found & ALBUM_XML_TYPE) {
+		DSFYDEBUG("Got album-type %d\n", xml->type);
+		album->type = xml->type;
 	}
 	else
 		DSFYDEBUG("Failed to find album-type element\n");
@@ -275,9 +248,8 @@ int osfy_album_load_from_album_xml(sp_session *session, sp_album *album, ezxml_t
 		sp_image_release(album->image);
 
 	album->image = NULL;
-	if((node = ezxml_get(album_node, "cover", -1)) != NULL) {
-		hex_ascii_to_bytes(node->txt, id, 20);
-		album->image = osfy_image_create(session, id);
+	if(xml->found & ALBUM_XML_COVER) {
+		album->image = osfy_image_create(session, xml->cover);
 		sp_image_add_ref(album->image);
 	}
 	else {
@@ -293,10 +265,7 @@ int osfy_album_load_from_album_xml(sp_session *session, sp_album *album, ezxml_t
 
 
 /* Load an album from XML returned by searching */
-int osfy_album_load_from_search_xml(sp_session *session, sp_album *album, ezxml_t album_node) {
-	unsigned char id[20];
-	const char *str;
-	ezxml_t node;
+int osfy_album_load_from_search_xml(sp_session *session, sp_album *album, struct album_xml *xml) {
 
 	{
 		char buf[33];
@@ -305,64 +274,44 @@ int osfy_album_load_from_search_xml(sp_session *session, sp_album *album, ezxml_
 	}
 
 	/* Verify we're loading XML for the expected album ID */
-	if((node = ezxml_get(album_node, "id", -1)) == NULL) {
+	if(!(xml->found & ALBUM_XML_ID)) {
 		DSFYDEBUG("Failed to find element 'id'\n");
 		return -1;
 	}
 
-	hex_ascii_to_bytes(node->txt, id, sizeof(album->id));
-	assert(memcmp(album->id, id, sizeof(album->id)) == 0);
+	assert(memcmp(album->id, xml->id, sizeof(album->id)) == 0);
 
 
 	/* Album name */
-	if((node = ezxml_get(album_node, "name", -1)) == NULL) {
+	if(!(xml->found & ALBUM_XML_NAME)) {
 		DSFYDEBUG("Failed to find element 'name'\n");
 		return -1;
 	}
 
-	album->name = realloc(album->name, strlen(node->txt) + 1);
-	strcpy(album->name, node->txt);
+	album->name = realloc(album->name, strlen(xml->name) + 1);
+	strcpy(album->name, xml->name);
 
 
 	/* Album year */
-	if((node = ezxml_get(album_node, "year", -1)) != NULL)
-		album->year = atoi(node->txt);
+	if(xml->found & ALBUM_XML_YEAR)
+		album->year = xml->year;
 
 
 	/* Country restrictions */
 	assert(album->allowed_countries == NULL);
 	assert(album->restricted_countries == NULL);
-	for(node = ezxml_get(album_node, "restrictions", 0, "restriction", -1);
-	    node;
-	    node = node->next) {
-		str = ezxml_attr(node, "catalogues");
+	if(xml->restriction.allowed_countries)
+		album->allowed_countries = strdup(xml->restriction.allowed_countries);
 
-		/* There might be restrictions that do not apply for premium users */
-		if(!str || !strstr(str, "premium"))
-			continue;
+	if(xml->restriction.restricted_countries)
+		album->restricted_countries = strdup(xml->restriction.restricted_countries);
 
-		if((str = ezxml_attr(node, "allowed")) != NULL) {
-			album->allowed_countries = realloc(album->allowed_countries, strlen(str) + 1);
-			strcpy(album->allowed_countries, str);
-
-			if(strstr(album->allowed_countries, session->country))
-				album->is_available = 1;
-		}
-
-		if((str = ezxml_attr(node, "forbidden")) != NULL) {
-			album->restricted_countries = realloc(album->restricted_countries, strlen(str) + 1);
-			strcpy(album->restricted_countries, str);
-
-			if(strstr(album->restricted_countries, session->country))
-				album->is_available = 0;
-			else
-				album->is_available = 1;
-		}
-	}
+	if(xml->restriction.allowed_countries || xml->restriction.restricted_countries)
+		album->is_available = xml->restriction.is_available;
 
 
 	/* Album artist */
-	if((node = ezxml_get(album_node, "artist-id", -1)) == NULL) {
+	if(xml->artist_list.num_artists == 0 || !(xml->artist_list.artists[0].found & ARTIST_XML_ID)) {
 		DSFYDEBUG("Failed to find element 'artist-id'\n");
 		return -1;
 	}
@@ -370,8 +319,7 @@ int osfy_album_load_from_search_xml(sp_session *session, sp_album *album, ezxml_
 	if(album->artist != NULL)
 		sp_artist_release(album->artist);
 
-	hex_ascii_to_bytes(node->txt, id, 16);
-	album->artist = osfy_artist_add(session, id);
+	album->artist = osfy_artist_add(session, xml->artist_list.artists[0].id);
 	sp_artist_add_ref(album->artist);
 
 	if(sp_artist_is_loaded(album->artist) == 0) {
@@ -381,9 +329,9 @@ int osfy_album_load_from_search_xml(sp_session *session, sp_album *album, ezxml_
 			DSFYDEBUG("Artist '%s' not yet loaded, trying to load from search XML\n", buf);
 		}
 
-		if((node = ezxml_get(album_node, "artist-name", -1)) != NULL) {
-			album->artist->name = realloc(album->artist->name, strlen(node->txt) + 1);
-			strcpy(album->artist->name, node->txt);
+		if(xml->found & ALBUM_XML_ARTIST_NAME) {
+			album->artist->name = realloc(album->artist->name, strlen(xml->artist_name) + 1);
+			strcpy(album->artist->name, xml->artist_name);
 
 			album->artist->is_loaded = 1;
 		}
@@ -393,7 +341,7 @@ int osfy_album_load_from_search_xml(sp_session *session, sp_album *album, ezxml_
 
 
 	/* Album cover */
-	if((node = ezxml_get(album_node, "cover", -1)) == NULL) {
+	if(!(xml->found & ALBUM_XML_COVER)) {
 		DSFYDEBUG("Failed to find element 'cover'\n");
 		return -1;
 	}
@@ -401,8 +349,7 @@ int osfy_album_load_from_search_xml(sp_session *session, sp_album *album, ezxml_
 	if(album->image != NULL)
 		sp_image_release(album->image);
 
-	hex_ascii_to_bytes(node->txt, id, 20);
-	album->image = osfy_image_create(session, id);
+	album->image = osfy_image_create(session, xml->cover);
 	sp_image_add_ref(album->image);
 
 
@@ -414,9 +361,7 @@ int osfy_album_load_from_search_xml(sp_session *session, sp_album *album, ezxml_
 
 
 /* Load album from XML returned by track browsing */
-int osfy_album_load_from_track_xml(sp_session *session, sp_album *album, ezxml_t album_node) {
-	unsigned char id[20];
-	ezxml_t node;
+int osfy_album_load_from_track_xml(sp_session *session, sp_album *album, struct track_xml *xml) {
 
 	{
 		char buf[33];
@@ -425,48 +370,45 @@ int osfy_album_load_from_track_xml(sp_session *session, sp_album *album, ezxml_t
 	}
 
 	/* Verify we're loading XML for the expected album ID */
-	if((node = ezxml_get(album_node, "album-id", -1)) == NULL) {
+	if(!(xml->found & TRACK_XML_ALBUM_ID)) {
 		DSFYDEBUG("Failed to find element 'album-id'\n");
 		return -1;
 	}
 
-	hex_ascii_to_bytes(node->txt, id, sizeof(album->id));
-	assert(memcmp(album->id, id, sizeof(album->id)) == 0);
+	assert(memcmp(album->id, xml->album_id, sizeof(album->id)) == 0);
 
 
 	/* Album name */
-	if((node = ezxml_get(album_node, "album", -1)) == NULL) {
+	if(!(xml->found & TRACK_XML_ALBUM)) {
 		DSFYDEBUG("Failed to find element 'album'\n");
 		return -1;
 	}
 
-	album->name = realloc(album->name, strlen(node->txt) + 1);
-	strcpy(album->name, node->txt);
+	album->name = realloc(album->name, strlen(xml->album) + 1);
+	strcpy(album->name, xml->album);
 
 
 	/* Album year */
-	if((node = ezxml_get(album_node, "year", -1)) == NULL) {
+	if(!(xml->found & TRACK_XML_YEAR)) {
 		DSFYDEBUG("Failed to find element 'year'\n");
 		return -1;
 	}
 
-	album->year = atoi(node->txt);
+	album->year = xml->year;
 
 
 	/* Album artist */
-	if((node = ezxml_get(album_node, "album-artist-id", -1)) == NULL) {
+	if(!(xml->found & TRACK_XML_ALBUM_ARTIST_ID)) {
 		DSFYDEBUG("Failed to find element 'album-artist-id'\n");
 		return -1;
 	}
 
-	hex_ascii_to_bytes(node->txt, id, 16);
-
 
 	/* Add artist to album */
 	if(album->artist != NULL)
 		sp_artist_release(album->artist);
 
-	album->artist = osfy_artist_add(session, id);
+	album->artist = osfy_artist_add(session, xml->album_artist_id);
 	sp_artist_add_ref(album->artist);
 
 	/* Load album from XML if necessary */
@@ -477,25 +419,23 @@ int osfy_album_load_from_track_xml(sp_session *session, sp_album *album, ezxml_t
 			DSFYDEBUG("Artist '%s' not yet loaded, trying to load from XML\n", buf);
 		}
 
-		osfy_artist_load_album_artist_from_xml(session, album->artist, album_node);
+		osfy_artist_load_album_artist_from_xml(session, album->artist, xml);
 	}
 
 	assert(sp_artist_is_loaded(album->artist) != 0);
 
 
 	/* Album cover */
-	if((node = ezxml_get(album_node, "cover", -1)) == NULL) {
+	if(!(xml->found & TRACK_XML_COVER)) {
 		DSFYDEBUG("Failed to find element 'cover'\n");
 		return -1;
 	}
 
-	hex_ascii_to_bytes(node->txt, id, 20);
-
 	/* Add cover to album */
 	if(album->image != NULL)
 		sp_image_release(album->image);
 
-	album->image = osfy_image_create(session, id);
+	album->image = osfy_image_create(session, xml->cover);
 	sp_image_add_ref(album->image);
 
 
@@ -505,6 +445,8 @@ int osfy_album_load_from_track_xml(sp_session *session, sp_album *album, ezxml_t
 	return 0;
 }
 
+static void osfy_album_browse_xml_start(void *arg, int depth, const char *name, const char **attrs);
+static void osfy_album_browse_xml_end(void *arg, int depth, const char *name, char *text);
 static int osfy_album_browse_callback(struct browse_callback_ctx *brctx);
 
 /*
@@ -535,7 +477,7 @@ int osfy_album_browse(sp_session *session, sp_album *album) {
 
 	brctx->session = session;
 	brctx->req = NULL; /* Filled in by the request processor */
-	brctx->buf = NULL; /* Filled in by the request processor */
+	brctx->reply = NULL; /* Filled in by the request processor */
 
 	brctx->type = REQ_TYPE_BROWSE_ALBUM;
 	brctx->data.albums = albums;
@@ -544,8 +486,10 @@ int osfy_album_browse(sp_session *session, sp_album *album) {
 	brctx->num_in_request = 0;
 
 
-	/* Our gzip'd XML parser */
+	/* Our XML handlers */
 	brctx->browse_parser = osfy_album_browse_callback;
+	brctx->xml_start = osfy_album_browse_xml_start;
+	brctx->xml_end = osfy_album_browse_xml_end;
 
 	/* Request input container. Will be free'd when the request is finished. */
 	container = (void **)malloc(sizeof(void *));
@@ -555,47 +499,40 @@ int osfy_album_browse(sp_session *session, sp_album *album) {
 }
 
 
-static int osfy_album_browse_callback(struct browse_callback_ctx *brctx) {
+static void osfy_album_browse_xml_start(void *arg, int depth, const char *name, const char **attrs) {
+	struct browse_callback_ctx *brctx = (struct browse_callback_ctx *)arg;
+
+	if(depth > 1)
+		album_xml_start(&brctx->album, depth - 1, name, attrs);
+}
+
+
+/* The album is the root element, load it when it closes */
+static void osfy_album_browse_xml_end(void *arg, int depth, const char *name, char *text) {
+	struct browse_callback_ctx *brctx = (struct browse_callback_ctx *)arg;
 	sp_album **albums;
 	int i;
-	struct buf *xml;
-	ezxml_t root;
-
-	xml = despotify_inflate(brctx->buf->ptr, brctx->buf->len);
-#ifdef DEBUG
-	{
-		FILE *fd;
-		DSFYDEBUG("Decompresed %d bytes data, xml=%p\n",
-			  brctx->buf->len, xml);
-		fd = fopen("browse-albums.xml", "w");
-		if(fd) {
-			fwrite(xml->ptr, xml->len, 1, fd);
-			fclose(fd);
-		}
-	}
-#endif
 
-	root = ezxml_parse_str((char *) xml->ptr, xml->len);
-	if(root == NULL) {
-		DSFYDEBUG("Failed to parse XML\n");
-		buf_free(xml);
-		return -1;
+	if(depth > 1) {
+		album_xml_end(&brctx->album, depth - 1, name, text);
+		return;
 	}
 
 	albums = brctx->data.albums;
 	for(i = 0; i < brctx->num_in_request; i++) {
-		osfy_album_load_from_album_xml(brctx->session, albums[brctx->num_browsed + i], root);
+		osfy_album_load_from_album_xml(brctx->session, albums[brctx->num_browsed + i], &brctx->album);
 		assert(sp_album_is_loaded(albums[brctx->num_browsed + i]));
 	}
+}
 
 
-	ezxml_free(root);
-	buf_free(xml);
+static int osfy_album_browse_callback(struct browse_callback_ctx *brctx) {
+	int i;
 
 
 	/* Release references made in osfy_album_browse() */
 	for(i = 0; i < brctx->num_in_request; i++)
-		sp_album_release(albums[brctx->num_browsed + i]);
+		sp_album_release(brctx->data.albums[brctx->num_browsed + i]);
 
 
 	return 0;
@@ -8,15 +8,18 @@
 #include "artist.h"
 #include "browse.h"
 #include "debug.h"
-#include "ezxml.h"
 #include "request.h"
 #include "sp_opaque.h"
 #include "track.h"
 #include "util.h"
 
 
+static void osfy_albumbrowse_xml_start(void *arg, int depth, const char *name, const char **attrs);
+static void osfy_albumbrowse_xml_end(void *arg, int depth, const char *name, char *text);
 static int osfy_albumbrowse_browse_callback(struct browse_callback_ctx *brctx);
-static int osfy_albumbrowse_load_from_xml(sp_session *session, sp_albumbrowse *alb, ezxml_t root);
+static void osfy_albumbrowse_reset(sp_albumbrowse *alb);
+static int osfy_albumbrowse_load_album(sp_session *session, sp_albumbrowse *alb, struct album_xml *xml);
+static void osfy_albumbrowse_add_track(sp_session *session, sp_albumbrowse *alb, struct track_xml *xml, int disc_number, int index);
 
 
 SP_LIBEXPORT(sp_albumbrowse *) sp_albumbrowse_create(sp_session *session, sp_album *album, albumbrowse_complete_cb *callback, void *userdata) {
@@ -66,7 +69,7 @@ SP_LIBEXPORT(sp_albumbrowse *) sp_albumbrowse_create(sp_session *session, sp_alb
 
 	brctx->session = session;
 	brctx->req = NULL; /* Filled in by the request processor */
-	brctx->buf = NULL; /* Filled in by the request processor */
+	brctx->reply = NULL; /* Filled in by the request processor */
 
 	brctx->type = REQ_TYPE_ALBUMBROWSE;
 	brctx->data.albumbrowses = (sp_albumbrowse **)malloc(sizeof(sp_albumbrowse *));
@@ -76,8 +79,10 @@ SP_LIBEXPORT(sp_albumbrowse *) sp_albumbrowse_create(sp_session *session, sp_alb
 	brctx->num_in_request = 0;
 
 
-	/* Our gzip'd XML parser */
+	/* Our XML handlers */
 	brctx->browse_parser = osfy_albumbrowse_browse_callback;
+	brctx->xml_start = osfy_albumbrowse_xml_start;
+	brctx->xml_end = osfy_albumbrowse_xml_end;
 
 	/* Request input container. Will be free'd when the request is finished. */
 	container = (void **)malloc(sizeof(void *));
@@ -90,54 +95,123 @@ SP_LIBEXPORT(sp_albumbrowse *) sp_albumbrowse_create(sp_session *session, sp_alb
 }
 
 
-static int osfy_albumbrowse_browse_callback(struct browse_callback_ctx *brctx) {
-	sp_albumbrowse *alb;
+/*
+ * The album is the root element, with the tracks at <discs><disc><track>
+ * brctx->section is 0 until the album and its artist have been loaded,
+ * which is done before the first track, 1 once they have and -1 if they
+ * couldn't be.
+ *
+ */
+static void osfy_albumbrowse_xml_start(void *arg, int depth, const char *name, const char **attrs) {
+	struct browse_callback_ctx *brctx = (struct browse_callback_ctx *)arg;
 	int i;
-	struct buf *xml;
-	ezxml_t root;
 
-	for(i = 0; i < brctx->num_in_request; i++) {
-		alb = brctx->data.albumbrowses[brctx->num_browsed + i];
+	if(depth == 1) {
+		/* Start over if an earlier attempt failed half way */
+		for(i = 0; i < brctx->num_in_request; i++)
+			osfy_albumbrowse_reset(brctx->data.albumbrowses[brctx->num_browsed + i]);
 
-		/* Set defaults */
-		alb->is_loaded = 0;
-		alb->error = SP_ERROR_OTHER_TRANSIENT;
+		return;
 	}
 
-	/* Might happen because of a channel error */
-	if(brctx->buf == NULL)
-		return 0;
+	album_xml_start(&brctx->album, depth - 1, name, attrs);
 
-
-	xml = despotify_inflate(brctx->buf->ptr, brctx->buf->len);
-#ifdef DEBUG
-	{
-		FILE *fd;
-		DSFYDEBUG("Decompresed %d bytes data, xml=%p\n",
-			  brctx->buf->len, xml);
-		fd = fopen("browse-albumbrowse.xml", "w");
-		if(fd) {
-			fwrite(xml->ptr, xml->len, 1, fd);
-			fclose(fd);
-		}
+	if(depth == 2 && !strcmp(name, "discs") && brctx->section == 0) {
+		brctx->section = 1;
+		for(i = 0; i < brctx->num_in_request; i++)
+			if(osfy_albumbrowse_load_album(brctx->session, brctx->data.albumbrowses[brctx->num_browsed + i], &brctx->album))
+				brctx->section = -1;
+	}
+	else if(depth == 3 && !strcmp(name, "disc")) {
+		brctx->disc_number = -1;
+		brctx->disc_index = 0;
 	}
-#endif
+	else if(depth == 4 && !strcmp(name, "track")) {
+		track_xml_free(&brctx->track);
+		brctx->disc_index++;
+	}
+	else if(depth > 4)
+		track_xml_start(&brctx->track, depth - 4, name, attrs);
+}
 
-	root = ezxml_parse_str((char *) xml->ptr, xml->len);
-	if(root == NULL) {
-		DSFYDEBUG("Failed to parse XML\n");
-		buf_free(xml);
-		return -1;
+
+static void osfy_albumbrowse_xml_end(void *arg, int depth, const char *name, char *text) {
+	struct browse_callback_ctx *brctx = (struct browse_callback_ctx *)arg;
+	sp_albumbrowse *alb;
+	int i;
+
+	if(depth > 4) {
+		track_xml_end(&brctx->track, depth - 4, name, text);
+		return;
 	}
 
+	if(depth > 1)
+		album_xml_end(&brctx->album, depth - 1, name, text);
+
 	for(i = 0; i < brctx->num_in_request; i++) {
 		alb = brctx->data.albumbrowses[brctx->num_browsed + i];
-		osfy_albumbrowse_load_from_xml(brctx->session, alb, root);
+
+		if(depth == 4 && !strcmp(name, "disc-number")) {
+			/* Cache disc number */
+			brctx->disc_number = atoi(text);
+		}
+		else if(depth == 4 && !strcmp(name, "track")) {
+			if(brctx->section == 1 && brctx->disc_number >= 0)
+				osfy_albumbrowse_add_track(brctx->session, alb, &brctx->track, brctx->disc_number, brctx->disc_index);
+		}
+		else if(depth == 3 && !strcmp(name, "disc")) {
+			if(brctx->disc_number < 0) {
+				DSFYDEBUG("BUG: Found no 'disc-numner' under discs -> disc\n");
+			}
+			else if(brctx->section == 1)
+				assert(alb->num_tracks > 0);
+		}
+		else if(depth == 3 && !strcmp(name, "c")) {
+			/* Add copyright text */
+			alb->copyrights = realloc(alb->copyrights, sizeof(char *) * (1 + alb->num_copyrights));
+			alb->copyrights[alb->num_copyrights] = strdup(text);
+			alb->num_copyrights++;
+		}
+		else if(depth == 2 && !strcmp(name, "review")) {
+			if(alb->review)
+				free(alb->review);
+
+			alb->review = strdup(text);
+		}
+		else if(depth == 1) {
+			/* Albums without tracks have no 'discs' element */
+			if(brctx->section == 0 && osfy_albumbrowse_load_album(brctx->session, alb, &brctx->album))
+				continue;
+
+			if(brctx->section < 0)
+				continue;
+
+			if(alb->review == NULL)
+				alb->review = strdup("");
+
+			alb->is_loaded = 1;
+			alb->error = SP_ERROR_OK;
+		}
 	}
+}
+
+
+static int osfy_albumbrowse_browse_callback(struct browse_callback_ctx *brctx) {
+	sp_albumbrowse *alb;
+	int i;
 
+	/* Might happen because of a channel error */
+	if(brctx->reply == NULL) {
+		for(i = 0; i < brctx->num_in_request; i++) {
+			alb = brctx->data.albumbrowses[brctx->num_browsed + i];
 
-	ezxml_free(root);
-	buf_free(xml);
+			/* Set defaults */
+			alb->is_loaded = 0;
+			alb->error = SP_ERROR_OTHER_TRANSIENT;
+		}
+
+		return 0;
+	}
 
 
 	/* Release references made in sp_albumbrowse_create() */
@@ -149,142 +223,130 @@ static int osfy_albumbrowse_browse_callback(struct browse_callback_ctx *brctx) {
 }
 
 
-static int osfy_albumbrowse_load_from_xml(sp_session *session, sp_albumbrowse *alb, ezxml_t root) {
-	unsigned char id[20];
-	int disc_number, i;
-	sp_track *track;
-	ezxml_t node, loop_node, track_node;
+/* Set defaults and drop what an earlier attempt added */
+static void osfy_albumbrowse_reset(sp_albumbrowse *alb) {
+	int i;
+
+	alb->is_loaded = 0;
+	alb->error = SP_ERROR_OTHER_TRANSIENT;
+
+	for(i = 0; i < alb->num_tracks; i++)
+		sp_track_release(alb->tracks[i]);
+
+	if(alb->num_tracks)
+		free(alb->tracks);
+
+	alb->num_tracks = 0;
+	alb->tracks = NULL;
+
+
+	for(i = 0; i < alb->num_copyrights; i++)
+		free(alb->copyrights[i]);
+
+	if(alb->num_copyrights)
+		free(alb->copyrights);
+
+	alb->num_copyrights = 0;
+	alb->copyrights = NULL;
+
+
+	if(alb->review)
+		free(alb->review);
+
+	alb->review = NULL;
+
+
+	if(alb->artist)
+		sp_artist_release(alb->artist);
+
+	alb->artist = NULL;
+}
+
+
+/* Load the album and its artist, the album's elements have been read by now */
+static int osfy_albumbrowse_load_album(sp_session *session, sp_albumbrowse *alb, struct album_xml *xml) {
 
 
 	/* Load album from XML if not yet loaded */
 	DSFYDEBUG("Loading from XML\n");
 	if(sp_album_is_loaded(alb->album) == 0)
-		osfy_album_load_from_album_xml(session, alb->album, root);
+		osfy_album_load_from_album_xml(session, alb->album, xml);
 
 
 	/* Load album type */
-	if((node = ezxml_get(root, "album-type", -1)) != NULL) {
-		if(!strcmp(node->txt, "album"))
-			alb->album->type = SP_ALBUMTYPE_ALBUM;
-		else if(!strcmp(node->txt, "single"))
-			alb->album->type = SP_ALBUMTYPE_SINGLE;
-		else if(!strcmp(node->txt, "compilation"))
-			alb->album->type = SP_ALBUMTYPE_COMPILATION;
-		else
-			alb->album->type = SP_ALBUMTYPE_UNKNOWN;
-	}
+	if(xml->found & ALBUM_XML_TYPE)
+		alb->album->type = xml->type;
 
 
 	/* Load artist */
-	if((node = ezxml_get(root, "artist-id", -1)) == NULL) {
+	if(xml->artist_list.num_artists == 0 || !(xml->artist_list.artists[0].found & ARTIST_XML_ID)) {
 		DSFYDEBUG("Failed to find element 'artist-id'\n");
 		alb->error = SP_ERROR_OTHER_PERMANENT;
 		return -1;
 	}
 
 
-	hex_ascii_to_bytes(node->txt, id, 16);
-	alb->artist = osfy_artist_add(session, id);
+	alb->artist = osfy_artist_add(session, xml->artist_list.artists[0].id);
 	sp_artist_add_ref(alb->artist);
 	if(sp_artist_is_loaded(alb->artist) == 0) {
-		DSFYDEBUG("Loading artist '%s' from XML returned by album browsing\n", node->txt);
-		osfy_artist_load_track_artist_from_xml(session, alb->artist, root);
+		DSFYDEBUG("Loading artist from XML returned by album browsing\n");
+		osfy_artist_load_track_artist_from_xml(session, alb->artist, xml->artist_list.artists, xml->artist_list.num_artists);
 	}
 
 	assert(sp_artist_is_loaded(alb->artist));
 
+	return 0;
+}
 
-	/* Loop over each disc and add tracks */
-	assert(alb->num_tracks == 0);
-	for(loop_node = ezxml_get(root, "discs", 0, "disc", -1);
-	    loop_node;
-	    loop_node = loop_node->next) {
-
-		/* Cache disc number */
-		if((node = ezxml_get(loop_node, "disc-number", -1)) == NULL) {
-			DSFYDEBUG("BUG: Found no 'disc-numner' under discs -> disc\n");
-			continue;
-		}
-
-		disc_number = atoi(node->txt);
-
-
-		/* Loop over each track and add it to the albumbrowse tracks list */
-		for(track_node = ezxml_get(loop_node, "track", -1), i = 1;
-		    track_node;
-		    track_node = track_node->next, i++) {
-
-			/* Extract track ID and add it */
-			if((node = ezxml_get(track_node, "id", -1)) == NULL)
-				continue;
-
-			hex_ascii_to_bytes(node->txt, id, 16);
-			track = osfy_track_add(session, id);
-
-
-			/* Load track details from XML if not already loaded */
-			if(sp_track_is_loaded(track) == 0)
-				osfy_track_load_from_xml(session, track, track_node);
-
-			assert(sp_track_is_loaded(track));
 
+/* Add a track from one of the album's discs to the albumbrowse tracks list */
+static void osfy_albumbrowse_add_track(sp_session *session, sp_albumbrowse *alb, struct track_xml *xml, int disc_number, int index) {
+	sp_track *track;
 
-			/* Set disc number */
-			track->disc = disc_number;
 
+	/* Extract track ID and add it */
+	if(!(xml->found & TRACK_XML_ID))
+		return;
 
-			/* Set album (as it's not available under the track node) */
-			if(track->album == NULL) {
-				track->album = alb->album;
-				sp_album_add_ref(track->album);
-			}
+	track = osfy_track_add(session, xml->id);
 
 
-			/* Mark track as available if the album is available and the album has a non-zero duration (i.e, associated files) */
-			if(!track->is_available && track->duration) {
-				DSFYDEBUG("Track '%s' marked as not available but has files, force-marking track as %savailable\n",
-						node->txt, !alb->album->is_available? "not ": "");
-				track->is_available = alb->album->is_available;
-			}
+	/* Load track details from XML if not already loaded */
+	if(sp_track_is_loaded(track) == 0)
+		osfy_track_load_from_xml(session, track, xml);
 
+	assert(sp_track_is_loaded(track));
 
-			/* Set track index on disc */
-			if(track->index == 0)
-				track->index = i;
 
+	/* Set disc number */
+	track->disc = disc_number;
 
-			/* Add track to albumbrowse and increase the track's ref count */
-			alb->tracks = realloc(alb->tracks, sizeof(sp_track *) * (1 + alb->num_tracks));
-			alb->tracks[alb->num_tracks] = track;
-			sp_track_add_ref(alb->tracks[alb->num_tracks]);
-			alb->num_tracks++;
-		}
 
-		assert(alb->num_tracks > 0);
+	/* Set album (as it's not available under the track node) */
+	if(track->album == NULL) {
+		track->album = alb->album;
+		sp_album_add_ref(track->album);
 	}
 
 
-	/* Loop over each copyright and add copyright text */
-	for(node = ezxml_get(root, "copyright", 0, "c", -1);
-	    node;
-	    node = node->next) {
-		alb->copyrights = realloc(alb->copyrights, sizeof(char *) * (1 + alb->num_copyrights));
-		alb->copyrights[alb->num_copyrights] = strdup(node->txt);
-		alb->num_copyrights++;
+	/* Mark track as available if the album is available and the album has a non-zero duration (i.e, associated files) */
+	if(!track->is_available && track->duration) {
+		DSFYDEBUG("Track at index %d marked as not available but has files, force-marking track as %savailable\n",
+				index, !alb->album->is_available? "not ": "");
+		track->is_available = alb->album->is_available;
 	}
 
 
-	/* Add review */
-	if((node = ezxml_get(root, "review", -1)) != NULL)
-		alb->review = strdup(node->txt);
-	else
-		alb->review = strdup("");
-
+	/* Set track index on disc */
+	if(track->index == 0)
+		track->index = index;
 
-	alb->is_loaded = 1;
-	alb->error = SP_ERROR_OK;
 
-	return 0;
+	/* Add track to albumbrowse and increase the track's ref count */
+	alb->tracks = realloc(alb->tracks, sizeof(sp_track *) * (1 + alb->num_tracks));
+	alb->tracks[alb->num_tracks] = track;
+	sp_track_add_ref(alb->tracks[alb->num_tracks]);
+	alb->num_tracks++;
 }
 
 
@@ -94,9 +94,7 @@ void osfy_artist_free(sp_artist *artist) {
 
 
 /* Load artist from XML returned by artist browsing of the artist in question */
-int osfy_artist_load_artist_from_xml(sp_session *session, sp_artist *artist, ezxml_t artist_node) {
-	unsigned char id[16];
-	ezxml_t node;
+int osfy_artist_load_artist_from_xml(sp_session *session, sp_artist *artist, struct artist_xml *xml) {
 
 	{
 		char buf[33];
@@ -105,23 +103,22 @@ int osfy_artist_load_artist_from_xml(sp_session *session, sp_artist *artist, ezx
 	}
 
 	/* Verify we're loading XML for the expected artist ID */
-	if((node = ezxml_get(artist_node, "id", -1)) == NULL) {
+	if(!(xml->found & ARTIST_XML_ID)) {
 		DSFYDEBUG("Failed to find element 'id'\n");
 		return -1;
 	}
 
-	hex_ascii_to_bytes(node->txt, id, sizeof(artist->id));
-	assert(memcmp(artist->id, id, sizeof(artist->id)) == 0);
+	assert(memcmp(artist->id, xml->id, sizeof(artist->id)) == 0);
 
 
 	/* Artist name */
-	if((node = ezxml_get(artist_node, "name", -1)) == NULL) {
+	if(!(xml->found & ARTIST_XML_NAME)) {
 		DSFYDEBUG("Failed to find element 'name'\n");
 		return -1;
 	}
 
-	artist->name = realloc(artist->name, strlen(node->txt) + 1);
-	strcpy(artist->name, node->txt);
+	artist->name = realloc(artist->name, strlen(xml->name) + 1);
+	strcpy(artist->name, xml->name);
 
 
 	artist->is_loaded = 1;
@@ -130,10 +127,8 @@ int osfy_artist_load_artist_from_xml(sp_session *session, sp_artist *artist, ezx
 }
 
 
-/* Load track's artist from XML returned by album, artist or album browsing */
-int osfy_artist_load_track_artist_from_xml(sp_session *session, sp_artist *artist, ezxml_t track_node) {
-	unsigned char id[16];
-	ezxml_t id_node, name_node;
+/* Load track's artist from the artists listed in XML returned by album, artist or album browsing */
+int osfy_artist_load_track_artist_from_xml(sp_session *session, sp_artist *artist, struct artist_xml *artists, int num_artists) {
 	int i;
 
 	{
@@ -142,29 +137,24 @@ int osfy_artist_load_track_artist_from_xml(sp_session *session, sp_artist *artis
 		DSFYDEBUG("Loading track artist '%s' from XML returned by browsing\n", buf);
 	}
 
-	for(i = 0,
-		id_node = ezxml_get(track_node, "artist-id", -1),
-		name_node = ezxml_get(track_node, "artist", -1);
-		id_node && track_node;
-		id_node = id_node->next,
-		name_node = name_node->next,
-		i++) {
+	for(i = 0; i < num_artists; i++) {
 
 		/* Verify we're loading XML for the expected artist ID */
-		hex_ascii_to_bytes(id_node->txt, id, sizeof(artist->id));
-		if(memcmp(artist->id, id, sizeof(artist->id))) {
-			DSFYDEBUG("Artist '%s' at offset %d is not the one sought\n", id_node->txt, i);
+		if(!(artists[i].found & ARTIST_XML_ID)
+			|| memcmp(artist->id, artists[i].id, sizeof(artist->id))) {
+			DSFYDEBUG("Artist at offset %d is not the one sought\n", i);
 			continue;
 		}
 
 		/* Artist name */
-		artist->name = realloc(artist->name, strlen(name_node->txt) + 1);
-		strcpy(artist->name, name_node->txt);
+		assert(artists[i].found & ARTIST_XML_NAME);
+		artist->name = realloc(artist->name, strlen(artists[i].name) + 1);
+		strcpy(artist->name, artists[i].name);
 		break;
 	}
 
 
-	assert(id_node != NULL && name_node != NULL);
+	assert(i < num_artists);
 
 	artist->is_loaded = 1;
 
@@ -173,9 +163,7 @@ int osfy_artist_load_track_artist_from_xml(sp_session *session, sp_artist *artis
 
 
 /* Load albums's artist from XML returned by track browsing */
-int osfy_artist_load_album_artist_from_xml(sp_session *session, sp_artist *artist, ezxml_t artist_node) {
-	unsigned char id[16];
-	ezxml_t node;
+int osfy_artist_load_album_artist_from_xml(sp_session *session, sp_artist *artist, struct track_xml *xml) {
 
 	{
 		char buf[33];
@@ -184,23 +172,22 @@ int osfy_artist_load_album_artist_from_xml(sp_session *session, sp_artist *artis
 	}
 
 	/* Verify we're loading XML for the expected artist ID */
-	if((node = ezxml_get(artist_node, "album-artist-id", -1)) == NULL) {
+	if(!(xml->found & TRACK_XML_ALBUM_ARTIST_ID)) {
 		DSFYDEBUG("Failed to find element 'album-artist-id'\n");
 		return -1;
 	}
 
-	hex_ascii_to_bytes(node->txt, id, sizeof(artist->id));
-	assert(memcmp(artist->id, id, sizeof(artist->id)) == 0);
+	assert(memcmp(artist->id, xml->album_artist_id, sizeof(artist->id)) == 0);
 
 
 	/* Artist name */
-	if((node = ezxml_get(artist_node, "album-artist", -1)) == NULL) {
+	if(!(xml->found & TRACK_XML_ALBUM_ARTIST)) {
 		DSFYDEBUG("Failed to find element 'album-artist'\n");
 		return -1;
 	}
 
-	artist->name = realloc(artist->name, strlen(node->txt) + 1);
-	strcpy(artist->name, node->txt);
+	artist->name = realloc(artist->name, strlen(xml->album_artist) + 1);
+	strcpy(artist->name, xml->album_artist);
 
 
 	artist->is_loaded = 1;
@@ -209,6 +196,7 @@ int osfy_artist_load_album_artist_from_xml(sp_session *session, sp_artist *artis
 }
 
 
+static void osfy_artist_browse_xml_end(void *arg, int depth, const char *name, char *text);
 static int osfy_artist_browse_callback(struct browse_callback_ctx *brctx);
 
 /*
@@ -239,7 +227,7 @@ int osfy_artist_browse(sp_session *session, sp_artist *artist) {
 
 	brctx->session = session;
 	brctx->req = NULL; /* Filled in by the request processor */
-	brctx->buf = NULL; /* Filled in by the request processor */
+	brctx->reply = NULL; /* Filled in by the request processor */
 
 	brctx->type = REQ_TYPE_BROWSE_ARTIST;
 	brctx->data.artists = artists;
@@ -248,8 +236,10 @@ int osfy_artist_browse(sp_session *session, sp_artist *artist) {
 	brctx->num_in_request = 0;
 
 
-	/* Our gzip'd XML parser */
+	/* Our XML handlers */
 	brctx->browse_parser = osfy_artist_browse_callback;
+	brctx->xml_start = NULL;
+	brctx->xml_end = osfy_artist_browse_xml_end;
 
 	/* Request input container. Will be free'd when the request is finished. */
 	container = (void **)malloc(sizeof(void *));
@@ -259,47 +249,30 @@ int osfy_artist_browse(sp_session *session, sp_artist *artist) {
 }
 
 
-static int osfy_artist_browse_callback(struct browse_callback_ctx *brctx) {
+/* The artist is the root element, load it when it closes */
+static void osfy_artist_browse_xml_end(void *arg, int depth, const char *name, char *text) {
+	struct browse_callback_ctx *brctx = (struct browse_callback_ctx *)arg;
 	sp_artist **artists;
 	int i;
-	struct buf *xml;
-	ezxml_t root;
 
-	xml = despotify_inflate(brctx->buf->ptr, brctx->buf->len);
-#ifdef DEBUG
-	{
-		FILE *fd;
-		DSFYDEBUG("Decompresed %d bytes data, xml=%p\n",
-			  brctx->buf->len, xml);
-		fd = fopen("browse-artists.xml", "w");
-		if(fd) {
-			fwrite(xml->ptr, xml->len, 1, fd);
-			fclose(fd);
-		}
-	}
-#endif
-
-	root = ezxml_parse_str((char *) xml->ptr, xml->len);
-	if(root == NULL) {
-		DSFYDEBUG("Failed to parse XML\n");
-		buf_free(xml);
-		return -1;
+	if(depth > 1) {
+		artist_xml_end(&brctx->artist, depth - 1, name, text);
+		return;
 	}
 
-
 	artists = brctx->data.artists;
-	for(i = 0; i < brctx->num_in_request; i++) {
-		osfy_artist_load_artist_from_xml(brctx->session, artists[brctx->num_browsed + i], root);
-	}
+	for(i = 0; i < brctx->num_in_request; i++)
+		osfy_artist_load_artist_from_xml(brctx->session, artists[brctx->num_browsed + i], &brctx->artist);
+}
 
 
-	ezxml_free(root);
-	buf_free(xml);
+static int osfy_artist_browse_callback(struct browse_callback_ctx *brctx) {
+	int i;
 
 
 	/* Release references made in osfy_artist_browse() */
 	for(i = 0; i < brctx->num_in_request; i++)
-		sp_artist_release(artists[brctx->num_browsed + i]);
+		sp_artist_release(brctx->data.artists[brctx->num_browsed + i]);
 
 
 	return 0;
@@ -8,15 +8,32 @@
 #include "artist.h"
 #include "browse.h"
 #include "debug.h"
-#include "ezxml.h"
 #include "request.h"
 #include "sp_opaque.h"
 #include "track.h"
 #include "util.h"
 
 
+/*
+ * Which of the artist's elements is being read, kept in brctx->section
+ * The artist itself is loaded as soon as one of the lists starts.
+ *
+ */
+#define ARTISTBROWSE_XML_ARTIST		0	/* Artist not loaded yet */
+#define ARTISTBROWSE_XML_OTHER		1
+#define ARTISTBROWSE_XML_BIOS		2
+#define ARTISTBROWSE_XML_SIMILAR	3
+#define ARTISTBROWSE_XML_ALBUMS		4
+#define ARTISTBROWSE_XML_ALBUM		5	/* Album added, reading its tracks */
+
+
+static void osfy_artistbrowse_xml_start(void *arg, int depth, const char *name, const char **attrs);
+static void osfy_artistbrowse_xml_end(void *arg, int depth, const char *name, char *text);
 static int osfy_artistbrowse_browse_callback(struct browse_callback_ctx *brctx);
-static int osfy_artistbrowse_load_from_xml(sp_session *session, sp_artistbrowse *arb, ezxml_t root);
+static void osfy_artistbrowse_load_artist(struct browse_callback_ctx *brctx);
+static void osfy_artistbrowse_add_similar_artist(sp_session *session, sp_artistbrowse *arb, struct artist_xml *xml);
+static void osfy_artistbrowse_add_album(struct browse_callback_ctx *brctx);
+static void osfy_artistbrowse_add_track(sp_session *session, sp_artistbrowse *arb, struct track_xml *xml, int disc_number, int index);
 
 
 SP_LIBEXPORT(sp_artistbrowse *) sp_artistbrowse_create(sp_session *session, sp_artist *artist, artistbrowse_complete_cb *callback, void *userdata) {
@@ -71,7 +88,7 @@ SP_LIBEXPORT(sp_artistbrowse *) sp_artistbrowse_create(sp_session *session, sp_a
 
 	brctx->session = session;
 	brctx->req = NULL; /* Filled in by the request processor */
-	brctx->buf = NULL; /* Filled in by the request processor */
+	brctx->reply = NULL; /* Filled in by the request processor */
 
 	brctx->type = REQ_TYPE_ARTISTBROWSE;
 	brctx->data.artistbrowses = (sp_artistbrowse **)malloc(sizeof(sp_artistbrowse *));
@@ -80,8 +97,10 @@ SP_LIBEXPORT(sp_artistbrowse *) sp_artistbrowse_create(sp_session *session, sp_a
 	brctx->num_browsed = 0;
 	brctx->num_in_request = 0;
 
-	/* Our gzip'd XML parser */
+	/* Our XML handlers */
 	brctx->browse_parser = osfy_artistbrowse_browse_callback;
+	brctx->xml_start = osfy_artistbrowse_xml_start;
+	brctx->xml_end = osfy_artistbrowse_xml_end;
 
 	/* Request input container. Will be free'd when the request is finished. */
 	container = (void **)malloc(sizeof(void *));
@@ -94,232 +113,327 @@ SP_LIBEXPORT(sp_artistbrowse *) sp_artistbrowse_create(sp_session *session, sp_a
 }
 
 
-static int osfy_artistbrowse_browse_callback(struct browse_callback_ctx *brctx) {
+/*
+ * The artist is the root element with its portraits and biography at
+ * <bios><bio>, similar artists at <similar-artists><artist> and tracks
+ * at <albums><album><discs><disc><track>
+ *
+ */
+static void osfy_artistbrowse_xml_start(void *arg, int depth, const char *name, const char **attrs) {
+	struct browse_callback_ctx *brctx = (struct browse_callback_ctx *)arg;
+
+	if(depth == 2) {
+		if(brctx->section == ARTISTBROWSE_XML_ARTIST
+			&& (!strcmp(name, "bios") || !strcmp(name, "similar-artists") || !strcmp(name, "albums")))
+			osfy_artistbrowse_load_artist(brctx);
+
+		if(brctx->section == ARTISTBROWSE_XML_ARTIST)
+			return;
+
+		if(!strcmp(name, "bios")) {
+			brctx->section = ARTISTBROWSE_XML_BIOS;
+
+			/* Number of 'bio' elements seen, only the first one is used */
+			brctx->disc_index = 0;
+		}
+		else if(!strcmp(name, "similar-artists"))
+			brctx->section = ARTISTBROWSE_XML_SIMILAR;
+		else if(!strcmp(name, "albums"))
+			brctx->section = ARTISTBROWSE_XML_ALBUMS;
+		else
+			brctx->section = ARTISTBROWSE_XML_OTHER;
+
+		return;
+	}
+
+	switch(brctx->section) {
+		case ARTISTBROWSE_XML_BIOS:
+			if(depth == 3)
+				brctx->disc_index++;
+			break;
+
+		case ARTISTBROWSE_XML_SIMILAR:
+			if(depth == 3)
+				artist_xml_free(&brctx->artist);
+			break;
+
+		case ARTISTBROWSE_XML_ALBUMS:
+		case ARTISTBROWSE_XML_ALBUM:
+			if(depth == 3) {
+				album_xml_free(&brctx->album);
+				brctx->section = ARTISTBROWSE_XML_ALBUMS;
+				break;
+			}
+
+			album_xml_start(&brctx->album, depth - 3, name, attrs);
+
+			/* The album's own elements come before its tracks */
+			if(depth == 4 && !strcmp(name, "discs") && brctx->section == ARTISTBROWSE_XML_ALBUMS)
+				osfy_artistbrowse_add_album(brctx);
+			else if(depth == 5 && !strcmp(name, "disc")) {
+				brctx->disc_number = -1;
+				brctx->disc_index = 0;
+			}
+			else if(depth == 6 && !strcmp(name, "track")) {
+				track_xml_free(&brctx->track);
+				brctx->disc_index++;
+			}
+			else if(depth > 6)
+				track_xml_start(&brctx->track, depth - 6, name, attrs);
+			break;
+
+		default:
+			break;
+	}
+}
+
+
+static void osfy_artistbrowse_xml_end(void *arg, int depth, const char *name, char *text) {
+	struct browse_callback_ctx *brctx = (struct browse_callback_ctx *)arg;
 	sp_artistbrowse *arb;
 	int i;
-	struct buf *xml;
-	ezxml_t root;
 
-	for(i = 0; i < brctx->num_in_request; i++) {
-		arb = brctx->data.artistbrowses[brctx->num_browsed + i];
+	if(depth == 1) {
+		if(brctx->section == ARTISTBROWSE_XML_ARTIST)
+			osfy_artistbrowse_load_artist(brctx);
 
-		/* Set defaults */
-		arb->is_loaded = 0;
-		arb->error = SP_ERROR_OTHER_TRANSIENT;
-	}
+		for(i = 0; i < brctx->num_in_request; i++) {
+			arb = brctx->data.artistbrowses[brctx->num_browsed + i];
 
-	/* Might happen because of a channel error */
-	if(brctx->buf == NULL)
-		return 0;
+			if(arb->biography == NULL)
+				arb->biography = strdup("");
 
-	xml = despotify_inflate(brctx->buf->ptr, brctx->buf->len);
-#ifdef DEBUG
-	{
-		FILE *fd;
-		DSFYDEBUG("Decompresed %d bytes data, xml=%p\n",
-			  brctx->buf->len, xml);
-		fd = fopen("browse-artistbrowse.xml", "w");
-		if(fd) {
-			fwrite(xml->ptr, xml->len, 1, fd);
-			fclose(fd);
+			arb->is_loaded = 1;
+			arb->error = SP_ERROR_OK;
 		}
+
+		return;
 	}
-#endif
 
-	root = ezxml_parse_str((char *) xml->ptr, xml->len);
-	if(root == NULL) {
-		DSFYDEBUG("Failed to parse XML\n");
-		buf_free(xml);
-		return -1;
+	if(brctx->section == ARTISTBROWSE_XML_ARTIST) {
+		artist_xml_end(&brctx->artist, depth - 1, name, text);
+		return;
 	}
 
 	for(i = 0; i < brctx->num_in_request; i++) {
 		arb = brctx->data.artistbrowses[brctx->num_browsed + i];
-		osfy_artistbrowse_load_from_xml(brctx->session, arb, root);
-		arb->is_loaded = 1;
-		arb->error = SP_ERROR_OK;
-	}
 
+		switch(brctx->section) {
+			case ARTISTBROWSE_XML_BIOS:
+				if(brctx->disc_index != 1)
+					break;
 
-	ezxml_free(root);
-	buf_free(xml);
+				/* Load portraits */
+				if(depth == 6 && !strcmp(name, "id")) {
+					arb->portraits = realloc(arb->portraits, sizeof(unsigned char *) * (1 + arb->num_portraits));
+					arb->portraits[arb->num_portraits] = malloc(20);
 
+					hex_ascii_to_bytes(text, arb->portraits[arb->num_portraits], 20);
 
-	/* Release references made in sp_artistbrowse_create() */
-	for(i = 0; i < brctx->num_in_request; i++)
-		sp_artistbrowse_release(brctx->data.artistbrowses[brctx->num_browsed + i]);
-
+					arb->num_portraits++;
+				}
+				/* Load biography */
+				else if(depth == 4 && !strcmp(name, "text") && arb->biography == NULL)
+					arb->biography = strdup(text);
+				break;
+
+			case ARTISTBROWSE_XML_SIMILAR:
+				if(depth == 3)
+					osfy_artistbrowse_add_similar_artist(brctx->session, arb, &brctx->artist);
+				break;
+
+			case ARTISTBROWSE_XML_ALBUM:
+				/* Cache disc number */
+				if(depth == 6 && !strcmp(name, "disc-number"))
+					brctx->disc_number = atoi(text);
+				else if(depth == 6 && !strcmp(name, "track") && brctx->disc_number >= 0)
+					osfy_artistbrowse_add_track(brctx->session, arb, &brctx->track, brctx->disc_number, brctx->disc_index);
+				else if(depth == 5 && !strcmp(name, "disc") && brctx->disc_number < 0)
+					DSFYDEBUG("BUG: Found no 'disc-numner' under discs -> disc\n");
+				break;
+
+			default:
+				break;
+		}
+	}
 
-	return 0;
+	switch(brctx->section) {
+		case ARTISTBROWSE_XML_SIMILAR:
+			if(depth == 4)
+				artist_xml_end(&brctx->artist, depth - 3, name, text);
+			break;
+
+		case ARTISTBROWSE_XML_ALBUMS:
+		case ARTISTBROWSE_XML_ALBUM:
+			if(depth > 6)
+				track_xml_end(&brctx->track, depth - 6, name, text);
+			else if(depth > 3)
+				album_xml_end(&brctx->album, depth - 3, name, text);
+			else if(depth == 3 && brctx->section == ARTISTBROWSE_XML_ALBUMS)
+				/* Albums without tracks have no 'discs' element */
+				osfy_artistbrowse_add_album(brctx);
+			break;
+
+		default:
+			break;
+	}
 }
 
 
-static int osfy_artistbrowse_load_from_xml(sp_session *session, sp_artistbrowse *arb, ezxml_t root) {
-	unsigned char id[20];
-	int disc_number, i;
-	sp_track *track;
-	sp_album *album;
-	ezxml_t node, album_node, loop_node, track_node;
+static int osfy_artistbrowse_browse_callback(struct browse_callback_ctx *brctx) {
+	sp_artistbrowse *arb;
+	int i;
 
+	/* Might happen because of a channel error */
+	if(brctx->reply == NULL) {
+		for(i = 0; i < brctx->num_in_request; i++) {
+			arb = brctx->data.artistbrowses[brctx->num_browsed + i];
 
-	/* Load artist from XML if not yet loaded */
-	if(sp_artist_is_loaded(arb->artist) == 0)
-		osfy_artist_load_artist_from_xml(session, arb->artist, root);
+			/* Set defaults */
+			arb->is_loaded = 0;
+			arb->error = SP_ERROR_OTHER_TRANSIENT;
+		}
 
-	assert(sp_artist_is_loaded(arb->artist));
+		return 0;
+	}
 
 
-	/* Load portraits */
-	for(loop_node = ezxml_get(root, "bios", 0, "bio", 0, "portraits", 0, "portrait", -1);
-	    loop_node;
-	    loop_node = loop_node->next) {
+	/* Release references made in sp_artistbrowse_create() */
+	for(i = 0; i < brctx->num_in_request; i++)
+		sp_artistbrowse_release(brctx->data.artistbrowses[brctx->num_browsed + i]);
+
 
-		if((node = ezxml_get(loop_node, "id", -1)) == NULL)
-			continue;
+	return 0;
+}
 
-		arb->portraits = realloc(arb->portraits, sizeof(unsigned char *) * (1 + arb->num_portraits));
-		arb->portraits[arb->num_portraits] = malloc(20);
 
-		hex_ascii_to_bytes(node->txt, arb->portraits[arb->num_portraits], 20);
+/* Load artist from XML if not yet loaded, its 'id' and 'name' have been read by now */
+static void osfy_artistbrowse_load_artist(struct browse_callback_ctx *brctx) {
+	sp_artistbrowse *arb;
+	int i;
 
-		arb->num_portraits++;
-	}		
+	for(i = 0; i < brctx->num_in_request; i++) {
+		arb = brctx->data.artistbrowses[brctx->num_browsed + i];
 
+		if(sp_artist_is_loaded(arb->artist) == 0)
+			osfy_artist_load_artist_from_xml(brctx->session, arb->artist, &brctx->artist);
 
-	/* Load biography */
-	if((node = ezxml_get(root, "bios", 0, "bio", 0, "text", -1)) != NULL)
-		arb->biography = strdup(node->txt);
-	else
-		arb->biography = strdup("");
+		assert(sp_artist_is_loaded(arb->artist));
+	}
 
+	brctx->section = ARTISTBROWSE_XML_OTHER;
+}
 
-	/* Load similar artists */
-	for(loop_node = ezxml_get(root, "similar-artists", 0, "artist", -1);
-	    loop_node;
-	    loop_node = loop_node->next) {
 
-		if((node = ezxml_get(loop_node, "id", -1)) == NULL)
-			continue;
+static void osfy_artistbrowse_add_similar_artist(sp_session *session, sp_artistbrowse *arb, struct artist_xml *xml) {
 
-		arb->similar_artists = realloc(arb->similar_artists, sizeof(sp_artist *) * (1 + arb->num_similar_artists));
-		hex_ascii_to_bytes(node->txt, id, 16);
+	if(!(xml->found & ARTIST_XML_ID))
+		return;
 
-		arb->similar_artists[arb->num_similar_artists]
-					= osfy_artist_add(session, id);
-		sp_artist_add_ref(arb->similar_artists[arb->num_similar_artists]);
+	arb->similar_artists = realloc(arb->similar_artists, sizeof(sp_artist *) * (1 + arb->num_similar_artists));
 
-		if(sp_artist_is_loaded(arb->similar_artists[arb->num_similar_artists]) == 0) {
-			DSFYDEBUG("Loading similar artist from artistbrowse XML\n");
-			osfy_artist_load_artist_from_xml(session, 
-						arb->similar_artists[arb->num_similar_artists],
-							       loop_node);
-		}
-		assert(sp_artist_is_loaded(arb->similar_artists[arb->num_similar_artists]));
+	arb->similar_artists[arb->num_similar_artists]
+				= osfy_artist_add(session, xml->id);
+	sp_artist_add_ref(arb->similar_artists[arb->num_similar_artists]);
 
-		arb->num_similar_artists++;
+	if(sp_artist_is_loaded(arb->similar_artists[arb->num_similar_artists]) == 0) {
+		DSFYDEBUG("Loading similar artist from artistbrowse XML\n");
+		osfy_artist_load_artist_from_xml(session, 
+					arb->similar_artists[arb->num_similar_artists],
+						       xml);
 	}
+	assert(sp_artist_is_loaded(arb->similar_artists[arb->num_similar_artists]));
+
+	arb->num_similar_artists++;
+}
+
 
+/* Add the album being read to the artistbrowses' lists of albums */
+static void osfy_artistbrowse_add_album(struct browse_callback_ctx *brctx) {
+	sp_artistbrowse *arb;
+	sp_album *album;
+	int i;
 
-	/* Loop over each album listed */
-	for(album_node = ezxml_get(root, "albums", 0, "album", -1);
-	    album_node;
-	    album_node = album_node->next) {
+	/* Extract album ID and add it */
+	if(!(brctx->album.found & ALBUM_XML_ID))
+		return;
 
-		/* Extract album ID and add it */
-		if((node = ezxml_get(album_node, "id", -1)) == NULL)
-			continue;
+	album = sp_album_add(brctx->session, brctx->album.id);
 
-		hex_ascii_to_bytes(node->txt, id, 16);
-		album = sp_album_add(session, id);
 
+	/* Load album if necessary */
+	if(sp_album_is_loaded(album) == 0)
+	   osfy_album_load_from_album_xml(brctx->session, album, &brctx->album);
 
-		/* Load album if necessary */
-		if(sp_album_is_loaded(album) == 0)
-		   osfy_album_load_from_album_xml(session, album, album_node);
+	assert(sp_album_is_loaded(album));
 
-		assert(sp_album_is_loaded(album));
 
+	/* Add album to artistbrowse's list of albums */
+	for(i = 0; i < brctx->num_in_request; i++) {
+		arb = brctx->data.artistbrowses[brctx->num_browsed + i];
 
-		/* Add album to artistbrowse's list of albums */
 		arb->albums = realloc(arb->albums, sizeof(sp_album *) * (1 + arb->num_albums));
 		arb->albums[arb->num_albums] = album;
 		sp_album_add_ref(arb->albums[arb->num_albums]);
 		arb->num_albums++;
+	}
 
+	brctx->section = ARTISTBROWSE_XML_ALBUM;
+}
 
-		/* Loop over each disc in the album and add tracks */
-		for(loop_node = ezxml_get(album_node, "discs", 0, "disc", -1);
-		    loop_node;
-		    loop_node = loop_node->next) {
-
-			/* Cache disc number */
-			if((node = ezxml_get(loop_node, "disc-number", -1)) == NULL) {
-				DSFYDEBUG("BUG: Found no 'disc-numner' under discs -> disc\n");
-				continue;
-			}
-
-			disc_number = atoi(node->txt);
-
-
-			/* Loop over each track and add it to the artistbrowse tracks list */
-			for(track_node = ezxml_get(loop_node, "track", -1), i = 1;
-			    track_node;
-			    track_node = track_node->next, i++) {
-
-				/* Extract track ID and add it */
-				if((node = ezxml_get(track_node, "id", -1)) == NULL)
-					continue;
-
-				hex_ascii_to_bytes(node->txt, id, 16);
-				track = osfy_track_add(session, id);
 
+/* Add a track from a disc of the last album added to the artistbrowse tracks list */
+static void osfy_artistbrowse_add_track(sp_session *session, sp_artistbrowse *arb, struct track_xml *xml, int disc_number, int index) {
+	sp_track *track;
+	sp_album *album;
 
-				/* Add album to track */
-				if(track->album)
-					sp_album_release(track->album);
+	album = arb->albums[arb->num_albums - 1];
 
-				track->album = album;
-				sp_album_add_ref(track->album);
 
+	/* Extract track ID and add it */
+	if(!(xml->found & TRACK_XML_ID))
+		return;
 
-				/* Set disc number */
-				track->disc = disc_number;
+	track = osfy_track_add(session, xml->id);
 
 
-				/* Set track index on disc */
-				if(track->index == 0)
-					track->index = i;
+	/* Add album to track */
+	if(track->album)
+		sp_album_release(track->album);
 
+	track->album = album;
+	sp_album_add_ref(track->album);
 
-				/* Load track details from XML if not already loaded */
-				if(sp_track_is_loaded(track) == 0)
-					osfy_track_load_from_xml(session, track, track_node);
 
-				assert(sp_track_is_loaded(track));
+	/* Set disc number */
+	track->disc = disc_number;
 
 
-				/* Mark track as available if the album is available and the album has a non-zero duration (i.e, associated files) */
-				if(!track->is_available && track->duration) {
-					DSFYDEBUG("Track '%s' marked as not available but has files, force-marking track as %savailable\n",
-							node->txt, !album->is_available? "not ": "");
-					track->is_available = album->is_available;
-				}
+	/* Set track index on disc */
+	if(track->index == 0)
+		track->index = index;
 
-				/* Add track to artistbrowse and increase the track's ref count */
-				arb->tracks = realloc(arb->tracks, sizeof(sp_track *) * (1 + arb->num_tracks));
-				arb->tracks[arb->num_tracks] = track;
-				sp_track_add_ref(arb->tracks[arb->num_tracks]);
 
-				arb->num_tracks++;
-			}
+	/* Load track details from XML if not already loaded */
+	if(sp_track_is_loaded(track) == 0)
+		osfy_track_load_from_xml(session, track, xml);
 
-		} /* for each disc in album */
+	assert(sp_track_is_loaded(track));
 
 
-	} /* for each album */
+	/* Mark track as available if the album is available and the album has a non-zero duration (i.e, associated files) */
+	if(!track->is_available && track->duration) {
+		DSFYDEBUG("Track at index %d marked as not available but has files, force-marking track as %savailable\n",
+				index, !album->is_available? "not ": "");
+		track->is_available = album->is_available;
+	}
 
+	/* Add track to artistbrowse and increase the track's ref count */
+	arb->tracks = realloc(arb->tracks, sizeof(sp_track *) * (1 + arb->num_tracks));
+	arb->tracks[arb->num_tracks] = track;
+	sp_track_add_ref(arb->tracks[arb->num_tracks]);
 
-	return 0;
+	arb->num_tracks++;
 }
 
 
@@ -66,8 +66,10 @@ SP_LIBEXPORT(sp_image *) sp_image_create(sp_session *session, const byte image_i
 
 
 	/* Prevent the image from being loaded twice */
-	if(image->error == SP_ERROR_IS_LOADING)
+	if(image->error == SP_ERROR_IS_LOADING) {
+		atomic_add(&session->num_coalesced, 1);
 		return image;
+	}
 
 	image->error = SP_ERROR_IS_LOADING;
 
@@ -210,7 +212,7 @@ static int osfy_image_callback(CHANNEL *ch, unsigned char *payload, unsigned sho
 			image_ctx->image->data = NULL;
 
 			/* Reset timeout so the request can be retried */
-			image_ctx->req->next_timeout = get_millisecs() + IMAGE_RETRY_TIMEOUT*1000;
+			request_set_next_timeout(image_ctx->session, image_ctx->req, get_millisecs() + IMAGE_RETRY_TIMEOUT*1000);
 
 			break;
 
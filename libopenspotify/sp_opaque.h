@@ -26,6 +26,8 @@
 
 #include "channel.h"
 #include "hashtable.h"
+#include "keypool.h"
+#include "parsepool.h"
 #include "login.h"
 #include "player.h"
 #include "shn.h"
@@ -335,11 +337,37 @@ struct sp_session {
 	int sock;
 
 
-	/* Used when logging in */
+	/* Where to keep settings, like the SRV cache, NULL if not configured */
+	char *settings_location;
+
+	/* Used when logging in, and again by the connection supervisor */
 	char username[256];
 	char password[256];
 	struct login_ctx *login;
 
+	/* Keys for the next logins, generated in the background, see keypool.c */
+	struct keypool *keypool;
+
+	/* Workers inflating and parsing replies, see parsepool.c */
+	struct parsepool *parsepool;
+
+	/*
+	 * Connection supervisor, see iothread.c
+	 * reconnect is the REQ_TYPE_RECONNECT request in charge, if any,
+	 * reconnect_backoff is the delay before the next attempt to log in
+	 * again and num_reconnects the number of successful reconnects
+	 * since sp_session_login()
+	 *
+	 */
+	struct request *reconnect;
+	int reconnect_backoff;
+	int num_reconnects;
+
+	/* Requests held back while reconnecting, oldest first */
+	int num_held;
+	int held_size;
+	struct request **held;
+
 
 	/* Stream cipher context */
 	unsigned int key_recv_IV;
@@ -347,15 +375,45 @@ struct sp_session {
 	shn_ctx shn_recv;
 	shn_ctx shn_send;
 
-	struct buf *packet;
-
-	/* Channels */
-	CHANNEL *channels;
+	/*
+	 * Receive buffer, see packet.c
+	 * recv_head is the start of the first unprocessed packet and
+	 * recv_tail the end of received data. recv_payload_len is the
+	 * payload length of the first packet once its header has been
+	 * decrypted in place, -1 before that.
+	 *
+	 */
+	unsigned char *recv_buf;
+	int recv_head;
+	int recv_tail;
+	int recv_payload_len;
+
+	/*
+	 * Send buffer, see packet.c
+	 * Packets are queued encrypted between send_head and send_tail
+	 * until the socket takes them. send_size is the allocated size.
+	 *
+	 */
+	unsigned char *send_buf;
+	int send_head;
+	int send_tail;
+	int send_size;
+
+	/*
+	 * Channels, see channel.c
+	 * channel_table is indexed by channel id and channel_ids is a bitmap
+	 * of ids in use. Unregistered channels are kept in channel_pool.
+	 *
+	 */
+	CHANNEL **channel_table;
+	int channel_table_size;
+	unsigned int *channel_ids;
+	CHANNEL *channel_pool;
 	int num_channels;
-	int next_channel_id;
+	struct channel_budget channel_budgets[CHANNEL_NUM_CLASSES];
 
-	/* Requests scoreboard */
-	struct request *requests;
+	/* Requests scoreboard, see request.c */
+	struct request_scheduler *requests;
 
 
 	/* High level connection state */
@@ -372,6 +430,19 @@ struct sp_session {
 	struct hashtable *hashtable_tracks;
 	struct hashtable *hashtable_users;
 
+	/* Single object browses in flight, see browse.c */
+	struct hashtable *hashtable_browses;
+
+	/* Lookups answered by an identical one already in flight */
+	volatile int num_coalesced;
+
+	/* Track browses waiting to share a CMD_BROWSE, see browse.c */
+	struct browse_batch *browse_batch;
+	volatile int browse_batch_window;
+
+	/* Chunks of a playlist's tracks fetched at once */
+	volatile int browse_max_chunks;
+
 	/* Player */
 	struct player *player;
 
@@ -387,6 +458,22 @@ struct sp_session {
 	pthread_t thread_main;
 	pthread_t thread_io;
 #endif
+
+#ifdef __linux__
+	/*
+	 * Event loop for the networking thread, see iothread.c
+	 * wakeup_fd is an eventfd signalled by request_post()
+	 * timer_fd is armed for the earliest request timeout
+	 * epoll_sock is the socket currently registered with epoll_fd
+	 * and epoll_sock_events the events it's registered for
+	 *
+	 */
+	int epoll_fd;
+	int wakeup_fd;
+	int timer_fd;
+	int epoll_sock;
+	unsigned int epoll_sock_events;
+#endif
 };
 
 #endif
@@ -68,7 +68,7 @@ SP_LIBEXPORT(sp_search *) sp_search_create(sp_session *session, const char *quer
 
 	search_ctx->session = session;
 	search_ctx->req = NULL; /* Filled in by the request processor */
-	search_ctx->buf = buf_new();
+	search_ctx->reply = NULL; /* Filled in by the request processor */
 	search_ctx->search = search;
 
 	/* Request input container. Will be free'd when the request is finished. */
@@ -6,20 +6,30 @@
 #include <windows.h>
 #else
 #include <pthread.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #endif
 
 #include <spotify/api.h>
 
+#include "browse.h"
 #include "cache.h"
 #include "debug.h"
 #include "iothread.h"
+#include "keypool.h"
 #include "link.h"
 #include "login.h"
+#include "parsepool.h"
 #include "player.h"
 #include "playlist.h"
 #include "request.h"
 #include "sp_opaque.h"
 #include "user.h"
+#include "util.h"
 
 
 SP_LIBEXPORT(sp_error) sp_session_init (const sp_session_config *config, sp_session **psession) {
@@ -59,11 +69,23 @@ SP_LIBEXPORT(sp_error) sp_session_init (const sp_session_config *config, sp_sess
 	session->user = NULL;
 	memset(session->country, 0, sizeof(session->country));
 	
+	session->settings_location = NULL;
+	if(config->settings_location != NULL && *config->settings_location)
+		session->settings_location = strdup(config->settings_location);
+
 	/* Login context, needed by network.c and login.c */
 	session->login = NULL;
 	memset(session->username, 0, sizeof(session->username));
 	memset(session->password, 0, sizeof(session->password));
 
+	/* Start generating keys now so they're ready when the user logs in */
+	if((session->keypool = keypool_create(KEYPOOL_SIZE)) == NULL)
+		return SP_ERROR_API_INITIALIZATION_FAILED;
+
+	/* Workers are started as replies come in */
+	if((session->parsepool = parsepool_create(session, PARSEPOOL_THREADS)) == NULL)
+		return SP_ERROR_API_INITIALIZATION_FAILED;
+
 	
 	/* Playlist container object */
 	playlistcontainer_create(session);
@@ -74,6 +96,11 @@ SP_LIBEXPORT(sp_error) sp_session_init (const sp_session_config *config, sp_sess
 	session->hashtable_images = hashtable_create(20);
 	session->hashtable_tracks = hashtable_create(16);
 	session->hashtable_users = hashtable_create(256);
+	session->hashtable_browses = hashtable_create(BROWSE_INFLIGHT_KEY_SIZE);
+	session->num_coalesced = 0;
+	session->browse_batch = NULL;
+	session->browse_batch_window = BROWSE_BATCH_WINDOW;
+	session->browse_max_chunks = BROWSE_MAX_CHUNKS;
 
 	/* Allocate memory for user info. */
 	if((session->user = (sp_user *)malloc(sizeof(sp_user))) == NULL)
@@ -82,16 +109,27 @@ SP_LIBEXPORT(sp_error) sp_session_init (const sp_session_config *config, sp_sess
 	/* Low-level networking stuff. */
 	session->sock = -1;
 
-	/* Incoming packet buffer */
-	session->packet = NULL;
+	/* Incoming packet buffer, allocated on first use */
+	session->recv_buf = NULL;
+
+	/* Outgoing packet queue, allocated on first use */
+	session->send_buf = NULL;
+
+	/* For the connection supervisor in iothread.c */
+	session->reconnect = NULL;
+	session->reconnect_backoff = RECONNECT_BACKOFF_MIN;
+	session->num_reconnects = 0;
+	session->num_held = 0;
+	session->held_size = 0;
+	session->held = NULL;
 
 	/* To allow main thread to communicate with network thread */
-	session->requests = NULL;
+	if(request_init(session))
+		return SP_ERROR_API_INITIALIZATION_FAILED;
 
 	/* Channels */
-	session->channels = NULL;
-	session->next_channel_id = 0;
-	session->num_channels = 0;
+	if(channel_init(session))
+		return SP_ERROR_API_INITIALIZATION_FAILED;
 
 
 	/* Spawn networking thread. */
@@ -104,6 +142,28 @@ SP_LIBEXPORT(sp_error) sp_session_init (const sp_session_config *config, sp_sess
 	pthread_mutex_init(&session->request_mutex, NULL);
 	pthread_cond_init(&session->idle_wakeup, NULL);
 
+#ifdef __linux__
+	/* Event loop for the networking thread */
+	session->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	session->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	session->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	session->epoll_sock = -1;
+	if(session->epoll_fd == -1 || session->wakeup_fd == -1 || session->timer_fd == -1)
+		return SP_ERROR_API_INITIALIZATION_FAILED;
+	else {
+		struct epoll_event ev;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+
+		ev.data.fd = session->wakeup_fd;
+		epoll_ctl(session->epoll_fd, EPOLL_CTL_ADD, session->wakeup_fd, &ev);
+
+		ev.data.fd = session->timer_fd;
+		epoll_ctl(session->epoll_fd, EPOLL_CTL_ADD, session->timer_fd, &ev);
+	}
+#endif
+
 	session->thread_main = pthread_self();
 	if(pthread_create(&session->thread_io, NULL, iothread, session))
 		return SP_ERROR_OTHER_TRANSIENT;
@@ -334,6 +394,107 @@ SP_LIBEXPORT(void) sp_session_process_events(sp_session *session, int *next_time
 }
 
 
+/*
+ * Not present in the official library
+ * Returns a file descriptor that becomes readable when there are results
+ * for sp_session_process_events() to deliver, so the session can be added
+ * to an application's poll()/epoll loop. Always -1 on Windows.
+ *
+ */
+SP_LIBEXPORT(int) opensp_session_fd(sp_session *session) {
+
+	return request_result_fd(session);
+}
+
+
+/*
+ * Not present in the official library
+ * Returns the number of track, album, artist, image and user lookups that
+ * were answered by an identical lookup already in flight instead of going
+ * out on the network again.
+ *
+ */
+SP_LIBEXPORT(int) opensp_session_num_coalesced(sp_session *session) {
+
+	return atomic_add(&session->num_coalesced, 0);
+}
+
+
+/*
+ * Not present in the official library
+ * Sets for how many milliseconds track browses are held back so browses
+ * from other requests can share the same CMD_BROWSE. 0 disables batching.
+ *
+ */
+SP_LIBEXPORT(void) opensp_session_set_browse_batch_window(sp_session *session, int msecs) {
+
+	session->browse_batch_window = msecs < 0? 0: msecs;
+}
+
+
+/*
+ * Not present in the official library
+ * Sets how many chunks of a playlist's tracks are browsed concurrently.
+ * Chunks beyond the first one are only sent while the session has
+ * channels to spare.
+ *
+ */
+SP_LIBEXPORT(void) opensp_session_set_browse_chunks(sp_session *session, int num_chunks) {
+
+	session->browse_max_chunks = num_chunks < 1? 1: num_chunks;
+}
+
+
+/*
+ * Not present in the official library
+ * Sets how many threads inflate and parse browse, search and toplist
+ * replies, at most PARSEPOOL_MAX_THREADS. With 0 they're parsed on the
+ * networking thread as they arrive. Applies to replies requested from
+ * now on.
+ *
+ */
+SP_LIBEXPORT(void) opensp_session_set_parse_threads(sp_session *session, int num_threads) {
+
+	parsepool_set_limit(session->parsepool, num_threads);
+}
+
+
+/*
+ * Not present in the official library
+ * Reports the current channel limit, the number of open channels and the
+ * number of requests waiting for a channel. Set audio to non-zero for the
+ * audio budget, zero for metadata. The limits adapt to server latency and
+ * errors, see channel.c. The numbers are owned by the networking thread
+ * and only meant as a snapshot.
+ *
+ */
+SP_LIBEXPORT(void) opensp_session_channel_stats(sp_session *session, int audio, int *limit, int *num_open, int *num_waiting) {
+	struct channel_budget *budget;
+
+	budget = &session->channel_budgets[audio? CHANNEL_CLASS_AUDIO: CHANNEL_CLASS_METADATA];
+
+	if(limit)
+		*limit = budget->limit;
+
+	if(num_open)
+		*num_open = budget->num_open;
+
+	if(num_waiting)
+		*num_waiting = budget->num_waiting;
+}
+
+
+/*
+ * Not present in the official library
+ * Returns the number of times the connection was lost and reestablished
+ * since the last call to sp_session_login()
+ *
+ */
+SP_LIBEXPORT(int) opensp_session_num_reconnects(sp_session *session) {
+	return session->num_reconnects;
+}
+
+
 SP_LIBEXPORT(sp_error) sp_session_player_load(sp_session *session, sp_track *track) {
 	void **container;
 
@@ -405,35 +566,61 @@ SP_LIBEXPORT(sp_playlistcontainer *) sp_session_playlistcontainer(sp_session *se
  */
 SP_LIBEXPORT(sp_error) sp_session_release (sp_session *session) {
 
-	/* Unregister channels */
-	DSFYDEBUG("Unregistering any active channels\n");
-	channel_fail_and_unregister_all(session);
-
-	/* Kill player thread */
-	player_free(session);
+	/* Stop the parse workers, they wake up the networking thread */
+	parsepool_stop(session->parsepool);
 
 	/* Kill networking thread */
 	DSFYDEBUG("Terminating network thread\n");
 #ifdef _WIN32
 	TerminateThread(session->thread_io, 0);
 	session->thread_io = (HANDLE)0;
-	CloseHandle(session->idle_wakeup);
-	CloseHandle(session->request_mutex);
 #else
 
 	pthread_cancel(session->thread_io);
 	pthread_join(session->thread_io, NULL);
 	session->thread_io = (pthread_t)0;
+#endif
+
+	/*
+	 * Unregister channels now that nothing else uses them
+	 * Their callbacks may still post results and feed the player.
+	 *
+	 */
+	DSFYDEBUG("Unregistering any active channels\n");
+	channel_fail_and_unregister_all(session);
+	channel_release(session);
+
+	/* Kill player thread */
+	player_free(session);
+
+#ifdef _WIN32
+	CloseHandle(session->idle_wakeup);
+	CloseHandle(session->request_mutex);
+#else
 	pthread_mutex_destroy(&session->request_mutex);
 	pthread_cond_destroy(&session->idle_wakeup);
 #endif
 
-	if(session->packet)
-		buf_free(session->packet);
+#ifdef __linux__
+	close(session->epoll_fd);
+	close(session->wakeup_fd);
+	close(session->timer_fd);
+#endif
+
+	request_release(session);
+	free(session->held);
+
+	free(session->recv_buf);
+	free(session->send_buf);
 
 	if(session->login)
 		login_release(session->login);
 
+	if(session->keypool)
+		keypool_release(session->keypool);
+
+	parsepool_release(session->parsepool);
+
 	playlistcontainer_release(session);
 
 	if(session->hashtable_albums)
@@ -453,8 +640,12 @@ SP_LIBEXPORT(sp_error) sp_session_release (sp_session *session) {
 	
 	if(session->hashtable_users)
 		hashtable_free(session->hashtable_users);
+
+	if(session->hashtable_browses)
+		browse_release(session);
 	
 	free(session->callbacks);
+	free(session->settings_location);
 
 	/* Helper function for sp_link_create_from_string() */
 	libopenspotify_link_release();
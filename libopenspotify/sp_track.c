@@ -13,7 +13,6 @@
 #include "artist.h"
 #include "browse.h"
 #include "debug.h"
-#include "ezxml.h"
 #include "hashtable.h"
 #include "sp_opaque.h"
 #include "track.h"
@@ -198,16 +197,12 @@ void osfy_track_free(sp_track *track) {
 }
 
 
-int osfy_track_load_from_xml(sp_session *session, sp_track *track, ezxml_t track_node) {
-	unsigned char id[20];
-	const char *str;
-	double popularity;
-	int i;
-	ezxml_t node;
+int osfy_track_load_from_xml(sp_session *session, sp_track *track, struct track_xml *xml) {
+	int i, j;
 	
 
 	/* Track UUID */
-	if((node = ezxml_get(track_node, "id", -1)) == NULL) {
+	if(!(xml->found & TRACK_XML_ID)) {
 		DSFYDEBUG("Failed to find element 'id'\n");
 		/* This might happen when a track that doesn't exist is browsed */
 
@@ -215,72 +210,44 @@ int osfy_track_load_from_xml(sp_session *session, sp_track *track, ezxml_t track
 		return -1;
 	}
 	
-	DSFYDEBUG("Found track with ID '%s' in XML\n", node->txt);
+	{
+		char buf[33];
+		hex_bytes_to_ascii(xml->id, buf, 16);
+		DSFYDEBUG("Found track with ID '%s' in XML\n", buf);
+	}
 	
 	
 	/* Track name */
-	if((node = ezxml_get(track_node, "title", -1)) == NULL) {
+	if(!(xml->found & TRACK_XML_TITLE)) {
 		DSFYDEBUG("Failed to find element 'title'\n");
 		return -1;
 	}
 
-	track->name = realloc(track->name, strlen(node->txt) + 1);
-	strcpy(track->name, node->txt);
+	track->name = realloc(track->name, strlen(xml->title) + 1);
+	strcpy(track->name, xml->title);
 
 
 	/* Explicit lyrics? */
-	if((node = ezxml_get(track_node, "explicit", -1)) != NULL) {
-#ifdef _WIN32
-		if(!stricmp(node->txt, "true"))
-#else
-		if(!strcasecmp(node->txt, "true"))
-#endif
-			track->has_explicit_lyrics = 1;
-	}
+	if(xml->has_explicit_lyrics)
+		track->has_explicit_lyrics = 1;
 
 
 	/* Track popularity */
-	if((node = ezxml_get(track_node, "popularity", -1)) == NULL) {
+	if(!(xml->found & TRACK_XML_POPULARITY)) {
 		DSFYDEBUG("Failed to find element 'popularity'\n");
 		return -1;
 	}
 	
-	sscanf(node->txt, "%lf", &popularity);
-	track->popularity = (int)(100 * popularity);
+	track->popularity = (int)(100 * xml->popularity);
 
 	
-	/*
-	 * Grab ID of file
-	 * Multiple files might be listed here, all with different bit rates
-	 * Zero 'file' elements indicates the file is not available.
-	 *
-	 * Example:
-	 * <files>
-	 *   <file id="cfe68177e9eb9526b7b441f6147d1c5a9a07ca62" format="Ogg Vorbis,160000,1,32,4"/>
-	 *   <file id="bf1314d9814795f64a995c6dc8a9b6cc12b952d6" format="Ogg Vorbis,96000,1,32,4"/>
-	 * </files>
-	 *
-	 */
-	memset(track->file_id, 0, sizeof(track->file_id));
-	for(node = ezxml_get(track_node, "files", 0, "file", -1);
-	    node;
-	    node = node->next) {
-		/* XXX - Only care about 160kbit/s files for now */
-		str = ezxml_attr(node, "format");
-		if(!strstr(str, "160000")) {
-			continue;
-		}
-
-		str = ezxml_attr(node, "id");
-		assert(str != NULL);
-		hex_ascii_to_bytes(str, id, sizeof(track->file_id));
-		memcpy(track->file_id, id, sizeof(track->file_id));
-	}
+	/* ID of the 160 kbit/s file, zero if the file is not available */
+	memcpy(track->file_id, xml->file_id, sizeof(track->file_id));
 
 	
 	/* Track duration */
-	if((node = ezxml_get(track_node, "length", -1)) != NULL) {
-		track->duration = atoi(node->txt);
+	if(xml->found & TRACK_XML_LENGTH) {
+		track->duration = xml->length;
 	}
 	else {
 		/* Track duration defaults to zero so no update is needed */
@@ -291,34 +258,14 @@ int osfy_track_load_from_xml(sp_session *session, sp_track *track, ezxml_t track
 	/* Country restrictions */
 	assert(track->allowed_countries == NULL);
 	assert(track->restricted_countries == NULL);
-	for(node = ezxml_get(track_node, "restrictions", 0, "restriction", -1);
-	    node;
-	    node = node->next) {
-	    	str = ezxml_attr(node, "catalogues");
+	if(xml->restriction.allowed_countries)
+		track->allowed_countries = strdup(xml->restriction.allowed_countries);
 
+	if(xml->restriction.restricted_countries)
+		track->restricted_countries = strdup(xml->restriction.restricted_countries);
 
-		/* There might be restrictions that do not apply for premium users */
-		if(!str || !strstr(str, "premium"))
-			continue;
-
-		if((str = ezxml_attr(node, "allowed")) != NULL) {
-			track->allowed_countries = realloc(track->allowed_countries, strlen(str) + 1);
-			strcpy(track->allowed_countries, str);
-
-			if(strstr(track->allowed_countries, session->country))
-				track->is_available = 1;
-		}
-
-		if((str = ezxml_attr(node, "forbidden")) != NULL) {
-			track->restricted_countries = realloc(track->restricted_countries, strlen(str) + 1);
-			strcpy(track->restricted_countries, str);
-
-			if(strstr(track->restricted_countries, session->country))
-				track->is_available = 0;
-			else
-				track->is_available = 1;
-		}
-	}
+	if(xml->restriction.allowed_countries || xml->restriction.restricted_countries)
+		track->is_available = xml->restriction.is_available;
 
 
 	/* Tracks with no files can't be played */
@@ -327,28 +274,28 @@ int osfy_track_load_from_xml(sp_session *session, sp_track *track, ezxml_t track
 
 
 	/* Add artists */
-	for(node = ezxml_get(track_node, "artist-id", -1);
-	    node;
-	    node = node->next) {
-		hex_ascii_to_bytes(node->txt, id, 16);
+	for(j = 0; j < xml->artist_list.num_artists; j++) {
+		if(!(xml->artist_list.artists[j].found & ARTIST_XML_ID))
+			continue;
+
 		for(i = 0; i < track->num_artists; i++)
-			if(memcmp(track->artists[i]->id, id, sizeof(track->artists[i]->id)) == 0)
+			if(memcmp(track->artists[i]->id, xml->artist_list.artists[j].id, sizeof(track->artists[i]->id)) == 0)
 				break;
 	
 		/* Do not add already added artists */
 		if(i != track->num_artists)
 			continue;
 		
-		DSFYDEBUG("Adding artist '%s' to track's list\n", node->txt);
+		DSFYDEBUG("Adding artist %d to track's list\n", j);
 
 		track->artists = realloc(track->artists, sizeof(sp_artist *) * (1 + track->num_artists));
-		track->artists[track->num_artists] = osfy_artist_add(session, id);
+		track->artists[track->num_artists] = osfy_artist_add(session, xml->artist_list.artists[j].id);
 		sp_artist_add_ref(track->artists[track->num_artists]);
 		
 		if(sp_artist_is_loaded(track->artists[track->num_artists]) == 0)
 			osfy_artist_load_track_artist_from_xml(session, 
 							       track->artists[track->num_artists],
-							       track_node);
+							       xml->artist_list.artists, xml->artist_list.num_artists);
 			
 		
 		track->num_artists++;
@@ -361,13 +308,12 @@ int osfy_track_load_from_xml(sp_session *session, sp_track *track, ezxml_t track
 		hex_bytes_to_ascii(track->id, buf, 16);
 		DSFYDEBUG("Loading album for track '%s'\n", buf);
 	}
-	if((node = ezxml_get(track_node, "album-id", -1)) != NULL) {
+	if(xml->found & TRACK_XML_ALBUM_ID) {
 		/* Add album to track */
 		if(track->album != NULL)
 			sp_album_release(track->album);
 
-		hex_ascii_to_bytes(node->txt, id, 16);
-		track->album = sp_album_add(session, id);
+		track->album = sp_album_add(session, xml->album_id);
 		sp_album_add_ref(track->album);
 
 		/* Load album from XML if necessary */
@@ -376,7 +322,7 @@ int osfy_track_load_from_xml(sp_session *session, sp_track *track, ezxml_t track
 			hex_bytes_to_ascii(track->album->id, buf, 16);
 			DSFYDEBUG("Album '%s' not yet loaded, trying to load from XML\n", buf);
 
-			osfy_album_load_from_track_xml(session, track->album, track_node);
+			osfy_album_load_from_track_xml(session, track->album, xml);
 			
 			/* FIXME: Assume that the album is available if the track is available */
 			if(track->is_available && !track->album->is_available) {
@@ -396,6 +342,8 @@ int osfy_track_load_from_xml(sp_session *session, sp_track *track, ezxml_t track
 }
 
 
+static void osfy_track_browse_xml_start(void *arg, int depth, const char *name, const char **attrs);
+static void osfy_track_browse_xml_end(void *arg, int depth, const char *name, char *text);
 static int osfy_track_browse_callback(struct browse_callback_ctx *brctx);
 
 /*
@@ -426,7 +374,7 @@ int osfy_track_browse(sp_session *session, sp_track *track) {
 	
 	brctx->session = session;
 	brctx->req = NULL; /* Filled in by the request processor */
-	brctx->buf = NULL; /* Filled in by the request processor */
+	brctx->reply = NULL; /* Filled in by the request processor */
 	
 	brctx->type = REQ_TYPE_BROWSE_TRACK;
 	brctx->data.tracks = tracks;
@@ -435,8 +383,10 @@ int osfy_track_browse(sp_session *session, sp_track *track) {
 	brctx->num_in_request = 0;
 	
 	
-	/* Our gzip'd XML parser */
+	/* Our XML handlers */
 	brctx->browse_parser = osfy_track_browse_callback;
+	brctx->xml_start = osfy_track_browse_xml_start;
+	brctx->xml_end = osfy_track_browse_xml_end;
 	
 	/* Request input container. Will be free'd when the request is finished. */
 	container = (void **)malloc(sizeof(void *));
@@ -446,56 +396,49 @@ int osfy_track_browse(sp_session *session, sp_track *track) {
 }
 
 
-static int osfy_track_browse_callback(struct browse_callback_ctx *brctx) {
+/* Tracks are at <result><tracks><track> */
+static void osfy_track_browse_xml_start(void *arg, int depth, const char *name, const char **attrs) {
+	struct browse_callback_ctx *brctx = (struct browse_callback_ctx *)arg;
+
+	if(depth == 3)
+		track_xml_free(&brctx->track);
+	else if(depth > 3)
+		track_xml_start(&brctx->track, depth - 3, name, attrs);
+}
+
+
+/* The tracks in the request are loaded from the first track element */
+static void osfy_track_browse_xml_end(void *arg, int depth, const char *name, char *text) {
+	struct browse_callback_ctx *brctx = (struct browse_callback_ctx *)arg;
 	sp_track **tracks;
 	int i;
-	struct buf *xml;
-	ezxml_t root, node;
-	
-	xml = despotify_inflate(brctx->buf->ptr, brctx->buf->len);
-	if(xml == NULL) {
-		DSFYDEBUG("Failed to decompress track XML\n");
-		return -1;
-	}
 
-#ifdef DEBUG
-	{
-		char buf[64];
-		FILE *fd;
-		sprintf(buf, "browse-tracks-%d-%d.xml", brctx->num_browsed, brctx->num_in_request);
-		fd = fopen(buf, "w");
-		if(fd) {
-			fwrite(xml->ptr, xml->len, 1, fd);
-			fclose(fd);
-		}
+	if(depth > 3) {
+		track_xml_end(&brctx->track, depth - 3, name, text);
+		return;
 	}
-#endif
 
-	root = ezxml_parse_str((char *) xml->ptr, xml->len);
-	if(root == NULL) {
-		DSFYDEBUG("Failed to parse XML\n");
-		buf_free(xml);
-		return -1;
-	}
-	
+	if(depth < 3 || brctx->section++ > 0)
+		return;
+
 	tracks = brctx->data.tracks;
 	for(i = 0; i < brctx->num_in_request; i++) {
-		node = ezxml_get(root, "tracks", 0, "track", -1);
-		if(osfy_track_load_from_xml(brctx->session, tracks[brctx->num_browsed + i], node)) {
+		if(osfy_track_load_from_xml(brctx->session, tracks[brctx->num_browsed + i], &brctx->track)) {
 			DSFYDEBUG("Failed to load track %d of %d from XML, error is %d\n", 
 				brctx->num_browsed + i + 1, brctx->num_in_request,
 				tracks[brctx->num_browsed + i]->error);
 		}
 	}
-	
-	
-	ezxml_free(root);
-	buf_free(xml);
+}
+
+
+static int osfy_track_browse_callback(struct browse_callback_ctx *brctx) {
+	int i;
 	
 	
 	/* Release references made in osfy_track_browse() */
 	for(i = 0; i < brctx->num_in_request; i++)
-		sp_track_release(tracks[brctx->num_browsed + i]);
+		sp_track_release(brctx->data.tracks[brctx->num_browsed + i]);
 	
 	
 	return 0;
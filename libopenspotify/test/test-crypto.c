@@ -0,0 +1,301 @@
+/*
+ * Known answer tests for the crypto code: Shannon, AES-128 CTR,
+ * SHA-1 and HMAC-SHA1
+ *
+ * Run with 'make test-crypto', exits non-zero if anything fails.
+ *
+ * The AES vectors are from NIST SP 800-38A (F.5.1) plus two made with
+ * OpenSSL using the nonce player.c starts audio decryption from, one of
+ * them at an offset where the counter carries across bytes.
+ * The Shannon vectors were produced with the unmodified reference code
+ * (shn.c as imported from despotify) and pin down the keystream, the
+ * encrypt/decrypt round trip and the MAC.
+ * SHA-1 and HMAC-SHA1 vectors are from FIPS 180-1 and RFC 2202.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../aesctr.h"
+#include "../hmac.h"
+#include "../sha1.h"
+#include "../shn.h"
+
+
+static int num_tests;
+static int num_failed;
+
+
+static void unhex(const char *hex, unsigned char *out, size_t *len) {
+	unsigned int byte;
+
+	*len = 0;
+	while(hex[0] && hex[1]) {
+		sscanf(hex, "%2x", &byte);
+		out[(*len)++] = byte;
+		hex += 2;
+	}
+}
+
+
+static void check(const char *name, const unsigned char *got, const char *expected_hex) {
+	unsigned char expected[512];
+	size_t len, i;
+
+	unhex(expected_hex, expected, &len);
+
+	num_tests++;
+	if(memcmp(got, expected, len) == 0)
+		return;
+
+	num_failed++;
+	printf("FAIL %s\n  got      ", name);
+	for(i = 0; i < len; i++)
+		printf("%02x", got[i]);
+	printf("\n  expected %s\n", expected_hex);
+}
+
+
+/*
+ * Shannon
+ *
+ */
+#define SHN_KEY		"test key 128bits"
+#define SHN_STREAM	"ea4a35b3c201c79a9458887a5d2c0d04cf304d0788467735ebb1a1c0471adcb2"
+#define SHN_CIPHERTEXT	"bbc789db89b7edf2af9980b0a186d2344b75a195f0eabbb6cd76bda05fc1afaa" \
+			"30e70736310a845f508a7658ff6bfe37337a27949c01d2784691b6d6484667a2" \
+			"d2da4933a681202b7e44a8783568fcff135f7870b37b9c83c5dfe04182cea4da" \
+			"0b16ff9a1d5814"
+#define SHN_MAC		"74dd2887c05721466ffb339ea500fcf1"
+
+static void test_shn(void) {
+	static const int splits[][3] = { { 103, 0, 0 }, { 3, 100, 0 }, { 1, 65, 37 }, { 64, 2, 37 } };
+	unsigned char nonce[4] = { 0, 0, 0, 1 };
+	unsigned char buf[103], mac[16];
+	char name[64];
+	shn_ctx c;
+	int i, j, pos;
+
+	/* Keystream, no nonce */
+	shn_key(&c, (unsigned char *)SHN_KEY, 16);
+	memset(buf, 0, 32);
+	shn_stream(&c, buf, 32);
+	check("shn_stream", buf, SHN_STREAM);
+
+	/* Encrypt and decrypt in a few pieces, like packet.c does header and payload */
+	for(i = 0; i < sizeof(splits) / sizeof(splits[0]); i++) {
+		for(j = 0; j < sizeof(buf); j++)
+			buf[j] = j;
+
+		shn_key(&c, (unsigned char *)SHN_KEY, 16);
+		shn_nonce(&c, nonce, 4);
+		for(j = 0, pos = 0; j < 3; pos += splits[i][j++])
+			shn_encrypt(&c, buf + pos, splits[i][j]);
+		shn_finish(&c, mac, 16);
+
+		sprintf(name, "shn_encrypt %d+%d+%d", splits[i][0], splits[i][1], splits[i][2]);
+		check(name, buf, SHN_CIPHERTEXT);
+		sprintf(name, "shn_encrypt %d+%d+%d MAC", splits[i][0], splits[i][1], splits[i][2]);
+		check(name, mac, SHN_MAC);
+
+		shn_key(&c, (unsigned char *)SHN_KEY, 16);
+		shn_nonce(&c, nonce, 4);
+		for(j = 0, pos = 0; j < 3; pos += splits[i][j++])
+			shn_decrypt(&c, buf + pos, splits[i][j]);
+		shn_finish(&c, mac, 16);
+
+		for(j = 0; j < sizeof(buf) && buf[j] == j; j++)
+			;
+		num_tests++;
+		if(j != sizeof(buf)) {
+			num_failed++;
+			printf("FAIL shn_decrypt %d+%d+%d: wrong plaintext at byte %d\n",
+				splits[i][0], splits[i][1], splits[i][2], j);
+		}
+
+		sprintf(name, "shn_decrypt %d+%d+%d MAC", splits[i][0], splits[i][1], splits[i][2]);
+		check(name, mac, SHN_MAC);
+	}
+
+	/* The MAC is over the plaintext, so shn_maconly() gives the same */
+	for(j = 0; j < sizeof(buf); j++)
+		buf[j] = j;
+
+	shn_key(&c, (unsigned char *)SHN_KEY, 16);
+	shn_nonce(&c, nonce, 4);
+	shn_maconly(&c, buf, sizeof(buf));
+	shn_finish(&c, mac, 16);
+	check("shn_maconly", mac, SHN_MAC);
+}
+
+
+/*
+ * AES-128 CTR
+ *
+ */
+static const struct {
+	const char *name;
+	const char *key;
+	const char *iv;
+	size_t offset;
+	const char *plaintext;
+	const char *ciphertext;
+} aes_vectors[] = {
+	{
+		"SP 800-38A F.5.1",
+		"2b7e151628aed2a6abf7158809cf4f3c",
+		"f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff", 0,
+		"6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+		"30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+		"874d6191b620e3261bef6864990db6ce9806f66b7970fdff8617187bb9fffdff"
+		"5ae4df3edbd5d35e5b4f09020db03eab1e031dda2fbe03d1792170a0f3009cee"
+	},
+	{
+		"audio nonce",
+		"000102030405060708090a0b0c0d0e0f",
+		"72e067fbddcbcf77ebe8bc643f630d93", 0,
+		"000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+		"202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f",
+		"beb35eed01d211af39ec676e7546a5a2d87541c16b2efff526e07f7ee8fa5cda"
+		"68872da94443c972de3b0f19d71e26f5f92040d9e91f161b37d7a6979e8adc28"
+	},
+	{
+		"audio nonce, counter carry",
+		"000102030405060708090a0b0c0d0e0f",
+		"72e067fbddcbcf77ebe8bc643f630d93", 0xf26c0,
+		"000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+		"202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f",
+		"c5e4b11d1fc8eabaf64184a180f3cb400836e42f9e2c8de1301311add6732e5b"
+		"d39baeef462e03e692fb53a6dc7b4bc33a343279c2ef3ce409dac080ee48c8a2"
+	}
+};
+
+static void test_aes_ctr(int use_aesni) {
+	struct aes_ctr ctx;
+	unsigned char key[16], iv[16], buf[64], src[1024], dest[1024];
+	unsigned char expected[64];
+	char name[128], hex[129];
+	size_t len, i, j;
+
+	for(i = 0; i < sizeof(aes_vectors) / sizeof(aes_vectors[0]); i++) {
+		unhex(aes_vectors[i].key, key, &len);
+		unhex(aes_vectors[i].iv, iv, &len);
+
+		aes_ctr_key(&ctx, key);
+		ctx.use_aesni = use_aesni;
+
+		/* All at once */
+		unhex(aes_vectors[i].plaintext, buf, &len);
+		aes_ctr_seek(&ctx, iv, aes_vectors[i].offset);
+		aes_ctr_xor(&ctx, buf, len);
+		sprintf(name, "aes_ctr_xor %s%s", aes_vectors[i].name, use_aesni? " (AES-NI)": "");
+		check(name, buf, aes_vectors[i].ciphertext);
+
+		/* A block, two more, and a partial one at the end */
+		unhex(aes_vectors[i].plaintext, buf, &len);
+		aes_ctr_seek(&ctx, iv, aes_vectors[i].offset);
+		aes_ctr_xor(&ctx, buf, 16);
+		aes_ctr_xor(&ctx, buf + 16, 32);
+		aes_ctr_xor(&ctx, buf + 48, 11);
+		snprintf(hex, sizeof(hex), "%.*s", 2 * 59, aes_vectors[i].ciphertext);
+		sprintf(name, "aes_ctr_xor split %s%s", aes_vectors[i].name, use_aesni? " (AES-NI)": "");
+		check(name, buf, hex);
+
+		/*
+		 * Decrypt a 1024 byte block stored as 4x256 byte stripes with the
+		 * ciphertext at the start, check the plaintext comes out in order
+		 *
+		 */
+		unhex(aes_vectors[i].ciphertext, expected, &len);
+		memset(src, 0, sizeof(src));
+		for(j = 0; j < len; j++)
+			src[(j % 4) * 256 + j / 4] = expected[j];
+
+		aes_ctr_seek(&ctx, iv, aes_vectors[i].offset);
+		aes_ctr_xor_interleaved(&ctx, dest, src, sizeof(src));
+		sprintf(name, "aes_ctr_xor_interleaved %s%s", aes_vectors[i].name, use_aesni? " (AES-NI)": "");
+		check(name, dest, aes_vectors[i].plaintext);
+	}
+}
+
+
+/*
+ * SHA-1 and HMAC-SHA1
+ *
+ */
+static void test_sha1(void) {
+	static const struct {
+		const char *msg;
+		int repeat;
+		const char *digest;
+	} vectors[] = {
+		{ "", 1, "da39a3ee5e6b4b0d3255bfef95601890afd80709" },
+		{ "abc", 1, "a9993e364706816aba3e25717850c26c9cd0d89d" },
+		{ "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+			"84983e441c3bd26ebaae4aa1f95129e5e54670f1" },
+		{ "aaaaaaaaaa", 100000, "34aa973cd4c4daa4f61eeb2bdbad27316534016f" },
+	};
+	SHA1_CTX ctx;
+	unsigned char digest[20];
+	char name[64];
+	int i, j;
+
+	for(i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+		SHA1Init(&ctx);
+		for(j = 0; j < vectors[i].repeat; j++)
+			SHA1Update(&ctx, (unsigned char *)vectors[i].msg, strlen(vectors[i].msg));
+		SHA1Final(digest, &ctx);
+
+		sprintf(name, "SHA1 #%d", i + 1);
+		check(name, digest, vectors[i].digest);
+	}
+}
+
+
+static void test_hmac(void) {
+	static const struct {
+		const char *key;
+		const char *msg;
+		const char *digest;
+	} vectors[] = {
+		{ "0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b", "Hi There",
+			"b617318655057264e28bc0b6fb378c8ef146be00" },
+		{ "4a656665", "what do ya want for nothing?",
+			"effcdf6ae5eb2fa2d27416d5f184df9c259a7c79" },
+		{ "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		  "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		  "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa",
+			"Test Using Larger Than Block-Size Key - Hash Key First",
+			"aa4ae5e15272d00e95705637ce8a3b55ed402112" },
+	};
+	unsigned char key[128], digest[20];
+	char name[64];
+	size_t len;
+	int i;
+
+	for(i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+		unhex(vectors[i].key, key, &len);
+		sha1_hmac(key, len, (unsigned char *)vectors[i].msg, strlen(vectors[i].msg), digest);
+
+		sprintf(name, "HMAC-SHA1 RFC 2202 #%d", i == 2? 6: i + 1);
+		check(name, digest, vectors[i].digest);
+	}
+}
+
+
+int main(void) {
+	test_shn();
+	test_aes_ctr(0);
+	if(aes_ctr_have_aesni())
+		test_aes_ctr(1);
+	else
+		printf("No AES-NI on this CPU, skipping those tests\n");
+	test_sha1();
+	test_hmac();
+
+	printf("crypto: %d of %d tests passed\n", num_tests - num_failed, num_tests);
+
+	return num_failed? 1: 0;
+}
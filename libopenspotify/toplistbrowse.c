@@ -9,15 +9,27 @@
 #include "buf.h"
 #include "commands.h"
 #include "debug.h"
-#include "ezxml.h"
 #include "toplistbrowse.h"
 #include "sp_opaque.h"
 #include "track.h"
 #include "util.h"
+#include "xmlparser.h"
+#include "xmlreply.h"
+
+
+/* Lists in the XML, kept in toplistbrowse_ctx->section */
+#define TOPLISTBROWSE_XML_NONE		0
+#define TOPLISTBROWSE_XML_ARTISTS	1
+#define TOPLISTBROWSE_XML_ALBUMS	2
+#define TOPLISTBROWSE_XML_TRACKS	3
 
 
 static int toplistbrowse_callback(CHANNEL *ch, unsigned char *payload, unsigned short len);
-static int toplistbrowse_parse_xml(struct toplistbrowse_ctx *toplistbrowse_ctx);
+static void toplistbrowse_parsed(void *arg, int ret);
+static int toplistbrowse_xml_start(struct toplistbrowse_ctx *toplistbrowse_ctx);
+static void toplistbrowse_xml_free(struct toplistbrowse_ctx *toplistbrowse_ctx);
+static void toplistbrowse_xml_element_start(void *arg, int depth, const char *name, const char **attrs);
+static void toplistbrowse_xml_element_end(void *arg, int depth, const char *name, char *text);
 
 
 int toplistbrowse_process_request(sp_session *session, struct request *req) {
@@ -36,56 +48,33 @@ int toplistbrowse_process_request(sp_session *session, struct request *req) {
 
 	DSFYDEBUG("Initiating toplistbrowse with type %d, region %d\n", toplistbrowse->type, toplistbrowse->region);
 
+	/* Parser for the XML retrieved, a new one for each attempt */
+	toplistbrowse_xml_free(toplistbrowse_ctx);
+	if(toplistbrowse_xml_start(toplistbrowse_ctx))
+		return -1;
+
 	return cmd_toplistbrowse(session, toplistbrowse->type, toplistbrowse->region, toplistbrowse_callback, toplistbrowse_ctx);
 }
 
 
 static int toplistbrowse_callback(CHANNEL *ch, unsigned char *payload, unsigned short len) {
-	int skip_len;
 	struct toplistbrowse_ctx *toplistbrowse_ctx = (struct toplistbrowse_ctx *)ch->private;
 
 	switch(ch->state) {
 		case CHANNEL_DATA:
-			/* Skip a minimal gzip header */
-			if (ch->total_data_len < 10) {
-				skip_len = 10 - ch->total_data_len;
-				while(skip_len && len) {
-					skip_len--;
-					len--;
-					payload++;
-				}
-
-				if (len == 0)
-					break;
-			}
-
-			buf_append_data(toplistbrowse_ctx->buf, payload, len);
+			xml_reply_write(toplistbrowse_ctx->reply, payload, len);
 			break;
 
 		case CHANNEL_ERROR:
 			DSFYDEBUG("Got a channel ERROR, retrying within %d seconds\n", TOPLISTBROWSE_RETRY_TIMEOUT);
-			buf_free(toplistbrowse_ctx->buf);
-			toplistbrowse_ctx->buf = buf_new();
+			toplistbrowse_xml_free(toplistbrowse_ctx);
 
 			/* Reset timeout so the request can be retried */
-			toplistbrowse_ctx->req->next_timeout = get_millisecs() + TOPLISTBROWSE_RETRY_TIMEOUT*1000;
+			request_set_next_timeout(toplistbrowse_ctx->session, toplistbrowse_ctx->req, get_millisecs() + TOPLISTBROWSE_RETRY_TIMEOUT*1000);
 			break;
 
 		case CHANNEL_END:
-			if(toplistbrowse_parse_xml(toplistbrowse_ctx) == 0) {
-				toplistbrowse_ctx->toplistbrowse->error = SP_ERROR_OK;
-				toplistbrowse_ctx->toplistbrowse->is_loaded = 1;
-			}
-			else
-				toplistbrowse_ctx->toplistbrowse->error = SP_ERROR_OTHER_PERMANENT;
-
-			request_set_result(toplistbrowse_ctx->session, toplistbrowse_ctx->req, toplistbrowse_ctx->toplistbrowse->error, toplistbrowse_ctx->toplistbrowse);
-
-			/* Release reference made in sp_toplistbrowse_create() */
-			sp_toplistbrowse_release(toplistbrowse_ctx->toplistbrowse);
-
-			buf_free(toplistbrowse_ctx->buf);
-			free(toplistbrowse_ctx);
+			xml_reply_finish(toplistbrowse_ctx->reply, toplistbrowse_parsed, toplistbrowse_ctx);
 			break;
 
 		default:
@@ -97,99 +86,175 @@ static int toplistbrowse_callback(CHANNEL *ch, unsigned char *payload, unsigned
 }
 
 
-static int toplistbrowse_parse_xml(struct toplistbrowse_ctx *toplistbrowse_ctx) {
-	unsigned char id[16];
-	struct buf *xml;
-	sp_toplistbrowse *toplistbrowse = toplistbrowse_ctx->toplistbrowse;
-	ezxml_t root, listnode, node;
-	sp_artist *artist;
-	sp_album *album;
-	sp_track *track;
+/* Called once the XML has been parsed, which may be after the channel has gone */
+static void toplistbrowse_parsed(void *arg, int ret) {
+	struct toplistbrowse_ctx *toplistbrowse_ctx = (struct toplistbrowse_ctx *)arg;
 
-	xml = despotify_inflate(toplistbrowse_ctx->buf->ptr, toplistbrowse_ctx->buf->len);
-	if(xml == NULL)
-		return -1;
-
-#ifdef DEBUG
-	{
-		FILE *fd;
-		char buf[64];
-		sprintf(buf, "toplistbrowse-%04x-%04x.xml", toplistbrowse->type, toplistbrowse->region);
-		fd = fopen(buf, "w");
-		if(fd) {
-			fwrite(xml->ptr, xml->len, 1, fd);
-			fclose(fd);
-		}
+	if(ret == 0) {
+		toplistbrowse_ctx->toplistbrowse->error = SP_ERROR_OK;
+		toplistbrowse_ctx->toplistbrowse->is_loaded = 1;
 	}
-#endif
-
-	root = ezxml_parse_str((char *)xml->ptr, xml->len);
-	if(root == NULL) {
+	else {
 		DSFYDEBUG("Failed to parse XML\n");
-		buf_free(xml);
-		return -1;
+		toplistbrowse_ctx->toplistbrowse->error = SP_ERROR_OTHER_PERMANENT;
 	}
 
+	request_set_result(toplistbrowse_ctx->session, toplistbrowse_ctx->req, toplistbrowse_ctx->toplistbrowse->error, toplistbrowse_ctx->toplistbrowse);
+
+	/* Release reference made in sp_toplistbrowse_create() */
+	sp_toplistbrowse_release(toplistbrowse_ctx->toplistbrowse);
+
+	toplistbrowse_xml_free(toplistbrowse_ctx);
+	free(toplistbrowse_ctx);
+}
+
 
-	for(listnode = ezxml_get(root, "artists", 0, "artist", -1);
-	    listnode;
-	    listnode = listnode->next) {
+/* Set up for parsing the XML */
+static int toplistbrowse_xml_start(struct toplistbrowse_ctx *toplistbrowse_ctx) {
+	toplistbrowse_ctx->reply = xml_reply_new(toplistbrowse_ctx->session->parsepool, toplistbrowse_xml_element_start, toplistbrowse_xml_element_end, toplistbrowse_ctx);
+	if(toplistbrowse_ctx->reply == NULL)
+		return -1;
 
-		if((node = ezxml_get(listnode, "id", -1)) == NULL)
-			continue;
+	toplistbrowse_ctx->section = TOPLISTBROWSE_XML_NONE;
+	artist_xml_init(&toplistbrowse_ctx->artist, toplistbrowse_ctx->reply->arena);
+	album_xml_init(&toplistbrowse_ctx->album, toplistbrowse_ctx->reply->arena, toplistbrowse_ctx->session->country);
+	track_xml_init(&toplistbrowse_ctx->track, toplistbrowse_ctx->reply->arena, toplistbrowse_ctx->session->country);
 
-		hex_ascii_to_bytes(node->txt, id, 16);
-		artist = osfy_artist_add(toplistbrowse_ctx->session, id);
+	return 0;
+}
 
-		if(!sp_artist_is_loaded(artist))
-			osfy_artist_load_artist_from_xml(toplistbrowse_ctx->session, artist, listnode);
 
-		sp_artist_add_ref(artist);
-		toplistbrowse->artists = (sp_artist **)realloc(toplistbrowse->artists, (toplistbrowse->num_artists + 1) * sizeof(sp_artist *));
-		toplistbrowse->artists[toplistbrowse->num_artists++] = artist;
+static void toplistbrowse_xml_free(struct toplistbrowse_ctx *toplistbrowse_ctx) {
+	/* The records' contents go with it */
+	if(toplistbrowse_ctx->reply) {
+		xml_reply_free(toplistbrowse_ctx->reply);
+		toplistbrowse_ctx->reply = NULL;
 	}
+}
+
+
+/* The root element holds a list each of artists, albums and tracks */
+static void toplistbrowse_xml_element_start(void *arg, int depth, const char *name, const char **attrs) {
+	struct toplistbrowse_ctx *toplistbrowse_ctx = (struct toplistbrowse_ctx *)arg;
+	sp_toplistbrowse *toplistbrowse = toplistbrowse_ctx->toplistbrowse;
+	int i;
 
+	if(depth == 1) {
+		/* Drop what an earlier attempt returned */
+		for(i = 0; i < toplistbrowse->num_artists; i++)
+			sp_artist_release(toplistbrowse->artists[i]);
 
-	for(listnode = ezxml_get(root, "albums", 0, "album", -1);
-	    listnode;
-	    listnode = listnode->next) {
+		for(i = 0; i < toplistbrowse->num_albums; i++)
+			sp_album_release(toplistbrowse->albums[i]);
 
-		if((node = ezxml_get(listnode, "id", -1)) == NULL)
-			continue;
+		for(i = 0; i < toplistbrowse->num_tracks; i++)
+			sp_track_release(toplistbrowse->tracks[i]);
 
-		hex_ascii_to_bytes(node->txt, id, 16);
-		album = sp_album_add(toplistbrowse_ctx->session, id);
+		toplistbrowse->num_artists = 0;
+		toplistbrowse->num_albums = 0;
+		toplistbrowse->num_tracks = 0;
+	}
+	else if(depth == 2) {
+		if(!strcmp(name, "artists"))
+			toplistbrowse_ctx->section = TOPLISTBROWSE_XML_ARTISTS;
+		else if(!strcmp(name, "albums"))
+			toplistbrowse_ctx->section = TOPLISTBROWSE_XML_ALBUMS;
+		else if(!strcmp(name, "tracks"))
+			toplistbrowse_ctx->section = TOPLISTBROWSE_XML_TRACKS;
+		else
+			toplistbrowse_ctx->section = TOPLISTBROWSE_XML_NONE;
+	}
+	else if(toplistbrowse_ctx->section == TOPLISTBROWSE_XML_ARTISTS) {
+		if(depth == 3)
+			artist_xml_free(&toplistbrowse_ctx->artist);
+	}
+	else if(toplistbrowse_ctx->section == TOPLISTBROWSE_XML_ALBUMS) {
+		if(depth == 3)
+			album_xml_free(&toplistbrowse_ctx->album);
+		else
+			album_xml_start(&toplistbrowse_ctx->album, depth - 3, name, attrs);
+	}
+	else if(toplistbrowse_ctx->section == TOPLISTBROWSE_XML_TRACKS) {
+		if(depth == 3)
+			track_xml_free(&toplistbrowse_ctx->track);
+		else
+			track_xml_start(&toplistbrowse_ctx->track, depth - 3, name, attrs);
+	}
+}
 
-		if(!sp_album_is_loaded(album))
-			osfy_album_load_from_search_xml(toplistbrowse_ctx->session, album, listnode);
 
-		sp_album_add_ref(album);
-		toplistbrowse->albums = (sp_album **)realloc(toplistbrowse->albums, (toplistbrowse->num_albums + 1) * sizeof(sp_album *));
-		toplistbrowse->albums[toplistbrowse->num_albums++] = album;
+/* Objects are added to the toplist as their elements close */
+static void toplistbrowse_xml_element_end(void *arg, int depth, const char *name, char *text) {
+	struct toplistbrowse_ctx *toplistbrowse_ctx = (struct toplistbrowse_ctx *)arg;
+	sp_toplistbrowse *toplistbrowse = toplistbrowse_ctx->toplistbrowse;
+	sp_artist *artist;
+	sp_album *album;
+	sp_track *track;
+
+	if(depth == 2) {
+		toplistbrowse_ctx->section = TOPLISTBROWSE_XML_NONE;
+		return;
 	}
 
+	switch(toplistbrowse_ctx->section) {
+		case TOPLISTBROWSE_XML_ARTISTS:
+			if(depth > 3) {
+				artist_xml_end(&toplistbrowse_ctx->artist, depth - 3, name, text);
+				break;
+			}
 
-	for(listnode = ezxml_get(root, "tracks", 0, "track", -1);
-	    listnode;
-	    listnode = listnode->next) {
+			if(!(toplistbrowse_ctx->artist.found & ARTIST_XML_ID))
+				break;
 
-		if((node = ezxml_get(listnode, "id", -1)) == NULL)
-			continue;
+			artist = osfy_artist_add(toplistbrowse_ctx->session, toplistbrowse_ctx->artist.id);
 
-		hex_ascii_to_bytes(node->txt, id, 16);
-		track = osfy_track_add(toplistbrowse_ctx->session, id);
+			if(!sp_artist_is_loaded(artist))
+				osfy_artist_load_artist_from_xml(toplistbrowse_ctx->session, artist, &toplistbrowse_ctx->artist);
 
-		if(!sp_track_is_loaded(track))
-			osfy_track_load_from_xml(toplistbrowse_ctx->session, track, listnode);
+			sp_artist_add_ref(artist);
+			toplistbrowse->artists = (sp_artist **)realloc(toplistbrowse->artists, (toplistbrowse->num_artists + 1) * sizeof(sp_artist *));
+			toplistbrowse->artists[toplistbrowse->num_artists++] = artist;
+			break;
 
-		sp_track_add_ref(track);
-		toplistbrowse->tracks = (sp_track **)realloc(toplistbrowse->tracks, (toplistbrowse->num_tracks + 1) * sizeof(sp_track *));
-		toplistbrowse->tracks[toplistbrowse->num_tracks++] = track;
-	}
+		case TOPLISTBROWSE_XML_ALBUMS:
+			if(depth > 3) {
+				album_xml_end(&toplistbrowse_ctx->album, depth - 3, name, text);
+				break;
+			}
 
+			if(!(toplistbrowse_ctx->album.found & ALBUM_XML_ID))
+				break;
 
-	ezxml_free(root);
-	buf_free(xml);
+			album = sp_album_add(toplistbrowse_ctx->session, toplistbrowse_ctx->album.id);
 
-	return 0;
+			if(!sp_album_is_loaded(album))
+				osfy_album_load_from_search_xml(toplistbrowse_ctx->session, album, &toplistbrowse_ctx->album);
+
+			sp_album_add_ref(album);
+			toplistbrowse->albums = (sp_album **)realloc(toplistbrowse->albums, (toplistbrowse->num_albums + 1) * sizeof(sp_album *));
+			toplistbrowse->albums[toplistbrowse->num_albums++] = album;
+			break;
+
+		case TOPLISTBROWSE_XML_TRACKS:
+			if(depth > 3) {
+				track_xml_end(&toplistbrowse_ctx->track, depth - 3, name, text);
+				break;
+			}
+
+			if(!(toplistbrowse_ctx->track.found & TRACK_XML_ID))
+				break;
+
+			track = osfy_track_add(toplistbrowse_ctx->session, toplistbrowse_ctx->track.id);
+
+			if(!sp_track_is_loaded(track))
+				osfy_track_load_from_xml(toplistbrowse_ctx->session, track, &toplistbrowse_ctx->track);
+
+			sp_track_add_ref(track);
+			toplistbrowse->tracks = (sp_track **)realloc(toplistbrowse->tracks, (toplistbrowse->num_tracks + 1) * sizeof(sp_track *));
+			toplistbrowse->tracks[toplistbrowse->num_tracks++] = track;
+			break;
+
+		default:
+			break;
+	}
 }
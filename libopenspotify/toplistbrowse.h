@@ -4,7 +4,10 @@
 #include <spotify/api.h>
 
 #include "buf.h"
+#include "metadata.h"
 #include "request.h"
+#include "xmlparser.h"
+#include "xmlreply.h"
 
 
 #define TOPLISTBROWSE_RETRY_TIMEOUT	30*1000
@@ -13,8 +16,14 @@
 struct toplistbrowse_ctx {
         sp_session *session;
         struct request *req;
-	struct buf *buf;
+	struct xml_reply *reply;
         sp_toplistbrowse *toplistbrowse;
+
+	/* The list and object being read, see toplistbrowse.c */
+	int section;
+	struct artist_xml artist;
+	struct album_xml album;
+	struct track_xml track;
 };
 
 
@@ -9,6 +9,7 @@
 #include "commands.h"
 #include "debug.h"
 #include "ezxml.h"
+#include "inflater.h"
 #include "request.h"
 #include "sp_opaque.h"
 #include "user.h"
@@ -19,6 +20,7 @@ struct user_ctx {
         sp_session *session;
         struct request *req;
 	struct buf *buf;
+	struct inflater *inflater;
         sp_user *user;
 };
 
@@ -70,6 +72,10 @@ int user_lookup(sp_session *session, sp_user *user) {
 			"or in a different state than SP_ERROR_RESOURCE_NOT_LOADED (currently %d)\n",
 			user->canonical_name, user->is_loaded, user->error);
 
+		/* Someone else's lookup will load it for us */
+		if(user->error == SP_ERROR_IS_LOADING)
+			atomic_add(&session->num_coalesced, 1);
+
 		return 0;
 	}
 
@@ -86,6 +92,7 @@ int user_lookup(sp_session *session, sp_user *user) {
 	user_ctx->session = session;
 	user_ctx->req = NULL;
 	user_ctx->buf = buf_new();
+	user_ctx->inflater = inflater_new(NULL, inflater_sink_buf, user_ctx->buf);
 	user_ctx->user = user;
 	
         container = (void **)malloc(sizeof(void *));
@@ -139,34 +146,22 @@ int user_process_request(sp_session *session, struct request *req) {
 
 
 static int user_callback(CHANNEL *ch, unsigned char *payload, unsigned short len) {
-	int skip_len;
 	struct user_ctx *user_ctx = (struct user_ctx *)ch->private;
 	
 	switch(ch->state) {
 		case CHANNEL_DATA:
-			/* Skip a minimal gzip header */
-			if (ch->total_data_len < 10) {
-				skip_len = 10 - ch->total_data_len;
-				while(skip_len && len) {
-					skip_len--;
-					len--;
-					payload++;
-				}
-				
-				if (len == 0)
-					break;
-			}
-
-			buf_append_data(user_ctx->buf, payload, len);
+			inflater_write(user_ctx->inflater, payload, len);
 			break;
 			
 		case CHANNEL_ERROR:
 			DSFYDEBUG("Got a channel ERROR, retrying within %d seconds\n", USER_RETRY_TIMEOUT);
+			inflater_free(user_ctx->inflater);
 			buf_free(user_ctx->buf);
 			user_ctx->buf = buf_new();
+			user_ctx->inflater = inflater_new(NULL, inflater_sink_buf, user_ctx->buf);
 
 			/* Reset timeout so the request can be retried */
-			user_ctx->req->next_timeout = get_millisecs() + USER_RETRY_TIMEOUT*1000;
+			request_set_next_timeout(user_ctx->session, user_ctx->req, get_millisecs() + USER_RETRY_TIMEOUT*1000);
 
 			break;
 			
@@ -174,12 +169,15 @@ static int user_callback(CHANNEL *ch, unsigned char *payload, unsigned short len
 			if(user_parse_xml(user_ctx) == 0) {
 				request_set_result(user_ctx->session, user_ctx->req, SP_ERROR_OK, user_ctx->user);
 			
+				inflater_free(user_ctx->inflater);
 				buf_free(user_ctx->buf);
 				free(user_ctx);
 			}
 			else {
+				inflater_free(user_ctx->inflater);
 				buf_free(user_ctx->buf);
 				user_ctx->buf = buf_new();
+				user_ctx->inflater = inflater_new(NULL, inflater_sink_buf, user_ctx->buf);
 			}
 			break;
 			
@@ -196,9 +194,11 @@ static int user_parse_xml(struct user_ctx *user_ctx) {
 	struct buf *xml;
 	ezxml_t root, node;
 	
-	xml = despotify_inflate(user_ctx->buf->ptr, user_ctx->buf->len);
-	if(xml == NULL)
+	if(inflater_finish(user_ctx->inflater))
 		return -1;
+
+	xml = user_ctx->buf;
+	buf_append_u8(xml, 0); /* null terminate string */
 	
 	{
 		FILE *fd;
@@ -215,7 +215,6 @@ static int user_parse_xml(struct user_ctx *user_ctx) {
 	root = ezxml_parse_str((char *) xml->ptr, xml->len);
 	if(root == NULL) {
 		DSFYDEBUG("Failed to parse XML\n");
-		buf_free(xml);
 		return -1;
 	}
 
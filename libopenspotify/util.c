@@ -19,8 +19,6 @@
 #include <ctype.h>
 #include <errno.h>
 
-#include <zlib.h>
-
 #include "buf.h"
 #include "debug.h"
 #include "util.h"
@@ -219,66 +217,15 @@ int get_millisecs(void) {
 }
 
 
-struct buf* despotify_inflate(unsigned char* data, int len) {
-	int done, offset, rc;
-	struct buf *b;
-	struct z_stream_s z;
-
-	if(!len)
-		return NULL;
-
-	memset(&z, 0, sizeof z);
-
-	rc = inflateInit2(&z, -MAX_WBITS);
-	if (rc != Z_OK) {
-		DSFYDEBUG("error: inflateInit() returned %d\n", rc);
-		return NULL;
-	}
-
-	z.next_in = data;
-	z.avail_in = len;
-
-	b = buf_new();
-	buf_extend(b, 4096);
-
-	offset = 0;
-	done = 0;
-	while(!done) {
-		z.avail_out = b->size - offset;
-		z.next_out = b->ptr + offset;
-
-		rc = inflate(&z, Z_NO_FLUSH);
-		switch (rc) {
-		case Z_OK:
-	                /* inflated fine */
-	                if (z.avail_out == 0) {
-				/* zlib needs more output buffer */
-				offset = b->size;
-				buf_extend(b, b->size * 2);
-	                }
-                break;
-
-		case Z_STREAM_END:
-	                /* end of input */
-	                done = 1;
-                break;
-
-		default:
-	                /* error */
-	                DSFYDEBUG("error: inflate() returned %d\n", rc);
-	                done = 1;
-	                buf_free(b);
-	                b = NULL;
-	                break;
-		}
-	}
-
-	if (b) {
-		b->len = b->size - z.avail_out;
-		buf_append_u8(b, 0); /* null terminate string */
-	}
-
-	inflateEnd(&z);
-
-	return b;
+/*
+ * Atomically add delta to *value and return the new value
+ * Used for statistics counters touched by both the main thread and the iothread
+ *
+ */
+int atomic_add(volatile int *value, int delta) {
+#ifdef _MSC_VER
+	return InterlockedExchangeAdd((volatile LONG *)value, delta) + delta;
+#else
+	return __sync_add_and_fetch(value, delta);
+#endif
 }
@@ -26,6 +26,6 @@ void logdata (char *, int, void *, int);
 ssize_t block_read (int, void *, size_t);
 ssize_t block_write (int, const void *, size_t);
 int get_millisecs(void);
-struct buf* despotify_inflate(unsigned char* data, int len);
+int atomic_add(volatile int *, int);
 
 #endif
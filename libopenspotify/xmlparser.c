@@ -0,0 +1,494 @@
+/*
+ * Incremental XML parser
+ *
+ * Browse, search and toplist replies used to be collected in full and
+ * parsed into a tree by ezxml before the loaders looked up each field
+ * they wanted with ezxml_get(). This parser is fed the XML a piece at a
+ * time, straight from inflater.c, and calls a start handler as each
+ * element opens and an end handler with the element's text as it closes.
+ * All it keeps is the tag being read, the text of the innermost element
+ * and the names of the open elements, in buffers that grow within the
+ * response's arena. There's nothing to free, the parser goes with the
+ * arena.
+ *
+ * It understands what the Spotify servers send: elements, attributes,
+ * character and entity references, CDATA sections, comments and
+ * processing instructions. Declarations such as a DOCTYPE are skipped.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "debug.h"
+#include "xmlparser.h"
+
+
+/* What the parser is in the middle of */
+#define XML_STATE_TEXT		0	/* Character data */
+#define XML_STATE_OPEN		1	/* Just after a '<' */
+#define XML_STATE_TAG		2	/* Start or end tag */
+#define XML_STATE_BANG		3	/* After "<!", comment, CDATA or declaration? */
+#define XML_STATE_COMMENT	4
+#define XML_STATE_CDATA		5
+#define XML_STATE_DECL		6
+#define XML_STATE_PI		7	/* Processing instruction, like <?xml ...?> */
+#define XML_STATE_ERROR		8
+
+#define XML_SPACE		" \t\r\n"
+
+
+static void xml_buf_append(struct xml_parser *p, struct xml_buf *b, const void *data, int len);
+static void xml_buf_append_u8(struct xml_parser *p, struct xml_buf *b, unsigned char c);
+static void xml_parser_tag(struct xml_parser *p);
+static int xml_parser_attrs(struct xml_parser *p, char *s);
+static void xml_parser_open(struct xml_parser *p, const char *name);
+static void xml_parser_close(struct xml_parser *p);
+static void xml_decode(char *s);
+static int xml_utf8(unsigned long c, char *out);
+
+
+struct xml_parser *xml_parser_new(struct arena *arena, xml_start_handler start, xml_end_handler end, void *arg) {
+	struct xml_parser *p;
+
+	if((p = arena_alloc(arena, sizeof(struct xml_parser))) == NULL)
+		return NULL;
+
+	p->arena = arena;
+	p->start = start;
+	p->end = end;
+	p->arg = arg;
+
+	p->state = XML_STATE_TEXT;
+	p->match = 0;
+	p->quote = 0;
+	p->done = 0;
+
+	p->depth = 0;
+	p->names.ptr = p->tag.ptr = p->text.ptr = NULL;
+	p->names.len = p->tag.len = p->text.len = 0;
+	p->names.size = p->tag.size = p->text.size = 0;
+
+	return p;
+}
+
+
+/*
+ * Parse the next piece of the document, calling the handlers for the
+ * elements that open and close in it
+ * Returns 0, or -1 if the document is malformed.
+ *
+ */
+int xml_parser_write(struct xml_parser *p, unsigned char *data, int len) {
+	unsigned char *end = data + len, *ptr;
+	unsigned char c;
+	int n;
+
+	while(data < end) {
+		switch(p->state) {
+			case XML_STATE_TEXT:
+				if((ptr = memchr(data, '<', end - data)) == NULL)
+					ptr = end;
+
+				/* Whitespace around the root element is of no interest */
+				if(p->depth > 0)
+					xml_buf_append(p, &p->text, data, ptr - data);
+
+				data = ptr;
+				if(data < end) {
+					p->state = XML_STATE_OPEN;
+					data++;
+				}
+				break;
+
+			case XML_STATE_OPEN:
+				p->tag.len = 0;
+				p->match = 0;
+				p->quote = 0;
+
+				if(*data == '!') {
+					p->state = XML_STATE_BANG;
+					data++;
+				}
+				else if(*data == '?') {
+					p->state = XML_STATE_PI;
+					data++;
+				}
+				else
+					p->state = XML_STATE_TAG;
+				break;
+
+			case XML_STATE_TAG:
+				/* Attribute values may contain '>' */
+				for(n = 0; data + n < end; n++) {
+					c = data[n];
+					if(p->quote) {
+						if(c == p->quote)
+							p->quote = 0;
+					}
+					else if(c == '"' || c == '\'')
+						p->quote = c;
+					else if(c == '>')
+						break;
+				}
+
+				xml_buf_append(p, &p->tag, data, n);
+				data += n;
+				if(data == end)
+					break;
+
+				data++;
+				p->state = XML_STATE_TEXT;
+				xml_parser_tag(p);
+				break;
+
+			case XML_STATE_BANG:
+				c = *data++;
+				xml_buf_append_u8(p, &p->tag, c);
+
+				n = p->tag.len;
+				if(n <= 2 && !memcmp(p->tag.ptr, "--", n)) {
+					if(n == 2)
+						p->state = XML_STATE_COMMENT;
+				}
+				else if(n <= 7 && !memcmp(p->tag.ptr, "[CDATA[", n)) {
+					if(n == 7)
+						p->state = XML_STATE_CDATA;
+				}
+				else
+					p->state = c == '>'? XML_STATE_TEXT: XML_STATE_DECL;
+				break;
+
+			case XML_STATE_COMMENT:
+				c = *data++;
+				if(c == '-') {
+					if(p->match < 2)
+						p->match++;
+				}
+				else if(c == '>' && p->match == 2)
+					p->state = XML_STATE_TEXT;
+				else
+					p->match = 0;
+				break;
+
+			case XML_STATE_CDATA:
+				c = *data++;
+				if(c == ']' && p->match < 2)
+					p->match++;
+				else if(c == '>' && p->match == 2)
+					p->state = XML_STATE_TEXT;
+				else if(c == ']')
+					xml_buf_append_u8(p, &p->text, c);
+				else {
+					for(; p->match > 0; p->match--)
+						xml_buf_append_u8(p, &p->text, ']');
+
+					/* The text is decoded when the element closes, so escape '&' */
+					if(c == '&')
+						xml_buf_append(p, &p->text, "&amp;", 5);
+					else
+						xml_buf_append_u8(p, &p->text, c);
+				}
+				break;
+
+			case XML_STATE_DECL:
+				if((ptr = memchr(data, '>', end - data)) == NULL) {
+					data = end;
+					break;
+				}
+
+				data = ptr + 1;
+				p->state = XML_STATE_TEXT;
+				break;
+
+			case XML_STATE_PI:
+				c = *data++;
+				if(c == '>' && p->match)
+					p->state = XML_STATE_TEXT;
+				else
+					p->match = c == '?';
+				break;
+
+			default:
+				return -1;
+		}
+	}
+
+	return p->state == XML_STATE_ERROR? -1: 0;
+}
+
+
+/*
+ * Called when there's no more data
+ * Returns 0 if a complete document was parsed, -1 if it was malformed or cut short
+ *
+ */
+int xml_parser_finish(struct xml_parser *p) {
+	if(p->state == XML_STATE_ERROR)
+		return -1;
+
+	if(!p->done) {
+		DSFYDEBUG("Document ended with %d elements still open\n", p->depth);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/* Parse decompressed data from inflater.c, 'arg' is the parser */
+void xml_parser_sink(void *arg, unsigned char *data, int len) {
+	xml_parser_write((struct xml_parser *)arg, data, len);
+}
+
+
+/* Value of an attribute passed to a start handler, or NULL */
+const char *xml_attr(const char **attrs, const char *name) {
+	for(; *attrs; attrs += 2)
+		if(!strcmp(*attrs, name))
+			return attrs[1];
+
+	return NULL;
+}
+
+
+/* Buffers start at this size and double as needed */
+#define XML_BUF_SIZE	512
+
+static void xml_buf_append(struct xml_parser *p, struct xml_buf *b, const void *data, int len) {
+	int size;
+
+	if(len == 0)
+		return;
+
+	if(b->len + len > b->size) {
+		for(size = b->size? b->size: XML_BUF_SIZE; b->len + len > size; size *= 2)
+			;
+
+		b->ptr = arena_realloc(p->arena, b->ptr, b->len, size);
+		b->size = size;
+	}
+
+	memcpy(b->ptr + b->len, data, len);
+	b->len += len;
+}
+
+
+static void xml_buf_append_u8(struct xml_parser *p, struct xml_buf *b, unsigned char c) {
+	if(b->len < b->size)
+		b->ptr[b->len++] = c;
+	else
+		xml_buf_append(p, b, &c, 1);
+}
+
+
+/* A start or end tag has been read into p->tag */
+static void xml_parser_tag(struct xml_parser *p) {
+	char *s, *end, *name;
+	int empty = 0;
+
+	xml_buf_append_u8(p, &p->tag, 0);
+	s = p->tag.ptr;
+	end = s + p->tag.len - 1;
+
+	/* End tag */
+	if(*s == '/') {
+		name = s + 1;
+		name[strcspn(name, XML_SPACE)] = 0;
+
+		if(p->depth == 0 || strcmp(name, p->names.ptr + p->name_offset[p->depth - 1])) {
+			DSFYDEBUG("Unexpected end tag '%s'\n", name);
+			p->state = XML_STATE_ERROR;
+			return;
+		}
+
+		xml_parser_close(p);
+		return;
+	}
+
+	/* Empty element, like <year/> */
+	if(end > s && end[-1] == '/') {
+		*--end = 0;
+		empty = 1;
+	}
+
+	name = s;
+	s += strcspn(s, XML_SPACE);
+	if(*s)
+		*s++ = 0;
+
+	if(*name == 0 || xml_parser_attrs(p, s)) {
+		DSFYDEBUG("Malformed tag '%s'\n", name);
+		p->state = XML_STATE_ERROR;
+		return;
+	}
+
+	if(p->depth == XML_MAX_DEPTH || (p->depth == 0 && p->done)) {
+		DSFYDEBUG("Unexpected element '%s' at depth %d\n", name, p->depth);
+		p->state = XML_STATE_ERROR;
+		return;
+	}
+
+	xml_parser_open(p, name);
+	if(empty)
+		xml_parser_close(p);
+}
+
+
+/* Split up the attributes of a start tag, returns -1 if they're malformed */
+static int xml_parser_attrs(struct xml_parser *p, char *s) {
+	char *name, *name_end, *value, quote;
+	int n = 0;
+
+	for(;;) {
+		s += strspn(s, XML_SPACE);
+		if(*s == 0)
+			break;
+
+		name = s;
+		name_end = s + strcspn(s, "=" XML_SPACE);
+		s = name_end + strspn(name_end, XML_SPACE);
+		if(*s++ != '=')
+			return -1;
+
+		s += strspn(s, XML_SPACE);
+		if(*s != '"' && *s != '\'')
+			return -1;
+
+		quote = *s++;
+		value = s;
+		if((s = strchr(s, quote)) == NULL)
+			return -1;
+
+		*name_end = 0;
+		*s++ = 0;
+		xml_decode(value);
+
+		if(n < XML_MAX_ATTRS) {
+			p->attrs[2 * n] = name;
+			p->attrs[2 * n + 1] = value;
+			n++;
+		}
+	}
+
+	p->attrs[2 * n] = NULL;
+
+	return 0;
+}
+
+
+static void xml_parser_open(struct xml_parser *p, const char *name) {
+	p->name_offset[p->depth++] = p->names.len;
+	xml_buf_append(p, &p->names, name, strlen(name) + 1);
+
+	p->text.len = 0;
+	if(p->start)
+		p->start(p->arg, p->depth, name, p->attrs);
+}
+
+
+static void xml_parser_close(struct xml_parser *p) {
+	char *name, *text;
+
+	xml_buf_append_u8(p, &p->text, 0);
+	text = p->text.ptr;
+	if(memchr(text, '&', p->text.len))
+		xml_decode(text);
+
+	name = p->names.ptr + p->name_offset[p->depth - 1];
+	if(p->end)
+		p->end(p->arg, p->depth, name, text);
+
+	p->names.len = p->name_offset[--p->depth];
+	p->text.len = 0;
+
+	if(p->depth == 0)
+		p->done = 1;
+}
+
+
+/*
+ * Replace entity and character references in a string, in place
+ * Unknown entities are left as they are, like ezxml does.
+ *
+ */
+static void xml_decode(char *s) {
+	char *d = s, *semi;
+	unsigned long c;
+
+	while(*s) {
+		if(*s != '&') {
+			*d++ = *s++;
+			continue;
+		}
+
+		for(semi = s + 1; *semi && *semi != ';' && semi - s < 12; semi++)
+			;
+
+		if(*semi != ';') {
+			*d++ = *s++;
+			continue;
+		}
+
+		if(s[1] == '#') {
+			if(s[2] == 'x')
+				c = strtoul(s + 3, NULL, 16);
+			else
+				c = strtoul(s + 2, NULL, 10);
+
+			if(c == 0 || c > 0x10ffff) {
+				*d++ = *s++;
+				continue;
+			}
+
+			d += xml_utf8(c, d);
+		}
+		else if(!strncmp(s, "&lt;", 4))
+			*d++ = '<';
+		else if(!strncmp(s, "&gt;", 4))
+			*d++ = '>';
+		else if(!strncmp(s, "&amp;", 5))
+			*d++ = '&';
+		else if(!strncmp(s, "&quot;", 6))
+			*d++ = '"';
+		else if(!strncmp(s, "&apos;", 6))
+			*d++ = '\'';
+		else {
+			*d++ = *s++;
+			continue;
+		}
+
+		s = semi + 1;
+	}
+
+	*d = 0;
+}
+
+
+/* Encode a character as UTF-8, never longer than the reference it came from */
+static int xml_utf8(unsigned long c, char *out) {
+	if(c < 0x80) {
+		out[0] = (char)c;
+		return 1;
+	}
+
+	if(c < 0x800) {
+		out[0] = (char)(0xc0 | (c >> 6));
+		out[1] = (char)(0x80 | (c & 0x3f));
+		return 2;
+	}
+
+	if(c < 0x10000) {
+		out[0] = (char)(0xe0 | (c >> 12));
+		out[1] = (char)(0x80 | ((c >> 6) & 0x3f));
+		out[2] = (char)(0x80 | (c & 0x3f));
+		return 3;
+	}
+
+	out[0] = (char)(0xf0 | (c >> 18));
+	out[1] = (char)(0x80 | ((c >> 12) & 0x3f));
+	out[2] = (char)(0x80 | ((c >> 6) & 0x3f));
+	out[3] = (char)(0x80 | (c & 0x3f));
+	return 4;
+}
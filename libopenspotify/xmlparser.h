@@ -0,0 +1,67 @@
+/*
+ * Incremental XML parser, see xmlparser.c
+ *
+ */
+
+#ifndef LIBOPENSPOTIFY_XMLPARSER_H
+#define LIBOPENSPOTIFY_XMLPARSER_H
+
+#include "arena.h"
+
+/* Elements nested deeper than this are an error */
+#define XML_MAX_DEPTH	32
+
+/* Attributes beyond this many on an element are ignored */
+#define XML_MAX_ATTRS	16
+
+/*
+ * Called as an element opens, with its attributes as a NULL terminated
+ * list of name and value pairs, and as it closes, with the text directly
+ * inside it. The root element is at depth 1.
+ *
+ */
+typedef void (*xml_start_handler)(void *arg, int depth, const char *name, const char **attrs);
+typedef void (*xml_end_handler)(void *arg, int depth, const char *name, char *text);
+
+/* Grows within the parser's arena */
+struct xml_buf {
+	char *ptr;
+	int len;
+	int size;
+};
+
+struct xml_parser {
+	/* The parser and its buffers are allocated from this */
+	struct arena *arena;
+
+	xml_start_handler start;
+	xml_end_handler end;
+	void *arg;
+
+	/* Where in the markup we are, see xmlparser.c */
+	int state;
+	int match;
+	unsigned char quote;
+
+	/* Set once the root element has been closed */
+	int done;
+
+	/* Names of the open elements, NUL terminated, one after another */
+	int depth;
+	int name_offset[XML_MAX_DEPTH];
+	struct xml_buf names;
+
+	/* Markup between '<' and '>', and text since the last tag */
+	struct xml_buf tag;
+	struct xml_buf text;
+
+	const char *attrs[2 * XML_MAX_ATTRS + 2];
+};
+
+struct xml_parser *xml_parser_new(struct arena *arena, xml_start_handler start, xml_end_handler end, void *arg);
+int xml_parser_write(struct xml_parser *p, unsigned char *data, int len);
+int xml_parser_finish(struct xml_parser *p);
+void xml_parser_sink(void *arg, unsigned char *data, int len);
+const char *xml_attr(const char **attrs, const char *name);
+
+#endif
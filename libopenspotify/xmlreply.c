@@ -0,0 +1,259 @@
+/*
+ * Compressed XML replies
+ *
+ * Without a parse pool a reply is inflated and parsed as it arrives,
+ * with the caller's handlers called from the channel callback. With
+ * one, the channel data is only kept until the channel ends. A worker
+ * then inflates and parses it, recording each element as it opens and
+ * closes, and the networking thread replays the recording through the
+ * caller's handlers. The handlers, which look up and load objects in
+ * the session, see the same elements either way and always run on the
+ * networking thread. Only the done callback tells the two apart, by
+ * being called later.
+ *
+ * Everything the reply holds is allocated from its arena, the caller's
+ * records can use it too.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "debug.h"
+#include "inflater.h"
+#include "parsepool.h"
+#include "xmlparser.h"
+#include "xmlreply.h"
+
+
+static int xml_reply_parser_new(struct xml_reply *reply, xml_start_handler start, xml_end_handler end, void *arg);
+static int xml_reply_work(void *arg);
+static void xml_reply_complete(void *arg, int ret);
+static void xml_reply_record_start(void *arg, int depth, const char *name, const char **attrs);
+static void xml_reply_record_end(void *arg, int depth, const char *name, char *text);
+static struct xml_event *xml_reply_event(struct xml_reply *reply, int depth, const char *name);
+
+
+/* Without a pool, or one with no workers, the XML is parsed as it arrives */
+struct xml_reply *xml_reply_new(struct parsepool *pool, xml_start_handler start, xml_end_handler end, void *arg) {
+	struct arena *arena;
+	struct xml_reply *reply;
+
+	if((arena = arena_new()) == NULL)
+		return NULL;
+
+	if((reply = (struct xml_reply *)arena_alloc(arena, sizeof(struct xml_reply))) == NULL) {
+		arena_free(arena);
+		return NULL;
+	}
+
+	reply->arena = arena;
+	reply->start = start;
+	reply->end = end;
+	reply->arg = arg;
+
+	reply->pool = NULL;
+	if(pool != NULL && pool->limit > 0)
+		reply->pool = pool;
+
+	reply->inflater = NULL;
+	reply->parser = NULL;
+	reply->chunks = NULL;
+	reply->chunks_tail = &reply->chunks;
+	reply->events = NULL;
+	reply->events_tail = &reply->events;
+	reply->failed = 0;
+	reply->done = NULL;
+	reply->done_arg = NULL;
+
+	if(reply->pool == NULL && xml_reply_parser_new(reply, start, end, arg)) {
+		xml_reply_free(reply);
+		return NULL;
+	}
+
+	return reply;
+}
+
+
+/* Feed channel data to the parser, or keep it for a worker */
+void xml_reply_write(struct xml_reply *reply, unsigned char *data, int len) {
+	struct xml_chunk *chunk;
+
+	if(reply->pool == NULL) {
+		inflater_write(reply->inflater, data, len);
+		return;
+	}
+
+	if((chunk = (struct xml_chunk *)arena_alloc(reply->arena, sizeof(struct xml_chunk) + len)) == NULL) {
+		reply->failed = 1;
+		return;
+	}
+
+	chunk->next = NULL;
+	chunk->len = len;
+	memcpy(chunk->data, data, len);
+
+	*reply->chunks_tail = chunk;
+	reply->chunks_tail = &chunk->next;
+}
+
+
+/*
+ * Called once the channel has ended. done is called with 0 once a
+ * complete document has been handed to the handlers, or -1. It's called
+ * right away unless a worker took the reply, and may free it.
+ *
+ */
+void xml_reply_finish(struct xml_reply *reply, xml_reply_done done, void *done_arg) {
+	int ret;
+
+	reply->done = done;
+	reply->done_arg = done_arg;
+
+	if(reply->pool == NULL) {
+		ret = 0;
+		if(inflater_finish(reply->inflater) || xml_parser_finish(reply->parser))
+			ret = -1;
+
+		done(done_arg, ret);
+		return;
+	}
+
+	if(parsepool_submit(reply->pool, xml_reply_work, xml_reply_complete, reply) == 0)
+		return;
+
+	/* No worker could take it */
+	xml_reply_complete(reply, xml_reply_work(reply));
+}
+
+
+/* The reply's handlers must not be called after this */
+void xml_reply_free(struct xml_reply *reply) {
+	if(reply->inflater)
+		inflater_free(reply->inflater);
+
+	/* The reply goes with it */
+	arena_free(reply->arena);
+}
+
+
+static int xml_reply_parser_new(struct xml_reply *reply, xml_start_handler start, xml_end_handler end, void *arg) {
+	reply->parser = xml_parser_new(reply->arena, start, end, arg);
+	if(reply->parser == NULL
+		|| (reply->inflater = inflater_new(reply->arena, xml_parser_sink, reply->parser)) == NULL)
+		return -1;
+
+	return 0;
+}
+
+
+/* Inflate and parse what was received, on a worker */
+static int xml_reply_work(void *arg) {
+	struct xml_reply *reply = (struct xml_reply *)arg;
+	struct xml_chunk *chunk;
+	int ret = 0;
+
+	if(reply->failed || xml_reply_parser_new(reply, xml_reply_record_start, xml_reply_record_end, reply))
+		return -1;
+
+	for(chunk = reply->chunks; chunk != NULL; chunk = chunk->next)
+		inflater_write(reply->inflater, chunk->data, chunk->len);
+
+	if(inflater_finish(reply->inflater) || xml_parser_finish(reply->parser) || reply->failed)
+		ret = -1;
+
+	/* Release zlib's state right away, the rest stays until the reply is freed */
+	inflater_free(reply->inflater);
+	reply->inflater = NULL;
+
+	return ret;
+}
+
+
+/* Replay the elements through the handlers, on the networking thread */
+static void xml_reply_complete(void *arg, int ret) {
+	struct xml_reply *reply = (struct xml_reply *)arg;
+	struct xml_event *event;
+
+	/* The session is being released, the caller's context goes with it */
+	if(ret == PARSEPOOL_DROPPED) {
+		xml_reply_free(reply);
+		return;
+	}
+
+	if(ret == 0) {
+		for(event = reply->events; event != NULL; event = event->next) {
+			if(event->attrs != NULL)
+				reply->start(reply->arg, event->depth, event->name, event->attrs);
+			else
+				reply->end(reply->arg, event->depth, event->name, event->text);
+		}
+	}
+	else {
+		DSFYDEBUG("Failed to decompress or parse XML on a worker\n");
+	}
+
+	reply->done(reply->done_arg, ret);
+}
+
+
+static void xml_reply_record_start(void *arg, int depth, const char *name, const char **attrs) {
+	struct xml_reply *reply = (struct xml_reply *)arg;
+	struct xml_event *event;
+	int i, n;
+
+	if(reply->start == NULL || (event = xml_reply_event(reply, depth, name)) == NULL)
+		return;
+
+	for(n = 0; attrs[n] != NULL; n++)
+		;
+
+	if((event->attrs = (const char **)arena_alloc(reply->arena, (n + 1) * sizeof(char *))) == NULL) {
+		reply->failed = 1;
+		return;
+	}
+
+	for(i = 0; i < n; i++)
+		if((event->attrs[i] = arena_strdup(reply->arena, attrs[i])) == NULL)
+			reply->failed = 1;
+
+	event->attrs[n] = NULL;
+}
+
+
+static void xml_reply_record_end(void *arg, int depth, const char *name, char *text) {
+	struct xml_reply *reply = (struct xml_reply *)arg;
+	struct xml_event *event;
+
+	if(reply->end == NULL || (event = xml_reply_event(reply, depth, name)) == NULL)
+		return;
+
+	if((event->text = arena_strdup(reply->arena, text)) == NULL)
+		reply->failed = 1;
+}
+
+
+/* Append an event to the recording, NULL if the arena ran out */
+static struct xml_event *xml_reply_event(struct xml_reply *reply, int depth, const char *name) {
+	struct xml_event *event;
+
+	if(reply->failed)
+		return NULL;
+
+	event = (struct xml_event *)arena_alloc(reply->arena, sizeof(struct xml_event));
+	if(event == NULL || (event->name = arena_strdup(reply->arena, name)) == NULL) {
+		reply->failed = 1;
+		return NULL;
+	}
+
+	event->next = NULL;
+	event->depth = depth;
+	event->attrs = NULL;
+	event->text = NULL;
+
+	*reply->events_tail = event;
+	reply->events_tail = &event->next;
+
+	return event;
+}
@@ -0,0 +1,70 @@
+/*
+ * Compressed XML replies, parsed on the networking thread or by the
+ * parse pool, see xmlreply.c
+ *
+ */
+
+#ifndef LIBOPENSPOTIFY_XMLREPLY_H
+#define LIBOPENSPOTIFY_XMLREPLY_H
+
+#include "arena.h"
+#include "inflater.h"
+#include "parsepool.h"
+#include "xmlparser.h"
+
+/* Called on the networking thread once the reply has been parsed, ret is 0 or -1 */
+typedef void (*xml_reply_done)(void *arg, int ret);
+
+/* Channel data kept for a worker */
+struct xml_chunk {
+	struct xml_chunk *next;
+	int len;
+	unsigned char data[1];
+};
+
+/* An element opening or closing, recorded by a worker */
+struct xml_event {
+	struct xml_event *next;
+	int depth;
+	char *name;
+
+	/* Attributes when the element opens, NULL when it closes */
+	const char **attrs;
+	char *text;
+};
+
+struct xml_reply {
+	/* The reply is allocated from its arena, as is everything below */
+	struct arena *arena;
+
+	/* Where the XML goes, as in xml_parser_new() */
+	xml_start_handler start;
+	xml_end_handler end;
+	void *arg;
+
+	/* NULL to parse the XML as it arrives */
+	struct parsepool *pool;
+
+	/* Set up as the reply arrives or, with a pool, by the worker */
+	struct inflater *inflater;
+	struct xml_parser *parser;
+
+	/* The reply as received, and what the worker made of it */
+	struct xml_chunk *chunks;
+	struct xml_chunk **chunks_tail;
+	struct xml_event *events;
+	struct xml_event **events_tail;
+
+	/* Set if the arena ran out while keeping the reply or recording it */
+	int failed;
+
+	xml_reply_done done;
+	void *done_arg;
+};
+
+struct xml_reply *xml_reply_new(struct parsepool *pool, xml_start_handler start, xml_end_handler end, void *arg);
+void xml_reply_write(struct xml_reply *reply, unsigned char *data, int len);
+void xml_reply_finish(struct xml_reply *reply, xml_reply_done done, void *done_arg);
+void xml_reply_free(struct xml_reply *reply);
+
+#endif